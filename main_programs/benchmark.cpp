@@ -0,0 +1,36 @@
+/*
+Render the scene a number of times and report the render time and the rate of primary rays.
+This is for comparing acceleration structures and traversal code. With RENDER_STATS (in src/statistics.hpp),
+the render statistics of the last render (rays, BVH nodes visited, box and primitive tests) are reported too.
+    -- -n <number of renders>
+*/
+#include "ray_tracer.hpp"
+#include <chrono>
+
+void main_program(int argc, char *argv[], Renderer *renderer)
+{
+    int num_renders = 5;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i+1 < argc) sscanf(argv[i+1], "%d", &num_renders);
+    }
+    if (num_renders < 1) num_renders = 1;
+
+    double best_seconds = 0;
+    double total_seconds = 0;
+    for (int i = 0; i < num_renders; i++) {
+        auto start = std::chrono::steady_clock::now();
+        renderer->render_direct();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (i == 0 || seconds < best_seconds) best_seconds = seconds;
+        total_seconds += seconds;
+    }
+    double num_rays = renderer->pixels_x() * (double) renderer->pixels_y();
+    printf("Rendered %d times.\n", num_renders);
+    printf("    best: %.4fs (%.3f million primary rays/s)\n", best_seconds, num_rays / best_seconds * 1e-6);
+    printf("    mean: %.4fs (%.3f million primary rays/s)\n", total_seconds / num_renders, num_rays * num_renders / total_seconds * 1e-6);
+#if RENDER_STATS
+    renderer->last_render_stats().print();
+#endif
+    renderer->write_to_ppm("last_render.ppm");
+    close_multithreading();
+}
@@ -5,28 +5,43 @@ Player *g_player;
 
 static std::thread rendering_thread;
 #include <condition_variable>
+static std::mutex rendering_mutex;
 static std::condition_variable rendering_condition;
 static bool should_render = false;
 
 static void rendering_thread_function(Renderer *renderer)
 {
     // The rendering thread waits around in this function for an alert
-    // to start processing a render.
-    // I don't think there are synchronization issues here since it is just the one thread.
+    // to start processing a render. The render itself is shared out to the worker threads.
     while (true) {
-        if (should_render) {
-            renderer->render_direct();
+        {
+            std::unique_lock<std::mutex> lock(rendering_mutex);
+            rendering_condition.wait(lock, []{ return should_render; });
             should_render = false;
         }
+        renderer->render_direct();
     }
 }
 
+static void request_render()
+{
+    {
+        std::lock_guard<std::mutex> lock(rendering_mutex);
+        should_render = true;
+    }
+    rendering_condition.notify_one();
+}
+
 bool pretty_much_equal(const Transform &t1, const Transform &t2)
 {
     // Test if a transform has changed or not. The definition of "pretty much equal" could differ ...
-    mat4x4 diff = t1.matrix - t2.matrix;
     float sum_squares = 0.f;
-    for (int i = 0; i < 4; i++) sum_squares += glm::dot(diff[i], diff[i]);
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+            float diff = t1.matrix.m[i][j] - t2.matrix.m[i][j];
+            sum_squares += diff*diff;
+        }
+    }
     const float epsilon = 1e-1 * dt; // makes sense to scale this margin due to time passed each frame.
     float ep = sqrt(sum_squares);
     return ep < epsilon;
@@ -198,7 +213,7 @@ void FrameBufferViewerLoop::direct_view_loop() {
     //    As long as the image is being rendered, the logic of this loop is a free-for-all
     //    attempt to make the image being synthesized kind of look good while still or moving.
 
-    should_render = true;
+    request_render();
     renderer->downsample_to_framebuffer(&downsampled_framebuffer);
 
     shader_program.bind();
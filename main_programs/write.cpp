@@ -1,5 +1,7 @@
 /*
 Write the rendered image straight to a file.
+    -- -t <image filename> -j <statistics filename>
+With RENDER_STATS (in src/statistics.hpp), the render statistics are printed, and written as JSON if a file is given.
 */
 #include "ray_tracer.hpp"
 
@@ -7,10 +9,21 @@ void main_program(int argc, char *argv[], Renderer *renderer)
 {
     const char *default_filename = "last_render.ppm";
     const char *filename = default_filename;
+    const char *stats_filename = NULL;
     for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "-t") && i+1 < argc) filename = argv[i + 1];
+        if (strcmp(argv[i], "-t") == 0 && i+1 < argc) filename = argv[i + 1];
+        else if (strcmp(argv[i], "-j") == 0 && i+1 < argc) stats_filename = argv[i + 1];
     }
     renderer->render_direct();
     renderer->write_to_ppm(filename);
+#if RENDER_STATS
+    renderer->last_render_stats().print();
+    if (stats_filename != NULL) {
+        std::ofstream file(stats_filename);
+        renderer->last_render_stats().write_json(file);
+    }
+#else
+    if (stats_filename != NULL) std::cerr << "Render statistics are compiled out (see RENDER_STATS in src/statistics.hpp).\n";
+#endif
     close_multithreading();
 }
@@ -8,6 +8,7 @@ Scene *make_scene() {
 
 
     Model *bunny = load_OFF_model("models/bunny.off", 1, Point(0,1,0), true, PHONG_NORMALS);
+    if (bunny == NULL) exit(EXIT_FAILURE); // The loader reports why.
     primitives.push_back(new GeometricPrimitive(
                          new TriangleMesh(Transform::translate(3,-0.7,5) * Transform::y_rotation(1.5*M_PI/2),
                          bunny),
@@ -17,16 +18,18 @@ Scene *make_scene() {
                          1.2
                          ));
 #if 1
-    Model *dragon = load_OFF_model("models/dragon.off", 2, Point(0,0,0), true, PHONG_NORMALS);
+    TriangleMesh *dragon = load_triangle_mesh(Transform::translate(0,-1.4,5) * Transform::y_rotation(0.5),
+                                              "models/dragon.off", 2, Point(0,0,0), true, PHONG_NORMALS);
+    if (dragon == NULL) exit(EXIT_FAILURE); // The loader reports why.
     primitives.push_back(new GeometricPrimitive(
-                         new TriangleMesh(Transform::translate(0,-1.4,5) * Transform::y_rotation(0.5),
-                         dragon),
+                         dragon,
                          new ConstantTextureRGB(RGB(0.8,0.8,0.3)),
                          NULL,
                          0.8
                          ));
 #endif
     Model *apple = load_OFF_model("models/apple.off", 20, Point(0,0,0), true, PHONG_NORMALS);
+    if (apple == NULL) exit(EXIT_FAILURE); // The loader reports why.
     primitives.push_back(new GeometricPrimitive(
                          new TriangleMesh(Transform::translate(-3,-0.7,5) * Transform::y_rotation(1),
                          //new TriangleMesh(Transform::translate(0,-0.7,3.2) * Transform::y_rotation(1),
@@ -36,6 +39,7 @@ Scene *make_scene() {
                          0.5
                          ));
     Model *icosahedron = load_OFF_model("models/icosahedron.off", 1, Point(0,0,0), false, false);
+    if (icosahedron == NULL) exit(EXIT_FAILURE); // The loader reports why.
     for (int i = 0; i < 3; i++) {
     primitives.push_back(new GeometricPrimitive(
                          new TriangleMesh(Transform::translate(-3+3*i,i==1 ? 3.5 : 3.2,5) * Transform::y_rotation(i*0.3+i*i),
@@ -77,7 +81,7 @@ Scene *make_scene() {
 
     
 
-    BVH *bvh = new BVH(primitives);
+    WideBVH *bvh = new WideBVH(primitives);
     scene->add_primitive(bvh);
 
     return scene;
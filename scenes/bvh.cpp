@@ -3,6 +3,7 @@
 Scene *make_scene() {
     Scene *scene = new Scene();
     vector<Primitive *> primitives(0);
+    vector<TriangleMesh *> meshes(0);
 
 #if 1
     float r = 20;
@@ -17,20 +18,24 @@ Scene *make_scene() {
 
 
     Model *apple = load_OFF_model("models/apple.off", 30, Point(0,0,0), true);
+    if (apple == NULL) exit(EXIT_FAILURE); // The loader reports why.
     float R = 7;
+    TriangleMesh *apple_mesh = new TriangleMesh(Transform(), apple, false);
+    meshes.push_back(apple_mesh);
     for (int i = 0; i < 8; i++) {
-    primitives.push_back(new GeometricPrimitive(
-                         new TriangleMesh(Transform::translate(frand()*R,frand()*R,frand()*R),
-                         apple)));
+    primitives.push_back(new GeometricPrimitive(new Instance(Transform::translate(frand()*R,frand()*R,frand()*R), apple_mesh)));
     }
 #endif
     scene->add_light(new PointLight(Point(-3,5,0), 20.f*RGB(0.6,0.956,0.43)));
     scene->add_light(new PointLight(Point(3,4,2), 16.f*RGB(0.5,0.5,1)));
 
     Model *bunny = load_OFF_model("models/bunny.off", 1, Point(0,1,0), true);
-    primitives.push_back(new GeometricPrimitive(
-                         new TriangleMesh(Transform::translate(0,2,0),
-                         bunny)));
+    if (bunny == NULL) exit(EXIT_FAILURE); // The loader reports why.
+    TriangleMesh *bunny_mesh = new TriangleMesh(Transform::translate(0,2,0), bunny, false);
+    meshes.push_back(bunny_mesh);
+    primitives.push_back(new GeometricPrimitive(bunny_mesh));
+    // Build all of the meshes at once.
+    build_triangle_meshes(meshes);
     
 
 #if 1
@@ -13,16 +13,16 @@ Scene *make_scene() {
 
     float r = 20;
     int n = 5;
-    Model *dragon = load_OFF_model("models/dragon.off", 10, Point(0,0,0), true);
+    // The dragons share one mesh.
+    TriangleMesh *mesh = load_triangle_mesh(Transform(), "models/dragon.off", 10, Point(0,0,0), true);
+    if (mesh == NULL) exit(EXIT_FAILURE); // The loader reports why.
     for (int i = 0; i < n; i++) {
         float theta = i*2*M_PI/n;
-        primitives.push_back(new GeometricPrimitive(
-                             new TriangleMesh(Transform::translate(r*sin(theta),-6,r*cos(theta)),
-                             dragon)));
+        primitives.push_back(new GeometricPrimitive(new Instance(Transform::translate(r*sin(theta),-6,r*cos(theta)), mesh)));
     }
     
 
-    BVH *bvh = new BVH(primitives);
+    WideBVH *bvh = new WideBVH(primitives);
     scene->add_primitive(bvh);
 
     return scene;
@@ -0,0 +1,36 @@
+#include "ray_tracer.hpp"
+
+// A field of thousands of dragons and bunnies. Only two meshes are built; every placement is an Instance of one of them.
+Scene *make_scene() {
+    Scene *scene = new Scene();
+    vector<Primitive *> primitives(0);
+
+    scene->add_light(new PointLight(Point(0,60,0), 9000.f*RGB(0.9,0.9,0.98)));
+    scene->add_light(new PointLight(Point(-40,20,-40), 1500.f*RGB(0.98,0.5,0.3)));
+
+    primitives.push_back(new GeometricPrimitive(new Plane(Point(0,-1,0), Vector(1,0,0), Vector(0,0,1), 1000, 1000)));
+
+    vector<TriangleMesh *> meshes(0);
+    meshes.push_back(load_triangle_mesh(Transform(), "models/dragon.off", 2, Point(0,0,0), true, true, false));
+    meshes.push_back(load_triangle_mesh(Transform(), "models/bunny.off", 1, Point(0,1,0), true, true, false));
+    if (meshes[0] == NULL || meshes[1] == NULL) exit(EXIT_FAILURE); // The loader reports why.
+    build_triangle_meshes(meshes);
+
+    Texture *textures[2] = { new ConstantTextureRGB(RGB(0.8,0.8,0.3)), new ConstantTextureRGB(RGB(0.6,0.6,0.9)) };
+    int n = 60;
+    float spacing = 2.5;
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            int which = (i + j) % 2;
+            Transform transform = Transform::translate((i - n/2)*spacing, -0.4, (j - n/2)*spacing)
+                                * Transform::y_rotation(2*M_PI*frand());
+            primitives.push_back(new GeometricPrimitive(new Instance(transform, meshes[which]), textures[which]));
+        }
+    }
+    printf("%d instances of %d meshes\n", n*n, (int) meshes.size());
+
+    BVH *bvh = new BVH(primitives);
+    scene->add_primitive(bvh);
+
+    return scene;
+}
@@ -0,0 +1,29 @@
+#include "ray_tracer.hpp"
+
+// A cloud of a million spheres above a ground plane, as one SphereSet.
+Scene *make_scene() {
+    Scene *scene = new Scene();
+    vector<Primitive *> primitives(0);
+
+    scene->add_light(new PointLight(Point(0,30,0), 700.f*RGB(0.9,0.9,0.98)));
+    scene->add_light(new PointLight(Point(-2,3,0), 120.f*RGB(0.98,0.6,0.4)));
+
+    primitives.push_back(new GeometricPrimitive(new Plane(Point(0,-3,0), Vector(1,0,0), Vector(0,0,1), 1000, 1000)));
+
+    int n = 1000000;
+    vector<Point> centres(n);
+    vector<float> radii(n);
+    for (int i = 0; i < n; i++) {
+        // Denser towards the middle of the cloud.
+        Vector offset = Vector(frand()-0.5, frand()-0.5, frand()-0.5);
+        centres[i] = Point(0,1,14) + 16*glm::length(offset)*offset;
+        radii[i] = 0.01 + 0.02*frand();
+    }
+    primitives.push_back(new GeometricPrimitive(new SphereSet(centres, radii), new ConstantTextureRGB(RGB(0.6,0.6,0.9))));
+    printf("%d spheres\n", n);
+
+    BVH *bvh = new BVH(primitives);
+    scene->add_primitive(bvh);
+
+    return scene;
+}
@@ -7,6 +7,7 @@ Scene *make_scene() {
 #if 1
 {
     Model *bunny = load_OFF_model("models/bunny.off", 1.5, Point(0,1,0), true, true);
+    if (bunny == NULL) exit(EXIT_FAILURE); // The loader reports why.
     primitives.push_back(new GeometricPrimitive(
                          new TriangleMesh(Transform::translate(3.5,0,4) * Transform::y_rotation(1.5*M_PI/2),
                          bunny),
@@ -21,6 +22,7 @@ Scene *make_scene() {
 {
 #if 0
     Model *bunny = load_OFF_model("models/bunny.off", 1.7, Point(0,1,0), true, true);
+    if (bunny == NULL) exit(EXIT_FAILURE); // The loader reports why.
     primitives.push_back(new GeometricPrimitive(
                          new TriangleMesh(Transform::translate(-5,0.3,4) * Transform::y_rotation(2.6),
                          bunny),
@@ -31,6 +33,7 @@ Scene *make_scene() {
                          ));
 #endif
     Model *icosahedron = load_OFF_model("models/icosahedron.off", 0.8, Point(0,0,0), false, false);
+    if (icosahedron == NULL) exit(EXIT_FAILURE); // The loader reports why.
     Point positions[3] = {
         {-3.7,4,5},
         {0,4.2,4.8},
@@ -50,6 +53,7 @@ Scene *make_scene() {
 
 #if 0
     Model *icosahedron = load_OFF_model("models/icosahedron.off", 1, Point(0,0,0), false, false);
+    if (icosahedron == NULL) exit(EXIT_FAILURE); // The loader reports why.
     for (int i = 0; i < 3; i++) {
     primitives.push_back(new GeometricPrimitive(
                          new TriangleMesh(Transform::translate(-3+3*i,i==1 ? 3.5 : 3.2,5) * Transform::y_rotation(i*0.3+i*i),
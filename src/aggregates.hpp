@@ -4,5 +4,6 @@
 
 #include "aggregates/primitive_list.hpp"
 #include "aggregates/bvh.hpp"
+#include "aggregates/wide_bvh.hpp"
 
 #endif // AGGREGATES_H
@@ -3,11 +3,18 @@
     pbrt 2e's description and code for bvh construction.
 --------------------------------------------------------------------------------*/
 #include "aggregates/bvh.hpp"
+#include "shapes_library.hpp"
+#include "multithreading.hpp"
+#include "statistics.hpp"
 #include <algorithm>
+#include <typeinfo>
 
 struct PrimitiveInfo {
-    PrimitiveInfo(Primitive *_primitive) {
-        box = _primitive->world_bound();
+    PrimitiveInfo() {}
+    PrimitiveInfo(Primitive *_primitive) : PrimitiveInfo(_primitive, _primitive->world_bound()) {}
+    // A reference to the part of a primitive within box, for spatial splits.
+    PrimitiveInfo(Primitive *_primitive, const BoundingBox &_box) {
+        box = _box;
         // Converting to a Vector here since Point arithmetic is a bit restrictive.
         centroid = 0.5f*Vector(box.corners[0].x,box.corners[0].y,box.corners[0].z) +
                    0.5f*Vector(box.corners[1].x,box.corners[1].y,box.corners[1].z);
@@ -32,32 +39,269 @@ struct Comparer {
     }
 };
 
-static Node *BVH_create_node(vector<PrimitiveInfo> &p_infos,
-                             int first_primitive,
-                             int num_primitives,
-                             int *tree_size)
+// This acts as a "unary predicate" when passed to std::partition, for the surface area heuristic.
+// Primitives go in the first child if their centroid falls in a bin at or before the split bin.
+struct BinComparer {
+    BinComparer(int _split_bin, int _num_bins, float _min_value, float _inv_extent, int _splitting_dimension) {
+        split_bin = _split_bin;
+        num_bins = _num_bins;
+        min_value = _min_value;
+        inv_extent = _inv_extent;
+        splitting_dimension = _splitting_dimension;
+    }
+    int split_bin;
+    int num_bins;
+    float min_value;
+    float inv_extent;
+    int splitting_dimension;
+    bool operator()(const PrimitiveInfo &primitive_info) const {
+        return centroid_bin(primitive_info.centroid[splitting_dimension]) <= split_bin;
+    }
+    inline int centroid_bin(float value) const {
+        int bin = (int) (num_bins * (value - min_value) * inv_extent);
+        if (bin >= num_bins) bin = num_bins - 1;
+        if (bin < 0) bin = 0;
+        return bin;
+    }
+};
+
+/*--------------------------------------------------------------------------------
+    Each pass over the primitives of a node (bounding, binning, partitioning) is
+    done over a number of chunks of its range. The serial builder uses one chunk.
+    Near the root of a parallel build, the chunks are shared between threads.
+    Every chunk result is merged with operations that don't depend on the order
+    (box unions and counts), and partitions are stable, so the tree is the same
+    no matter how many chunks are used.
+--------------------------------------------------------------------------------*/
+static void for_each_chunk(int first_primitive, int num_primitives, int num_chunks,
+                           std::function<void(int,int,int)> f)
 {
-    // printf("first_primitive: %d\n", first_primitive);
-    // printf("num_primitives: %d\n", num_primitives);
-    // printf("tree_size: %d\n", *tree_size);
-    // printf("num p_infos: %zu\n", p_infos.size());
+    // f(begin, end, chunk_index)
+    if (num_chunks <= 1) {
+        f(first_primitive, first_primitive + num_primitives, 0);
+        return;
+    }
+    parallel_for_2D([&](int chunk, int, int) {
+        int begin = first_primitive + (int) (((long) num_primitives * chunk) / num_chunks);
+        int end = first_primitive + (int) (((long) num_primitives * (chunk + 1)) / num_chunks);
+        f(begin, end, chunk);
+    }, num_chunks, 1);
+}
 
-    (*tree_size)++;
-    static int max_num_primitives_in_leaf = 1;
-    if (num_primitives <= max_num_primitives_in_leaf) {
-        // Leaf node.
-        BoundingBox p_box = p_infos[first_primitive].box;
-        for (int i = first_primitive+1; i < first_primitive + num_primitives; i++) {
-            p_box.enlarge(p_box.enlarge(p_infos[i].box));
+// Stable partition of the range, returning the index of the first primitive that doesn't satisfy the predicate.
+template <typename Predicate>
+static int BVH_partition(vector<PrimitiveInfo> &p_infos, int first_primitive, int num_primitives, int num_chunks,
+                         const Predicate &predicate)
+{
+    if (num_chunks <= 1) {
+        PrimitiveInfo *mid_pointer = std::stable_partition(&p_infos[first_primitive], &p_infos[first_primitive + num_primitives - 1]+1,
+                                                           predicate);
+        return mid_pointer - &p_infos[0];
+    }
+    // Count the primitives going to the first side in each chunk, so each chunk knows where to scatter its primitives.
+    vector<int> chunk_counts(num_chunks);
+    for_each_chunk(first_primitive, num_primitives, num_chunks, [&](int begin, int end, int chunk) {
+        int count = 0;
+        for (int i = begin; i < end; i++) {
+            if (predicate(p_infos[i])) count ++;
         }
-        return new Node(p_box, first_primitive, num_primitives);
+        chunk_counts[chunk] = count;
+    });
+    int total_count = 0;
+    vector<int> chunk_offsets(num_chunks);
+    for (int chunk = 0; chunk < num_chunks; chunk++) {
+        chunk_offsets[chunk] = total_count;
+        total_count += chunk_counts[chunk];
     }
+    vector<PrimitiveInfo> partitioned(num_primitives, PrimitiveInfo());
+    for_each_chunk(first_primitive, num_primitives, num_chunks, [&](int begin, int end, int chunk) {
+        int first_side = chunk_offsets[chunk];
+        int second_side = total_count + (begin - first_primitive) - chunk_offsets[chunk];
+        for (int i = begin; i < end; i++) {
+            if (predicate(p_infos[i])) partitioned[first_side++] = p_infos[i];
+            else partitioned[second_side++] = p_infos[i];
+        }
+    });
+    for_each_chunk(first_primitive, num_primitives, num_chunks, [&](int begin, int end, int chunk) {
+        std::copy(&partitioned[begin - first_primitive], &partitioned[end - first_primitive - 1]+1, &p_infos[begin]);
+    });
+    return first_primitive + total_count;
+}
 
-    // bvh heuristic: Split across the dimension with the greatest extents of centroids of primitive bounding volumes.
+#define MAX_SAH_BINS 64
+struct SAHBin {
+    int count;
+    BoundingBox box;
+};
+
+// The cost of intersecting a leaf of this many primitives.
+static inline float sah_leaf_cost(int num_primitives, const BVHBuildParameters &params)
+{
+    return (num_primitives + params.sah_primitive_group_size - 1) / params.sah_primitive_group_size;
+}
+
+// The best split of a range of primitives into two by the bins of their centroids, under the surface area heuristic.
+struct SAHObjectSplit {
+    float cost;
+    int dimension; // -1 if there is no split (the centroids are all in one bin along every axis).
+    int split_bin; // The last bin of the first child.
+    int num_bins;
+    BoundingBox boxes[2];
+};
+
+// Find the split with the least cost under the surface area heuristic, considering the bin boundaries along each axis.
+static SAHObjectSplit sah_find_object_split(const vector<PrimitiveInfo> &p_infos,
+                                            int first_primitive,
+                                            int num_primitives,
+                                            const BoundingBox &node_box,
+                                            const BoundingBox &centroid_bounds,
+                                            const BVHBuildParameters &params,
+                                            int num_chunks)
+{
+    int num_bins = params.sah_num_bins;
+    if (num_bins > MAX_SAH_BINS) num_bins = MAX_SAH_BINS;
+    if (num_bins < 2) num_bins = 2;
+
+    float inv_node_area = 1.f / node_box.surface_area();
+    if (!(node_box.surface_area() > 0)) inv_node_area = 0.f; // Flat boxes (e.g. axis-aligned planes) make this degenerate.
+
+    // Bin the centroids along each axis.
+    vector<SAHBin> chunk_bins(num_chunks * 3 * num_bins);
+    for_each_chunk(first_primitive, num_primitives, num_chunks, [&](int begin, int end, int chunk) {
+        SAHBin *bins = &chunk_bins[chunk * 3 * num_bins];
+        for (int b = 0; b < 3 * num_bins; b++) {
+            bins[b].count = 0;
+            bins[b].box = BoundingBox();
+        }
+        for (int dim = 0; dim < 3; dim++) {
+            float min_value = centroid_bounds.corners[0][dim];
+            float extent = centroid_bounds.corners[1][dim] - min_value;
+            if (extent <= 0) continue;
+            BinComparer binner(0, num_bins, min_value, 1.f / extent, dim);
+            for (int i = begin; i < end; i++) {
+                int b = binner.centroid_bin(p_infos[i].centroid[dim]);
+                bins[dim * num_bins + b].count ++;
+                bins[dim * num_bins + b].box.enlarge(p_infos[i].box);
+            }
+        }
+    });
+    for (int chunk = 1; chunk < num_chunks; chunk++) {
+        for (int b = 0; b < 3 * num_bins; b++) {
+            chunk_bins[b].count += chunk_bins[chunk * 3 * num_bins + b].count;
+            chunk_bins[b].box.enlarge(chunk_bins[chunk * 3 * num_bins + b].box);
+        }
+    }
+
+    SAHObjectSplit best;
+    best.cost = INFINITY;
+    best.dimension = -1;
+    best.split_bin = 0;
+    best.num_bins = num_bins;
+    for (int dim = 0; dim < 3; dim++) {
+        float extent = centroid_bounds.corners[1][dim] - centroid_bounds.corners[0][dim];
+        if (extent <= 0) continue;
+        SAHBin *bins = &chunk_bins[dim * num_bins];
+        // Sweep from the right to get the box and count of every possible second child,
+        // then from the left, computing the cost of splitting after bin b.
+        BoundingBox right_boxes[MAX_SAH_BINS];
+        int right_counts[MAX_SAH_BINS];
+        BoundingBox right_box;
+        int right_count = 0;
+        for (int b = num_bins - 1; b > 0; b--) {
+            right_box.enlarge(bins[b].box);
+            right_count += bins[b].count;
+            right_boxes[b] = right_box;
+            right_counts[b] = right_count;
+        }
+        BoundingBox left_box;
+        int left_count = 0;
+        for (int b = 0; b < num_bins - 1; b++) {
+            left_box.enlarge(bins[b].box);
+            left_count += bins[b].count;
+            if (left_count == 0 || right_counts[b+1] == 0) continue;
+            float cost = params.sah_traversal_cost
+                       + inv_node_area * (sah_leaf_cost(left_count, params) * left_box.surface_area()
+                                          + sah_leaf_cost(right_counts[b+1], params) * right_boxes[b+1].surface_area());
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.dimension = dim;
+                best.split_bin = b;
+                best.boxes[0] = left_box;
+                best.boxes[1] = right_boxes[b+1];
+            }
+        }
+    }
+    return best;
+}
+
+// The predicate for partitioning a range of primitives by an object split.
+static BinComparer sah_object_split_comparer(const SAHObjectSplit &split, const BoundingBox &centroid_bounds)
+{
+    float min_value = centroid_bounds.corners[0][split.dimension];
+    float extent = centroid_bounds.corners[1][split.dimension] - min_value;
+    return BinComparer(split.split_bin, split.num_bins, min_value, 1.f / extent, split.dimension);
+}
+
+// Returns false if making a leaf is cheaper than any split. Otherwise, the range is partitioned and the first
+// primitive of the second child is returned in *mid.
+static bool BVH_sah_split(vector<PrimitiveInfo> &p_infos,
+                          int first_primitive,
+                          int num_primitives,
+                          const BoundingBox &node_box,
+                          const BoundingBox &centroid_bounds,
+                          const BVHBuildParameters &params,
+                          int num_chunks,
+                          int *mid,
+                          int *splitting_dimension)
+{
+    SAHObjectSplit split = sah_find_object_split(p_infos, first_primitive, num_primitives, node_box, centroid_bounds,
+                                                 params, num_chunks);
+    float leaf_cost = sah_leaf_cost(num_primitives, params);
+    if (split.dimension < 0) return false;
+    if (num_primitives <= params.max_leaf_primitives && leaf_cost <= split.cost) return false;
+
+    *mid = BVH_partition(p_infos, first_primitive, num_primitives, num_chunks,
+                         sah_object_split_comparer(split, centroid_bounds));
+    *splitting_dimension = split.dimension;
+    return true;
+}
+
+// Decide whether the range of primitives should be a leaf or be split in two. The bounding box of the range is returned
+// in *box, and if it is split, the range is partitioned with the first primitive of the second child returned in *mid.
+static bool BVH_split(vector<PrimitiveInfo> &p_infos,
+                      int first_primitive,
+                      int num_primitives,
+                      const BVHBuildParameters &params,
+                      int num_chunks,
+                      BoundingBox *box,
+                      int *mid,
+                      int *splitting_dimension)
+{
+    // Bound the primitives and their centroids.
+    vector<BoundingBox> chunk_boxes(num_chunks);
+    vector<BoundingBox> chunk_centroid_bounds(num_chunks);
+    for_each_chunk(first_primitive, num_primitives, num_chunks, [&](int begin, int end, int chunk) {
+        BoundingBox p_box = BoundingBox();
+        BoundingBox c_box = BoundingBox();
+        for (int i = begin; i < end; i++) {
+            p_box.enlarge(p_infos[i].box);
+            c_box.enlarge(p_infos[i].centroid);
+        }
+        chunk_boxes[chunk] = p_box;
+        chunk_centroid_bounds[chunk] = c_box;
+    });
     BoundingBox centroid_bounds = BoundingBox();
-    for (int i = first_primitive; i < first_primitive + num_primitives; i++) {
-        centroid_bounds.enlarge(p_infos[i].centroid);
+    *box = BoundingBox();
+    for (int chunk = 0; chunk < num_chunks; chunk++) {
+        box->enlarge(chunk_boxes[chunk]);
+        centroid_bounds.enlarge(chunk_centroid_bounds[chunk]);
+    }
+    if (num_primitives <= 1 || (params.split_method == BVH_SPLIT_MIDPOINT && num_primitives <= params.max_leaf_primitives)) {
+        // Leaf node.
+        return false;
     }
+
+    // bvh heuristic: Split across the dimension with the greatest extents of centroids of primitive bounding volumes.
     Vector min_corner(centroid_bounds.corners[0].x, centroid_bounds.corners[0].y, centroid_bounds.corners[0].z);
     Vector max_corner(centroid_bounds.corners[1].x, centroid_bounds.corners[1].y, centroid_bounds.corners[1].z);
 
@@ -65,42 +309,844 @@ static Node *BVH_create_node(vector<PrimitiveInfo> &p_infos,
     if (   max_corner.x - min_corner.x < stop_below_centroid_extents
         && max_corner.y - min_corner.y < stop_below_centroid_extents
         && max_corner.z - min_corner.z < stop_below_centroid_extents) {
-        // Put all remaining primitives in a box.
-        BoundingBox p_box = p_infos[first_primitive].box;
-        for (int i = first_primitive+1; i < first_primitive + num_primitives; i++) {
-            p_box.enlarge(p_box.enlarge(p_infos[i].box));
+        if (num_primitives <= BVH_MAX_LEAF_PRIMITIVES) {
+            // Put all remaining primitives in a box.
+            return false;
         }
-        return new Node(p_box, first_primitive, num_primitives);
+        // Too many to fit in one leaf, so just split the range in half.
+        *mid = first_primitive + num_primitives/2;
+        *splitting_dimension = 0;
+        return true;
     }
 
-
+    if (params.split_method == BVH_SPLIT_SAH) {
+        return BVH_sah_split(p_infos, first_primitive, num_primitives, *box, centroid_bounds, params, num_chunks,
+                             mid, splitting_dimension);
+    }
     // Compute the dimension of greatest extent (x:0, y:1, z:2).
     float max_extent = max_corner[0] - min_corner[0];
-    int splitting_dimension = 0;
+    *splitting_dimension = 0;
     for (int i = 1; i < 3; i++) {
         float new_extent = max_corner[i] - min_corner[i];
         if (new_extent > max_extent) {
             max_extent = new_extent;
-            splitting_dimension = i;
+            *splitting_dimension = i;
         }
     }
 
     // bvh heuristic: Along the chosen dimension, choose a splitting value as
     // the middle value of the bounding box of the centroids.
-    float split_value = 0.5f*min_corner[splitting_dimension] +
-                        0.5f*max_corner[splitting_dimension];
+    float split_value = 0.5f*min_corner[*splitting_dimension] +
+                        0.5f*max_corner[*splitting_dimension];
 
     // Partition the subarray of p_ordered so that it looks like
     //    [...[compares less or equal, compares greater]...].
-    PrimitiveInfo *mid_pointer = std::partition(&p_infos[first_primitive], &p_infos[first_primitive + num_primitives - 1]+1,
-                                                Comparer(split_value, splitting_dimension));
-    int mid = mid_pointer - &p_infos[0];
-    
-    Node *child_1 = BVH_create_node(p_infos, first_primitive, mid - first_primitive, tree_size);
-    Node *child_2 = BVH_create_node(p_infos, mid, first_primitive+num_primitives - mid, tree_size);
+    *mid = BVH_partition(p_infos, first_primitive, num_primitives, num_chunks,
+                         Comparer(split_value, *splitting_dimension));
+    return true;
+}
+
+static Node *BVH_create_node(vector<PrimitiveInfo> &p_infos,
+                             int first_primitive,
+                             int num_primitives,
+                             const BVHBuildParameters &params,
+                             int *tree_size)
+{
+    // printf("first_primitive: %d\n", first_primitive);
+    // printf("num_primitives: %d\n", num_primitives);
+    // printf("tree_size: %d\n", *tree_size);
+    // printf("num p_infos: %zu\n", p_infos.size());
+
+    (*tree_size)++;
+    BoundingBox box;
+    int mid;
+    int splitting_dimension;
+    if (!BVH_split(p_infos, first_primitive, num_primitives, params, 1, &box, &mid, &splitting_dimension)) {
+        // Leaf node.
+        return new Node(box, first_primitive, num_primitives);
+    }
+    Node *child_1 = BVH_create_node(p_infos, first_primitive, mid - first_primitive, params, tree_size);
+    Node *child_2 = BVH_create_node(p_infos, mid, first_primitive+num_primitives - mid, params, tree_size);
     return new Node(mid, child_1, child_2, splitting_dimension);
 }
-static void BVH_delete_node(Node *node)
+
+/*--------------------------------------------------------------------------------
+    Parallel construction.
+    The top of the tree is built by the calling thread, with the passes over the
+    primitives of each node shared between threads. Once a subtree is small enough
+    it is set aside, and then all of the set-aside subtrees are built at once
+    with the serial builder, one per task.
+--------------------------------------------------------------------------------*/
+struct BVHParallelBuild {
+    struct Subtree {
+        int first_primitive;
+        int num_primitives;
+        Node **node; // Where the built subtree is linked into the top of the tree.
+    };
+    vector<Subtree> subtrees;
+    int subtree_size; // Ranges at most this size are set aside as subtrees.
+    int min_chunk_size;
+    int max_chunks;
+    int tree_size; // Nodes in the top of the tree.
+};
+
+static void BVH_create_node_parallel(vector<PrimitiveInfo> &p_infos,
+                                     int first_primitive,
+                                     int num_primitives,
+                                     const BVHBuildParameters &params,
+                                     BVHParallelBuild *build,
+                                     Node **out_node)
+{
+    if (num_primitives <= build->subtree_size) {
+        BVHParallelBuild::Subtree subtree;
+        subtree.first_primitive = first_primitive;
+        subtree.num_primitives = num_primitives;
+        subtree.node = out_node;
+        build->subtrees.push_back(subtree);
+        return;
+    }
+    build->tree_size ++;
+    int num_chunks = num_primitives / build->min_chunk_size;
+    if (num_chunks > build->max_chunks) num_chunks = build->max_chunks;
+    if (num_chunks < 1) num_chunks = 1;
+
+    BoundingBox box;
+    int mid;
+    int splitting_dimension;
+    if (!BVH_split(p_infos, first_primitive, num_primitives, params, num_chunks, &box, &mid, &splitting_dimension)) {
+        *out_node = new Node(box, first_primitive, num_primitives);
+        return;
+    }
+    // This becomes a branching node when its children are linked in, once they are built.
+    // (The box of the primitives is the same as the union of the children's boxes.)
+    Node *node = new Node(box, first_primitive, num_primitives);
+    node->mid = mid;
+    node->axis = splitting_dimension;
+    *out_node = node;
+    BVH_create_node_parallel(p_infos, first_primitive, mid - first_primitive, params, build, &node->children[0]);
+    BVH_create_node_parallel(p_infos, mid, first_primitive+num_primitives - mid, params, build, &node->children[1]);
+}
+
+/*--------------------------------------------------------------------------------
+    Linear BVH construction.
+    The centroids are put on a grid of 2^LBVH_MORTON_BITS cells a side over their
+    bounds, and the primitives are sorted by the Morton codes of their cells (the
+    bits of the three cell coordinates interleaved) with a radix sort, whose
+    passes are shared between threads as the passes of the other builders are.
+    In this order the primitives under each node of the tree are a range of codes
+    with a common prefix, and Karras' method finds each of the n - 1 branching
+    nodes from the codes around its position, so they are all made at once.
+    The boxes and costs are then filled in going up from the primitives, where
+    the second thread to reach a node does it (its other child is done by then).
+    Treelet restructuring passes go up the tree in the same way.
+--------------------------------------------------------------------------------*/
+#define LBVH_MORTON_BITS 10
+#define LBVH_RADIX_BITS 10
+
+struct LBVHNode {
+    // Children are indices of LBVHNodes, or ~i for the i'th primitive in Morton order.
+    int child[2];
+    int parent; // -1 for the root.
+    int num_primitives;
+    BoundingBox box;
+    // The SAH cost of the subtree, weighted by surface area as in sah_weighted_cost_recur.
+    float cost;
+    // Whether the subtree is made a single leaf.
+    bool collapse;
+};
+
+struct LBVHBuild {
+    const BVHBuildParameters &params;
+    vector<PrimitiveInfo> sorted;
+    vector<LBVHNode> nodes;
+    vector<int> leaf_parent;
+    LBVHBuild(const BVHBuildParameters &_params) : params(_params) {}
+
+    inline const BoundingBox &box(int child) const {
+        return child < 0 ? sorted[~child].box : nodes[child].box;
+    }
+    inline int count(int child) const {
+        return child < 0 ? 1 : nodes[child].num_primitives;
+    }
+    inline float cost(int child) const {
+        return child < 0 ? sorted[~child].box.surface_area() * sah_leaf_cost(1, params) : nodes[child].cost;
+    }
+};
+
+// Spread the low 10 bits of v out to every third bit.
+static inline uint32_t lbvh_expand_bits(uint32_t v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+static void lbvh_morton_codes(const vector<PrimitiveInfo> &p_infos, vector<uint32_t> &codes, int grain_size)
+{
+    int n = p_infos.size();
+    BoundingBox centroid_bounds = parallel_reduce(n, BoundingBox(), [&](int begin, int end, int) {
+        BoundingBox box;
+        for (int i = begin; i < end; i++) box.enlarge(p_infos[i].centroid);
+        return box;
+    }, [](const BoundingBox &a, const BoundingBox &b) { return enlarged(a, b); }, grain_size);
+    const float max_cell = (1 << LBVH_MORTON_BITS) - 1;
+    float scale[3];
+    for (int axis = 0; axis < 3; axis++) {
+        float extent = centroid_bounds.corners[1][axis] - centroid_bounds.corners[0][axis];
+        scale[axis] = extent > 0 ? (1 << LBVH_MORTON_BITS) / extent : 0;
+    }
+    codes = vector<uint32_t>(n);
+    parallel_for([&](int begin, int end, int) {
+        for (int i = begin; i < end; i++) {
+            uint32_t code = 0;
+            for (int axis = 0; axis < 3; axis++) {
+                float cell = (p_infos[i].centroid[axis] - centroid_bounds.corners[0][axis]) * scale[axis];
+                code |= lbvh_expand_bits(cell > 0 ? (uint32_t) min(cell, max_cell) : 0) << (2 - axis);
+            }
+            codes[i] = code;
+        }
+    }, n, grain_size);
+}
+
+// Sort the codes, giving the order of the primitives. Each pass is a stable counting sort on LBVH_RADIX_BITS bits
+// of the codes: each chunk counts its digits, the counts tell each chunk where its primitives with each digit go,
+// and then the chunks are scattered at once.
+static void lbvh_radix_sort(vector<uint32_t> &codes, vector<int> &order, int num_chunks)
+{
+    int n = codes.size();
+    const int num_buckets = 1 << LBVH_RADIX_BITS;
+    order = vector<int>(n);
+    for (int i = 0; i < n; i++) order[i] = i;
+    vector<uint32_t> sorted_codes(n);
+    vector<int> sorted_order(n);
+    vector<int> offsets(num_chunks * num_buckets);
+    for (int shift = 0; shift < 3 * LBVH_MORTON_BITS; shift += LBVH_RADIX_BITS) {
+        for_each_chunk(0, n, num_chunks, [&](int begin, int end, int chunk) {
+            int *counts = &offsets[chunk * num_buckets];
+            std::fill(counts, counts + num_buckets, 0);
+            for (int i = begin; i < end; i++) counts[(codes[i] >> shift) & (num_buckets - 1)]++;
+        });
+        // Primitives with smaller digits go first, and within a digit, those from earlier chunks.
+        int offset = 0;
+        for (int bucket = 0; bucket < num_buckets; bucket++) {
+            for (int chunk = 0; chunk < num_chunks; chunk++) {
+                int count = offsets[chunk * num_buckets + bucket];
+                offsets[chunk * num_buckets + bucket] = offset;
+                offset += count;
+            }
+        }
+        for_each_chunk(0, n, num_chunks, [&](int begin, int end, int chunk) {
+            int *next = &offsets[chunk * num_buckets];
+            for (int i = begin; i < end; i++) {
+                int j = next[(codes[i] >> shift) & (num_buckets - 1)]++;
+                sorted_codes[j] = codes[i];
+                sorted_order[j] = order[i];
+            }
+        });
+        codes.swap(sorted_codes);
+        order.swap(sorted_order);
+    }
+}
+
+// Make branching node i of the binary radix tree over the sorted codes (Karras 2012, figure 4).
+// Equal codes are told apart by their positions, as if these were appended to the codes.
+static void lbvh_emit_node(LBVHBuild &build, const vector<uint32_t> &codes, int i)
+{
+    int n = codes.size();
+    // The length of the common prefix of the codes at positions i and j, or -1 if j is out of range.
+    auto delta = [&](int j) {
+        if (j < 0 || j >= n) return -1;
+        uint32_t different = codes[i] ^ codes[j];
+        if (different == 0) return 32 + __builtin_clz((uint32_t) i ^ (uint32_t) j);
+        return __builtin_clz(different);
+    };
+    // The node's range goes from i towards the neighbour with the longer common prefix.
+    int d = delta(i + 1) > delta(i - 1) ? 1 : -1;
+    // Everything in the range has a longer common prefix with i than the neighbour on the other side does.
+    // Find the other end by doubling the length, and then a binary search.
+    int min_delta = delta(i - d);
+    int max_length = 2;
+    while (delta(i + max_length * d) > min_delta) max_length *= 2;
+    int length = 0;
+    for (int t = max_length / 2; t >= 1; t /= 2) {
+        if (delta(i + (length + t) * d) > min_delta) length += t;
+    }
+    int j = i + length * d;
+    // The range splits after the last position that has a longer common prefix with i than the whole range does.
+    int node_delta = delta(j);
+    int s = 0;
+    for (int t = (length + 1) / 2; ; t = (t + 1) / 2) {
+        if (delta(i + (s + t) * d) > node_delta) s += t;
+        if (t == 1) break;
+    }
+    int split = i + s * d + min(d, 0);
+
+    LBVHNode &node = build.nodes[i];
+    node.child[0] = min(i, j) == split ? ~split : split;
+    node.child[1] = max(i, j) == split + 1 ? ~(split + 1) : split + 1;
+    for (int side = 0; side < 2; side++) {
+        int child = node.child[side];
+        if (child < 0) build.leaf_parent[~child] = i;
+        else build.nodes[child].parent = i;
+    }
+}
+
+// Fill in node i from its children, making it a leaf if the SAH says that is cheaper.
+static void lbvh_update_node(LBVHBuild &build, int i)
+{
+    LBVHNode &node = build.nodes[i];
+    node.box = enlarged(build.box(node.child[0]), build.box(node.child[1]));
+    node.num_primitives = build.count(node.child[0]) + build.count(node.child[1]);
+    float area = node.box.surface_area();
+    node.cost = area * build.params.sah_traversal_cost + build.cost(node.child[0]) + build.cost(node.child[1]);
+    node.collapse = false;
+    if (node.num_primitives <= build.params.max_leaf_primitives) {
+        float leaf_cost = area * sah_leaf_cost(node.num_primitives, build.params);
+        if (leaf_cost <= node.cost) {
+            node.cost = leaf_cost;
+            node.collapse = true;
+        }
+    }
+}
+
+// The cheapest tree over each subset of a treelet's leaves, given as bit masks.
+struct LBVHTreelet {
+    int leaves[BVH_TREELET_LEAVES];
+    int branches[BVH_TREELET_LEAVES - 1];
+    int num_leaves;
+    BoundingBox boxes[1 << BVH_TREELET_LEAVES];
+    float costs[1 << BVH_TREELET_LEAVES];
+    int counts[1 << BVH_TREELET_LEAVES];
+    uint8_t partitions[1 << BVH_TREELET_LEAVES]; // The leaves of the first child.
+    bool collapses[1 << BVH_TREELET_LEAVES];
+};
+
+// Link up the nodes of the treelet for a subset of its leaves, taking branching nodes from those that the
+// treelet had. Returns the child reference for the subset.
+static int lbvh_link_treelet(LBVHBuild &build, const LBVHTreelet &treelet, int subset, int index, int *next_branch)
+{
+    if ((subset & (subset - 1)) == 0) return treelet.leaves[__builtin_ctz(subset)];
+    if (index < 0) index = treelet.branches[(*next_branch)++];
+    int partition = treelet.partitions[subset];
+    for (int side = 0; side < 2; side++) {
+        int child = lbvh_link_treelet(build, treelet, side == 0 ? partition : subset ^ partition, -1, next_branch);
+        build.nodes[index].child[side] = child;
+        if (child < 0) build.leaf_parent[~child] = index;
+        else build.nodes[child].parent = index;
+    }
+    LBVHNode &node = build.nodes[index];
+    node.box = treelet.boxes[subset];
+    node.num_primitives = treelet.counts[subset];
+    node.cost = treelet.costs[subset];
+    node.collapse = treelet.collapses[subset];
+    return index;
+}
+
+// Rearrange the treelet rooted at node i into its cheapest shape (Karras and Aila 2013, section 4).
+static void lbvh_restructure_treelet(LBVHBuild &build, int i)
+{
+    const BVHBuildParameters &params = build.params;
+    // Grow the treelet from node i's children, each time opening the leaf with the greatest surface area.
+    LBVHTreelet treelet;
+    treelet.leaves[0] = build.nodes[i].child[0];
+    treelet.leaves[1] = build.nodes[i].child[1];
+    treelet.branches[0] = i;
+    treelet.num_leaves = 2;
+    while (treelet.num_leaves < BVH_TREELET_LEAVES) {
+        int to_open = -1;
+        float greatest_area = -1;
+        for (int k = 0; k < treelet.num_leaves; k++) {
+            if (treelet.leaves[k] < 0) continue;
+            float area = build.nodes[treelet.leaves[k]].box.surface_area();
+            if (area > greatest_area) {
+                greatest_area = area;
+                to_open = k;
+            }
+        }
+        if (to_open < 0) break;
+        int opened = treelet.leaves[to_open];
+        treelet.branches[treelet.num_leaves - 1] = opened;
+        treelet.leaves[to_open] = build.nodes[opened].child[0];
+        treelet.leaves[treelet.num_leaves++] = build.nodes[opened].child[1];
+    }
+    // With two leaves there is only one shape.
+    if (treelet.num_leaves < 3) return;
+
+    // Every proper subset of a subset is a smaller number, so going up through the numbers finds the best tree
+    // for each part of a subset before the subset.
+    int all = (1 << treelet.num_leaves) - 1;
+    for (int k = 0; k < treelet.num_leaves; k++) {
+        treelet.boxes[1 << k] = build.box(treelet.leaves[k]);
+        treelet.costs[1 << k] = build.cost(treelet.leaves[k]);
+        treelet.counts[1 << k] = build.count(treelet.leaves[k]);
+    }
+    for (int subset = 1; subset <= all; subset++) {
+        int lowest = subset & -subset;
+        if (subset == lowest) continue;
+        int rest = subset ^ lowest;
+        treelet.boxes[subset] = enlarged(treelet.boxes[rest], treelet.boxes[lowest]);
+        treelet.counts[subset] = treelet.counts[rest] + treelet.counts[lowest];
+        // Each way of splitting the subset in two is tried once, with the lowest leaf in the first part.
+        float best_cost = INFINITY;
+        int best_partition = lowest;
+        for (int part = rest; ; part = (part - 1) & rest) {
+            int first = part | lowest;
+            if (first != subset) {
+                float cost = treelet.costs[first] + treelet.costs[subset ^ first];
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_partition = first;
+                }
+            }
+            if (part == 0) break;
+        }
+        float area = treelet.boxes[subset].surface_area();
+        treelet.costs[subset] = area * params.sah_traversal_cost + best_cost;
+        treelet.partitions[subset] = best_partition;
+        treelet.collapses[subset] = false;
+        if (treelet.counts[subset] <= params.max_leaf_primitives) {
+            float leaf_cost = area * sah_leaf_cost(treelet.counts[subset], params);
+            if (leaf_cost <= treelet.costs[subset]) {
+                treelet.costs[subset] = leaf_cost;
+                treelet.collapses[subset] = true;
+            }
+        }
+    }
+    if (treelet.costs[all] >= build.nodes[i].cost) return;
+    int next_branch = 1;
+    lbvh_link_treelet(build, treelet, all, i, &next_branch);
+}
+
+// Go up the tree from every primitive, calling f on each branching node once both of its children are done.
+template <typename F>
+static void lbvh_bottom_up(LBVHBuild &build, int grain_size, const F &f)
+{
+    int n = build.sorted.size();
+    vector<std::atomic<int>> arrivals(n - 1);
+    for (std::atomic<int> &arrived : arrivals) arrived.store(0, std::memory_order_relaxed);
+    parallel_for([&](int begin, int end, int) {
+        for (int k = begin; k < end; k++) {
+            int i = build.leaf_parent[k];
+            // The first to arrive at a node leaves it to whoever comes up through its other child.
+            while (i >= 0 && arrivals[i].fetch_add(1, std::memory_order_acq_rel) == 1) {
+                f(i);
+                i = build.nodes[i].parent;
+            }
+        }
+    }, n, grain_size);
+}
+
+static void lbvh_gather_primitives(const LBVHBuild &build, int child, vector<PrimitiveInfo> &p_infos, int *next)
+{
+    if (child < 0) {
+        p_infos[(*next)++] = build.sorted[~child];
+        return;
+    }
+    lbvh_gather_primitives(build, build.nodes[child].child[0], p_infos, next);
+    lbvh_gather_primitives(build, build.nodes[child].child[1], p_infos, next);
+}
+
+// Make the linked tree of Nodes for a subtree, laying out its primitives in p_infos from first in depth-first
+// order, so that the primitives under each node are a range, as the other builders leave them.
+static Node *lbvh_make_node(const LBVHBuild &build, int child, int first, vector<PrimitiveInfo> &p_infos,
+                            int *tree_size)
+{
+    (*tree_size)++;
+    if (child < 0 || build.nodes[child].collapse) {
+        int next = first;
+        lbvh_gather_primitives(build, child, p_infos, &next);
+        BoundingBox box = build.box(child);
+        return new Node(box, first, next - first);
+    }
+    const LBVHNode &node = build.nodes[child];
+    // Traversal visits the children in an order given by the ray's direction along the node's axis, with the
+    // first child taken to be on the low side. So take the axis that their centres are furthest apart along,
+    // and put them in order along it.
+    const BoundingBox &box_0 = build.box(node.child[0]);
+    const BoundingBox &box_1 = build.box(node.child[1]);
+    int axis = 0;
+    float greatest_separation = -1;
+    for (int i = 0; i < 3; i++) {
+        float separation = fabs(box_1.corners[0][i] + box_1.corners[1][i] - box_0.corners[0][i] - box_0.corners[1][i]);
+        if (separation > greatest_separation) {
+            greatest_separation = separation;
+            axis = i;
+        }
+    }
+    bool swap = box_1.corners[0][axis] + box_1.corners[1][axis] < box_0.corners[0][axis] + box_0.corners[1][axis];
+    int low = node.child[swap ? 1 : 0];
+    int high = node.child[swap ? 0 : 1];
+
+    int mid = first + build.count(low);
+    Node *children[2];
+    if (build.params.parallel_build && node.num_primitives >= build.params.parallel_min_primitives
+            && num_parallel_threads() > 1) {
+        int second_tree_size = 0;
+        TaskGroup group;
+        group.spawn([&](int) {
+            children[1] = lbvh_make_node(build, high, mid, p_infos, &second_tree_size);
+        });
+        children[0] = lbvh_make_node(build, low, first, p_infos, tree_size);
+        group.wait();
+        *tree_size += second_tree_size;
+    } else {
+        children[0] = lbvh_make_node(build, low, first, p_infos, tree_size);
+        children[1] = lbvh_make_node(build, high, mid, p_infos, tree_size);
+    }
+    return new Node(mid, children[0], children[1], axis);
+}
+
+static Node *BVH_create_lbvh(vector<PrimitiveInfo> &p_infos, const BVHBuildParameters &params, int *tree_size)
+{
+    int n = p_infos.size();
+    // The usual builder makes the single leaf.
+    if (n <= 1) return BVH_create_node(p_infos, 0, n, params, tree_size);
+    // Without a parallel build, the grain is the whole range, so each pass runs on the calling thread.
+    bool parallel = params.parallel_build && num_parallel_threads() > 1 && n >= params.parallel_min_primitives;
+    int grain_size = parallel ? 4096 : n;
+    int num_chunks = parallel ? min(4 * num_parallel_threads(), n / 1024) : 1;
+
+    vector<uint32_t> codes;
+    vector<int> order;
+    lbvh_morton_codes(p_infos, codes, grain_size);
+    lbvh_radix_sort(codes, order, num_chunks);
+
+    LBVHBuild build(params);
+    build.sorted = vector<PrimitiveInfo>(n);
+    build.nodes = vector<LBVHNode>(n - 1);
+    build.leaf_parent = vector<int>(n);
+    build.nodes[0].parent = -1;
+    parallel_for([&](int begin, int end, int) {
+        for (int i = begin; i < end; i++) build.sorted[i] = p_infos[order[i]];
+    }, n, grain_size);
+    parallel_for([&](int begin, int end, int) {
+        for (int i = begin; i < end; i++) lbvh_emit_node(build, codes, i);
+    }, n - 1, grain_size);
+    lbvh_bottom_up(build, grain_size, [&](int i) {
+        lbvh_update_node(build, i);
+    });
+    // Small subtrees are left alone, with the least size doubling after each pass. Most of the work is near the
+    // bottom, and the first pass finds most of the improvement there.
+    int min_primitives = BVH_TREELET_LEAVES;
+    for (int pass = 0; pass < params.lbvh_treelet_passes; pass++) {
+        lbvh_bottom_up(build, grain_size, [&](int i) {
+            // The subtrees below may have been improved since this node was filled in.
+            lbvh_update_node(build, i);
+            if (build.nodes[i].num_primitives >= min_primitives) lbvh_restructure_treelet(build, i);
+        });
+        min_primitives *= 2;
+    }
+    return lbvh_make_node(build, 0, 0, p_infos, tree_size);
+}
+
+/*--------------------------------------------------------------------------------
+    Spatial split BVH construction.
+    Each node holds its own array of references, which are PrimitiveInfos whose
+    boxes may be clipped to part of their primitive. At each node the best object
+    split is found as by the SAH builder, and if its children overlap, so is the
+    best spatial split: the node's box is cut into bins along each axis, each
+    reference is chopped into the bins it crosses (with Primitive::split_bound()),
+    and the plane between two bins is costed with the boxes of the chopped parts
+    and the references entering and leaving bins on either side.
+    The leaves' references are laid out in depth-first order.
+--------------------------------------------------------------------------------*/
+struct SBVHSpatialBin {
+    BoundingBox box;
+    int entries; // References starting in this bin.
+    int exits; // References ending in this bin.
+};
+
+struct SBVHSpatialSplit {
+    float cost;
+    int dimension; // -1 if there is no split.
+    float position;
+    int num_left;
+    int num_right;
+};
+
+static SBVHSpatialSplit sbvh_find_spatial_split(const vector<PrimitiveInfo> &refs, const BoundingBox &node_box,
+                                                const BVHBuildParameters &params)
+{
+    int num_bins = params.sah_num_bins;
+    if (num_bins > MAX_SAH_BINS) num_bins = MAX_SAH_BINS;
+    if (num_bins < 2) num_bins = 2;
+    float inv_node_area = node_box.surface_area() > 0 ? 1.f / node_box.surface_area() : 0.f;
+
+    SBVHSpatialSplit best;
+    best.cost = INFINITY;
+    best.dimension = -1;
+    for (int dim = 0; dim < 3; dim++) {
+        float min_value = node_box.corners[0][dim];
+        float extent = node_box.corners[1][dim] - min_value;
+        if (!(extent > 0)) continue;
+        float bin_width = extent / num_bins;
+        auto bin_of = [&](float value) {
+            int bin = (int) ((value - min_value) / bin_width);
+            return max(0, min(num_bins - 1, bin));
+        };
+        SBVHSpatialBin bins[MAX_SAH_BINS];
+        for (int b = 0; b < num_bins; b++) {
+            bins[b].box = BoundingBox();
+            bins[b].entries = bins[b].exits = 0;
+        }
+        for (const PrimitiveInfo &ref : refs) {
+            int first_bin = bin_of(ref.box.corners[0][dim]);
+            int last_bin = bin_of(ref.box.corners[1][dim]);
+            bins[first_bin].entries ++;
+            bins[last_bin].exits ++;
+            // Chop the reference at each plane it crosses.
+            BoundingBox rest = ref.box;
+            for (int b = first_bin; b < last_bin; b++) {
+                BoundingBox part;
+                ref.primitive->split_bound(rest, dim, min_value + (b + 1) * bin_width, &part, &rest);
+                bins[b].box.enlarge(part);
+            }
+            bins[last_bin].box.enlarge(rest);
+        }
+        // Sweep as for object splits, with the counts of references entering bins on the left and leaving them
+        // on the right.
+        BoundingBox right_boxes[MAX_SAH_BINS];
+        int right_counts[MAX_SAH_BINS];
+        BoundingBox right_box;
+        int right_count = 0;
+        for (int b = num_bins - 1; b > 0; b--) {
+            right_box.enlarge(bins[b].box);
+            right_count += bins[b].exits;
+            right_boxes[b] = right_box;
+            right_counts[b] = right_count;
+        }
+        BoundingBox left_box;
+        int left_count = 0;
+        for (int b = 0; b < num_bins - 1; b++) {
+            left_box.enlarge(bins[b].box);
+            left_count += bins[b].entries;
+            if (left_count == 0 || right_counts[b+1] == 0) continue;
+            float cost = params.sah_traversal_cost
+                       + inv_node_area * (sah_leaf_cost(left_count, params) * left_box.surface_area()
+                                          + sah_leaf_cost(right_counts[b+1], params) * right_boxes[b+1].surface_area());
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.dimension = dim;
+                best.position = min_value + (b + 1) * bin_width;
+                best.num_left = left_count;
+                best.num_right = right_counts[b+1];
+            }
+        }
+    }
+    return best;
+}
+
+// Share the references between the sides of the plane, chopping those that cross it. A crossing reference is
+// instead put wholly on one side if that is cheaper (the "reference unsplitting" of Stich et al.), which saves
+// a reference where a primitive only pokes a little way through the plane.
+static void sbvh_spatial_partition(const vector<PrimitiveInfo> &refs, int dim, float position,
+                                   vector<PrimitiveInfo> &left, vector<PrimitiveInfo> &right)
+{
+    BoundingBox left_box, right_box;
+    vector<int> crossing;
+    for (int i = 0; i < refs.size(); i++) {
+        const PrimitiveInfo &ref = refs[i];
+        if (ref.box.corners[1][dim] <= position) {
+            left.push_back(ref);
+            left_box.enlarge(ref.box);
+        } else if (ref.box.corners[0][dim] >= position) {
+            right.push_back(ref);
+            right_box.enlarge(ref.box);
+        } else {
+            crossing.push_back(i);
+        }
+    }
+    // Unsplitting is decided against the sides with every crossing reference chopped.
+    vector<BoundingBox> parts(2 * crossing.size());
+    for (int k = 0; k < crossing.size(); k++) {
+        const PrimitiveInfo &ref = refs[crossing[k]];
+        ref.primitive->split_bound(ref.box, dim, position, &parts[2*k], &parts[2*k+1]);
+        left_box.enlarge(parts[2*k]);
+        right_box.enlarge(parts[2*k+1]);
+    }
+    int num_left = left.size() + crossing.size();
+    int num_right = right.size() + crossing.size();
+    for (int k = 0; k < crossing.size(); k++) {
+        const PrimitiveInfo &ref = refs[crossing[k]];
+        const BoundingBox &left_part = parts[2*k];
+        const BoundingBox &right_part = parts[2*k+1];
+        // The clipping can find that the primitive is only on one side after all (leaving the identity box).
+        bool to_left = right_part.corners[0].x > right_part.corners[1].x;
+        bool to_right = left_part.corners[0].x > left_part.corners[1].x;
+        if (!to_left && !to_right) {
+            float split_cost = left_box.surface_area() * num_left + right_box.surface_area() * num_right;
+            float left_cost = enlarged(left_box, ref.box).surface_area() * num_left
+                            + right_box.surface_area() * (num_right - 1);
+            float right_cost = left_box.surface_area() * (num_left - 1)
+                             + enlarged(right_box, ref.box).surface_area() * num_right;
+            // Don't empty a side.
+            if (num_right > 1 && left_cost < split_cost && left_cost <= right_cost) to_left = true;
+            else if (num_left > 1 && right_cost < split_cost) to_right = true;
+        }
+        if (to_left) {
+            left.push_back(ref);
+            left_box.enlarge(ref.box);
+            num_right --;
+        } else if (to_right) {
+            right.push_back(ref);
+            right_box.enlarge(ref.box);
+            num_left --;
+        } else {
+            left.push_back(PrimitiveInfo(ref.primitive, left_part));
+            right.push_back(PrimitiveInfo(ref.primitive, right_part));
+        }
+    }
+}
+
+static Node *sbvh_create_node(vector<PrimitiveInfo> &refs, int max_references, float root_area,
+                              const BVHBuildParameters &params, vector<PrimitiveInfo> &leaf_refs, int *tree_size)
+{
+    (*tree_size)++;
+    int n = refs.size();
+    BoundingBox box, centroid_bounds;
+    for (const PrimitiveInfo &ref : refs) {
+        box.enlarge(ref.box);
+        centroid_bounds.enlarge(ref.centroid);
+    }
+    auto make_leaf = [&]() {
+        // The leaf's first primitive is filled in once the whole tree is built.
+        leaf_refs.insert(leaf_refs.end(), refs.begin(), refs.end());
+        return new Node(box, 0, n);
+    };
+    if (n <= 1) return make_leaf();
+
+    vector<PrimitiveInfo> children_refs[2];
+    int splitting_dimension = 0;
+    SAHObjectSplit object_split = sah_find_object_split(refs, 0, n, box, centroid_bounds, params, 1);
+    SBVHSpatialSplit spatial_split;
+    spatial_split.dimension = -1;
+    spatial_split.cost = INFINITY;
+    if (max_references > n && (object_split.dimension < 0
+            || intersected(object_split.boxes[0], object_split.boxes[1]).surface_area()
+                   > params.sbvh_overlap_threshold * root_area)) {
+        spatial_split = sbvh_find_spatial_split(refs, box, params);
+        if (spatial_split.num_left + spatial_split.num_right > max_references) spatial_split.dimension = -1;
+    }
+    float split_cost = min(object_split.dimension >= 0 ? object_split.cost : INFINITY,
+                           spatial_split.dimension >= 0 ? spatial_split.cost : INFINITY);
+    if (n <= params.max_leaf_primitives && sah_leaf_cost(n, params) <= split_cost) return make_leaf();
+
+    bool spatial = spatial_split.dimension >= 0 && spatial_split.cost < object_split.cost;
+    if (spatial) {
+        splitting_dimension = spatial_split.dimension;
+        sbvh_spatial_partition(refs, splitting_dimension, spatial_split.position, children_refs[0], children_refs[1]);
+        // The bins and the partition can disagree about references touching the plane.
+        if (children_refs[0].empty() || children_refs[1].empty()) {
+            children_refs[0].clear();
+            children_refs[1].clear();
+            spatial = false;
+        }
+    }
+    if (!spatial && object_split.dimension >= 0) {
+        splitting_dimension = object_split.dimension;
+        BinComparer comparer = sah_object_split_comparer(object_split, centroid_bounds);
+        for (const PrimitiveInfo &ref : refs) children_refs[comparer(ref) ? 0 : 1].push_back(ref);
+    } else if (!spatial) {
+        if (n <= BVH_MAX_LEAF_PRIMITIVES) return make_leaf();
+        // Too many to fit in one leaf but they can't be told apart, so just split the array in half.
+        children_refs[0].assign(refs.begin(), refs.begin() + n/2);
+        children_refs[1].assign(refs.begin() + n/2, refs.end());
+    }
+    vector<PrimitiveInfo>().swap(refs);
+
+    // Share what is left of the allowance for references between the children by their sizes.
+    int num_children_refs = children_refs[0].size() + children_refs[1].size();
+    int spare = max(0, max_references - num_children_refs);
+    int left_spare = (int) (((long) spare * children_refs[0].size()) / num_children_refs);
+    int max_child_references[2] = { (int) children_refs[0].size() + left_spare,
+                                    (int) children_refs[1].size() + spare - left_spare };
+    Node *children[2];
+    if (params.parallel_build && n >= params.parallel_min_primitives && num_parallel_threads() > 1) {
+        vector<PrimitiveInfo> second_leaf_refs;
+        int second_tree_size = 0;
+        TaskGroup group;
+        group.spawn([&](int) {
+            children[1] = sbvh_create_node(children_refs[1], max_child_references[1], root_area, params,
+                                           second_leaf_refs, &second_tree_size);
+        });
+        children[0] = sbvh_create_node(children_refs[0], max_child_references[0], root_area, params,
+                                       leaf_refs, tree_size);
+        group.wait();
+        leaf_refs.insert(leaf_refs.end(), second_leaf_refs.begin(), second_leaf_refs.end());
+        *tree_size += second_tree_size;
+    } else {
+        for (int i = 0; i < 2; i++) {
+            children[i] = sbvh_create_node(children_refs[i], max_child_references[i], root_area, params,
+                                           leaf_refs, tree_size);
+        }
+    }
+    return new Node(0, children[0], children[1], splitting_dimension);
+}
+
+// Fill in the ranges of the references under each node, which are in depth-first order.
+static void sbvh_number_node(Node *node, int *next)
+{
+    if (node->is_leaf()) {
+        node->first_primitive = *next;
+        *next += node->num_primitives;
+        return;
+    }
+    sbvh_number_node(node->children[0], next);
+    node->mid = *next;
+    sbvh_number_node(node->children[1], next);
+}
+
+static Node *BVH_create_sbvh(vector<PrimitiveInfo> &p_infos, const BVHBuildParameters &params, int *tree_size)
+{
+    int n = p_infos.size();
+    BoundingBox root_box;
+    for (const PrimitiveInfo &info : p_infos) root_box.enlarge(info.box);
+    int max_references = n + (int) (params.sbvh_max_duplication * n);
+    vector<PrimitiveInfo> refs;
+    refs.swap(p_infos);
+    Node *root = sbvh_create_node(refs, max_references, root_box.surface_area(), params, p_infos, tree_size);
+    int next = 0;
+    sbvh_number_node(root, &next);
+    return root;
+}
+
+static Node *BVH_create_tree(vector<PrimitiveInfo> &p_infos, const BVHBuildParameters &params, int *tree_size)
+{
+    int num_primitives = p_infos.size();
+    if (params.split_method == BVH_SPLIT_LBVH) return BVH_create_lbvh(p_infos, params, tree_size);
+    if (params.split_method == BVH_SPLIT_SBVH) return BVH_create_sbvh(p_infos, params, tree_size);
+    int threads = num_parallel_threads();
+    if (!params.parallel_build || threads <= 1 || num_primitives < params.parallel_min_primitives) {
+        return BVH_create_node(p_infos, 0, num_primitives, params, tree_size);
+    }
+    BVHParallelBuild build;
+    build.subtrees = vector<BVHParallelBuild::Subtree>(0);
+    // Make a few subtrees per thread, so that threads which finish early can pick up more.
+    build.subtree_size = max(params.parallel_min_primitives / 4, num_primitives / (8 * threads));
+    build.min_chunk_size = 1024;
+    build.max_chunks = 4 * threads;
+    build.tree_size = 0;
+    Node *root = NULL;
+    BVH_create_node_parallel(p_infos, 0, num_primitives, params, &build, &root);
+
+    // Build the biggest subtrees first.
+    std::sort(build.subtrees.begin(), build.subtrees.end(), [](const BVHParallelBuild::Subtree &a, const BVHParallelBuild::Subtree &b) {
+        return a.num_primitives > b.num_primitives;
+    });
+    vector<int> subtree_sizes(build.subtrees.size());
+    parallel_for_2D([&](int i, int, int) {
+        BVHParallelBuild::Subtree &subtree = build.subtrees[i];
+        subtree_sizes[i] = 0;
+        *subtree.node = BVH_create_node(p_infos, subtree.first_primitive, subtree.num_primitives, params, &subtree_sizes[i]);
+    }, build.subtrees.size(), 1);
+
+    *tree_size = build.tree_size;
+    for (int size : subtree_sizes) *tree_size += size;
+    return root;
+}
+void BVH_delete_node(Node *node)
 {
     if (IS_LEAF(node)) delete node;
     else {
@@ -164,8 +1210,74 @@ static void BVH_compactify(Node *root, vector<BVHNode> &compacted)
     BVH_compactify_recur(compacted, root, 0);
 }
 
-BVH::BVH(const vector<Primitive *> &_primitives, bool keep_root)
+// The SAH cost of a tree, given either compacted or as a linked tree if there is no compacted array.
+// This sums the cost of each node weighted by the probability that a random ray hitting the root also hits
+// that node, which is the ratio of their surface areas.
+static float sah_weighted_cost_recur(const Node *node, const BVHBuildParameters &params)
+{
+    if (node->is_leaf()) return node->box.surface_area() * sah_leaf_cost(node->num_primitives, params);
+    return node->box.surface_area() * params.sah_traversal_cost
+         + sah_weighted_cost_recur(node->children[0], params)
+         + sah_weighted_cost_recur(node->children[1], params);
+}
+static float sah_cost(const vector<BVHNode> &compacted, const Node *root, const BVHBuildParameters &params)
+{
+    float weighted_cost = 0;
+    float root_area = 0;
+    if (!compacted.empty()) {
+        for (const BVHNode &node : compacted) {
+            float cost = node.num_primitives == 0 ? params.sah_traversal_cost : sah_leaf_cost(node.num_primitives, params);
+            weighted_cost += node.box.surface_area() * cost;
+        }
+        root_area = compacted[0].box.surface_area();
+    } else if (root != NULL) {
+        weighted_cost = sah_weighted_cost_recur(root, params);
+        root_area = root->box.surface_area();
+    }
+    return root_area > 0 ? weighted_cost / root_area : 0;
+}
+
+static BVHLeafPrimitive tag_leaf_primitive(Primitive *primitive)
+{
+    BVHLeafPrimitive leaf = { NULL, primitive, BVH_LEAF_PRIMITIVE };
+    // Only exact types are tagged, as a derived class might override the routines that are called directly.
+    if (typeid(*primitive) != typeid(GeometricPrimitive)) return leaf;
+    const Shape *shape = static_cast<GeometricPrimitive *>(primitive)->shape;
+    const std::type_info &type = typeid(*shape);
+    if (type == typeid(Sphere)) leaf.type = BVH_LEAF_SPHERE;
+    else if (type == typeid(Plane)) leaf.type = BVH_LEAF_PLANE;
+    else if (type == typeid(MeshTriangle)) leaf.type = BVH_LEAF_TRIANGLE;
+    else if (type == typeid(TriangleMesh)) leaf.type = BVH_LEAF_MESH;
+    else if (type == typeid(Instance)) leaf.type = BVH_LEAF_INSTANCE;
+    else if (type == typeid(SphereSet)) leaf.type = BVH_LEAF_SPHERE_SET;
+    else return leaf;
+    leaf.shape = shape;
+    return leaf;
+}
+// Tag the primitives, and sort each leaf's primitives by type (keeping the order within each type).
+static void BVH_tag_leaf_primitives(vector<Primitive *> &primitives, const vector<BVHNode> &compacted,
+                                    vector<BVHLeafPrimitive> &leaf_primitives)
+{
+    leaf_primitives.resize(primitives.size());
+    for (size_t i = 0; i < primitives.size(); i++) leaf_primitives[i] = tag_leaf_primitive(primitives[i]);
+    for (const BVHNode &node : compacted) {
+        if (node.num_primitives <= 1) continue;
+        auto first = leaf_primitives.begin() + node.primitives_offset;
+        std::stable_sort(first, first + node.num_primitives, [](const BVHLeafPrimitive &a, const BVHLeafPrimitive &b) {
+            return a.type < b.type;
+        });
+        for (int i = 0; i < node.num_primitives; i++) {
+            primitives[node.primitives_offset + i] = leaf_primitives[node.primitives_offset + i].primitive;
+        }
+    }
+}
+
+BVH::BVH(const vector<Primitive *> &_primitives, bool keep_root, const BVHBuildParameters &build_parameters)
 {
+    m_build_parameters = build_parameters;
+    if (m_build_parameters.max_leaf_primitives < 1) m_build_parameters.max_leaf_primitives = 1;
+    if (m_build_parameters.max_leaf_primitives > BVH_MAX_LEAF_PRIMITIVES) m_build_parameters.max_leaf_primitives = BVH_MAX_LEAF_PRIMITIVES;
+    if (m_build_parameters.sah_primitive_group_size < 1) m_build_parameters.sah_primitive_group_size = 1;
     // Compute a more compact, homogeneous array of primitive information.
     vector<PrimitiveInfo> p_infos;
     p_infos.reserve(_primitives.size());
@@ -188,7 +1300,7 @@ BVH::BVH(const vector<Primitive *> &_primitives, bool keep_root)
     // While recurring, the array is being rearranged so that nodes only need to hold ranges.
 
     int tree_size = 0;
-    Node *root = BVH_create_node(p_infos, 0, _primitives.size(), &tree_size);
+    Node *root = BVH_create_tree(p_infos, m_build_parameters, &tree_size);
     
     // print_node(root);
     // A side-effect of BVH_create_node is that the PrimitiveInfo array in the order of a depth first traversal
@@ -208,6 +1320,7 @@ BVH::BVH(const vector<Primitive *> &_primitives, bool keep_root)
     compacted = vector<BVHNode>(tree_size);
     BVH_compactify(root, compacted);
     m_box = root->box;
+    BVH_tag_leaf_primitives(primitives, compacted, leaf_primitives);
     if (keep_root) {
         // special case use: BVHs are processed into another form to be more optimal for triangle meshes.
         // The tree representation is more convenient to work on.
@@ -219,6 +1332,7 @@ BVH::BVH(const vector<Primitive *> &_primitives, bool keep_root)
     // print_compacted(compacted);
     // getchar();
     #endif
+    m_built_sah_cost = sah_cost(compacted, uncompacted_root, m_build_parameters);
 }
 
 BoundingBox BVH::world_bound() const
@@ -226,6 +1340,89 @@ BoundingBox BVH::world_bound() const
     return m_box;
 }
 
+static BoundingBox primitives_bound(const vector<Primitive *> &primitives, int first, int num)
+{
+    BoundingBox box;
+    for (int i = first; i < first + num; i++) box.enlarge(primitives[i]->world_bound());
+    return box;
+}
+static void refit_recur(Node *node, const vector<Primitive *> &primitives)
+{
+    if (node->is_leaf()) {
+        node->box = primitives_bound(primitives, node->first_primitive, node->num_primitives);
+        return;
+    }
+    refit_recur(node->children[0], primitives);
+    refit_recur(node->children[1], primitives);
+    node->box = enlarged(node->children[0]->box, node->children[1]->box);
+}
+float BVH::refit()
+{
+    // Children come after their parent in the compacted array, so going backwards reaches them first.
+    for (int i = compacted.size() - 1; i >= 0; i--) {
+        BVHNode &node = compacted[i];
+        if (node.num_primitives > 0) {
+            node.box = primitives_bound(primitives, node.primitives_offset, node.num_primitives);
+        } else {
+            node.box = enlarged(compacted[i + 1].box, compacted[node.second_child_offset].box);
+        }
+    }
+    if (uncompacted_root != NULL) refit_recur(uncompacted_root, primitives);
+    if (!compacted.empty()) m_box = compacted[0].box;
+    else if (uncompacted_root != NULL) m_box = uncompacted_root->box;
+    float cost = sah_cost(compacted, uncompacted_root, m_build_parameters);
+    return m_built_sah_cost > 0 ? cost / m_built_sah_cost : 1;
+}
+
+static void build_report_recur(const vector<BVHNode> &compacted, int index, int depth,
+                               BVHBuildReport *report, long *leaf_depth_sum)
+{
+    const BVHNode &node = compacted[index];
+    report->num_nodes ++;
+    if (depth > report->max_depth) report->max_depth = depth;
+    if (node.num_primitives == 0) {
+        build_report_recur(compacted, index + 1, depth + 1, report, leaf_depth_sum);
+        build_report_recur(compacted, node.second_child_offset, depth + 1, report, leaf_depth_sum);
+    } else {
+        report->num_leaves ++;
+        (*leaf_depth_sum) += depth;
+        if (report->leaf_size_histogram.size() <= node.num_primitives) {
+            report->leaf_size_histogram.resize(node.num_primitives + 1, 0);
+        }
+        report->leaf_size_histogram[node.num_primitives] ++;
+    }
+}
+BVHBuildReport BVH::build_report() const
+{
+    BVHBuildReport report;
+    report.sah_cost = 0;
+    report.num_nodes = 0;
+    report.num_leaves = 0;
+    report.max_depth = 0;
+    report.average_leaf_depth = 0;
+    report.leaf_size_histogram = vector<int>(0);
+    if (compacted.empty()) return report;
+
+    long leaf_depth_sum = 0;
+    build_report_recur(compacted, 0, 0, &report, &leaf_depth_sum);
+    report.sah_cost = sah_cost(compacted, NULL, m_build_parameters);
+    report.average_leaf_depth = report.num_leaves > 0 ? ((float) leaf_depth_sum) / report.num_leaves : 0;
+    return report;
+}
+void BVHBuildReport::print() const
+{
+    std::cout << "BVH build report:\n";
+    std::cout << "    SAH cost: " << sah_cost << "\n";
+    std::cout << "    num_nodes: " << num_nodes << "\n";
+    std::cout << "    num_leaves: " << num_leaves << "\n";
+    std::cout << "    max_depth: " << max_depth << "\n";
+    std::cout << "    average_leaf_depth: " << average_leaf_depth << "\n";
+    std::cout << "    leaf size histogram:\n";
+    for (int i = 1; i < leaf_size_histogram.size(); i++) {
+        if (leaf_size_histogram[i] == 0) continue;
+        printf("        %3d: %d\n", i, leaf_size_histogram[i]);
+    }
+}
 
 #if NO_COMPACTIFY
 // Inefficient implementations that just traverse the data structure created while the BVH was being built.
@@ -261,22 +1458,38 @@ bool BVH::does_intersect(Ray &ray) const
     Intersection inter;
     return intersect(ray, &inter);
 }
+uint32_t BVH::intersect_packet(RayPacket &packet, uint32_t active, Intersection *inters)
+{
+    return Primitive::intersect_packet(packet, active, inters);
+}
+const Primitive *BVH::occluder(Ray &ray) const
+{
+    return Primitive::occluder(ray);
+}
+uint32_t BVH::occluder_packet(RayPacket &packet, uint32_t active, const Primitive **occluders) const
+{
+    return Primitive::occluder_packet(packet, active, occluders);
+}
 #else
 // Hopefully more efficient methods that traverse a compacted data structure, with optimizations
 // such as precomputations for ray-bounding box intersections.
 
 
-static inline bool intersect_box(const BVHNode &node, const Ray &ray, const Vector &inv_d, const int is_negative[3])
+// If the ray hits the box, *t_entry is where the ray's line enters it (which is before min_t if the ray starts inside).
+static inline bool intersect_box(const BVHNode &node, const Ray &ray, const Vector &inv_d, const Vector &inv_d_far,
+                                 const int is_negative[3], float *t_entry)
 {
     // Optimized function used for box tests in the BVH.
+    RENDER_STATS_ADD(box_tests, 1);
+    // The far planes use inv_d scaled by RAY_BOX_FAR_SCALE.
     // Check box intersection.
     float t0x, t1x, t0y, t1y, t0z, t1z;
     // X
     t0x = (node.box.corners[is_negative[0]].x - ray.o.x) * inv_d.x;
-    t1x = (node.box.corners[1-is_negative[0]].x - ray.o.x) * inv_d.x;
+    t1x = (node.box.corners[1-is_negative[0]].x - ray.o.x) * inv_d_far.x;
     // Y
     t0y = (node.box.corners[is_negative[1]].y - ray.o.y) * inv_d.y;
-    t1y = (node.box.corners[1-is_negative[1]].y - ray.o.y) * inv_d.y;
+    t1y = (node.box.corners[1-is_negative[1]].y - ray.o.y) * inv_d_far.y;
     if (t0x > t1y || t0y > t1x) {
         // No intersection, the X and Y interval intersection is degenerate.
         return false;
@@ -286,7 +1499,7 @@ static inline bool intersect_box(const BVHNode &node, const Ray &ray, const Vect
     if (t1y < t1x) t1x = t1y;
     // Z
     t0z = (node.box.corners[is_negative[2]].z - ray.o.z) * inv_d.z;
-    t1z = (node.box.corners[1-is_negative[2]].z - ray.o.z) * inv_d.z;
+    t1z = (node.box.corners[1-is_negative[2]].z - ray.o.z) * inv_d_far.z;
     if (t0x > t1z || t0z > t1x) {
         // No intersection, the box interval is degenerate.
         return false;
@@ -299,64 +1512,207 @@ static inline bool intersect_box(const BVHNode &node, const Ray &ray, const Vect
         // If either of these is true then the intersection must be degenerate. The converse is also true.
         return false;
     }
+    *t_entry = t0x;
     return true;
 }
 
 
+#if BVH_TYPED_LEAVES
+// Leaf primitive dispatch. Naming the shape's class in the call makes it a direct call (which the compiler can
+// inline) instead of a virtual one, and the GeometricPrimitive is only touched to be recorded as the hit primitive.
+// These do what GeometricPrimitive's routines do.
+template <typename S>
+static inline uint32_t intersect_lanes(const S *shape, RayPacket &packet, uint32_t active, LocalGeometry *geoms)
+{
+    // As Shape::intersect_packet(), for the shapes which don't have a packet routine.
+    uint32_t hit = 0;
+    for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+        if (!(active & (1 << lane))) continue;
+        Ray ray = packet.ray(lane);
+        if (shape->S::intersect(ray, &geoms[lane])) {
+            packet.max_t[lane] = ray.max_t;
+            hit |= 1 << lane;
+        }
+    }
+    return hit;
+}
+template <typename S>
+static inline uint32_t does_intersect_lanes(const S *shape, RayPacket &packet, uint32_t active)
+{
+    uint32_t hit = 0;
+    for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+        if (!(active & (1 << lane))) continue;
+        Ray ray = packet.ray(lane);
+        if (shape->S::does_intersect(ray)) hit |= 1 << lane;
+    }
+    return hit;
+}
+
+static inline bool intersect_leaf_primitive(const BVHLeafPrimitive &leaf, Ray &ray, Intersection *inter)
+{
+    bool hit;
+    switch (leaf.type) {
+    case BVH_LEAF_SPHERE: hit = static_cast<const Sphere *>(leaf.shape)->Sphere::intersect(ray, &inter->geom); break;
+    case BVH_LEAF_PLANE: hit = static_cast<const Plane *>(leaf.shape)->Plane::intersect(ray, &inter->geom); break;
+    case BVH_LEAF_TRIANGLE: hit = static_cast<const MeshTriangle *>(leaf.shape)->MeshTriangle::intersect(ray, &inter->geom); break;
+    case BVH_LEAF_MESH: hit = static_cast<const TriangleMesh *>(leaf.shape)->TriangleMesh::intersect(ray, &inter->geom); break;
+    case BVH_LEAF_INSTANCE: hit = static_cast<const Instance *>(leaf.shape)->Instance::intersect(ray, &inter->geom); break;
+    case BVH_LEAF_SPHERE_SET: hit = static_cast<const SphereSet *>(leaf.shape)->SphereSet::intersect(ray, &inter->geom); break;
+    default: return leaf.primitive->intersect(ray, inter);
+    }
+    if (hit) inter->primitive = static_cast<GeometricPrimitive *>(leaf.primitive);
+    return hit;
+}
+static inline const Primitive *leaf_primitive_occluder(const BVHLeafPrimitive &leaf, Ray &ray)
+{
+    bool hit;
+    switch (leaf.type) {
+    case BVH_LEAF_SPHERE: hit = static_cast<const Sphere *>(leaf.shape)->Sphere::does_intersect(ray); break;
+    case BVH_LEAF_PLANE: hit = static_cast<const Plane *>(leaf.shape)->Plane::does_intersect(ray); break;
+    case BVH_LEAF_TRIANGLE: hit = static_cast<const MeshTriangle *>(leaf.shape)->MeshTriangle::does_intersect(ray); break;
+    case BVH_LEAF_MESH: hit = static_cast<const TriangleMesh *>(leaf.shape)->TriangleMesh::does_intersect(ray); break;
+    case BVH_LEAF_INSTANCE: hit = static_cast<const Instance *>(leaf.shape)->Instance::does_intersect(ray); break;
+    case BVH_LEAF_SPHERE_SET: hit = static_cast<const SphereSet *>(leaf.shape)->SphereSet::does_intersect(ray); break;
+    default: return leaf.primitive->occluder(ray);
+    }
+    return hit ? leaf.primitive : NULL;
+}
+static inline uint32_t intersect_packet_leaf_primitive(const BVHLeafPrimitive &leaf, RayPacket &packet, uint32_t active,
+                                                       Intersection *inters)
+{
+    LocalGeometry geoms[RAY_PACKET_SIZE];
+    uint32_t hit;
+    switch (leaf.type) {
+    case BVH_LEAF_SPHERE: hit = intersect_lanes(static_cast<const Sphere *>(leaf.shape), packet, active, geoms); break;
+    case BVH_LEAF_PLANE: hit = intersect_lanes(static_cast<const Plane *>(leaf.shape), packet, active, geoms); break;
+    case BVH_LEAF_TRIANGLE: hit = intersect_lanes(static_cast<const MeshTriangle *>(leaf.shape), packet, active, geoms); break;
+    case BVH_LEAF_MESH:
+        hit = static_cast<const TriangleMesh *>(leaf.shape)->TriangleMesh::intersect_packet(packet, active, geoms);
+        break;
+    case BVH_LEAF_INSTANCE:
+        hit = static_cast<const Instance *>(leaf.shape)->Instance::intersect_packet(packet, active, geoms);
+        break;
+    case BVH_LEAF_SPHERE_SET:
+        hit = static_cast<const SphereSet *>(leaf.shape)->SphereSet::intersect_packet(packet, active, geoms);
+        break;
+    default: return leaf.primitive->intersect_packet(packet, active, inters);
+    }
+    for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+        if (!(hit & (1 << lane))) continue;
+        inters[lane].geom = geoms[lane];
+        inters[lane].primitive = static_cast<GeometricPrimitive *>(leaf.primitive);
+    }
+    return hit;
+}
+static inline uint32_t occluder_packet_leaf_primitive(const BVHLeafPrimitive &leaf, RayPacket &packet, uint32_t active,
+                                                      const Primitive **occluders)
+{
+    uint32_t occluded;
+    switch (leaf.type) {
+    case BVH_LEAF_SPHERE: occluded = does_intersect_lanes(static_cast<const Sphere *>(leaf.shape), packet, active); break;
+    case BVH_LEAF_PLANE: occluded = does_intersect_lanes(static_cast<const Plane *>(leaf.shape), packet, active); break;
+    case BVH_LEAF_TRIANGLE: occluded = does_intersect_lanes(static_cast<const MeshTriangle *>(leaf.shape), packet, active); break;
+    case BVH_LEAF_MESH:
+        occluded = static_cast<const TriangleMesh *>(leaf.shape)->TriangleMesh::does_intersect_packet(packet, active);
+        break;
+    case BVH_LEAF_INSTANCE:
+        occluded = static_cast<const Instance *>(leaf.shape)->Instance::does_intersect_packet(packet, active);
+        break;
+    case BVH_LEAF_SPHERE_SET:
+        occluded = static_cast<const SphereSet *>(leaf.shape)->SphereSet::does_intersect_packet(packet, active);
+        break;
+    default: return leaf.primitive->occluder_packet(packet, active, occluders);
+    }
+    for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+        if (occluded & (1 << lane)) occluders[lane] = leaf.primitive;
+    }
+    return occluded;
+}
+#endif // BVH_TYPED_LEAVES
+
 bool BVH::intersect(Ray &ray, Intersection *inter)
 {
     // Precomputations
-    Vector inv_d(1.f / ray.d.x, 1.f / ray.d.y, 1.f / ray.d.z);
-    Point origin = ray(ray.min_t);
-    int is_negative[3] = { ray.d.x < 0, ray.d.y < 0, ray.d.z < 0 };
+    Vector inv_d = ray.inv_d;
+    Vector inv_d_far = inv_d * RAY_BOX_FAR_SCALE;
+    int is_negative[3] = { ray.is_negative[0], ray.is_negative[1], ray.is_negative[2] };
 
     bool any_intersection = false;
+    // The children of a branching node are tested before going into it, and the one that the ray enters first is
+    // visited first. The other is put on the stack with its entry distance, and skipped when it is popped if a hit
+    // closer than that has been found by then.
     uint32_t todo[128];
-    int todo_now = 0;
-    todo[0] = 0;
-    int index = 0;
-    do {
-        if (intersect_box(compacted[index], ray, inv_d, is_negative)) {
-            if (compacted[index].num_primitives == 0) {
-                // Branching node.
-                if (is_negative[compacted[index].axis]) {
-                    todo_now ++;
-                    todo[todo_now] = index + 1;
-                    index = compacted[index].second_child_offset;
-                } else {
-                    todo_now ++;
-                    todo[todo_now] = compacted[index].second_child_offset;
-                    index ++;
-                }
-            } else {
+    float todo_t[128];
+    int todo_now = -1;
+    if (intersect_box(compacted[0], ray, inv_d, inv_d_far, is_negative, &todo_t[0])) {
+        todo_now = 0;
+        todo[0] = 0;
+    }
+    while (todo_now >= 0) {
+        int index = todo[todo_now];
+        if (todo_t[todo_now--] > ray.max_t) continue;
+        // Go down from this node, through the nearer child each time, until a leaf or a node whose children are missed.
+        while (true) {
+            RENDER_STATS_ADD(nodes_visited, 1);
+            const BVHNode &node = compacted[index];
+            if (node.num_primitives != 0) {
                 // Leaf node.
-                int n = compacted[index].primitives_offset+compacted[index].num_primitives;
-                for (int i = compacted[index].primitives_offset;
-                         i < n;
-                         i++) {
+                RENDER_STATS_ADD(primitive_tests, node.num_primitives);
+                int n = node.primitives_offset + node.num_primitives;
+                for (int i = node.primitives_offset; i < n; i++) {
+#if BVH_TYPED_LEAVES
+                    if (intersect_leaf_primitive(leaf_primitives[i], ray, inter)) any_intersection = true;
+#else
                     if (primitives[i]->intersect(ray, inter)) any_intersection = true;
+#endif
                 }
-                index = todo[todo_now--];
+                break;
+            }
+            // Branching node.
+            uint32_t near = index + 1;
+            uint32_t far = node.second_child_offset;
+            float t_near = INFINITY, t_far = INFINITY;
+            bool hit_near = intersect_box(compacted[near], ray, inv_d, inv_d_far, is_negative, &t_near);
+            bool hit_far = intersect_box(compacted[far], ray, inv_d, inv_d_far, is_negative, &t_far);
+            if (hit_near && hit_far) {
+                // Ties go by the direction of the ray along the split axis.
+                if (t_far < t_near || (t_far == t_near && is_negative[node.axis])) {
+                    std::swap(near, far);
+                    std::swap(t_near, t_far);
+                }
+                todo_now ++;
+                todo[todo_now] = far;
+                todo_t[todo_now] = t_far;
+                index = near;
+            } else if (hit_near || hit_far) {
+                index = hit_near ? near : far;
+            } else {
+                break;
             }
-        } else {
-            index = todo[todo_now--];
         }
-    } while (todo_now >= 0);
+    }
     return any_intersection;
 }
 bool BVH::does_intersect(Ray &ray) const
+{
+    return occluder(ray) != NULL;
+}
+const Primitive *BVH::occluder(Ray &ray) const
 {
     // Precomputations
-    Vector inv_d(1.f / ray.d.x, 1.f / ray.d.y, 1.f / ray.d.z);
+    Vector inv_d = ray.inv_d;
+    Vector inv_d_far = inv_d * RAY_BOX_FAR_SCALE;
     Point origin = ray(ray.min_t);
-    int is_negative[3] = { ray.d.x < 0, ray.d.y < 0, ray.d.z < 0 };
+    int is_negative[3] = { ray.is_negative[0], ray.is_negative[1], ray.is_negative[2] };
 
     uint32_t todo[128];
     int todo_now = 0;
     todo[0] = 0;
     int index = 0;
     do {
-        if (intersect_box(compacted[index], ray, inv_d, is_negative)) {
+        float t_entry;
+        if (intersect_box(compacted[index], ray, inv_d, inv_d_far, is_negative, &t_entry)) {
+            RENDER_STATS_ADD(nodes_visited, 1);
             if (compacted[index].num_primitives == 0) {
                 // Branching node.
                 if (is_negative[compacted[index].axis]) {
@@ -370,11 +1726,17 @@ bool BVH::does_intersect(Ray &ray) const
                 }
             } else {
                 // Leaf node.
+                RENDER_STATS_ADD(primitive_tests, compacted[index].num_primitives);
                 int n = compacted[index].primitives_offset+compacted[index].num_primitives;
                 for (int i = compacted[index].primitives_offset;
                          i < n;
                          i++) {
-                    if (primitives[i]->does_intersect(ray)) return true;
+#if BVH_TYPED_LEAVES
+                    const Primitive *blocker = leaf_primitive_occluder(leaf_primitives[i], ray);
+#else
+                    const Primitive *blocker = primitives[i]->occluder(ray);
+#endif
+                    if (blocker != NULL) return blocker;
                 }
                 index = todo[todo_now--];
             }
@@ -382,6 +1744,102 @@ bool BVH::does_intersect(Ray &ray) const
             index = todo[todo_now--];
         }
     } while (todo_now >= 0);
-    return false;
+    return NULL;
+}
+
+uint32_t BVH::intersect_packet(RayPacket &packet, uint32_t active, Intersection *inters)
+{
+    if (RayPacket::num_rays(active) < RAY_PACKET_MIN_RAYS) return Primitive::intersect_packet(packet, active, inters);
+    // Each entry of the stack holds the rays that hit its parent's box, so rays that miss a box
+    // don't take part in anything below it.
+    uint32_t hit = 0;
+    uint32_t todo[128];
+    uint32_t todo_active[128];
+    int todo_now = 0;
+    todo[0] = 0;
+    todo_active[0] = active;
+    while (todo_now >= 0) {
+        int index = todo[todo_now];
+        uint32_t mask = todo_active[todo_now--];
+        const BVHNode &node = compacted[index];
+        RENDER_STATS_ADD(box_tests, RayPacket::num_rays(mask));
+        mask = ray_packet_intersect_box(packet, mask, node.box);
+        if (mask == 0) continue;
+        RENDER_STATS_ADD(nodes_visited, RayPacket::num_rays(mask));
+        if (node.num_primitives == 0) {
+            // Branching node. Visit the near child first, going by the direction of the first of the rays.
+            // (The rays are coherent, so this is probably right for most of them.)
+            int lane = __builtin_ctz(mask);
+            todo_now += 2;
+            todo_active[todo_now-1] = todo_active[todo_now] = mask;
+            if (packet.d[node.axis][lane] < 0) {
+                todo[todo_now-1] = index + 1;
+                todo[todo_now] = node.second_child_offset;
+            } else {
+                todo[todo_now-1] = node.second_child_offset;
+                todo[todo_now] = index + 1;
+            }
+        } else {
+            // Leaf node.
+            RENDER_STATS_ADD(primitive_tests, RayPacket::num_rays(mask) * node.num_primitives);
+            int n = node.primitives_offset + node.num_primitives;
+            for (int i = node.primitives_offset; i < n; i++) {
+#if BVH_TYPED_LEAVES
+                hit |= intersect_packet_leaf_primitive(leaf_primitives[i], packet, mask, inters);
+#else
+                hit |= primitives[i]->intersect_packet(packet, mask, inters);
+#endif
+            }
+        }
+    }
+    return hit;
+}
+uint32_t BVH::occluder_packet(RayPacket &packet, uint32_t active, const Primitive **occluders) const
+{
+    if (RayPacket::num_rays(active) < RAY_PACKET_MIN_RAYS) return Primitive::occluder_packet(packet, active, occluders);
+    // As in intersect_packet, but rays drop out once they are found to be blocked, and traversal stops when all are.
+    uint32_t occluded = 0;
+    uint32_t todo[128];
+    uint32_t todo_active[128];
+    int todo_now = 0;
+    todo[0] = 0;
+    todo_active[0] = active;
+    while (todo_now >= 0) {
+        int index = todo[todo_now];
+        uint32_t mask = todo_active[todo_now--] & ~occluded;
+        const BVHNode &node = compacted[index];
+        RENDER_STATS_ADD(box_tests, RayPacket::num_rays(mask));
+        mask = ray_packet_intersect_box(packet, mask, node.box);
+        if (mask == 0) continue;
+        RENDER_STATS_ADD(nodes_visited, RayPacket::num_rays(mask));
+        if (node.num_primitives == 0) {
+            // Branching node. Any hit will do, but the near child is still more likely to have one.
+            int lane = __builtin_ctz(mask);
+            todo_now += 2;
+            todo_active[todo_now-1] = todo_active[todo_now] = mask;
+            if (packet.d[node.axis][lane] < 0) {
+                todo[todo_now-1] = index + 1;
+                todo[todo_now] = node.second_child_offset;
+            } else {
+                todo[todo_now-1] = node.second_child_offset;
+                todo[todo_now] = index + 1;
+            }
+        } else {
+            // Leaf node.
+            RENDER_STATS_ADD(primitive_tests, RayPacket::num_rays(mask) * node.num_primitives);
+            int n = node.primitives_offset + node.num_primitives;
+            for (int i = node.primitives_offset; i < n && mask != 0; i++) {
+#if BVH_TYPED_LEAVES
+                uint32_t blocked = occluder_packet_leaf_primitive(leaf_primitives[i], packet, mask, occluders);
+#else
+                uint32_t blocked = primitives[i]->occluder_packet(packet, mask, occluders);
+#endif
+                occluded |= blocked;
+                mask &= ~blocked;
+            }
+            if (occluded == active) break;
+        }
+    }
+    return occluded;
 }
 #endif // NO_COMPACTIFY
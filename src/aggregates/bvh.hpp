@@ -34,6 +34,8 @@ struct Node {
     int axis; //0:x  1:y  2:z
 };
 #define IS_LEAF(NODE) (( NODE )->children[0] == NULL)
+// Free a tree, such as one kept with keep_root once it has been processed.
+void BVH_delete_node(Node *node);
 #if NO_COMPACTIFY
 struct PrimitiveInfo;
 #endif
@@ -50,21 +52,157 @@ struct BVHNode {
     uint8_t __pad[2];
 };
 
+// BVHNode::num_primitives is a byte, so leaves can't hold more than this.
+#define BVH_MAX_LEAF_PRIMITIVES 255
+// The most subtrees that a treelet of the LBVH builder is rearranged over. The cost of searching the shapes of
+// a treelet grows as 3^n.
+#define BVH_TREELET_LEAVES 7
+
+// How the primitives of a node are split between its two children while building.
+enum BVHSplitMethod {
+    // Split at the middle of the bounding box of the centroids, along its axis of greatest extent.
+    BVH_SPLIT_MIDPOINT,
+    // Binned surface area heuristic (pbrt 2e, section 4.4.2, and Wald's "On fast construction of SAH-based
+    // bounding volume hierarchies"). The split with the least estimated ray tracing cost is chosen among the
+    // bin boundaries along each axis, and a leaf is made if that is cheaper than any split.
+    BVH_SPLIT_SAH,
+    // Linear BVH (Lauterbach et al., "Fast BVH Construction on GPUs", and Karras, "Maximizing Parallelism in the
+    // Construction of BVHs, Octrees, and k-d Trees", HPG 2012). The primitives are sorted along a Morton curve
+    // through their centroids, and the tree is read off the sorted Morton codes, each node at once. This is much
+    // faster to build than with the SAH, for a worse tree, so suits primitives that move every frame.
+    // Subtrees are made leaves where the SAH says so, and lbvh_treelet_passes can improve the tree further.
+    BVH_SPLIT_LBVH,
+    // Spatial split BVH (Stich, Friedrich and Dietrich, "Spatial Splits in Bounding Volume Hierarchies", HPG 2009).
+    // As BVH_SPLIT_SAH, but where the children of the best split of the primitives would overlap, splitting the
+    // node's box by a plane is also considered, with the primitives crossing the plane referenced from both
+    // children, each bounding only its own part (see Primitive::split_bound()). This makes much better trees for
+    // long, thin primitives, such as the triangles of ground planes and architecture, at a higher build cost.
+    // The primitives of the BVH's array are then not all distinct, and refit() keeps the tree but not the clipping.
+    BVH_SPLIT_SBVH,
+};
+
+struct BVHBuildParameters {
+    BVHSplitMethod split_method;
+
+    // Leaves are never made with more primitives than this (unless the primitives can't be told apart).
+    // For the midpoint split method this is the leaf size that is split down to.
+    int max_leaf_primitives;
+
+    // Surface area heuristic parameters.
+    int sah_num_bins;
+    // The cost of traversing a branching node, relative to the cost of intersecting a primitive.
+    float sah_traversal_cost;
+    // Leaves are intersected this many primitives at a time, at about the cost of one (e.g. with SIMD instructions),
+    // so the cost of a leaf is its number of groups of this size.
+    int sah_primitive_group_size;
+
+    // With BVH_SPLIT_LBVH, the number of treelet restructuring passes (Karras and Aila, "Fast Parallel
+    // Construction of High-Quality Bounding Volume Hierarchies", HPG 2013). Each pass goes up the tree, and
+    // rearranges each node's treelet (the node and up to BVH_TREELET_LEAVES - 1 of its descendants, the biggest
+    // first) into whichever shape of tree over the same subtrees has the least SAH cost. Two passes make up about
+    // two thirds of the difference in SAH cost to BVH_SPLIT_SAH, and take four to six times as long as the plain
+    // LBVH (still less than the SAH build).
+    int lbvh_treelet_passes;
+
+    // With BVH_SPLIT_SBVH, the most extra references to primitives that spatial splits may make, as a fraction of
+    // the number of primitives. This limits the memory taken, and the build time. Each split shares what is left
+    // of its node's allowance between the children by their sizes, so the tree doesn't depend on the order of the build.
+    float sbvh_max_duplication;
+    // Spatial splits are only tried where the children of the best object split overlap by more than this fraction
+    // of the surface area of the root (Stich et al.'s alpha). 0 tries them everywhere, and 1 never.
+    float sbvh_overlap_threshold;
+
+    // Build in parallel, using the worker threads (if multithreading is initialized).
+    // The tree is the same as the one built serially.
+    bool parallel_build;
+    // Don't bother building in parallel if there are fewer primitives than this.
+    int parallel_min_primitives;
+
+    BVHBuildParameters(BVHSplitMethod _split_method = BVH_SPLIT_SAH) {
+        split_method = _split_method;
+        if (split_method == BVH_SPLIT_MIDPOINT) {
+            max_leaf_primitives = 1;
+        } else {
+            max_leaf_primitives = 4;
+        }
+        sah_num_bins = 16;
+        sah_traversal_cost = 0.125f;
+        sah_primitive_group_size = 1;
+        lbvh_treelet_passes = 0;
+        sbvh_max_duplication = 0.3f;
+        sbvh_overlap_threshold = 1e-5f;
+        parallel_build = true;
+        parallel_min_primitives = 4096;
+    }
+};
+
+// Statistics describing the quality of a built BVH, so that build methods can be compared.
+struct BVHBuildReport {
+    // The estimated cost of tracing a random ray through the tree, as given by the surface area heuristic
+    // (in units of primitive intersection cost).
+    float sah_cost;
+    int num_nodes;
+    int num_leaves;
+    int max_depth;
+    float average_leaf_depth;
+    // leaf_size_histogram[n] is the number of leaves holding n primitives.
+    vector<int> leaf_size_histogram;
+
+    void print() const;
+};
+
+// Set this flag to intersect the primitives in the leaves of the compacted BVH's traversals through the type-tagged
+// BVH::leaf_primitives array, calling the shapes' routines directly, rather than through two virtual calls
+// (Primitive, then Shape) per primitive.
+#define BVH_TYPED_LEAVES 1
+
+// The kinds of leaf primitive that the traversals dispatch by a switch. A GeometricPrimitive of exactly one of
+// these shapes (not a class derived from it) is tagged with its shape's type, and anything else, such as a
+// nested aggregate, is BVH_LEAF_PRIMITIVE and goes through the virtual Primitive interface.
+enum BVHLeafType : uint32_t {
+    BVH_LEAF_PRIMITIVE,
+    BVH_LEAF_SPHERE,
+    BVH_LEAF_PLANE,
+    BVH_LEAF_TRIANGLE, // MeshTriangle
+    BVH_LEAF_MESH,     // TriangleMesh
+    BVH_LEAF_INSTANCE,
+    BVH_LEAF_SPHERE_SET,
+};
+struct BVHLeafPrimitive {
+    const Shape *shape; // The GeometricPrimitive's shape, or NULL for BVH_LEAF_PRIMITIVE.
+    Primitive *primitive;
+    BVHLeafType type;
+};
+
 class BVH : public Aggregate {
 public:
-    BVH() {}
-    BVH(const vector<Primitive *> &primitives, bool keep_root = false);
+    BVH() : uncompacted_root{NULL}, m_built_sah_cost{0} {}
+    BVH(const vector<Primitive *> &primitives, bool keep_root = false,
+        const BVHBuildParameters &build_parameters = BVHBuildParameters());
     
     // Aggregate-Primitive interface implementations.
     BoundingBox world_bound() const;
     BoundingBox object_bound() const;
     bool intersect(Ray &ray, Intersection *inter);
     bool does_intersect(Ray &ray) const;
+    uint32_t intersect_packet(RayPacket &packet, uint32_t active, Intersection *inters);
+    const Primitive *occluder(Ray &ray) const;
+    uint32_t occluder_packet(RayPacket &packet, uint32_t active, const Primitive **occluders) const;
 
     int flattened_length() const {
         // How many entries there are (branches and leaves) if flattened into a contiguous array.
         return compacted.size();
     }
+    // Compute statistics of the compacted tree.
+    BVHBuildReport build_report() const;
+
+    // Once primitives have moved (such as by changing the transforms of their shapes with Shape::set_transform()),
+    // recompute the boxes of the nodes from the bottom up, keeping the tree as it is. This is much cheaper than
+    // building a new BVH, but the tree gets worse as the primitives move away from where they were when it was built.
+    // Returns the SAH cost of the refitted tree relative to that of the tree as built, so that the caller can decide
+    // when it is worth rebuilding (say, once this passes 1.5).
+    // Aggregates among the primitives must be refitted first.
+    float refit();
 
     Node *uncompacted_root;
 #if NO_COMPACTIFY
@@ -72,8 +210,13 @@ public:
 #endif
     BoundingBox m_box; // Bounds all the internal primitives (this is the same as the bounding box of the root node).
     vector<Primitive *> primitives;
+    // The same primitives, tagged by type, in the same order. The primitives of each leaf are sorted by type, so
+    // that the shapes of a leaf are dispatched in runs.
+    vector<BVHLeafPrimitive> leaf_primitives;
     vector<BVHNode> compacted;
+    BVHBuildParameters m_build_parameters;
 private:
+    float m_built_sah_cost; // The SAH cost of the tree as built, to compare refitted trees with.
 };
 
 #endif // PRIMITIVE_AGGREGATE_BVH_H
@@ -32,10 +32,38 @@ bool PrimitiveList::intersect(Ray &ray, Intersection *out_inter)
 }
 bool PrimitiveList::does_intersect(Ray &ray) const
 {
-    if (!world_bound().intersect(ray)) return false;
+    return occluder(ray) != NULL;
+}
+const Primitive *PrimitiveList::occluder(Ray &ray) const
+{
+    if (!world_bound().intersect(ray)) return NULL;
 
     for (const Primitive * primitive : primitives) {
-        if (primitive->does_intersect(ray)) return true;
+        const Primitive *blocker = primitive->occluder(ray);
+        if (blocker != NULL) return blocker;
+    }
+    return NULL;
+}
+uint32_t PrimitiveList::occluder_packet(RayPacket &packet, uint32_t active, const Primitive **occluders) const
+{
+    active = ray_packet_intersect_box(packet, active, world_bound());
+    uint32_t occluded = 0;
+    for (const Primitive *primitive : primitives) {
+        if (active == 0) break;
+        uint32_t blocked = primitive->occluder_packet(packet, active, occluders);
+        occluded |= blocked;
+        active &= ~blocked;
+    }
+    return occluded;
+}
+uint32_t PrimitiveList::intersect_packet(RayPacket &packet, uint32_t active, Intersection *inters)
+{
+    active = ray_packet_intersect_box(packet, active, world_bound());
+    if (active == 0) return 0;
+
+    uint32_t hit = 0;
+    for (Primitive *primitive : primitives) {
+        hit |= primitive->intersect_packet(packet, active, inters);
     }
-    return false;
+    return hit;
 }
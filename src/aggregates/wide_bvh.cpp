@@ -0,0 +1,253 @@
+/*--------------------------------------------------------------------------------
+    Wide BVH.
+    See wide_bvh.hpp for the traversal routines, which are shared with triangle meshes.
+--------------------------------------------------------------------------------*/
+#include "aggregates/wide_bvh.hpp"
+
+static void set_child_box(WideBVHNode &node, int i, const BoundingBox &box)
+{
+    node.min_x[i] = box.corners[0].x;
+    node.min_y[i] = box.corners[0].y;
+    node.min_z[i] = box.corners[0].z;
+    node.max_x[i] = box.corners[1].x;
+    node.max_y[i] = box.corners[1].y;
+    node.max_z[i] = box.corners[1].z;
+}
+
+static void clear_child(WideBVHNode &node, int i)
+{
+    // An inverted box, which the slab test never reports as hit.
+    node.min_x[i] = node.min_y[i] = node.min_z[i] = INFINITY;
+    node.max_x[i] = node.max_y[i] = node.max_z[i] = -INFINITY;
+    node.child[i] = 0;
+    node.num_primitives[i] = 0;
+}
+
+static uint32_t collapse_recur(const Node *node, vector<WideBVHNode> &nodes)
+{
+    // Gather the children of the wide node, starting with the two children of the binary node.
+    // While there is room, the branching child with the greatest surface area (the one most likely to be
+    // hit) is replaced by its two children.
+    const Node *children[WIDE_BVH_WIDTH];
+    int num_children = 2;
+    children[0] = node->children[0];
+    children[1] = node->children[1];
+    while (num_children < WIDE_BVH_WIDTH) {
+        int to_open = -1;
+        float greatest_area = -1;
+        for (int i = 0; i < num_children; i++) {
+            if (children[i]->is_leaf()) continue;
+            float area = children[i]->box.surface_area();
+            if (area > greatest_area) {
+                greatest_area = area;
+                to_open = i;
+            }
+        }
+        if (to_open < 0) break;
+        const Node *opened = children[to_open];
+        children[to_open] = opened->children[0];
+        children[num_children++] = opened->children[1];
+    }
+
+    uint32_t index = nodes.size();
+    nodes.push_back(WideBVHNode());
+    for (int i = 0; i < WIDE_BVH_WIDTH; i++) {
+        if (i >= num_children) {
+            clear_child(nodes[index], i);
+            continue;
+        }
+        set_child_box(nodes[index], i, children[i]->box);
+        if (children[i]->is_leaf()) {
+            nodes[index].child[i] = children[i]->first_primitive;
+            nodes[index].num_primitives[i] = children[i]->num_primitives;
+        } else {
+            // Careful, the recursion reallocates the node array.
+            uint32_t child_index = collapse_recur(children[i], nodes);
+            nodes[index].child[i] = child_index;
+            nodes[index].num_primitives[i] = 0;
+        }
+    }
+    return index;
+}
+
+void collapse_to_wide_bvh(const Node *root, vector<WideBVHNode> &nodes)
+{
+    nodes.clear();
+    if (root == NULL) return;
+    if (root->is_leaf()) {
+        // The root of a wide BVH is always a node, so this has a single child.
+        nodes.push_back(WideBVHNode());
+        for (int i = 1; i < WIDE_BVH_WIDTH; i++) clear_child(nodes[0], i);
+        set_child_box(nodes[0], 0, root->box);
+        nodes[0].child[0] = root->first_primitive;
+        nodes[0].num_primitives[0] = root->num_primitives;
+        return;
+    }
+    collapse_recur(root, nodes);
+}
+
+// The least exponent for which the grid starting at lo reaches hi within 255 steps.
+static int grid_exponent(float lo, float hi)
+{
+    int e = -126;
+    if (hi > lo) {
+        frexpf((hi - lo) / 255, &e);
+        e = max(e - 1, -126);
+    }
+    while (e < 127 && lo + 255 * ldexpf(1, e) < hi) e++;
+    return e;
+}
+
+static QuantizedWideBVHNode quantize_node(const WideBVHNode &node)
+{
+    QuantizedWideBVHNode q;
+    memset(&q, 0, sizeof(q));
+    float lo[3] = { INFINITY, INFINITY, INFINITY };
+    float hi[3] = { -INFINITY, -INFINITY, -INFINITY };
+    for (int i = 0; i < WIDE_BVH_WIDTH; i++) {
+        q.child[i] = node.child[i];
+        q.num_primitives[i] = node.num_primitives[i];
+        BoundingBox box = node.child_box(i);
+        if (box.corners[0].x > box.corners[1].x) continue; // an empty slot
+        q.child_mask |= 1 << i;
+        for (int axis = 0; axis < 3; axis++) {
+            lo[axis] = min(lo[axis], box.corners[0][axis]);
+            hi[axis] = max(hi[axis], box.corners[1][axis]);
+        }
+    }
+    if (q.child_mask == 0) return q;
+    for (int axis = 0; axis < 3; axis++) {
+        q.origin[axis] = lo[axis];
+        q.exponent[axis] = grid_exponent(lo[axis], hi[axis]);
+    }
+    uint8_t *mins[3] = { q.min_x, q.min_y, q.min_z };
+    uint8_t *maxs[3] = { q.max_x, q.max_y, q.max_z };
+    for (int i = 0; i < WIDE_BVH_WIDTH; i++) {
+        if (!(q.child_mask & (1 << i))) continue;
+        BoundingBox box = node.child_box(i);
+        for (int axis = 0; axis < 3; axis++) {
+            // Round outwards, checking against the decoded values so that the decoded box contains the true one.
+            float s = q.scale(axis);
+            int q_min = max(0, min(255, (int) floorf((box.corners[0][axis] - lo[axis]) / s)));
+            while (q_min > 0 && q.decode(axis, q_min) > box.corners[0][axis]) q_min--;
+            int q_max = max(0, min(255, (int) ceilf((box.corners[1][axis] - lo[axis]) / s)));
+            while (q_max < 255 && q.decode(axis, q_max) < box.corners[1][axis]) q_max++;
+            mins[axis][i] = q_min;
+            maxs[axis][i] = q_max;
+        }
+    }
+    return q;
+}
+
+void quantize_wide_bvh(const vector<WideBVHNode> &nodes, vector<QuantizedWideBVHNode> &quantized)
+{
+    quantized = vector<QuantizedWideBVHNode>(nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++) quantized[i] = quantize_node(nodes[i]);
+}
+
+WideBVH::WideBVH(const vector<Primitive *> &_primitives, const BVHBuildParameters &build_parameters)
+{
+    BVH bvh(_primitives, true, build_parameters);
+    m_box = bvh.world_bound();
+    primitives = bvh.primitives;
+    collapse_to_wide_bvh(bvh.uncompacted_root, nodes);
+    BVH_delete_node(bvh.uncompacted_root);
+    bvh.uncompacted_root = NULL;
+}
+
+WideBVH::WideBVH(const BVH &bvh)
+{
+    if (bvh.uncompacted_root == NULL) {
+        fprintf(stderr, "ERROR: WideBVH can only be made from a BVH that was built with keep_root.\n");
+        exit(EXIT_FAILURE);
+    }
+    m_box = bvh.world_bound();
+    primitives = bvh.primitives;
+    collapse_to_wide_bvh(bvh.uncompacted_root, nodes);
+}
+
+BoundingBox WideBVH::world_bound() const
+{
+    return m_box;
+}
+
+// Leaf intersectors for the shared traversal routines.
+struct PrimitiveLeafIntersector {
+    vector<Primitive *> &primitives;
+    Intersection *inter;
+    inline bool operator()(uint32_t first, int num_primitives, Ray &ray) {
+        bool any = false;
+        for (uint32_t i = first; i < first + num_primitives; i++) {
+            if (primitives[i]->intersect(ray, inter)) any = true;
+        }
+        return any;
+    }
+};
+struct PrimitiveLeafOccluder {
+    const vector<Primitive *> &primitives;
+    const Primitive *occluder; // The primitive found to block the ray.
+    inline bool operator()(uint32_t first, int num_primitives, Ray &ray) {
+        for (uint32_t i = first; i < first + num_primitives; i++) {
+            occluder = primitives[i]->occluder(ray);
+            if (occluder != NULL) return true;
+        }
+        return false;
+    }
+};
+
+struct PrimitivePacketLeafIntersector {
+    const vector<Primitive *> &primitives;
+    Intersection *inters;
+    inline uint32_t operator()(uint32_t first, int num_primitives, RayPacket &packet, uint32_t active) {
+        uint32_t hit = 0;
+        for (uint32_t i = first; i < first + num_primitives; i++) {
+            hit |= primitives[i]->intersect_packet(packet, active, inters);
+        }
+        return hit;
+    }
+};
+struct PrimitivePacketLeafOccluder {
+    const vector<Primitive *> &primitives;
+    const Primitive **occluders;
+    inline uint32_t operator()(uint32_t first, int num_primitives, RayPacket &packet, uint32_t active) {
+        uint32_t occluded = 0;
+        for (uint32_t i = first; i < first + num_primitives && active != 0; i++) {
+            uint32_t blocked = primitives[i]->occluder_packet(packet, active, occluders);
+            occluded |= blocked;
+            active &= ~blocked;
+        }
+        return occluded;
+    }
+};
+
+bool WideBVH::intersect(Ray &ray, Intersection *inter)
+{
+    PrimitiveLeafIntersector leaf_intersector = { primitives, inter };
+    return wide_bvh_intersect(nodes, ray, leaf_intersector);
+}
+
+bool WideBVH::does_intersect(Ray &ray) const
+{
+    return occluder(ray) != NULL;
+}
+
+const Primitive *WideBVH::occluder(Ray &ray) const
+{
+    PrimitiveLeafOccluder leaf_occluder = { primitives, NULL };
+    if (!wide_bvh_does_intersect(nodes, ray, leaf_occluder)) return NULL;
+    return leaf_occluder.occluder;
+}
+
+uint32_t WideBVH::intersect_packet(RayPacket &packet, uint32_t active, Intersection *inters)
+{
+    if (RayPacket::num_rays(active) < RAY_PACKET_MIN_RAYS) return Primitive::intersect_packet(packet, active, inters);
+    PrimitivePacketLeafIntersector leaf_intersector = { primitives, inters };
+    return wide_bvh_intersect_packet(nodes, packet, active, leaf_intersector);
+}
+
+uint32_t WideBVH::occluder_packet(RayPacket &packet, uint32_t active, const Primitive **occluders) const
+{
+    if (RayPacket::num_rays(active) < RAY_PACKET_MIN_RAYS) return Primitive::occluder_packet(packet, active, occluders);
+    PrimitivePacketLeafOccluder leaf_occluder = { primitives, occluders };
+    return wide_bvh_does_intersect_packet(nodes, packet, active, leaf_occluder);
+}
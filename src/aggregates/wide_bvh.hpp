@@ -0,0 +1,485 @@
+#ifndef PRIMITIVE_AGGREGATE_WIDE_BVH_H
+#define PRIMITIVE_AGGREGATE_WIDE_BVH_H
+#include "primitives.hpp"
+#include "aggregates/bvh.hpp"
+#include "statistics.hpp"
+#if defined(__SSE__) || defined(__x86_64__)
+#include <immintrin.h>
+#define WIDE_BVH_SIMD 1
+#else
+#define WIDE_BVH_SIMD 0
+#endif
+
+/*--------------------------------------------------------------------------------
+    A wide BVH is a BVH with up to WIDE_BVH_WIDTH children per node. It is made by
+    collapsing the binary tree given by the usual BVH builder, pulling grandchildren
+    up into a node until it is full.
+
+    The boxes of a node's children are stored as a structure of arrays, so that
+    one SIMD slab test can be done against all of them. Hit children are then
+    visited front-to-back, in order of the distance the ray enters their box.
+
+    8-wide nodes need AVX. Set this flag (and compile with -mavx) to use them.
+--------------------------------------------------------------------------------*/
+#define WIDE_BVH_8 0
+#if WIDE_BVH_8 && defined(__AVX__)
+#define WIDE_BVH_WIDTH 8
+#else
+#define WIDE_BVH_WIDTH 4
+#endif
+
+struct WideBVHNode {
+    // Child boxes. Empty child slots have "identity boxes", which rays never hit.
+    float min_x[WIDE_BVH_WIDTH];
+    float max_x[WIDE_BVH_WIDTH];
+    float min_y[WIDE_BVH_WIDTH];
+    float max_y[WIDE_BVH_WIDTH];
+    float min_z[WIDE_BVH_WIDTH];
+    float max_z[WIDE_BVH_WIDTH];
+    // For a branching child, the index of its node. For a leaf, the index of its first primitive.
+    uint32_t child[WIDE_BVH_WIDTH];
+    // Zero signifies a branching child.
+    uint8_t num_primitives[WIDE_BVH_WIDTH];
+
+    inline BoundingBox child_box(int i) const {
+        BoundingBox box;
+        box.corners[0] = Point(min_x[i], min_y[i], min_z[i]);
+        box.corners[1] = Point(max_x[i], max_y[i], max_z[i]);
+        return box;
+    }
+};
+
+// Collapse a binary tree (as kept by the BVH with keep_root) into wide nodes, with the root at index 0.
+// Leaves reference the same primitive ranges as the binary tree.
+void collapse_to_wide_bvh(const Node *root, vector<WideBVHNode> &nodes);
+
+/*--------------------------------------------------------------------------------
+    Quantized wide nodes.
+    The child boxes are stored as 8-bit coordinates on a grid laid over the node's
+    own box (following Ylitie, Karras and Laine, "Efficient Incoherent Ray Traversal
+    on GPUs Through Compressed Wide BVHs", HPG 2017). The grid lines along each axis
+    are a power of two apart, so a grid coordinate q decodes exactly to
+        origin + q * 2^exponent
+    and the child boxes are rounded outwards onto the grid, so the decoded boxes
+    contain the true ones and no hit is lost (though a few more boxes are entered).
+    A 4-wide node then fits in a 64-byte cache line, rather than taking about two.
+--------------------------------------------------------------------------------*/
+struct alignas(64) QuantizedWideBVHNode {
+    float origin[3];
+    int8_t exponent[3];
+    // Bit i is set if child i is used. The boxes of empty slots are not looked at.
+    uint8_t child_mask;
+    uint8_t num_primitives[WIDE_BVH_WIDTH];
+    uint32_t child[WIDE_BVH_WIDTH];
+    uint8_t min_x[WIDE_BVH_WIDTH];
+    uint8_t max_x[WIDE_BVH_WIDTH];
+    uint8_t min_y[WIDE_BVH_WIDTH];
+    uint8_t max_y[WIDE_BVH_WIDTH];
+    uint8_t min_z[WIDE_BVH_WIDTH];
+    uint8_t max_z[WIDE_BVH_WIDTH];
+
+    // 2^exponent[axis], made directly from the float's bits.
+    inline float scale(int axis) const {
+        uint32_t bits = (uint32_t) (exponent[axis] + 127) << 23;
+        float s;
+        memcpy(&s, &bits, sizeof(float));
+        return s;
+    }
+    inline float decode(int axis, uint8_t q) const {
+        return origin[axis] + q * scale(axis);
+    }
+};
+
+// Quantize the nodes of a wide BVH, keeping the same indices (so that leaves still reference the same primitives).
+void quantize_wide_bvh(const vector<WideBVHNode> &nodes, vector<QuantizedWideBVHNode> &quantized);
+
+/*--------------------------------------------------------------------------------
+    Traversal.
+    This is templated over what is done at leaves, so that the same code is used
+    for aggregates of primitives and for triangle meshes, and over the node type
+    (WideBVHNode or QuantizedWideBVHNode).
+    A leaf intersector is called as
+        bool leaf_intersector(uint32_t first_primitive, int num_primitives, Ray &ray)
+    For closest-hit traversal it returns whether anything in the leaf was hit
+    (shortening ray.max_t). For any-hit traversal, returning true stops traversal.
+--------------------------------------------------------------------------------*/
+// Precomputations for the box tests of a single ray.
+struct WideBVHRay {
+    float o[3];
+    float inv_d[3];
+    float inv_d_far[3]; // inv_d scaled by RAY_BOX_FAR_SCALE, for the far planes.
+    int is_negative[3];
+    WideBVHRay(const Ray &ray) {
+        o[0] = ray.o.x; o[1] = ray.o.y; o[2] = ray.o.z;
+        for (int i = 0; i < 3; i++) {
+            inv_d[i] = ray.inv_d[i];
+            inv_d_far[i] = inv_d[i] * RAY_BOX_FAR_SCALE;
+            is_negative[i] = ray.is_negative[i];
+        }
+    }
+};
+
+// Test the ray segment [min_t, max_t] against all child boxes of the node at once. Returns a mask of the hit children,
+// with the distances that the ray enters their boxes written to t_near.
+static inline int wide_bvh_intersect_boxes(const WideBVHNode &node, const WideBVHRay &r, float min_t, float max_t,
+                                           float t_near[WIDE_BVH_WIDTH])
+{
+    // The near planes are the min or max planes depending on the sign of the direction, as in BVH::intersect.
+    const float *near_x = r.is_negative[0] ? node.max_x : node.min_x;
+    const float *far_x  = r.is_negative[0] ? node.min_x : node.max_x;
+    const float *near_y = r.is_negative[1] ? node.max_y : node.min_y;
+    const float *far_y  = r.is_negative[1] ? node.min_y : node.max_y;
+    const float *near_z = r.is_negative[2] ? node.max_z : node.min_z;
+    const float *far_z  = r.is_negative[2] ? node.min_z : node.max_z;
+#if WIDE_BVH_SIMD && WIDE_BVH_WIDTH == 8
+    // Max and min return their second operand if either is NaN (from 0*inf), so the ray's range always goes second.
+    __m256 t0 = _mm256_set1_ps(min_t);
+    __m256 t1 = _mm256_set1_ps(max_t);
+    t0 = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(near_x), _mm256_set1_ps(r.o[0])), _mm256_set1_ps(r.inv_d[0])), t0);
+    t1 = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(far_x), _mm256_set1_ps(r.o[0])), _mm256_set1_ps(r.inv_d_far[0])), t1);
+    t0 = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(near_y), _mm256_set1_ps(r.o[1])), _mm256_set1_ps(r.inv_d[1])), t0);
+    t1 = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(far_y), _mm256_set1_ps(r.o[1])), _mm256_set1_ps(r.inv_d_far[1])), t1);
+    t0 = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(near_z), _mm256_set1_ps(r.o[2])), _mm256_set1_ps(r.inv_d[2])), t0);
+    t1 = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(far_z), _mm256_set1_ps(r.o[2])), _mm256_set1_ps(r.inv_d_far[2])), t1);
+    _mm256_storeu_ps(t_near, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+#elif WIDE_BVH_SIMD && WIDE_BVH_WIDTH == 4
+    // Max and min return their second operand if either is NaN (from 0*inf), so the ray's range always goes second.
+    __m128 t0 = _mm_set1_ps(min_t);
+    __m128 t1 = _mm_set1_ps(max_t);
+    t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(near_x), _mm_set1_ps(r.o[0])), _mm_set1_ps(r.inv_d[0])), t0);
+    t1 = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(far_x), _mm_set1_ps(r.o[0])), _mm_set1_ps(r.inv_d_far[0])), t1);
+    t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(near_y), _mm_set1_ps(r.o[1])), _mm_set1_ps(r.inv_d[1])), t0);
+    t1 = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(far_y), _mm_set1_ps(r.o[1])), _mm_set1_ps(r.inv_d_far[1])), t1);
+    t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(near_z), _mm_set1_ps(r.o[2])), _mm_set1_ps(r.inv_d[2])), t0);
+    t1 = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(far_z), _mm_set1_ps(r.o[2])), _mm_set1_ps(r.inv_d_far[2])), t1);
+    _mm_storeu_ps(t_near, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+#else
+    int mask = 0;
+    for (int i = 0; i < WIDE_BVH_WIDTH; i++) {
+        float t0 = min_t;
+        float t1 = max_t;
+        float t;
+        t = (near_x[i] - r.o[0]) * r.inv_d[0]; if (t > t0) t0 = t;
+        t = (far_x[i] - r.o[0]) * r.inv_d_far[0]; if (t < t1) t1 = t;
+        t = (near_y[i] - r.o[1]) * r.inv_d[1]; if (t > t0) t0 = t;
+        t = (far_y[i] - r.o[1]) * r.inv_d_far[1]; if (t < t1) t1 = t;
+        t = (near_z[i] - r.o[2]) * r.inv_d[2]; if (t > t0) t0 = t;
+        t = (far_z[i] - r.o[2]) * r.inv_d_far[2]; if (t < t1) t1 = t;
+        t_near[i] = t0;
+        if (t0 <= t1) mask |= 1 << i;
+    }
+    return mask;
+#endif
+}
+
+// The same test against the decoded boxes of a quantized node.
+#if WIDE_BVH_SIMD && WIDE_BVH_WIDTH == 8
+static inline __m256 wide_bvh_decode(const uint8_t *q, float origin, float scale)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i shorts = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) q), zero);
+    __m256i ints = _mm256_insertf128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi16(shorts, zero)),
+                                           _mm_unpackhi_epi16(shorts, zero), 1);
+    return _mm256_add_ps(_mm256_set1_ps(origin), _mm256_mul_ps(_mm256_cvtepi32_ps(ints), _mm256_set1_ps(scale)));
+}
+#elif WIDE_BVH_SIMD && WIDE_BVH_WIDTH == 4
+static inline __m128 wide_bvh_decode(const uint8_t *q, float origin, float scale)
+{
+    int32_t bytes;
+    memcpy(&bytes, q, 4);
+    __m128i zero = _mm_setzero_si128();
+    __m128i ints = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero);
+    return _mm_add_ps(_mm_set1_ps(origin), _mm_mul_ps(_mm_cvtepi32_ps(ints), _mm_set1_ps(scale)));
+}
+#endif
+static inline int wide_bvh_intersect_boxes(const QuantizedWideBVHNode &node, const WideBVHRay &r, float min_t, float max_t,
+                                           float t_near[WIDE_BVH_WIDTH])
+{
+    const uint8_t *near_x = r.is_negative[0] ? node.max_x : node.min_x;
+    const uint8_t *far_x  = r.is_negative[0] ? node.min_x : node.max_x;
+    const uint8_t *near_y = r.is_negative[1] ? node.max_y : node.min_y;
+    const uint8_t *far_y  = r.is_negative[1] ? node.min_y : node.max_y;
+    const uint8_t *near_z = r.is_negative[2] ? node.max_z : node.min_z;
+    const uint8_t *far_z  = r.is_negative[2] ? node.min_z : node.max_z;
+    float sx = node.scale(0);
+    float sy = node.scale(1);
+    float sz = node.scale(2);
+#if WIDE_BVH_SIMD && WIDE_BVH_WIDTH == 8
+    __m256 t0 = _mm256_set1_ps(min_t);
+    __m256 t1 = _mm256_set1_ps(max_t);
+    t0 = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(wide_bvh_decode(near_x, node.origin[0], sx), _mm256_set1_ps(r.o[0])), _mm256_set1_ps(r.inv_d[0])), t0);
+    t1 = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(wide_bvh_decode(far_x, node.origin[0], sx), _mm256_set1_ps(r.o[0])), _mm256_set1_ps(r.inv_d_far[0])), t1);
+    t0 = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(wide_bvh_decode(near_y, node.origin[1], sy), _mm256_set1_ps(r.o[1])), _mm256_set1_ps(r.inv_d[1])), t0);
+    t1 = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(wide_bvh_decode(far_y, node.origin[1], sy), _mm256_set1_ps(r.o[1])), _mm256_set1_ps(r.inv_d_far[1])), t1);
+    t0 = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(wide_bvh_decode(near_z, node.origin[2], sz), _mm256_set1_ps(r.o[2])), _mm256_set1_ps(r.inv_d[2])), t0);
+    t1 = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(wide_bvh_decode(far_z, node.origin[2], sz), _mm256_set1_ps(r.o[2])), _mm256_set1_ps(r.inv_d_far[2])), t1);
+    _mm256_storeu_ps(t_near, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ)) & node.child_mask;
+#elif WIDE_BVH_SIMD && WIDE_BVH_WIDTH == 4
+    __m128 t0 = _mm_set1_ps(min_t);
+    __m128 t1 = _mm_set1_ps(max_t);
+    t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(wide_bvh_decode(near_x, node.origin[0], sx), _mm_set1_ps(r.o[0])), _mm_set1_ps(r.inv_d[0])), t0);
+    t1 = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(wide_bvh_decode(far_x, node.origin[0], sx), _mm_set1_ps(r.o[0])), _mm_set1_ps(r.inv_d_far[0])), t1);
+    t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(wide_bvh_decode(near_y, node.origin[1], sy), _mm_set1_ps(r.o[1])), _mm_set1_ps(r.inv_d[1])), t0);
+    t1 = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(wide_bvh_decode(far_y, node.origin[1], sy), _mm_set1_ps(r.o[1])), _mm_set1_ps(r.inv_d_far[1])), t1);
+    t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(wide_bvh_decode(near_z, node.origin[2], sz), _mm_set1_ps(r.o[2])), _mm_set1_ps(r.inv_d[2])), t0);
+    t1 = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(wide_bvh_decode(far_z, node.origin[2], sz), _mm_set1_ps(r.o[2])), _mm_set1_ps(r.inv_d_far[2])), t1);
+    _mm_storeu_ps(t_near, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1)) & node.child_mask;
+#else
+    int mask = 0;
+    for (int i = 0; i < WIDE_BVH_WIDTH; i++) {
+        float t0 = min_t;
+        float t1 = max_t;
+        float t;
+        t = (node.origin[0] + near_x[i] * sx - r.o[0]) * r.inv_d[0]; if (t > t0) t0 = t;
+        t = (node.origin[0] + far_x[i] * sx - r.o[0]) * r.inv_d_far[0]; if (t < t1) t1 = t;
+        t = (node.origin[1] + near_y[i] * sy - r.o[1]) * r.inv_d[1]; if (t > t0) t0 = t;
+        t = (node.origin[1] + far_y[i] * sy - r.o[1]) * r.inv_d_far[1]; if (t < t1) t1 = t;
+        t = (node.origin[2] + near_z[i] * sz - r.o[2]) * r.inv_d[2]; if (t > t0) t0 = t;
+        t = (node.origin[2] + far_z[i] * sz - r.o[2]) * r.inv_d_far[2]; if (t < t1) t1 = t;
+        t_near[i] = t0;
+        if (t0 <= t1) mask |= 1 << i;
+    }
+    return mask & node.child_mask;
+#endif
+}
+
+struct WideBVHStackEntry {
+    uint32_t child;
+    uint32_t num_primitives; // Zero signifies a node.
+    float t_near;
+};
+#define WIDE_BVH_STACK_SIZE 512
+
+template <typename NODE, typename LeafIntersector>
+static inline bool wide_bvh_intersect(const vector<NODE> &nodes, Ray &ray, LeafIntersector &leaf_intersector)
+{
+    if (nodes.empty()) return false;
+    WideBVHRay r(ray);
+    bool any_intersection = false;
+
+    WideBVHStackEntry todo[WIDE_BVH_STACK_SIZE];
+    int todo_now = 0;
+    todo[0].child = 0;
+    todo[0].num_primitives = 0;
+    todo[0].t_near = ray.min_t;
+    while (todo_now >= 0) {
+        WideBVHStackEntry entry = todo[todo_now--];
+        // Something closer may have been hit since this was pushed.
+        if (entry.t_near > ray.max_t) continue;
+        if (entry.num_primitives > 0) {
+            RENDER_STATS_ADD(primitive_tests, entry.num_primitives);
+            if (leaf_intersector(entry.child, entry.num_primitives, ray)) any_intersection = true;
+            continue;
+        }
+        const NODE &node = nodes[entry.child];
+        RENDER_STATS_ADD(nodes_visited, 1);
+        RENDER_STATS_ADD(box_tests, WIDE_BVH_WIDTH);
+        float t_near[WIDE_BVH_WIDTH];
+        int mask = wide_bvh_intersect_boxes(node, r, ray.min_t, ray.max_t, t_near);
+        if (mask == 0) continue;
+
+        // Push the hit children so that the nearest is on top of the stack.
+        // An insertion sort on the few hit children orders this part of the stack by decreasing distance.
+        int first = todo_now + 1;
+        for (int i = 0; i < WIDE_BVH_WIDTH; i++) {
+            if (!(mask & (1 << i))) continue;
+            WideBVHStackEntry child_entry;
+            child_entry.child = node.child[i];
+            child_entry.num_primitives = node.num_primitives[i];
+            child_entry.t_near = t_near[i];
+            int j = ++todo_now;
+            while (j > first && todo[j-1].t_near < child_entry.t_near) {
+                todo[j] = todo[j-1];
+                j--;
+            }
+            todo[j] = child_entry;
+        }
+    }
+    return any_intersection;
+}
+
+template <typename NODE, typename LeafIntersector>
+static inline bool wide_bvh_does_intersect(const vector<NODE> &nodes, Ray &ray, LeafIntersector &leaf_intersector)
+{
+    // Any hit will do, so children are not ordered.
+    if (nodes.empty()) return false;
+    WideBVHRay r(ray);
+
+    uint32_t todo[WIDE_BVH_STACK_SIZE];
+    int todo_now = 0;
+    todo[0] = 0;
+    while (todo_now >= 0) {
+        const NODE &node = nodes[todo[todo_now--]];
+        RENDER_STATS_ADD(nodes_visited, 1);
+        RENDER_STATS_ADD(box_tests, WIDE_BVH_WIDTH);
+        float t_near[WIDE_BVH_WIDTH];
+        int mask = wide_bvh_intersect_boxes(node, r, ray.min_t, ray.max_t, t_near);
+        for (int i = 0; i < WIDE_BVH_WIDTH; i++) {
+            if (!(mask & (1 << i))) continue;
+            if (node.num_primitives[i] > 0) {
+                RENDER_STATS_ADD(primitive_tests, node.num_primitives[i]);
+                if (leaf_intersector(node.child[i], node.num_primitives[i], ray)) return true;
+            } else {
+                todo[++todo_now] = node.child[i];
+            }
+        }
+    }
+    return false;
+}
+
+/*--------------------------------------------------------------------------------
+    Packet traversal.
+    Each node is fetched once for all of the active rays. The rays are tested
+    against one child box at a time, with the rays as the SIMD lanes (see
+    ray_packet_intersect_box()), and a child is visited by the rays that hit its
+    box, in order of the nearest distance that any of these rays enters it.
+    A leaf intersector is called as
+        uint32_t leaf_intersector(uint32_t first_primitive, int num_primitives, RayPacket &packet, uint32_t active)
+    and returns the mask of the rays that hit something in the leaf (shortening their max_t).
+--------------------------------------------------------------------------------*/
+// Test the active rays of a packet against the box of child i, writing the distances that they enter it to t_near.
+static inline uint32_t wide_bvh_packet_intersect_child(const WideBVHNode &node, int i, const RayPacket &packet,
+                                                       uint32_t active, float t_near[RAY_PACKET_SIZE])
+{
+    return ray_packet_intersect_box(packet, active, node.min_x[i], node.min_y[i], node.min_z[i],
+                                    node.max_x[i], node.max_y[i], node.max_z[i], t_near);
+}
+static inline uint32_t wide_bvh_packet_intersect_child(const QuantizedWideBVHNode &node, int i, const RayPacket &packet,
+                                                       uint32_t active, float t_near[RAY_PACKET_SIZE])
+{
+    if (!(node.child_mask & (1 << i))) return 0;
+    float sx = node.scale(0);
+    float sy = node.scale(1);
+    float sz = node.scale(2);
+    return ray_packet_intersect_box(packet, active,
+                                    node.origin[0] + node.min_x[i] * sx, node.origin[1] + node.min_y[i] * sy,
+                                    node.origin[2] + node.min_z[i] * sz, node.origin[0] + node.max_x[i] * sx,
+                                    node.origin[1] + node.max_y[i] * sy, node.origin[2] + node.max_z[i] * sz, t_near);
+}
+
+struct WideBVHPacketStackEntry {
+    uint32_t child;
+    uint32_t num_primitives; // Zero signifies a node.
+    uint32_t active;
+    float t_near;
+};
+
+template <typename NODE, typename LeafIntersector>
+static inline uint32_t wide_bvh_intersect_packet(const vector<NODE> &nodes, RayPacket &packet, uint32_t active,
+                                                 LeafIntersector &leaf_intersector)
+{
+    if (nodes.empty() || active == 0) return 0;
+    uint32_t hit = 0;
+
+    WideBVHPacketStackEntry todo[WIDE_BVH_STACK_SIZE];
+    int todo_now = 0;
+    todo[0].child = 0;
+    todo[0].num_primitives = 0;
+    todo[0].active = active;
+    todo[0].t_near = -INFINITY;
+    while (todo_now >= 0) {
+        WideBVHPacketStackEntry entry = todo[todo_now--];
+        // Every ray may have hit something closer since this was pushed.
+        if (entry.t_near > packet.furthest_max_t(entry.active)) continue;
+        if (entry.num_primitives > 0) {
+            RENDER_STATS_ADD(primitive_tests, RayPacket::num_rays(entry.active) * entry.num_primitives);
+            hit |= leaf_intersector(entry.child, entry.num_primitives, packet, entry.active);
+            continue;
+        }
+        const NODE &node = nodes[entry.child];
+        RENDER_STATS_ADD(nodes_visited, RayPacket::num_rays(entry.active));
+        RENDER_STATS_ADD(box_tests, RayPacket::num_rays(entry.active) * WIDE_BVH_WIDTH);
+        uint32_t child_active[WIDE_BVH_WIDTH];
+        float child_t_near[WIDE_BVH_WIDTH];
+        for (int i = 0; i < WIDE_BVH_WIDTH; i++) {
+            alignas(16) float t_near[RAY_PACKET_SIZE];
+            child_active[i] = wide_bvh_packet_intersect_child(node, i, packet, entry.active, t_near);
+            child_t_near[i] = INFINITY;
+            for (uint32_t lanes = child_active[i]; lanes != 0; lanes &= lanes - 1) {
+                int lane = __builtin_ctz(lanes);
+                if (t_near[lane] < child_t_near[i]) child_t_near[i] = t_near[lane];
+            }
+        }
+        // Insertion sort, as in wide_bvh_intersect, so that the nearest child is on top of the stack.
+        int first = todo_now + 1;
+        for (int i = 0; i < WIDE_BVH_WIDTH; i++) {
+            if (child_active[i] == 0) continue;
+            WideBVHPacketStackEntry child_entry;
+            child_entry.child = node.child[i];
+            child_entry.num_primitives = node.num_primitives[i];
+            child_entry.active = child_active[i];
+            child_entry.t_near = child_t_near[i];
+            int j = ++todo_now;
+            while (j > first && todo[j-1].t_near < child_entry.t_near) {
+                todo[j] = todo[j-1];
+                j--;
+            }
+            todo[j] = child_entry;
+        }
+    }
+    return hit;
+}
+
+// Any-hit packet traversal. The leaf intersector returns the mask of the rays found to be blocked in the leaf,
+// and these take no further part. Children are not ordered, and traversal stops when all of the rays are blocked.
+template <typename NODE, typename LeafOccluder>
+static inline uint32_t wide_bvh_does_intersect_packet(const vector<NODE> &nodes, RayPacket &packet, uint32_t active,
+                                                      LeafOccluder &leaf_occluder)
+{
+    if (nodes.empty() || active == 0) return 0;
+    uint32_t occluded = 0;
+
+    uint32_t todo[WIDE_BVH_STACK_SIZE];
+    uint32_t todo_active[WIDE_BVH_STACK_SIZE];
+    int todo_now = 0;
+    todo[0] = 0;
+    todo_active[0] = active;
+    while (todo_now >= 0) {
+        const NODE &node = nodes[todo[todo_now]];
+        uint32_t node_active = todo_active[todo_now--] & ~occluded;
+        RENDER_STATS_ADD(nodes_visited, RayPacket::num_rays(node_active));
+        RENDER_STATS_ADD(box_tests, RayPacket::num_rays(node_active) * WIDE_BVH_WIDTH);
+        for (int i = 0; i < WIDE_BVH_WIDTH; i++) {
+            alignas(16) float t_near[RAY_PACKET_SIZE];
+            // Rays blocked in an earlier child's leaf take no further part.
+            uint32_t lanes = wide_bvh_packet_intersect_child(node, i, packet, node_active & ~occluded, t_near);
+            if (lanes == 0) continue;
+            if (node.num_primitives[i] > 0) {
+                RENDER_STATS_ADD(primitive_tests, RayPacket::num_rays(lanes) * node.num_primitives[i]);
+                occluded |= leaf_occluder(node.child[i], node.num_primitives[i], packet, lanes);
+                if (occluded == active) return occluded;
+            } else {
+                todo[++todo_now] = node.child[i];
+                todo_active[todo_now] = lanes;
+            }
+        }
+    }
+    return occluded;
+}
+
+class WideBVH : public Aggregate {
+public:
+    WideBVH() {}
+    WideBVH(const vector<Primitive *> &primitives, const BVHBuildParameters &build_parameters = BVHBuildParameters());
+    // Collapse a BVH that was built with keep_root.
+    WideBVH(const BVH &bvh);
+
+    // Aggregate-Primitive interface implementations.
+    BoundingBox world_bound() const;
+    bool intersect(Ray &ray, Intersection *inter);
+    bool does_intersect(Ray &ray) const;
+    uint32_t intersect_packet(RayPacket &packet, uint32_t active, Intersection *inters);
+    const Primitive *occluder(Ray &ray) const;
+    uint32_t occluder_packet(RayPacket &packet, uint32_t active, const Primitive **occluders) const;
+
+    BoundingBox m_box;
+    vector<Primitive *> primitives;
+    vector<WideBVHNode> nodes;
+private:
+};
+
+#endif // PRIMITIVE_AGGREGATE_WIDE_BVH_H
@@ -1,9 +1,63 @@
 #include "light.hpp"
 #include "primitives.hpp"
+#include "statistics.hpp"
 
 // Test if this ray (or ray segment) intersects a primitive.
 // Most likely this will be the scene or possibly some other aggregate primitive.
 bool VisibilityTester::unoccluded(const Primitive *primitive)
 {
-    return !primitive->does_intersect(ray);
+    RENDER_STATS_ADD(rays[RAY_SHADOW], 1);
+    bool occluded = primitive->does_intersect(ray);
+    RENDER_STATS_ADD(ray_hits[RAY_SHADOW], occluded);
+    return !occluded;
+}
+
+// Rays with NaNs (from degenerate hits) fail every box test, so traversal never finds them occluded.
+// Testing a cached occluder directly could, so these rays skip the cache.
+static inline bool ray_has_nan(const Ray &ray)
+{
+    return std::isnan(ray.o.x + ray.o.y + ray.o.z + ray.d.x + ray.d.y + ray.d.z);
+}
+
+bool VisibilityTester::unoccluded(const Primitive *primitive, OcclusionCache *cache, int light_index)
+{
+    if (!OCCLUSION_CACHE || cache == NULL) return unoccluded(primitive);
+    RENDER_STATS_ADD(rays[RAY_SHADOW], 1);
+    const Primitive *&last_occluder = cache->last_occluder[light_index];
+    if (last_occluder != NULL && !ray_has_nan(ray)) {
+        Ray cached_ray = ray;
+        if (last_occluder->does_intersect(cached_ray)) {
+            RENDER_STATS_ADD(ray_hits[RAY_SHADOW], 1);
+            return false;
+        }
+    }
+    // Remember what blocked this ray. If nothing did, the next ray is likely to get through too,
+    // and testing the old occluder for it first would be wasted.
+    last_occluder = primitive->occluder(ray);
+    RENDER_STATS_ADD(ray_hits[RAY_SHADOW], last_occluder != NULL);
+    return last_occluder == NULL;
+}
+
+uint32_t unoccluded_packet(const Primitive *primitive, const VisibilityTester *visibility_testers, uint32_t active,
+                           OcclusionCache *cache, int light_index)
+{
+    RayPacket packet;
+    uint32_t cacheable = 0;
+    for (uint32_t lanes = active; lanes != 0; lanes &= lanes - 1) {
+        int lane = __builtin_ctz(lanes);
+        packet.set(lane, visibility_testers[lane].ray);
+        if (!ray_has_nan(visibility_testers[lane].ray)) cacheable |= 1 << lane;
+    }
+    if (!OCCLUSION_CACHE) cache = NULL;
+    const Primitive *occluders[RAY_PACKET_SIZE];
+    uint32_t remaining = active;
+    if (cache != NULL && cache->last_occluder[light_index] != NULL && cacheable != 0) {
+        // Occluded lanes have their max_t shortened, but they take no further part.
+        remaining &= ~cache->last_occluder[light_index]->occluder_packet(packet, cacheable, occluders);
+    }
+    uint32_t occluded = primitive->occluder_packet(packet, remaining, occluders);
+    if (cache != NULL && remaining != 0) cache->last_occluder[light_index] = occluded != 0 ? occluders[__builtin_ctz(occluded)] : NULL;
+    RENDER_STATS_ADD(rays[RAY_SHADOW], RayPacket::num_rays(active));
+    RENDER_STATS_ADD(ray_hits[RAY_SHADOW], RayPacket::num_rays(active & ~(remaining & ~occluded)));
+    return remaining & ~occluded;
 }
@@ -13,6 +13,7 @@
     lights.  Point light occlusion should be done in a segment. The ray min_t and max_t
     values are used here.
 --------------------------------------------------------------------------------*/
+struct OcclusionCache;
 struct VisibilityTester {
     // The data is just a ray. The VisibilityTester is basically a wrapper around a ray, with some extra methods.
     Ray ray;
@@ -32,8 +33,30 @@ struct VisibilityTester {
         ray.min_t = error_shift;
     }
     bool unoccluded(const Primitive *primitive);
+    // As above, but first trying the primitive that last blocked a ray to the same light (see OcclusionCache).
+    bool unoccluded(const Primitive *primitive, OcclusionCache *cache, int light_index);
 };
 
+/*--------------------------------------------------------------------------------
+    Neighbouring shadow rays to the same light are usually blocked by the same
+    thing. An OcclusionCache remembers, for each light, the primitive which blocked
+    the last ray to it that was traced through the scene (if any), and this is
+    tested before traversing the whole scene.
+    Each thread keeps its own, so there is no sharing between threads.
+--------------------------------------------------------------------------------*/
+// Set to 0 to ignore the caches (for comparison). It pays off most where one object shadows many pixels,
+// and least where rays graze large meshes that only sometimes block them.
+#define OCCLUSION_CACHE 1
+struct OcclusionCache {
+    vector<const Primitive *> last_occluder; // Indexed by light. NULL if nothing is known.
+    OcclusionCache(int num_lights = 0) : last_occluder(num_lights, NULL) {}
+};
+
+// Test the shadow rays of the active lanes (all towards the same light) for occlusion together,
+// trying the cached occluder first if a cache is given. Returns the mask of the unoccluded lanes.
+uint32_t unoccluded_packet(const Primitive *primitive, const VisibilityTester *visibility_testers, uint32_t active,
+                           OcclusionCache *cache = NULL, int light_index = 0);
+
 /*
 pbrt2 source
 struct VisibilityTester {
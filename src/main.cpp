@@ -57,6 +57,7 @@ int main(int argc, char *argv[])
     float camera_altitude = 0;
     bool override_num_threads = false;
     unsigned int num_threads; // only used if overridden.
+    bool wavefront = false;
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-r") == 0) {
             if (i+1 >= argc
@@ -77,6 +78,10 @@ int main(int argc, char *argv[])
                 || sscanf(argv[i+1], "%u", &num_threads) == EOF) arg_error("-p must be followed by a valid number of threads.");
             override_num_threads = true;
         }
+        else if (strcmp(argv[i], "-w") == 0) {
+            // Render in wavefront mode.
+            wavefront = true;
+        }
     }
     std::cout << "System specs:\n";
     std::cout << "    num cores: " << num_system_cores() << "\n";
@@ -93,6 +98,15 @@ int main(int argc, char *argv[])
 
     Camera *camera = new Camera(camera_position, camera_look_at, 60, 0.566);
 
+    // The worker threads are started before the scene is made, so that scene construction
+    // (e.g. building acceleration structures) can use them.
+    if (override_num_threads) {
+        init_multithreading(true, num_threads);
+    } else {
+        // By default, probably use the number of system cores.
+        init_multithreading();
+    }
+
     // This program should be linked with an implementation of make_scene,
     // which is specific to the scene being rendered.
     Scene *scene = make_scene();
@@ -101,6 +115,7 @@ int main(int argc, char *argv[])
     std::cout << "Creating renderer:\n";
     std::cout << "------------------------------------------------------\n";
     Renderer *renderer = new Renderer(scene, camera, horizontal_pixels, supersampling_width);
+    renderer->set_wavefront(wavefront);
     renderer->print_properties();
     std::cout << "------------------------------------------------------\n";
 
@@ -122,11 +137,5 @@ int main(int argc, char *argv[])
             break;
         }
     }
-    if (override_num_threads) {
-        init_multithreading(true, num_threads);
-    } else {
-        // By default, probably use the number of system cores.
-        init_multithreading();
-    }
     main_program(pass_argc, pass_argv, renderer);
 }
@@ -4,6 +4,7 @@
 #include "mathematics/geometry.hpp"
 #include "mathematics/transform.hpp"
 #include "mathematics/numerics.hpp"
+#include "mathematics/ray_packet.hpp"
 
 #endif // MATHEMATICS_H
 
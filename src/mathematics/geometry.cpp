@@ -57,6 +57,26 @@ BoundingBox enlarged(const BoundingBox &box, const Point &point)
     new_box.enlarge(point);
     return new_box;
 }
+BoundingBox intersected(const BoundingBox &box, const BoundingBox &other_box)
+{
+    BoundingBox new_box;
+    for (int i = 0; i < 3; i++) {
+        new_box.corners[0][i] = fmax(box.corners[0][i], other_box.corners[0][i]);
+        new_box.corners[1][i] = fmin(box.corners[1][i], other_box.corners[1][i]);
+        // An inverted box would not act as the identity box in unions.
+        if (!(new_box.corners[0][i] <= new_box.corners[1][i])) return BoundingBox();
+    }
+    return new_box;
+}
+void BoundingBox::split(int axis, float position, BoundingBox *below, BoundingBox *above) const
+{
+    BoundingBox plane_below = *this;
+    BoundingBox plane_above = *this;
+    plane_below.corners[1][axis] = position;
+    plane_above.corners[0][axis] = position;
+    *below = intersected(*this, plane_below);
+    *above = intersected(*this, plane_above);
+}
 
 /* pbr 2e, page 194 */
 bool BoundingBox::intersect(const Ray &ray, float *out_t0, float *out_t1) const
@@ -72,7 +92,7 @@ bool BoundingBox::intersect(const Ray &ray, float *out_t0, float *out_t1) const
     }
 
     //-----This should really be a loop, need to change the Point class a bit.
-    inv_d = 1.0 / ray.d.x; // IEEE floating point gives infinite values which should work here.
+    inv_d = ray.inv_d.x; // IEEE floating point gives infinite values which should work here.
     new_t0 = inv_d * (corners[0].x - ray.o.x);
     new_t1 = inv_d * (corners[1].x - ray.o.x);
     // Order the new range.
@@ -83,7 +103,7 @@ bool BoundingBox::intersect(const Ray &ray, float *out_t0, float *out_t1) const
     if (t1 < t0) return false;
 
     // Y slabs
-    inv_d = 1.0 / ray.d.y;
+    inv_d = ray.inv_d.y;
     new_t0 = inv_d * (corners[0].y - ray.o.y);
     new_t1 = inv_d * (corners[1].y - ray.o.y);
     if (new_t1 < new_t0) SWAP(new_t0, new_t1);
@@ -92,7 +112,7 @@ bool BoundingBox::intersect(const Ray &ray, float *out_t0, float *out_t1) const
     if (t1 < t0) return false;
 
     // Z slabs
-    inv_d = 1.0 / ray.d.z;
+    inv_d = ray.inv_d.z;
     new_t0 = inv_d * (corners[0].z - ray.o.z);
     new_t1 = inv_d * (corners[1].z - ray.o.z);
     if (new_t1 < new_t0) SWAP(new_t0, new_t1);
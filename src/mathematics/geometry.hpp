@@ -40,11 +40,18 @@ struct Point {
             z = v.z;
         } else {
             float winv = 1.f / v.w;
-            x = winv * x;
-            y = winv * y;
-            z = winv * z;
+            x = winv * v.x;
+            y = winv * v.y;
+            z = winv * v.z;
         }
     }
+    // Coordinates can be indexed, x:0, y:1, z:2.
+    inline float operator[](int index) const {
+        return index == 0 ? x : (index == 1 ? y : z);
+    }
+    inline float &operator[](int index) {
+        return index == 0 ? x : (index == 1 ? y : z);
+    }
     inline Vector operator-(const Point &other_p) const {
         return Vector(x - other_p.x, y - other_p.y, z - other_p.z);
     }
@@ -93,23 +100,37 @@ std::ostream &operator<<(std::ostream &os, const Point &point);
     can be thought of as a function r(t) giving points along the ray.
 
     This is not a pure geometric ray, but one to be used for ray tracing.
+    The reciprocal of the direction and its signs are worked out when the ray
+    is made, for the slab tests of boxes, so that every acceleration structure
+    the ray passes through doesn't divide again. The direction should only be
+    changed with set_direction().
 ===============================================================================*/
 struct Ray {
     Point o;
     Vector d;
     float min_t;
     float max_t;
+    Vector inv_d; // 1/d, componentwise.
+    int is_negative[3]; // 1 if d is negative along the axis, for selecting the near and far planes of boxes.
 
     Ray() {}
     Ray(const Point &_origin, const Vector &_direction) :
-        o{_origin}, d{_direction}
+        o{_origin}
     {
+        set_direction(_direction);
         min_t = 1e-5;
         max_t = INFINITY;
     }
 
+    inline void set_direction(const Vector &direction) {
+        d = direction;
+        inv_d = Vector(1.f / d.x, 1.f / d.y, 1.f / d.z);
+        is_negative[0] = d.x < 0;
+        is_negative[1] = d.y < 0;
+        is_negative[2] = d.z < 0;
+    }
     inline void normalize() {
-        glm::normalize(d);
+        set_direction(glm::normalize(d));
     }
 
     // Evaluate the ray with its corresponding parameterization, e.g. r(5).
@@ -120,6 +141,11 @@ struct Ray {
 // Print a Ray.
 std::ostream &operator<<(std::ostream &os, const Ray &ray);
 
+// Slab tests of rays against boxes scale the distances to the far planes up by this (1 + 2*gamma(3), as in pbrt),
+// so that rounding can't make a ray miss a box that it only grazes. Otherwise rays through a vertex or edge lying on
+// a box boundary can leak through a mesh, even when the triangle test itself is watertight.
+#define RAY_BOX_FAR_SCALE 1.0000004f
+
 /*================================================================================
     A BoundingBox is axis-aligned in some space (the geometric object doesn't
     neccessarily bound something, but it is called this because that what it is for).
@@ -167,7 +193,7 @@ struct BoundingBox {
 
     // Methods to minimally enlarge the box to contain other objects.
     // (the "algebra of bounding boxes")
-    inline BoundingBox enlarge(const BoundingBox &other_box) {
+    inline void enlarge(const BoundingBox &other_box) {
         corners[0].x = fmin(corners[0].x, other_box.corners[0].x);
         corners[0].y = fmin(corners[0].y, other_box.corners[0].y);
         corners[0].z = fmin(corners[0].z, other_box.corners[0].z);
@@ -175,7 +201,7 @@ struct BoundingBox {
         corners[1].y = fmax(corners[1].y, other_box.corners[1].y);
         corners[1].z = fmax(corners[1].z, other_box.corners[1].z);
     }
-    inline BoundingBox enlarge(const Point &encase_point) {
+    inline void enlarge(const Point &encase_point) {
         corners[0].x = fmin(corners[0].x, encase_point.x);
         corners[0].y = fmin(corners[0].y, encase_point.y);
         corners[0].z = fmin(corners[0].z, encase_point.z);
@@ -186,6 +212,11 @@ struct BoundingBox {
     // These friend methods construct a new box instead of editing in-place.
     friend BoundingBox enlarged(const BoundingBox &box, const BoundingBox &other_box);
     friend BoundingBox enlarged(const BoundingBox &box, const Point &point);
+    // The overlap of two boxes, or the "identity box" if they don't overlap.
+    friend BoundingBox intersected(const BoundingBox &box, const BoundingBox &other_box);
+    // Cut the box in two by the plane at position along axis (0:x  1:y  2:z).
+    // If the plane misses the box, one of the parts is the "identity box".
+    void split(int axis, float position, BoundingBox *below, BoundingBox *above) const;
 
     // Bounding box intersection with a ray. If they intersect, the
     // range along the ray that is on or inside the box is returned.
@@ -198,6 +229,16 @@ struct BoundingBox {
 
     inline Point min_corner() const { return corners[0]; };
     inline Point max_corner() const { return corners[1]; };
+
+    // The surface area is used by the surface area heuristic when building BVHs.
+    // The "identity box" (and any other box with incorrectly ordered corners) has zero area.
+    inline float surface_area() const {
+        float dx = corners[1].x - corners[0].x;
+        float dy = corners[1].y - corners[0].y;
+        float dz = corners[1].z - corners[0].z;
+        if (dx < 0 || dy < 0 || dz < 0) return 0.f;
+        return 2.f * (dx*dy + dy*dz + dz*dx);
+    }
 };
 // Print a BoundingBox.
 std::ostream &operator<<(std::ostream &os, const BoundingBox &box);
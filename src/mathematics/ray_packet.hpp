@@ -0,0 +1,133 @@
+#ifndef MATHEMATICS_RAY_PACKET_H
+#define MATHEMATICS_RAY_PACKET_H
+#include "core.hpp"
+#include "mathematics/geometry.hpp"
+#if defined(__SSE__) || defined(__x86_64__)
+#include <immintrin.h>
+#define RAY_PACKET_SIMD 1
+#else
+#define RAY_PACKET_SIMD 0
+#endif
+
+/*--------------------------------------------------------------------------------
+    A RayPacket is a small group of rays traced through an acceleration structure
+    together. Rays which start near each other and point in similar directions
+    (such as the camera rays of a block of pixels) mostly visit the same nodes, so
+    each node is fetched once for the whole packet and its box is tested against
+    all of the rays with SIMD instructions.
+
+    The rays are stored as a structure of arrays, with one lane per ray. Which
+    lanes are taking part is given by a bit mask (the "active" mask) passed along
+    with the packet. Traversal narrows the mask to the rays that hit each box,
+    and stops when it is empty.
+--------------------------------------------------------------------------------*/
+#define RAY_PACKET_SIZE 8
+// Packets of camera rays cover blocks of pixels this wide and tall.
+#define RAY_PACKET_WIDTH 4
+#define RAY_PACKET_HEIGHT 2
+// When fewer rays than this are still active (such as when a packet reaches a small object at the edge of
+// its pixels), packet traversal costs more than tracing the rays one at a time, so that is done instead.
+#define RAY_PACKET_MIN_RAYS 3
+
+struct RayPacket {
+    alignas(16) float o[3][RAY_PACKET_SIZE];
+    alignas(16) float d[3][RAY_PACKET_SIZE];
+    alignas(16) float inv_d[3][RAY_PACKET_SIZE];
+    // All bits set if the direction is negative along the axis, for selecting the near and far box planes.
+    alignas(16) int32_t is_negative[3][RAY_PACKET_SIZE];
+    alignas(16) float min_t[RAY_PACKET_SIZE];
+    alignas(16) float max_t[RAY_PACKET_SIZE];
+
+    inline void set(int lane, const Ray &ray) {
+        for (int i = 0; i < 3; i++) {
+            o[i][lane] = ray.o[i];
+            d[i][lane] = ray.d[i];
+            inv_d[i][lane] = ray.inv_d[i];
+            is_negative[i][lane] = -ray.is_negative[i];
+        }
+        min_t[lane] = ray.min_t;
+        max_t[lane] = ray.max_t;
+    }
+    inline Ray ray(int lane) const {
+        Ray ray(Point(o[0][lane], o[1][lane], o[2][lane]), Vector(d[0][lane], d[1][lane], d[2][lane]));
+        ray.min_t = min_t[lane];
+        ray.max_t = max_t[lane];
+        return ray;
+    }
+    static inline int num_rays(uint32_t active) {
+        return __builtin_popcount(active);
+    }
+    // The furthest any of the active rays reaches.
+    inline float furthest_max_t(uint32_t active) const {
+        float t = -INFINITY;
+        for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+            if ((active & (1 << lane)) && max_t[lane] > t) t = max_t[lane];
+        }
+        return t;
+    }
+};
+
+// Test the segments [min_t, max_t] of the active rays against a box, returning the mask of the rays which hit it.
+// If t_near is given, the distances that the rays enter the box are written to it.
+// This follows wide_bvh_intersect_boxes, with the near and far planes chosen separately for each ray,
+// so that inverted ("identity") boxes are never hit. The far distances are scaled by RAY_BOX_FAR_SCALE.
+static inline uint32_t ray_packet_intersect_box(const RayPacket &packet, uint32_t active,
+                                                float min_x, float min_y, float min_z,
+                                                float max_x, float max_y, float max_z,
+                                                float *t_near = NULL)
+{
+    uint32_t mask = 0;
+#if RAY_PACKET_SIMD
+    const float box_min[3] = { min_x, min_y, min_z };
+    const float box_max[3] = { max_x, max_y, max_z };
+    const __m128 far_scale = _mm_set1_ps(RAY_BOX_FAR_SCALE);
+    for (int g = 0; g < RAY_PACKET_SIZE; g += 4) {
+        if (((active >> g) & 0xF) == 0) continue;
+        // Max and min return their second operand if either is NaN (from 0*inf), so the ray's range always goes second.
+        __m128 t0 = _mm_load_ps(&packet.min_t[g]);
+        __m128 t1 = _mm_load_ps(&packet.max_t[g]);
+        for (int i = 0; i < 3; i++) {
+            __m128 o = _mm_load_ps(&packet.o[i][g]);
+            __m128 inv_d = _mm_load_ps(&packet.inv_d[i][g]);
+            __m128 negative = _mm_castsi128_ps(_mm_load_si128((const __m128i *) &packet.is_negative[i][g]));
+            __m128 t_min_plane = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box_min[i]), o), inv_d);
+            __m128 t_max_plane = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box_max[i]), o), inv_d);
+            __m128 t_near_plane = _mm_or_ps(_mm_and_ps(negative, t_max_plane), _mm_andnot_ps(negative, t_min_plane));
+            __m128 t_far_plane = _mm_or_ps(_mm_and_ps(negative, t_min_plane), _mm_andnot_ps(negative, t_max_plane));
+            t_far_plane = _mm_mul_ps(t_far_plane, far_scale);
+            t0 = _mm_max_ps(t_near_plane, t0);
+            t1 = _mm_min_ps(t_far_plane, t1);
+        }
+        if (t_near != NULL) _mm_storeu_ps(&t_near[g], t0);
+        mask |= _mm_movemask_ps(_mm_cmple_ps(t0, t1)) << g;
+    }
+#else
+    const float box_min[3] = { min_x, min_y, min_z };
+    const float box_max[3] = { max_x, max_y, max_z };
+    for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+        if (!(active & (1 << lane))) continue;
+        float t0 = packet.min_t[lane];
+        float t1 = packet.max_t[lane];
+        for (int i = 0; i < 3; i++) {
+            float t_min_plane = (box_min[i] - packet.o[i][lane]) * packet.inv_d[i][lane];
+            float t_max_plane = (box_max[i] - packet.o[i][lane]) * packet.inv_d[i][lane];
+            float t_near_plane = packet.is_negative[i][lane] ? t_max_plane : t_min_plane;
+            float t_far_plane = (packet.is_negative[i][lane] ? t_min_plane : t_max_plane) * RAY_BOX_FAR_SCALE;
+            if (t_near_plane > t0) t0 = t_near_plane;
+            if (t_far_plane < t1) t1 = t_far_plane;
+        }
+        if (t_near != NULL) t_near[lane] = t0;
+        if (t0 <= t1) mask |= 1 << lane;
+    }
+#endif
+    return mask & active;
+}
+static inline uint32_t ray_packet_intersect_box(const RayPacket &packet, uint32_t active, const BoundingBox &box,
+                                                float *t_near = NULL)
+{
+    return ray_packet_intersect_box(packet, active,
+                                    box.corners[0].x, box.corners[0].y, box.corners[0].z,
+                                    box.corners[1].x, box.corners[1].y, box.corners[1].z, t_near);
+}
+
+#endif // MATHEMATICS_RAY_PACKET_H
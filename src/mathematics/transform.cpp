@@ -2,6 +2,7 @@
     Transform
 ================================================================================*/
 #include "mathematics/transform.hpp"
+#include "mathematics/ray_packet.hpp"
 
 // Use a macro, since the translate function variants only vary in
 // where x,y,z come from.
@@ -44,6 +45,19 @@ Transform Transform::lookat(const Point &origin, const Point &lookat, const Vect
     return Transform(m);
 }
 
+// The product of the 4x4 matrices, whose bottom rows are (0,0,0,1). The sums are in the same order as glm's.
+AffineMatrix operator*(const AffineMatrix &A, const AffineMatrix &B)
+{
+    AffineMatrix C;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            C.m[i][j] = A.m[i][0]*B.m[0][j] + A.m[i][1]*B.m[1][j] + A.m[i][2]*B.m[2][j];
+        }
+        C.m[i][3] = A.m[i][0]*B.m[0][3] + A.m[i][1]*B.m[1][3] + A.m[i][2]*B.m[2][3] + A.m[i][3];
+    }
+    return C;
+}
+
 // Multiplying transforms gives their composition, (A,A^-1)*(B,B^-1) = (AB,B^-1 A^-1).
 Transform operator*(const Transform &A, const Transform &B)
 {
@@ -125,3 +139,103 @@ BoundingBox Transform::operator()(const BoundingBox &box) const
     return box_p;
 }
 
+
+/*--------------------------------------------------------------------------------
+    Batch transforms.
+    With SSE, four points are loaded at a time and rearranged into registers of
+    their x, y and z coordinates, so that each row of the matrix is applied to all
+    four with one multiply per entry.
+--------------------------------------------------------------------------------*/
+static_assert(sizeof(Point) == 3*sizeof(float) && sizeof(Vector) == 3*sizeof(float),
+              "The batch transforms read points and vectors as packed floats.");
+
+// Transform an array of packed (x, y, z) coordinates by the 3x4 matrix m, with or without its translation.
+static void transform_coordinates(const float m[3][4], bool translate, const float *in, float *out, int num)
+{
+    int i = 0;
+#if RAY_PACKET_SIMD
+    #define SHUFFLE(A,B, I0,I1,I2,I3) _mm_shuffle_ps(( A ), ( B ), _MM_SHUFFLE(( I3 ),( I2 ),( I1 ),( I0 )))
+    for (; i + 4 <= num; i += 4) {
+        // x0 y0 z0 x1 | y1 z1 x2 y2 | z2 x3 y3 z3
+        __m128 a = _mm_loadu_ps(&in[3*i]);
+        __m128 b = _mm_loadu_ps(&in[3*i + 4]);
+        __m128 c = _mm_loadu_ps(&in[3*i + 8]);
+        __m128 v[3];
+        v[0] = SHUFFLE(a, SHUFFLE(b, c, 2,2,1,1), 0,3,0,2);
+        v[1] = SHUFFLE(SHUFFLE(a, b, 1,1,0,0), SHUFFLE(b, c, 3,3,2,2), 0,2,0,2);
+        v[2] = SHUFFLE(SHUFFLE(a, b, 2,2,1,1), c, 0,2,0,3);
+        __m128 r[3];
+        for (int row = 0; row < 3; row++) {
+            __m128 xy = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[row][0]), v[0]), _mm_mul_ps(_mm_set1_ps(m[row][1]), v[1]));
+            __m128 z = _mm_mul_ps(_mm_set1_ps(m[row][2]), v[2]);
+            if (translate) z = _mm_add_ps(z, _mm_set1_ps(m[row][3]));
+            r[row] = _mm_add_ps(xy, z);
+        }
+        _mm_storeu_ps(&out[3*i], SHUFFLE(SHUFFLE(r[0], r[1], 0,1,0,1), SHUFFLE(r[2], r[0], 0,0,1,1), 0,2,0,2));
+        _mm_storeu_ps(&out[3*i + 4], SHUFFLE(SHUFFLE(r[1], r[2], 1,1,1,1), SHUFFLE(r[0], r[1], 2,2,2,2), 0,2,0,2));
+        _mm_storeu_ps(&out[3*i + 8], SHUFFLE(SHUFFLE(r[2], r[0], 2,2,3,3), SHUFFLE(r[1], r[2], 3,3,3,3), 0,2,0,2));
+    }
+    #undef SHUFFLE
+#endif
+    for (; i < num; i++) {
+        float x = in[3*i], y = in[3*i + 1], z = in[3*i + 2];
+        for (int row = 0; row < 3; row++) {
+            float zt = m[row][2]*z;
+            if (translate) zt += m[row][3];
+            out[3*i + row] = (m[row][0]*x + m[row][1]*y) + zt;
+        }
+    }
+}
+
+void transform_points(const Transform &transform, const Point *points, Point *out, int num_points)
+{
+    transform_coordinates(transform.matrix.m, true, &points[0].x, &out[0].x, num_points);
+}
+void transform_vectors(const Transform &transform, const Vector *vectors, Vector *out, int num_vectors)
+{
+    transform_coordinates(transform.matrix.m, false, &vectors[0].x, &out[0].x, num_vectors);
+}
+void transform_normals(const Transform &transform, const Vector *normals, Vector *out, int num_normals)
+{
+    // The inverse transpose.
+    float m[3][4];
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) m[i][j] = transform.inverse_matrix.m[j][i];
+        m[i][3] = 0;
+    }
+    transform_coordinates(m, false, &normals[0].x, &out[0].x, num_normals);
+}
+
+// The same as out->set(lane, transform(in.ray(lane))) for each active lane. Lanes are transformed four at a time,
+// and groups of four with no active rays are skipped.
+void transform_ray_packet(const Transform &transform, const RayPacket &in, uint32_t active, RayPacket *out)
+{
+    const AffineMatrix &M = transform.matrix;
+#if RAY_PACKET_SIMD
+    for (int g = 0; g < RAY_PACKET_SIZE; g += 4) {
+        if (((active >> g) & 0xF) == 0) continue;
+        __m128 o[3], d[3];
+        for (int i = 0; i < 3; i++) {
+            o[i] = _mm_load_ps(&in.o[i][g]);
+            d[i] = _mm_load_ps(&in.d[i][g]);
+        }
+        for (int row = 0; row < 3; row++) {
+            __m128 m0 = _mm_set1_ps(M.m[row][0]), m1 = _mm_set1_ps(M.m[row][1]), m2 = _mm_set1_ps(M.m[row][2]);
+            __m128 new_o = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m0, o[0]), _mm_mul_ps(m1, o[1])),
+                                      _mm_add_ps(_mm_mul_ps(m2, o[2]), _mm_set1_ps(M.m[row][3])));
+            __m128 new_d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m0, d[0]), _mm_mul_ps(m1, d[1])), _mm_mul_ps(m2, d[2]));
+            _mm_store_ps(&out->o[row][g], new_o);
+            _mm_store_ps(&out->d[row][g], new_d);
+            _mm_store_ps(&out->inv_d[row][g], _mm_div_ps(_mm_set1_ps(1.f), new_d));
+            _mm_store_ps((float *) &out->is_negative[row][g], _mm_cmplt_ps(new_d, _mm_setzero_ps()));
+        }
+        _mm_store_ps(&out->min_t[g], _mm_load_ps(&in.min_t[g]));
+        _mm_store_ps(&out->max_t[g], _mm_load_ps(&in.max_t[g]));
+    }
+#else
+    for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+        if (!(active & (1 << lane))) continue;
+        out->set(lane, transform(in.ray(lane)));
+    }
+#endif
+}
@@ -2,24 +2,76 @@
 #define CORE_TRANSFORM_H
 #include "core.hpp"
 #include "mathematics/geometry.hpp"
+#include "mathematics/ray_packet.hpp"
 
 /*================================================================================
-    A Transform stores a matrix and its inverse.
+    An AffineMatrix is a 4x4 matrix whose bottom row is (0,0,0,1), stored as its
+    top three rows. Row i gives output coordinate i, with the translation last.
+    This is all that the transforms of points, vectors and normals need: points
+    are transformed without a perspective division, vectors without the
+    translation, and it takes 48 bytes rather than 64.
+
+    The sums are done in the same order as glm's matrix-vector product, so the
+    results are the same as transforming by the full matrix.
+================================================================================*/
+struct AffineMatrix {
+    alignas(16) float m[3][4];
+
+    AffineMatrix() {}
+    // The affine part of a glm matrix (which is indexed by column, then row).
+    // The bottom row of the matrix is assumed to be (0,0,0,1).
+    explicit AffineMatrix(const mat4x4 &matrix) {
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 4; j++) m[i][j] = matrix[j][i];
+        }
+    }
+    mat4x4 to_mat4x4() const {
+        return mat4x4(m[0][0], m[1][0], m[2][0], 0,
+                      m[0][1], m[1][1], m[2][1], 0,
+                      m[0][2], m[1][2], m[2][2], 0,
+                      m[0][3], m[1][3], m[2][3], 1);
+    }
+    static AffineMatrix identity() {
+        AffineMatrix a;
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 4; j++) a.m[i][j] = i == j ? 1.f : 0.f;
+        }
+        return a;
+    }
+
+    inline Point apply(const Point &p) const {
+        return Point((m[0][0]*p.x + m[0][1]*p.y) + (m[0][2]*p.z + m[0][3]),
+                     (m[1][0]*p.x + m[1][1]*p.y) + (m[1][2]*p.z + m[1][3]),
+                     (m[2][0]*p.x + m[2][1]*p.y) + (m[2][2]*p.z + m[2][3]));
+    }
+    inline Vector apply(const Vector &v) const {
+        return Vector((m[0][0]*v.x + m[0][1]*v.y) + m[0][2]*v.z,
+                      (m[1][0]*v.x + m[1][1]*v.y) + m[1][2]*v.z,
+                      (m[2][0]*v.x + m[2][1]*v.y) + m[2][2]*v.z);
+    }
+    // Multiply a vector by the transpose of the linear part. Normals are transformed by the inverse transpose.
+    inline Vector apply_transpose(const Vector &v) const {
+        return Vector((m[0][0]*v.x + m[1][0]*v.y) + m[2][0]*v.z,
+                      (m[0][1]*v.x + m[1][1]*v.y) + m[2][1]*v.z,
+                      (m[0][2]*v.x + m[1][2]*v.y) + m[2][2]*v.z);
+    }
+};
+AffineMatrix operator*(const AffineMatrix &A, const AffineMatrix &B);
+
+/*================================================================================
+    A Transform stores an affine matrix and its inverse.
 ================================================================================*/
 class Transform {
 private:
 public:
-    mat4x4 matrix;
-    mat4x4 inverse_matrix;
+    AffineMatrix matrix;
+    AffineMatrix inverse_matrix;
     Transform() {
         // No-parameter constructor gives the identity Transform.
-        memset(&matrix, 0, sizeof(mat4x4));
-        memset(&inverse_matrix, 0, sizeof(mat4x4));
-        for (int i = 0; i < 4; i++) {
-            matrix[i][i] = 1.f;
-            inverse_matrix[i][i] = 1.f;
-        }
+        matrix = AffineMatrix::identity();
+        inverse_matrix = AffineMatrix::identity();
     }
+    // The matrix must be affine.
     Transform(mat4x4 _matrix) :
         matrix {_matrix},
         inverse_matrix {glm::inverse(_matrix)}
@@ -29,12 +81,16 @@ public:
         matrix {_matrix},
         inverse_matrix {_inverse_matrix}
     {}
+    Transform(const AffineMatrix &_matrix, const AffineMatrix &_inverse_matrix) :
+        matrix {_matrix},
+        inverse_matrix {_inverse_matrix}
+    {}
 
     inline Point operator()(const Point &p) const {
-        return Point(matrix * vec4(p.x, p.y, p.z, 1));
+        return matrix.apply(p);
     }
     inline Vector operator()(const Vector &v) const {
-        return Vector(matrix * vec4(v.x, v.y, v.z, 0));
+        return matrix.apply(v);
     }
     inline Ray operator()(const Ray &ray) const {
         Ray transformed_ray((*this)(ray.o), (*this)(ray.d));
@@ -49,12 +105,20 @@ public:
         return Transform(inverse_matrix, matrix);
     }
     inline Point position() const {
-        // This assumes that the matrix is affine.
         return (*this)(Point(0,0,0));
     };
 
+    inline bool is_identity() const {
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 4; j++) {
+                if (matrix.m[i][j] != (i == j ? 1.f : 0.f)) return false;
+            }
+        }
+        return true;
+    }
+
     inline Vector transform_normal(const Vector &n) const {
-        return Vector(glm::transpose(inverse_matrix) * vec4(n.x, n.y, n.z, 0));
+        return inverse_matrix.apply_transpose(n);
     }
 
     // Static methods.
@@ -73,4 +137,12 @@ public:
 
 Transform operator*(const Transform &A, const Transform &B);
 
+// Batch transforms of arrays, such as the vertices of a model. The input and output may be the same array.
+// These give the same results as transforming one at a time.
+void transform_points(const Transform &transform, const Point *points, Point *out, int num_points);
+void transform_vectors(const Transform &transform, const Vector *vectors, Vector *out, int num_vectors);
+void transform_normals(const Transform &transform, const Vector *normals, Vector *out, int num_normals);
+// Transform the active rays of a packet into out, with SIMD instructions. Inactive lanes of out may be overwritten.
+void transform_ray_packet(const Transform &transform, const RayPacket &in, uint32_t active, RayPacket *out);
+
 #endif // CORE_TRANSFORM_H
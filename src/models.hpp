@@ -10,34 +10,65 @@ struct Model {
 
     // Triangle model values.
     int num_triangles;
-    std::vector<uint16_t> triangles; // length is 3*num_triangles.
+    std::vector<uint32_t> triangles; // length is 3*num_triangles.
 
     // Stored vertex attributes.
     bool has_normals; // Otherwise these will be computed if needed.
     std::vector<Vector> normals;
+    bool has_uvs;
+    std::vector<float> uvs; // length is 2*num_vertices.
 
     Model() {
         num_vertices = 0;
         num_triangles = 0;
         has_normals = false;
+        has_uvs = false;
     }
-    Model(std::vector<Point> &_vertices, int _num_vertices, std::vector<uint16_t> &_triangles, int _num_triangles) {
+    Model(std::vector<Point> &_vertices, int _num_vertices, std::vector<uint32_t> &_triangles, int _num_triangles) {
         vertices = _vertices;
         num_vertices = _num_vertices;
         triangles = _triangles;
         num_triangles = _num_triangles;
         has_normals = false;
+        has_uvs = false;
     }
     void print_properties() const;
 
     Model *copy();
     void transform_by(const Transform &transform);
+    // Set the vertex normals to the normalized sums of the (area-weighted) normals of the triangles around them.
+    // This runs in parallel, giving the same normals as summing serially.
+    void compute_phong_normals();
 };
 
+// Models that can't be loaded are reported on stderr, and NULL is returned.
+// Large OFF files are parsed in parallel (see models.cpp), using the worker threads if multithreading is initialized.
 Model *load_OFF_model(std::string const &filename,
                       float scale = 1.f,
                       Point center = Point(0,0,0),
                       bool invert_winding_order = false,
                       bool create_phong_normals = true);
 
+// Read PLY models, in ASCII or binary (either endianness), with vertex positions, and optionally normals and
+// UV coordinates. Faces can be triangles or quads (or larger convex polygons), which are split into triangles.
+// Normals given in the file are used instead of computed Phong normals. If create_phong_normals is false,
+// no normals are kept.
+Model *load_PLY_model(std::string const &filename,
+                      float scale = 1.f,
+                      Point center = Point(0,0,0),
+                      bool invert_winding_order = false,
+                      bool create_phong_normals = true);
+
+// A whole file mapped read-only into memory, so that it can be parsed in place.
+// data is NULL if the file couldn't be opened or mapped.
+struct MappedFile {
+    const char *data;
+    size_t size;
+    MappedFile(std::string const &filename);
+    ~MappedFile();
+private:
+    MappedFile(const MappedFile &);
+    MappedFile &operator=(const MappedFile &);
+};
+
 #endif // MODELS_H
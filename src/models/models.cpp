@@ -1,6 +1,61 @@
 #include "models.hpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <charconv>
+#include <memory>
+#include "multithreading.hpp"
 
-// Read OFF models with triangle faces. Comments are allowed.
+/*--------------------------------------------------------------------------------
+    OFF model loading.
+    The file is memory-mapped, and after the header each line holds one vertex
+    (the first num_vertices lines) or one triangle (the next num_faces lines).
+    Large files are parsed in parallel: the body is cut into chunks at line
+    boundaries, the lines of each chunk are counted (so each chunk knows the
+    index of its first line, and so which vertices or triangles it holds), and
+    then the chunks are parsed, each into its own part of the arrays.
+--------------------------------------------------------------------------------*/
+// Chunks are no smaller than this many bytes.
+#define OFF_MIN_CHUNK_SIZE 65536
+
+static inline bool is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+static inline const char *skip_blanks(const char *p, const char *end)
+{
+    while (p < end && is_blank(*p)) p++;
+    return p;
+}
+static inline const char *line_end(const char *p, const char *end)
+{
+    const char *newline = (const char *) memchr(p, '\n', end - p);
+    return newline == NULL ? end : newline;
+}
+// from_chars doesn't take a leading '+', which scanf does.
+template <typename T>
+static inline bool parse_number(const char *&p, const char *end, T *value)
+{
+    p = skip_blanks(p, end);
+    if (p < end && *p == '+') p++;
+    std::from_chars_result result = std::from_chars(p, end, *value);
+    if (result.ec != std::errc()) return false;
+    p = result.ptr;
+    return true;
+}
+
+struct OFFChunk {
+    const char *begin;
+    const char *end;
+    int num_lines;
+    int first_line;
+    // The first error in the chunk, if any, and the body line it was on.
+    const char *error;
+    int error_line;
+};
+
+// Read OFF models with triangle faces. Comments are allowed before the vertices.
 // -
 // Ported from my own C code.
 Model *load_OFF_model(std::string const &filename, float scale, Point center, bool invert_winding_order, bool create_phong_normals)
@@ -9,82 +64,228 @@ Model *load_OFF_model(std::string const &filename, float scale, Point center, bo
     std::cout << "    scale: " << scale << "\n";
     std::cout << "    center: " << center << "\n";
     #define load_error(ERROR_STRING) {\
-        fprintf(stderr, "Error loading OFF file: " ERROR_STRING "\n");\
-        exit(EXIT_FAILURE);\
-    }
-    FILE *file = fopen(filename.c_str(), "r");
-    if (file == NULL) load_error("File doesn't exist.");
-    // std::fstream file;
-    // file.open(filename);
-    // if (!file.is_open()) {
-    //     load_error("File doesn't exist.");
-    // }
-    #define line_size 512
-    char line_buffer[line_size];
-    #define get_line() {\
-        while (1) {\
-            if (fgets(line_buffer, line_size, file) == NULL) load_error("Couldn't get a line.");\
-            break;\
-        }\
+        fprintf(stderr, "Error loading OFF file \"%s\": %s\n", filename.c_str(), ERROR_STRING);\
+        return NULL;\
     }
-    get_line();
-    if (strcmp(line_buffer, "OFF\n") != 0) load_error("OFF files must start with the line \"OFF\".");
-    get_line();
-    int num_vertices, num_faces, num_edges;
-    if (sscanf(line_buffer, "%d %d %d\n", &num_vertices, &num_faces, &num_edges) == EOF) load_error("Line should consist of 3 numbers, for #vertices, #faces, #edges.");
+    MappedFile file(filename);
+    if (file.data == NULL) load_error("File doesn't exist or couldn't be read.");
+    const char *p = file.data;
+    const char *end = file.data + file.size;
 
-    std::vector<Point> vertices(num_vertices);
+    // Read the header, skipping blank lines and comments.
+    #define header_line() {\
+        do {\
+            if (p >= end) load_error("The file ends in the header.");\
+            line = p;\
+            line_stop = line_end(p, end);\
+            p = line_stop == end ? end : line_stop + 1;\
+            line = skip_blanks(line, line_stop);\
+        } while (line == line_stop || *line == '#');\
+    }
+    const char *line;
+    const char *line_stop;
+    header_line();
+    if (line_stop - line < 3 || strncmp(line, "OFF", 3) != 0 || skip_blanks(line + 3, line_stop) != line_stop) {
+        load_error("OFF files must start with the line \"OFF\".");
+    }
+    header_line();
+    int num_vertices, num_faces;
+    if (!parse_number(line, line_stop, &num_vertices) || !parse_number(line, line_stop, &num_faces)
+            || num_vertices < 0 || num_faces < 0) {
+        load_error("Line should consist of 3 numbers, for #vertices, #faces, #edges.");
+    }
+    #undef header_line
+    // A vertex line takes at least 6 bytes ("x y z" and a newline) and a face line at least 8 ("3 a b c" and a newline),
+    // apart from a last line without a newline. This rejects counts the file can't hold before anything is allocated.
+    if (6 * (uint64_t) num_vertices + 8 * (uint64_t) num_faces > (uint64_t) (end - p) + 1) {
+        load_error("The file is too short for the numbers of vertices and faces in the header.");
+    }
 
-    for (int i = 0; i < num_vertices; i++) {
-        get_line();
-        float x,y,z;
-        if (sscanf(line_buffer, "%f %f %f\n", &x, &y, &z) == EOF) load_error("Malformed vertex entry.");
-        vertices[i] = Point(scale*(x - center.x),
-                            scale*(y - center.y),
-                            scale*(z - center.z));
+    // Cut the body into chunks, each ending just after a newline (or at the end of the file).
+    size_t body_size = end - p;
+    int num_chunks = min((int) (body_size / OFF_MIN_CHUNK_SIZE) + 1, 16 * num_parallel_threads());
+    vector<OFFChunk> chunks;
+    const char *chunk_begin = p;
+    for (int i = 1; i <= num_chunks && chunk_begin < end; i++) {
+        const char *chunk_end = i == num_chunks ? end : p + body_size * i / num_chunks;
+        if (chunk_end < chunk_begin) chunk_end = chunk_begin;
+        chunk_end = line_end(chunk_end, end);
+        if (chunk_end < end) chunk_end++;
+        OFFChunk chunk;
+        chunk.begin = chunk_begin;
+        chunk.end = chunk_end;
+        chunk.error = NULL;
+        chunks.push_back(chunk);
+        chunk_begin = chunk_end;
     }
-    std::vector<uint16_t> triangles(3 * num_faces);
-    for (int i = 0; i < num_faces; i++) {
-        get_line();
-        uint16_t a,b,c;
-        if (sscanf(line_buffer, "3 %hu %hu %hu\n", &a, &b, &c) == EOF) load_error("Malformed face entry. Faces must be triangles.");
-        if (invert_winding_order) {
-            triangles[3*i + 0] = c;
-            triangles[3*i + 1] = b;
-            triangles[3*i + 2] = a;
-        } else {
-            triangles[3*i + 0] = a;
-            triangles[3*i + 1] = b;
-            triangles[3*i + 2] = c;
+    // Count the lines, then number them.
+    parallel_for([&](int first_chunk, int last_chunk, int) {
+        for (int i = first_chunk; i < last_chunk; i++) {
+            OFFChunk &chunk = chunks[i];
+            int num_lines = 0;
+            for (const char *q = chunk.begin; q < chunk.end; q = line_end(q, chunk.end) + 1) num_lines++;
+            chunk.num_lines = num_lines;
         }
+    }, chunks.size());
+    int num_lines = 0;
+    for (OFFChunk &chunk : chunks) {
+        chunk.first_line = num_lines;
+        num_lines += chunk.num_lines;
     }
-    // vector<>s should be on the heap, so won't be destroyed. (?)
-    Model *model = new Model(vertices, num_vertices, triangles, num_faces);
-    if (create_phong_normals) {
-        model->has_normals = true;
-        model->normals = vector<Vector>(model->num_vertices);
-        for (int i = 0; i < model->num_vertices; i++) {
-            model->normals[i] = Vector(0,0,0);
-        }
-        for (int i = 0; i < model->num_triangles; i++) {
-            Point &a = model->vertices[model->triangles[3*i+0]];
-            Point &b = model->vertices[model->triangles[3*i+1]];
-            Point &c = model->vertices[model->triangles[3*i+2]];
-            Vector n = glm::cross(c-a, b-a);
-            model->normals[model->triangles[3*i+0]] += n;
-            model->normals[model->triangles[3*i+1]] += n;
-            model->normals[model->triangles[3*i+2]] += n;
+    // Any lines after the faces (such as edges) are ignored.
+    if (num_lines < (int64_t) num_vertices + num_faces) load_error("The file ends before all of the vertices and faces.");
+
+    std::vector<Point> vertices(num_vertices);
+    std::vector<uint32_t> triangles(3 * (size_t) num_faces);
+    parallel_for([&](int first_chunk, int last_chunk, int) {
+        for (int i = first_chunk; i < last_chunk; i++) {
+            OFFChunk &chunk = chunks[i];
+            #define chunk_error(ERROR_STRING) {\
+                chunk.error = ERROR_STRING;\
+                chunk.error_line = line_index;\
+                break;\
+            }
+            int line_index = chunk.first_line;
+            for (const char *q = chunk.begin; q < chunk.end && line_index < (int64_t) num_vertices + num_faces; line_index++) {
+                const char *stop = line_end(q, chunk.end);
+                if (line_index < num_vertices) {
+                    float x,y,z;
+                    if (!parse_number(q, stop, &x) || !parse_number(q, stop, &y) || !parse_number(q, stop, &z)) {
+                        chunk_error("Malformed vertex entry.");
+                    }
+                    vertices[line_index] = Point(scale*(x - center.x),
+                                                 scale*(y - center.y),
+                                                 scale*(z - center.z));
+                } else {
+                    uint32_t n,a,b,c;
+                    if (!parse_number(q, stop, &n) || n != 3
+                            || !parse_number(q, stop, &a) || !parse_number(q, stop, &b) || !parse_number(q, stop, &c)) {
+                        chunk_error("Malformed face entry. Faces must be triangles.");
+                    }
+                    if (a >= (uint32_t) num_vertices || b >= (uint32_t) num_vertices || c >= (uint32_t) num_vertices) {
+                        chunk_error("Face entry references a vertex that doesn't exist.");
+                    }
+                    uint32_t *triangle = &triangles[3*(line_index - num_vertices)];
+                    if (invert_winding_order) {
+                        triangle[0] = c;
+                        triangle[1] = b;
+                        triangle[2] = a;
+                    } else {
+                        triangle[0] = a;
+                        triangle[1] = b;
+                        triangle[2] = c;
+                    }
+                }
+                q = stop + 1;
+            }
+            #undef chunk_error
         }
-        for (int i = 0; i < model->num_vertices; i++) {
-            model->normals[i] = glm::dot(model->normals[i], model->normals[i]) < 1e-6 ? Vector(0,0,0) // shouldn't happen
-                                : glm::normalize(model->normals[i]);
+    }, chunks.size());
+    // Report the first error in the file.
+    for (const OFFChunk &chunk : chunks) {
+        if (chunk.error != NULL) {
+            fprintf(stderr, "Error loading OFF file \"%s\": %s (%s %d)\n", filename.c_str(), chunk.error,
+                    chunk.error_line < num_vertices ? "vertex" : "face",
+                    chunk.error_line < num_vertices ? chunk.error_line : chunk.error_line - num_vertices);
+            return NULL;
         }
     }
+    #undef load_error
+
+    // The Model constructor copies the arrays, so they are moved in instead.
+    Model *model = new Model();
+    model->num_vertices = num_vertices;
+    model->num_triangles = num_faces;
+    model->vertices.swap(vertices);
+    model->triangles.swap(triangles);
+    if (create_phong_normals) model->compute_phong_normals();
 
     model->print_properties();
     return model;
 }
 
+void Model::compute_phong_normals()
+{
+    // Rather than adding each triangle's normal to its vertices (a scatter, which can't be split between
+    // threads without the threads' sums colliding), each vertex sums the normals of the triangles around it.
+    // The triangles are summed in order, so the normals are the same as from adding them up serially.
+    const int grain_size = 4096;
+    vector<Vector> triangle_normals(num_triangles);
+    // List the triangles around each vertex, in the ranges first_slot[v] to first_slot[v+1] of vertex_triangles.
+    std::unique_ptr<std::atomic<uint32_t>[]> counts(new std::atomic<uint32_t>[num_vertices + 1]);
+    for (int i = 0; i <= num_vertices; i++) counts[i].store(0, std::memory_order_relaxed);
+    parallel_for([&](int begin, int end, int) {
+        for (int i = begin; i < end; i++) {
+            Point &a = vertices[triangles[3*i+0]];
+            Point &b = vertices[triangles[3*i+1]];
+            Point &c = vertices[triangles[3*i+2]];
+            triangle_normals[i] = glm::cross(c-a, b-a);
+            for (int j = 0; j < 3; j++) counts[triangles[3*i+j]].fetch_add(1, std::memory_order_relaxed);
+        }
+    }, num_triangles, grain_size);
+    vector<uint32_t> first_slot(num_vertices + 1);
+    uint32_t num_slots = 0;
+    for (int i = 0; i < num_vertices; i++) {
+        first_slot[i] = num_slots;
+        num_slots += counts[i].load(std::memory_order_relaxed);
+        // Reuse the counts as the next free slot of each vertex.
+        counts[i].store(first_slot[i], std::memory_order_relaxed);
+    }
+    first_slot[num_vertices] = num_slots;
+    vector<uint32_t> vertex_triangles(num_slots);
+    parallel_for([&](int begin, int end, int) {
+        for (int i = begin; i < end; i++) {
+            for (int j = 0; j < 3; j++) {
+                vertex_triangles[counts[triangles[3*i+j]].fetch_add(1, std::memory_order_relaxed)] = i;
+            }
+        }
+    }, num_triangles, grain_size);
+
+    has_normals = true;
+    normals = vector<Vector>(num_vertices);
+    parallel_for([&](int begin, int end, int) {
+        for (int i = begin; i < end; i++) {
+            // The slots were filled in any order, so sort them (there are only a few) to sum in triangle order.
+            uint32_t *around = &vertex_triangles[first_slot[i]];
+            int n = first_slot[i+1] - first_slot[i];
+            for (int j = 1; j < n; j++) {
+                uint32_t t = around[j];
+                int k = j;
+                for (; k > 0 && around[k-1] > t; k--) around[k] = around[k-1];
+                around[k] = t;
+            }
+            Vector normal(0,0,0);
+            for (int j = 0; j < n; j++) normal += triangle_normals[around[j]];
+            normals[i] = glm::dot(normal, normal) < 1e-6 ? Vector(0,0,0) // shouldn't happen
+                         : glm::normalize(normal);
+        }
+    }, num_vertices, grain_size);
+}
+
+MappedFile::MappedFile(std::string const &filename)
+{
+    data = NULL;
+    size = 0;
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0) {
+        void *mapped = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED) {
+            // The file is read from start to end.
+            madvise(mapped, file_stat.st_size, MADV_SEQUENTIAL);
+            data = (const char *) mapped;
+            size = file_stat.st_size;
+        }
+    }
+    // The mapping stays valid after the file is closed.
+    close(fd);
+}
+MappedFile::~MappedFile()
+{
+    if (data != NULL) munmap((void *) data, size);
+}
+
 
 void Model::print_properties() const
 {
@@ -106,19 +307,19 @@ Model *Model::copy()
     // There probably is a better way to do this.
     new_model->vertices = vector<Point>(num_vertices);
     for (int i = 0; i < num_vertices; i++) new_model->vertices[i] = vertices[i];
-    new_model->triangles = vector<uint16_t>(3*num_triangles);
+    new_model->triangles = vector<uint32_t>(3*num_triangles);
     for (int i = 0; i < 3*num_triangles; i++) new_model->triangles[i] = triangles[i];
 
     if (has_normals) {
         new_model->normals = vector<Vector>(num_vertices);
         for (int i = 0; i < num_vertices; i++) new_model->normals[i] = normals[i];
     }
+    new_model->has_uvs = has_uvs;
+    new_model->uvs = uvs;
     return new_model;
 }
 void Model::transform_by(const Transform &transform)
 {
     //---If normals are held, transform these.
-    for (int i = 0; i < num_vertices; i++) {
-        vertices[i] = transform(vertices[i]);
-    }
+    transform_points(transform, vertices.data(), vertices.data(), num_vertices);
 }
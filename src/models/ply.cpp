@@ -0,0 +1,407 @@
+/*--------------------------------------------------------------------------------
+    PLY model loading.
+    A PLY file is a header describing a list of elements (such as "vertex" and
+    "face"), each with a count and typed properties, followed by the element data
+    in ASCII or binary. See http://paulbourke.net/dataformats/ply/.
+
+    The file is memory-mapped and parsed in place. The ASCII and binary formats
+    are read through the same PLYReader, one property value at a time, so the
+    element handling is shared.
+--------------------------------------------------------------------------------*/
+#include "models.hpp"
+#include <charconv>
+
+// Errors are reported, and NULL returned, rather than ending the program.
+#define load_error(ERROR_STRING) {\
+    fprintf(stderr, "Error loading PLY file \"%s\": %s\n", filename.c_str(), ERROR_STRING);\
+    return NULL;\
+}
+
+enum PLYFormat {
+    PLY_ASCII,
+    PLY_BINARY_LITTLE_ENDIAN,
+    PLY_BINARY_BIG_ENDIAN,
+};
+enum PLYType {
+    PLY_CHAR,
+    PLY_UCHAR,
+    PLY_SHORT,
+    PLY_USHORT,
+    PLY_INT,
+    PLY_UINT,
+    PLY_FLOAT,
+    PLY_DOUBLE,
+    PLY_INVALID_TYPE,
+};
+static const int ply_type_sizes[] = { 1, 1, 2, 2, 4, 4, 4, 8 };
+
+static PLYType ply_type(const string &name)
+{
+    // Both the original names and the sized names are in use.
+    if (name == "char"   || name == "int8")    return PLY_CHAR;
+    if (name == "uchar"  || name == "uint8")   return PLY_UCHAR;
+    if (name == "short"  || name == "int16")   return PLY_SHORT;
+    if (name == "ushort" || name == "uint16")  return PLY_USHORT;
+    if (name == "int"    || name == "int32")   return PLY_INT;
+    if (name == "uint"   || name == "uint32")  return PLY_UINT;
+    if (name == "float"  || name == "float32") return PLY_FLOAT;
+    if (name == "double" || name == "float64") return PLY_DOUBLE;
+    return PLY_INVALID_TYPE;
+}
+
+struct PLYProperty {
+    string name;
+    PLYType type; // For a list, the type of the items.
+    bool is_list;
+    PLYType count_type;
+};
+struct PLYElement {
+    string name;
+    size_t count;
+    vector<PLYProperty> properties;
+    int property_index(const string &name) const {
+        for (int i = 0; i < properties.size(); i++) {
+            if (properties[i].name == name) return i;
+        }
+        return -1;
+    }
+    // The fewest bytes that one item of the element takes in binary (a list taking at least its count).
+    size_t min_binary_size() const {
+        size_t size = 0;
+        for (const PLYProperty &property : properties) {
+            size += ply_type_sizes[property.is_list ? property.count_type : property.type];
+        }
+        return size;
+    }
+};
+
+// Reads property values in turn from the body of a PLY file.
+// Every value is given as a double, which holds all of the PLY types exactly.
+struct PLYReader {
+    const char *p;
+    const char *end;
+    PLYFormat format;
+
+    inline bool read(PLYType type, double *value) {
+        if (format == PLY_ASCII) return read_ascii(type, value);
+        return read_binary(type, value);
+    }
+    inline bool read_ascii(PLYType type, double *value) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) p++;
+        std::from_chars_result result;
+        if (type == PLY_FLOAT) {
+            // Parse floats as floats, so that the values are the same as from strtof.
+            float f;
+            result = std::from_chars(p, end, f);
+            *value = f;
+        } else if (type == PLY_DOUBLE) {
+            result = std::from_chars(p, end, *value);
+        } else {
+            int64_t i = 0;
+            result = std::from_chars(p, end, i);
+            *value = i;
+        }
+        if (result.ec != std::errc()) return false;
+        p = result.ptr;
+        return true;
+    }
+    inline bool read_binary(PLYType type, double *value) {
+        int size = ply_type_sizes[type];
+        if (end - p < size) return false;
+        bool swap = format == PLY_BINARY_BIG_ENDIAN;
+        switch (type) {
+        case PLY_CHAR: *value = *(const int8_t *) p; break;
+        case PLY_UCHAR: *value = *(const uint8_t *) p; break;
+        case PLY_SHORT:
+        case PLY_USHORT: {
+            uint16_t bits;
+            memcpy(&bits, p, 2);
+            if (swap) bits = __builtin_bswap16(bits);
+            *value = type == PLY_SHORT ? (double) (int16_t) bits : (double) bits;
+            break;
+        }
+        case PLY_INT:
+        case PLY_UINT:
+        case PLY_FLOAT: {
+            uint32_t bits;
+            memcpy(&bits, p, 4);
+            if (swap) bits = __builtin_bswap32(bits);
+            if (type == PLY_INT) *value = (int32_t) bits;
+            else if (type == PLY_UINT) *value = bits;
+            else {
+                float f;
+                memcpy(&f, &bits, 4);
+                *value = f;
+            }
+            break;
+        }
+        case PLY_DOUBLE: {
+            uint64_t bits;
+            memcpy(&bits, p, 8);
+            if (swap) bits = __builtin_bswap64(bits);
+            memcpy(value, &bits, 8);
+            break;
+        }
+        default: return false;
+        }
+        p += size;
+        return true;
+    }
+    // Read the length of a list property.
+    inline bool read_count(PLYType type, int *count) {
+        double value;
+        if (!read(type, &value) || value < 0 || value > INT32_MAX) return false;
+        *count = (int) value;
+        return true;
+    }
+    // Read a property which is not used.
+    inline bool skip(const PLYProperty &property) {
+        double value;
+        int count = 1;
+        if (property.is_list && !read_count(property.count_type, &count)) return false;
+        for (int i = 0; i < count; i++) {
+            if (!read(property.type, &value)) return false;
+        }
+        return true;
+    }
+};
+
+// Get the next line of the header, without the line ending.
+static bool header_line(const char *&p, const char *end, string *line)
+{
+    if (p >= end) return false;
+    const char *line_end = (const char *) memchr(p, '\n', end - p);
+    if (line_end == NULL) line_end = end;
+    const char *content_end = line_end;
+    if (content_end > p && content_end[-1] == '\r') content_end --;
+    line->assign(p, content_end);
+    p = line_end < end ? line_end + 1 : end;
+    return true;
+}
+static vector<string> split_words(const string &line)
+{
+    vector<string> words;
+    size_t i = 0;
+    while (i < line.size()) {
+        while (i < line.size() && isspace((unsigned char) line[i])) i++;
+        size_t start = i;
+        while (i < line.size() && !isspace((unsigned char) line[i])) i++;
+        if (i > start) words.push_back(line.substr(start, i - start));
+    }
+    return words;
+}
+
+Model *load_PLY_model(std::string const &filename, float scale, Point center, bool invert_winding_order, bool create_phong_normals)
+{
+    std::cout << "Loading model \"" << filename << "\" with parameters:\n";
+    std::cout << "    scale: " << scale << "\n";
+    std::cout << "    center: " << center << "\n";
+    MappedFile file(filename);
+    if (file.data == NULL) load_error("File doesn't exist or couldn't be read.");
+    const char *p = file.data;
+    const char *end = file.data + file.size;
+
+    // Read the header.
+    string line;
+    if (!header_line(p, end, &line) || line != "ply") load_error("PLY files must start with the line \"ply\".");
+    PLYFormat format = PLY_ASCII;
+    bool has_format = false;
+    vector<PLYElement> elements;
+    while (true) {
+        if (!header_line(p, end, &line)) load_error("The header has no \"end_header\" line.");
+        vector<string> words = split_words(line);
+        if (words.empty() || words[0] == "comment" || words[0] == "obj_info") continue;
+        if (words[0] == "end_header") break;
+        if (words[0] == "format") {
+            if (words.size() != 3) load_error("Malformed format line.");
+            if (words[1] == "ascii") format = PLY_ASCII;
+            else if (words[1] == "binary_little_endian") format = PLY_BINARY_LITTLE_ENDIAN;
+            else if (words[1] == "binary_big_endian") format = PLY_BINARY_BIG_ENDIAN;
+            else load_error("Unknown format. It must be ascii, binary_little_endian or binary_big_endian.");
+            has_format = true;
+        } else if (words[0] == "element") {
+            if (words.size() != 3) load_error("Malformed element line.");
+            PLYElement element;
+            element.name = words[1];
+            char *count_end;
+            element.count = strtoull(words[2].c_str(), &count_end, 10);
+            if (*count_end != '\0') load_error("Malformed element count.");
+            elements.push_back(element);
+        } else if (words[0] == "property") {
+            if (elements.empty()) load_error("A property was given before any element.");
+            PLYProperty property;
+            if (words.size() == 5 && words[1] == "list") {
+                property.is_list = true;
+                property.count_type = ply_type(words[2]);
+                property.type = ply_type(words[3]);
+                property.name = words[4];
+                if (property.count_type == PLY_INVALID_TYPE || property.count_type == PLY_FLOAT
+                    || property.count_type == PLY_DOUBLE) load_error("Invalid list count type.");
+            } else if (words.size() == 3) {
+                property.is_list = false;
+                property.count_type = PLY_INVALID_TYPE;
+                property.type = ply_type(words[1]);
+                property.name = words[2];
+            } else load_error("Malformed property line.");
+            if (property.type == PLY_INVALID_TYPE) load_error("Invalid property type.");
+            elements.back().properties.push_back(property);
+        } else load_error("Unknown header line.");
+    }
+    if (!has_format) load_error("The header has no format line.");
+
+    // Work out which properties hold the vertex attributes.
+    int x = -1, y = -1, z = -1, nx = -1, ny = -1, nz = -1, u = -1, v = -1;
+    int vertex_indices = -1;
+    for (const PLYElement &element : elements) {
+        if (element.name == "vertex") {
+            x = element.property_index("x");
+            y = element.property_index("y");
+            z = element.property_index("z");
+            nx = element.property_index("nx");
+            ny = element.property_index("ny");
+            nz = element.property_index("nz");
+            const char *u_names[] = { "u", "s", "texture_u", "texture_s" };
+            const char *v_names[] = { "v", "t", "texture_v", "texture_t" };
+            for (int i = 0; i < 4 && (u < 0 || v < 0); i++) {
+                u = element.property_index(u_names[i]);
+                v = element.property_index(v_names[i]);
+            }
+            if (x < 0 || y < 0 || z < 0) load_error("Vertices must have x, y and z properties.");
+            if (element.properties[x].is_list || element.properties[y].is_list || element.properties[z].is_list)
+                load_error("Vertex positions can't be lists.");
+        } else if (element.name == "face") {
+            vertex_indices = element.property_index("vertex_indices");
+            if (vertex_indices < 0) vertex_indices = element.property_index("vertex_index");
+            if (vertex_indices < 0 || !element.properties[vertex_indices].is_list) load_error("Faces must have a vertex_indices list.");
+        }
+    }
+    bool has_normals = nx >= 0 && ny >= 0 && nz >= 0;
+    bool has_uvs = u >= 0 && v >= 0;
+
+    // Read the elements.
+    PLYReader reader;
+    reader.p = p;
+    reader.end = end;
+    reader.format = format;
+    std::vector<Point> vertices;
+    std::vector<Vector> normals;
+    std::vector<float> uvs;
+    std::vector<uint32_t> triangles;
+    bool read_vertices = false;
+    for (const PLYElement &element : elements) {
+        int num_properties = element.properties.size();
+        if (element.name == "vertex") {
+            if (read_vertices) load_error("There is more than one vertex element.");
+            read_vertices = true;
+            if (element.count > UINT32_MAX) load_error("Too many vertices.");
+            // The count is only trusted once the data is known to be there. Binary data takes at least a known number
+            // of bytes per vertex, so that can be checked first, and ASCII data is read into growing arrays.
+            if (format != PLY_ASCII) {
+                if (element.count > (size_t) (reader.end - reader.p) / element.min_binary_size()) {
+                    load_error("The file is too short for the number of vertices.");
+                }
+                vertices.reserve(element.count);
+                if (has_normals) normals.reserve(element.count);
+                if (has_uvs) uvs.reserve(2 * element.count);
+            }
+            vector<double> values(num_properties);
+            for (size_t i = 0; i < element.count; i++) {
+                for (int k = 0; k < num_properties; k++) {
+                    const PLYProperty &property = element.properties[k];
+                    if (property.is_list) {
+                        if (!reader.skip(property)) load_error("Malformed or truncated vertex data.");
+                    } else if (!reader.read(property.type, &values[k])) load_error("Malformed or truncated vertex data.");
+                }
+                vertices.push_back(Point(scale*(values[x] - center.x),
+                                         scale*(values[y] - center.y),
+                                         scale*(values[z] - center.z)));
+                if (has_normals) normals.push_back(Vector(values[nx], values[ny], values[nz]));
+                if (has_uvs) {
+                    uvs.push_back(values[u]);
+                    uvs.push_back(values[v]);
+                }
+            }
+        } else if (element.name == "face") {
+            if (!read_vertices) load_error("Faces must come after the vertices.");
+            // As for the vertices, a binary face takes at least its list count (and three indices), and the
+            // triangles of ASCII faces are added to a growing array.
+            if (format != PLY_ASCII) {
+                size_t min_size = element.min_binary_size() + 3 * ply_type_sizes[element.properties[vertex_indices].type];
+                if (element.count > (size_t) (reader.end - reader.p) / min_size) {
+                    load_error("The file is too short for the number of faces.");
+                }
+                triangles.reserve(triangles.size() + 3 * element.count);
+            }
+            const PLYProperty &indices_property = element.properties[vertex_indices];
+            uint32_t num_vertices = vertices.size();
+            for (size_t i = 0; i < element.count; i++) {
+                for (int k = 0; k < num_properties; k++) {
+                    if (k != vertex_indices) {
+                        if (!reader.skip(element.properties[k])) load_error("Malformed or truncated face data.");
+                        continue;
+                    }
+                    int n;
+                    if (!reader.read_count(indices_property.count_type, &n)) load_error("Malformed or truncated face data.");
+                    if (n < 3) load_error("Faces must have at least three vertices.");
+                    // Split the polygon into a fan of triangles around its first vertex (a quad gives two triangles).
+                    uint32_t first, previous;
+                    for (int j = 0; j < n; j++) {
+                        double value;
+                        if (!reader.read(indices_property.type, &value)) load_error("Malformed or truncated face data.");
+                        if (value < 0 || value >= num_vertices) load_error("Face entry references a vertex that doesn't exist.");
+                        uint32_t index = (uint32_t) value;
+                        if (j >= 2) {
+                            if (invert_winding_order) {
+                                triangles.push_back(index);
+                                triangles.push_back(previous);
+                                triangles.push_back(first);
+                            } else {
+                                triangles.push_back(first);
+                                triangles.push_back(previous);
+                                triangles.push_back(index);
+                            }
+                        }
+                        if (j == 0) first = index;
+                        previous = index;
+                    }
+                }
+            }
+        } else {
+            // Skip other elements. Their counts are checked first, as for the vertices and faces, since an element
+            // with no properties would otherwise loop through its count without reading anything.
+            if (element.count > 0 && num_properties == 0) load_error("An element with a nonzero count has no properties.");
+            size_t bytes_left = reader.end - reader.p;
+            if (element.count > (format == PLY_ASCII ? bytes_left : bytes_left / element.min_binary_size())) {
+                load_error("The file is too short for the number of elements.");
+            }
+            for (size_t i = 0; i < element.count; i++) {
+                for (const PLYProperty &property : element.properties) {
+                    if (!reader.skip(property)) load_error("Malformed or truncated element data.");
+                }
+            }
+        }
+    }
+    if (!read_vertices) load_error("There is no vertex element.");
+
+    // The Model constructor copies the arrays, so they are moved in instead.
+    Model *model = new Model();
+    model->num_vertices = vertices.size();
+    model->num_triangles = triangles.size() / 3;
+    model->vertices.swap(vertices);
+    model->triangles.swap(triangles);
+    if (create_phong_normals) {
+        if (has_normals) {
+            model->has_normals = true;
+            model->normals.swap(normals);
+        } else {
+            model->compute_phong_normals();
+        }
+    }
+    if (has_uvs) {
+        model->has_uvs = true;
+        model->uvs.swap(uvs);
+    }
+
+    model->print_properties();
+    return model;
+}
@@ -3,13 +3,69 @@
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <atomic>
 #include <utility>
 #include "core.hpp"
 
 int num_system_cores();
 void init_multithreading(bool overriding = false, unsigned int override_num_threads = 1);
 void close_multithreading();
+// The number of threads that parallel work is shared between (including the main thread).
+// This is 1 if multithreading is not initialized. Parallel work started from inside a task is shared between
+// the same threads, so this does not change inside a task.
+int num_parallel_threads();
 
-void parallel_for_2D(std::function<void(int,int,int)> f, const int &count_i, const int &count_j, bool use_main_thread = true);
+/*--------------------------------------------------------------------------------
+    A TaskGroup is a set of tasks which can be waited on together. Tasks are
+    spawned onto the spawning thread's own deque, and idle threads steal from
+    the other end of other threads' deques. A task may itself create a group
+    and spawn and wait on more tasks. While waiting, a thread runs other tasks
+    (those of its own group first, since they are at the top of its deque).
+    Tasks are functions of the index of the thread that runs them.
+--------------------------------------------------------------------------------*/
+struct Task;
+class TaskGroup {
+public:
+    TaskGroup() : m_pending(0) {}
+    ~TaskGroup() { wait(); }
+    void spawn(std::function<void(int)> f);
+    // Return when all tasks spawned in this group have finished.
+    // If help is false, the calling thread only blocks until then, and does not run tasks itself.
+    void wait(bool help = true);
+private:
+    friend void run_task(Task *task, int thread_index);
+    std::atomic<int> m_pending;
+};
+
+// Evaluate f(begin, end, thread_index) over sub-ranges covering [0, count). The range is split recursively
+// into tasks until pieces are no longer than grain_size.
+void parallel_for(std::function<void(int,int,int)> f, int count, int grain_size = 1);
+
+// Evaluate f(i, j, thread_index) over the grid [0,count_i)x[0,count_j). Threads take cells
+// chunk_size at a time from an atomic counter, so this suits many small, similar items, such as image tiles.
+void parallel_for_2D(std::function<void(int,int,int)> f, const int &count_i, const int &count_j, bool use_main_thread = true,
+                     int chunk_size = 1);
+
+// Reduce map(begin, end, thread_index) over [0, count) with reduce(T, T), starting from identity.
+// The range is cut into a fixed set of chunks whose results are combined in order, so the result
+// doesn't depend on how the chunks were scheduled, even when reduce is not associative (such as float addition).
+template <typename T, typename MAP, typename REDUCE>
+T parallel_reduce(int count, const T &identity, const MAP &map, const REDUCE &reduce, int grain_size = 1)
+{
+    if (count <= 0) return identity;
+    if (grain_size < 1) grain_size = 1;
+    int num_chunks = min((count + grain_size - 1) / grain_size, 4 * num_parallel_threads());
+    vector<T> results(num_chunks, identity);
+    parallel_for([&](int first_chunk, int last_chunk, int thread_index) {
+        for (int chunk = first_chunk; chunk < last_chunk; chunk++) {
+            int begin = (int) (((long) count * chunk) / num_chunks);
+            int end = (int) (((long) count * (chunk + 1)) / num_chunks);
+            results[chunk] = map(begin, end, thread_index);
+        }
+    }, num_chunks);
+    T result = identity;
+    for (const T &chunk_result : results) result = reduce(result, chunk_result);
+    return result;
+}
 
 #endif // MULTITHREADING_H
@@ -1,64 +1,132 @@
 #include "multithreading.hpp"
 // note: This is not supposed to be any sort of general multithreading module.
-// Multithreading is primarily for tiled rendering.
+// Multithreading is primarily for tiled rendering, and for building acceleration structures.
 //
 // I have used pbrt v3's parallelism implementation as reference and to learn how to use
 // C++ parallelism.
 // https://github.com/mmp/pbrt-v3/blob/9f717d847a807793fa966cf0eaa366852efef167/src/core/parallel.cpp
+// The work-stealing deque is the one of Chase and Lev, with the C11 memory orderings from
+//     Lê, Pop, Cohen, Zappa Nardelli, "Correct and Efficient Work-Stealing for Weak Memory Models" (2013).
 
 // Worker threads are the ones that hang around and jump in to do work if it is there,
 // which will probably be a tile to render. There can be other threads in the program.
+// Each worker thread, and the main thread (the one that called init_multithreading()), owns a deque of tasks.
+// Other threads (such as a rendering thread started by a main program) can still start parallel work. Their
+// tasks go into a shared injection queue, and they just block until the work is done.
 
 static vector<std::thread> threads;
 static bool threads_initialized = false;
+static std::atomic<bool> threads_should_terminate(false);
 
-// Should not require synchronization, since it is only written to by the main thread, and
-// running a thread a few extra times before detecting this doesn't matter.
-static bool threads_should_terminate = false;
+struct Task {
+    std::function<void(int)> f;
+    TaskGroup *group;
+};
 
-// "Work" is over a grid of indices and and evaluates a function of index pairs.
-// This is because this is really just for tiled rendering.
-struct Work {
-    Work(std::function<void(int,int,int)> _f, int _count_i, int _count_j) {
-        count_i = _count_i;
-        count_j = _count_j;
-        next_index_i = 0;
-        next_index_j = 0;
-        f = _f;
-        active_workers = 0;
-        m_finished = false;
-    }
-    int next_index_i;
-    int next_index_j;
-    std::function<void(int,int,int)> f; // i,j,thread_index
-    int count_i;
-    int count_j;
-    int active_workers;
+/*--------------------------------------------------------------------------------
+    Work-stealing deque
+    -------------------
+    The owning thread pushes and pops tasks at the bottom, with no locks. Other
+    threads steal from the top, contending only through a compare-and-swap on
+    the top index. When the circular array fills up it is replaced by one twice
+    the size. A thief may still be reading the old array, so old arrays are kept
+    until the deque is destroyed.
+--------------------------------------------------------------------------------*/
+struct TaskArray {
+    TaskArray(int64_t _size) : size(_size), tasks(new std::atomic<Task *>[_size]) {}
+    ~TaskArray() { delete[] tasks; }
+    Task *get(int64_t i) const { return tasks[i & (size - 1)].load(std::memory_order_relaxed); }
+    void put(int64_t i, Task *task) { tasks[i & (size - 1)].store(task, std::memory_order_relaxed); }
+    int64_t size; // A power of two.
+    std::atomic<Task *> *tasks;
+};
 
-    bool finished() const {
-        return m_finished && active_workers == 0;
+class TaskDeque {
+public:
+    TaskDeque() : m_top(0), m_bottom(0), m_array(new TaskArray(256)) {}
+    ~TaskDeque() {
+        delete m_array.load();
+        for (TaskArray *array : m_retired_arrays) delete array;
     }
-    bool work_available() const {
-        return next_index_i < count_i;
+    // Only the owner calls push() and pop().
+    void push(Task *task) {
+        int64_t bottom = m_bottom.load(std::memory_order_relaxed);
+        int64_t top = m_top.load(std::memory_order_acquire);
+        TaskArray *array = m_array.load(std::memory_order_relaxed);
+        if (bottom - top > array->size - 1) {
+            TaskArray *bigger_array = new TaskArray(2 * array->size);
+            for (int64_t i = top; i < bottom; i++) bigger_array->put(i, array->get(i));
+            m_retired_arrays.push_back(array);
+            m_array.store(bigger_array, std::memory_order_release);
+            array = bigger_array;
+        }
+        array->put(bottom, task);
+        // Publish the task to thieves (which load the bottom index with acquire).
+        m_bottom.store(bottom + 1, std::memory_order_release);
     }
-
-    // !!! The work mutex must be held when calling this !!!
-    void step() {
-        next_index_j ++;
-        if (next_index_j == count_j) {
-            next_index_j = 0;
-            next_index_i ++;
-            if (next_index_i == count_i) m_finished = true;
+    Task *pop() {
+        int64_t bottom = m_bottom.load(std::memory_order_relaxed) - 1;
+        TaskArray *array = m_array.load(std::memory_order_relaxed);
+        m_bottom.store(bottom, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t top = m_top.load(std::memory_order_relaxed);
+        if (top > bottom) {
+            // Empty.
+            m_bottom.store(bottom + 1, std::memory_order_relaxed);
+            return NULL;
         }
+        Task *task = array->get(bottom);
+        if (top == bottom) {
+            // This is the last task, so race the thieves for it.
+            if (!m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                task = NULL;
+            }
+            m_bottom.store(bottom + 1, std::memory_order_relaxed);
+        }
+        return task;
     }
-
-    bool m_finished;
+    // Any thread can call steal().
+    Task *steal() {
+        int64_t top = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t bottom = m_bottom.load(std::memory_order_acquire);
+        if (top >= bottom) return NULL;
+        TaskArray *array = m_array.load(std::memory_order_acquire);
+        Task *task = array->get(top);
+        if (!m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            // Lost the race to another thief or the owner.
+            return NULL;
+        }
+        return task;
+    }
+private:
+    std::atomic<int64_t> m_top;
+    std::atomic<int64_t> m_bottom;
+    std::atomic<TaskArray *> m_array;
+    vector<TaskArray *> m_retired_arrays;
 };
 
-static Work *work = NULL;
-// Access to the work pointer must be synchronized. This is done with mutexes and condition variables.
-static std::mutex work_mutex;
-static std::condition_variable work_condition_variable;
+// deques[0] belongs to the main thread, and deques[i] to worker thread i.
+static vector<TaskDeque *> deques;
+// The index passed to tasks run by this thread (0 for the main thread), or -1 for a thread that doesn't own a deque.
+static thread_local int current_thread_index = -1;
+
+// Tasks spawned by threads without a deque. This is only locked if there is something in it.
+static std::mutex injection_mutex;
+static vector<Task *> injected_tasks;
+static std::atomic<int> num_injected_tasks(0);
+
+/*--------------------------------------------------------------------------------
+    Idle threads sleep on a condition variable. Every time a task is spawned or
+    a group finishes, the wake epoch is incremented. A thread records the epoch
+    before looking for a task, and only goes to sleep if it hasn't changed since.
+    Spawning only locks the sleep mutex (to notify) if some thread is sleeping,
+    so no lock is taken per task while all threads are busy.
+--------------------------------------------------------------------------------*/
+static std::mutex sleep_mutex;
+static std::condition_variable sleep_condition_variable;
+static std::atomic<uint64_t> wake_epoch(0);
+static std::atomic<int> num_sleeping(0);
 
 static inline void check_init()
 {
@@ -113,139 +181,218 @@ Any thread that intends to wait on std::condition_variable has to
           three steps above
 --------------------------------------------------------------------------------*/
 
-static void worker_thread(int thread_index)
+static void wake_sleeping_threads()
 {
-    std::cout << "Spawned worker thread " << thread_index << "\n";
+    wake_epoch.fetch_add(1);
+    if (num_sleeping.load() > 0) {
+        // Taking the lock makes sure that a thread which has checked the epoch is already waiting, so it gets the notification.
+        { std::lock_guard<std::mutex> lock(sleep_mutex); }
+        sleep_condition_variable.notify_all();
+    }
+}
 
-    // Spawned threads start here.
-    // They simply wait for work on the task list, and if there is any work available, they do it.
-    // There needs to be carefully synchronized access to the task list for this to work.
+// Sleep until woken, unless the epoch has changed since it was read (meaning there may be new tasks or a finished group).
+static void sleep_unless_woken_since(uint64_t epoch)
+{
+    std::unique_lock<std::mutex> lock(sleep_mutex);
+    num_sleeping.fetch_add(1);
+    sleep_condition_variable.wait(lock, [&]{ return wake_epoch.load() != epoch || threads_should_terminate.load(); });
+    num_sleeping.fetch_sub(1);
+}
 
-    // Acquire a lock on the work mutex. This starts off with the lock.
-    std::unique_lock<std::mutex> lock(work_mutex);
+void run_task(Task *task, int thread_index)
+{
+    task->f(thread_index);
+    TaskGroup *group = task->group;
+    delete task;
+    if (group->m_pending.fetch_sub(1) == 1) {
+        // That was the group's last task, so whoever is waiting on it can return.
+        // The group may be destroyed as soon as the count is zero, so it must not be used after this.
+        wake_sleeping_threads();
+    }
+}
 
-    while (!threads_should_terminate) {
-        if (work == NULL) {
-            // Nothing to do. Wait until the main thread signifies there is work to do.
-            // When the thread is spawned, it should go straight into waiting.
+static Task *find_task(int thread_index)
+{
+    // First, this thread's own most recently spawned task.
+    Task *task = deques[thread_index]->pop();
+    if (task != NULL) return task;
+    // Then tasks spawned by threads that can't run them.
+    if (num_injected_tasks.load() > 0) {
+        std::lock_guard<std::mutex> lock(injection_mutex);
+        if (!injected_tasks.empty()) {
+            task = injected_tasks.back();
+            injected_tasks.pop_back();
+            num_injected_tasks.fetch_sub(1);
+            return task;
+        }
+    }
+    // Otherwise steal the oldest task of another thread (the biggest piece of work it has, if work is split recursively).
+    int num_deques = deques.size();
+    for (int i = 1; i < num_deques; i++) {
+        task = deques[(thread_index + i) % num_deques]->steal();
+        if (task != NULL) return task;
+    }
+    return NULL;
+}
 
-            // https://www.cplusplus.com/reference/condition_variable/condition_variable/wait/
-            //     The lock is unlocked, and the thread blocked until a notify on the condition variable,
-            //     where the lock is then held again.
-            work_condition_variable.wait(lock);
-        } else {
-            // printf("PARALLEL GOING!\n");getchar();
-            // This thread currently holds the work mutex.
-            int index_i = work->next_index_i;
-            int index_j = work->next_index_j;
-            // The next task is the next cell in the grid
-            // (if the work is done, this goes out of bounds so that Work::finished() returns false.)
-            work->step();
-            Work *my_work = work; // Save a pointer to the work. !! Remember to only use this now.
-            if (!work->work_available()) {
-                // This worker is finishing the last task, so set the work pointer to NULL,
-                // so that the other works (and the main thread helping out)
-                // don't try to pick up a non-existent task.
-                work = NULL;
-            }
-            my_work->active_workers ++;
-            
-            // Release the mutex, then do the work.
-            lock.unlock();
-            my_work->f(index_i, index_j, thread_index);
-            // Afterward, halt and request access to the mutex again.
-            lock.lock();
-            
-            my_work->active_workers --;
-            if (my_work->finished()) {
-                // After finishing the last task, notify all waiting threads.
-                // Worker threads will just wait again since work is NULL.
-                // The main thread will then get the lock and detect the work is finished.
-                work_condition_variable.notify_all();
-                //^... looping again makes this thread go back to waiting.
+void TaskGroup::spawn(std::function<void(int)> f)
+{
+    if (!threads_initialized || threads.empty()) {
+        // No spawned threads (only the main thread). Just run it now. (it may be a good way to test if multithreading
+        // is correct by spawning no threads and just doing this each time, and comparing).
+        f(max(current_thread_index, 0));
+        return;
+    }
+    m_pending.fetch_add(1);
+    Task *task = new Task { std::move(f), this };
+    if (current_thread_index >= 0) {
+        deques[current_thread_index]->push(task);
+    } else {
+        std::lock_guard<std::mutex> lock(injection_mutex);
+        injected_tasks.push_back(task);
+        num_injected_tasks.fetch_add(1);
+    }
+    wake_sleeping_threads();
+}
+
+void TaskGroup::wait(bool help)
+{
+    while (m_pending.load(std::memory_order_acquire) > 0) {
+        uint64_t epoch = wake_epoch.load();
+        if (help && current_thread_index >= 0) {
+            Task *task = find_task(current_thread_index);
+            if (task != NULL) {
+                run_task(task, current_thread_index);
+                continue;
             }
         }
+        if (m_pending.load(std::memory_order_acquire) == 0) break;
+        sleep_unless_woken_since(epoch);
     }
-    std::cout << "Closed worker thread " << thread_index << "\n";
 }
 
-void parallel_for_2D(std::function<void(int,int,int)> f, const int &count_i, const int &count_j, bool use_main_thread)
+static void worker_thread(int thread_index)
 {
-    // If the main thread is not being used, and there there are worker threads, the main thread context returns to the caller.
-    // It is the caller's job to do 
+    std::cout << "Spawned worker thread " << thread_index << "\n";
+    current_thread_index = thread_index;
 
-    check_init();
-    // Create tasks for each of (i,j) for i:[0,count_i), j:[0,count_j).
-    // The worker threads will then grab them from the task stack.
-    // Each worker just return to waiting for a task, and this (the main thread)
-    // can detect when the task stack is empty.
-    //----Be careful with synchronization!
-    if (work != NULL) {
-        std::cerr << "ERROR: parallel_for_2D: Cannot start more work, multithreaded work is already being done.\n";
-        exit(EXIT_FAILURE);
-    }
-    if (threads.empty()) {
-        // No spawned threads (only the main thread). Just do exactly what
-        // this for loop should do, but single-threaded. (it may be a good way to test if multithreading is correct by spawning no threads
-        // and just doing this each time, and comparing).
-        for (int i = 0; i < count_i; i++) {
-            for (int j = 0; j < count_j; j++) {
-                f(i, j, 0);
-            }
+    // Spawned threads start here.
+    // They look for tasks (in their own deque, then in other threads'), and if there are none, sleep until
+    // something is spawned.
+    while (!threads_should_terminate.load()) {
+        uint64_t epoch = wake_epoch.load();
+        Task *task = find_task(thread_index);
+        if (task != NULL) {
+            run_task(task, thread_index);
+            continue;
+        }
+        // Work often comes in bursts (e.g. a tile finishing and the next render starting), so try again
+        // a few times before sleeping.
+        for (int attempt = 0; attempt < 32 && task == NULL; attempt++) {
+            std::this_thread::yield();
+            task = find_task(thread_index);
         }
+        if (task != NULL) {
+            run_task(task, thread_index);
+            continue;
+        }
+        sleep_unless_woken_since(epoch);
+    }
+    std::cout << "Closed worker thread " << thread_index << "\n";
+}
+
+void parallel_for(std::function<void(int,int,int)> f, int count, int grain_size)
+{
+    if (count <= 0) return;
+    if (grain_size < 1) grain_size = 1;
+    if (!threads_initialized || threads.empty() || count <= grain_size) {
+        f(0, count, max(current_thread_index, 0));
         return;
     }
-    // Create the new work.
-    Work new_work = Work(std::move(f), count_i, count_j); // why std::move?
-    // Acquire a lock on the global, shared work mutex.
-    // (threads also acquire locks on this, and attempt to get access to it for new work.)
+    // Halve the range, spawning the upper half and continuing with the lower half, until it is small enough.
+    // The biggest pieces are at the top of the deque, so a thief takes half of the remaining work at a time.
+    TaskGroup group;
+    std::function<void(int,int,int)> split = [&](int begin, int end, int thread_index) {
+        while (end - begin > grain_size) {
+            int mid = begin + (end - begin) / 2;
+            group.spawn([&split, mid, end](int task_thread_index) {
+                split(mid, end, task_thread_index);
+            });
+            end = mid;
+        }
+        f(begin, end, thread_index);
+    };
+    if (current_thread_index >= 0) {
+        split(0, count, current_thread_index);
+    } else {
+        group.spawn([&split, count](int task_thread_index) {
+            split(0, count, task_thread_index);
+        });
+    }
+    group.wait();
+}
+
 /*--------------------------------------------------------------------------------
-cppreference std::lock_guard
---------------------------------------------------------------------------------
-The class lock_guard is a mutex wrapper that provides a convenient RAII-style mechanism for owning a mutex for
-the duration of a scoped block. When a lock_guard object is created, it attempts to take ownership of
-the mutex it is given. When control leaves the scope in which the lock_guard object was created, the
-lock_guard is destructed and the mutex is released.  The lock_guard class is non-copyable.
+    Grid loops (such as over the tiles of an image) are not split into a task
+    per cell. Instead one task per thread is spawned, and each participating
+    thread takes the next chunk of cells from a shared atomic counter until
+    they run out. Handing out a cell is then a single fetch_add, and the only
+    other synchronization is the group's pending count, whose last decrement
+    wakes the waiting thread (if it is asleep).
 --------------------------------------------------------------------------------*/
-    {
-        std::lock_guard<std::mutex> lock(work_mutex);
-        // This thread should now own the mutex. It will be released when this block scope is exited.
-        // Set up the new work.
-        work = &new_work;
+struct IndexDispenser {
+    IndexDispenser(int _count, int _chunk_size) : next(0), count(_count), chunk_size(_chunk_size) {}
+    bool next_range(int *begin, int *end) {
+        int first = next.fetch_add(chunk_size, std::memory_order_relaxed);
+        if (first >= count) return false;
+        *begin = first;
+        *end = min(count, first + chunk_size);
+        return true;
     }
-    std::unique_lock<std::mutex> lock(work_mutex);
-    // Start the other threads.
+    std::atomic<int> next;
+    int count;
+    int chunk_size;
+};
 
-    if (use_main_thread) {
-        // Help out.
-        while (work != NULL && !work->finished()) {
-            // printf("GOING!\n");getchar();
-            // This thread holds the work mutex.
-            int index_i = work->next_index_i;
-            int index_j = work->next_index_j;
-            // The next task is the next cell in the grid.
-            work->step();
-            Work *my_work = work;
-            if (!work->work_available()) {
-                work = NULL;
-            }
-            my_work->active_workers ++;
-            
-            // Release the mutex, then do the work.
-            lock.unlock();
-            // This is the point where any worker thread can jump in and grab the lock.
-            my_work->f(index_i, index_j, 0);
-            // Afterward, halt and request access to the mutex again.
-            lock.lock();
-            
-            my_work->active_workers --;
+void parallel_for_2D(std::function<void(int,int,int)> f, const int &count_i, const int &count_j, bool use_main_thread, int chunk_size)
+{
+    // Evaluate f(i, j, thread_index) for i:[0,count_i), j:[0,count_j).
+    // If use_main_thread is false, the calling thread only waits for the work to be done by the worker threads.
+    check_init();
+    if (count_i <= 0 || count_j <= 0) return;
+    if (chunk_size < 1) chunk_size = 1;
+    int num_j = count_j;
+    int count = count_i * count_j;
+    if (threads.empty()) {
+        // No spawned threads (only the main thread). Just do exactly what this for loop should do, but single-threaded.
+        for (int index = 0; index < count; index++) {
+            f(index / num_j, index % num_j, max(current_thread_index, 0));
         }
-        // finished.
-        work = NULL;
-    } else {
-        work_condition_variable.notify_all();
-        // If not using the main thread, just return to caller.
+        return;
     }
+    IndexDispenser dispenser(count, chunk_size);
+    auto dispense = [&](int thread_index) {
+        int begin, end;
+        while (dispenser.next_range(&begin, &end)) {
+            for (int index = begin; index < end; index++) {
+                f(index / num_j, index % num_j, thread_index);
+            }
+        }
+    };
+    bool caller_helps = use_main_thread && current_thread_index >= 0;
+    int num_chunks = (count + chunk_size - 1) / chunk_size;
+    int num_tasks = min((int) threads.size() + (caller_helps ? 0 : 1), num_chunks - (caller_helps ? 1 : 0));
+    TaskGroup group;
+    for (int i = 0; i < num_tasks; i++) group.spawn(dispense);
+    if (caller_helps) dispense(current_thread_index);
+    group.wait(use_main_thread);
+}
+
+int num_parallel_threads()
+{
+    if (!threads_initialized) return 1;
+    return threads.size() + 1;
 }
 
 void init_multithreading(bool overriding, unsigned int override_num_threads)
@@ -263,6 +410,11 @@ void init_multithreading(bool overriding, unsigned int override_num_threads)
         // Do not exceed number of system cores.
         num_threads = override_num_threads;
     }
+    // The calling thread is the main thread, and owns deque 0.
+    current_thread_index = 0;
+    for (int i = 0; i < num_threads; i++) {
+        deques.push_back(new TaskDeque());
+    }
     for (int i = 0; i < num_threads-1; i++) {
         threads.push_back(std::thread(worker_thread, i+1)); //i+1 is the thread index (0 stands for the main thread).
     }
@@ -272,10 +424,12 @@ void close_multithreading()
 {
     check_init();
     threads_should_terminate = true;
-    work_condition_variable.notify_all(); // wake up threads so they can do the !threads_should_terminate check.
+    wake_sleeping_threads(); // wake up threads so they can do the !threads_should_terminate check.
     for (std::thread &thread : threads) {
         // This causes the thread context to reach the end of its function (worker_thread()).
         thread.join();
     }
+    // Any later parallel work is done by the calling thread alone.
+    threads.clear();
     std::cout << "Closed multithreading\n";
 }
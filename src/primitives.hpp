@@ -41,6 +41,22 @@ public:
     // to return false, and give an error on these so that further derived classes don't have to implement it themselves.
     virtual bool intersect(Ray &ray, Intersection *inter);
     virtual bool does_intersect(Ray &ray) const = 0;
+    // Intersect the active rays of a packet, returning the mask of the rays which hit. The hit rays have their
+    // max_t shortened and inters[lane] filled in, as intersect() does for a single ray.
+    // By default each ray is intersected in turn. Aggregates override this to traverse with the whole packet.
+    virtual uint32_t intersect_packet(RayPacket &packet, uint32_t active, Intersection *inters);
+    // Occlusion (any-hit) tests, for shadow rays. These stop at the first hit found, in no particular order,
+    // and give no hit information except for what was hit: the occluder is the innermost primitive found blocking the ray
+    // (for an aggregate, one of the primitives it holds), or NULL.
+    // By default this is this primitive if does_intersect() is true.
+    virtual const Primitive *occluder(Ray &ray) const;
+    // Test the active rays of a packet for occlusion, returning the mask of the blocked rays, with occluders[lane] set
+    // to what blocked each of them. By default each ray is tested in turn.
+    virtual uint32_t occluder_packet(RayPacket &packet, uint32_t active, const Primitive **occluders) const;
+    // Bound the parts of the primitive within box that are below and above a plane, as Shape::split_world_bound().
+    // By default the box is cut in two.
+    virtual void split_bound(const BoundingBox &box, int axis, float position,
+                             BoundingBox *below, BoundingBox *above) const;
 
     // Overridable functions.
     virtual bool can_intersect() const { return true; }
@@ -75,9 +91,30 @@ public:
     virtual bool does_intersect(Ray &ray) const {
         return shape->does_intersect(ray);
     }
+    virtual uint32_t occluder_packet(RayPacket &packet, uint32_t active, const Primitive **occluders) const {
+        uint32_t occluded = shape->does_intersect_packet(packet, active);
+        for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+            if (occluded & (1 << lane)) occluders[lane] = this;
+        }
+        return occluded;
+    }
+    virtual uint32_t intersect_packet(RayPacket &packet, uint32_t active, Intersection *inters) {
+        LocalGeometry geoms[RAY_PACKET_SIZE];
+        uint32_t hit = shape->intersect_packet(packet, active, geoms);
+        for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+            if (!(hit & (1 << lane))) continue;
+            inters[lane].geom = geoms[lane];
+            inters[lane].primitive = this;
+        }
+        return hit;
+    }
     virtual BoundingBox world_bound() const {
         return shape->world_bound();
     };
+    virtual void split_bound(const BoundingBox &box, int axis, float position,
+                             BoundingBox *below, BoundingBox *above) const {
+        shape->split_world_bound(box, axis, position, below, above);
+    }
     Shape *shape;
 
     // All that is used currently is a basic Phong lighting model.
@@ -35,6 +35,42 @@ bool Primitive::intersect(Ray &ray, Intersection *inter) {
     std::cerr << "ERROR: Unimplemented intersect() routine of primitive called.\n";
     exit(EXIT_FAILURE);
 }
+uint32_t Primitive::intersect_packet(RayPacket &packet, uint32_t active, Intersection *inters)
+{
+    uint32_t hit = 0;
+    for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+        if (!(active & (1 << lane))) continue;
+        Ray ray = packet.ray(lane);
+        if (intersect(ray, &inters[lane])) {
+            packet.max_t[lane] = ray.max_t;
+            hit |= 1 << lane;
+        }
+    }
+    return hit;
+}
+const Primitive *Primitive::occluder(Ray &ray) const
+{
+    return does_intersect(ray) ? this : NULL;
+}
+uint32_t Primitive::occluder_packet(RayPacket &packet, uint32_t active, const Primitive **occluders) const
+{
+    uint32_t occluded = 0;
+    for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+        if (!(active & (1 << lane))) continue;
+        Ray ray = packet.ray(lane);
+        const Primitive *blocker = occluder(ray);
+        if (blocker != NULL) {
+            occluders[lane] = blocker;
+            occluded |= 1 << lane;
+        }
+    }
+    return occluded;
+}
+void Primitive::split_bound(const BoundingBox &box, int axis, float position,
+                            BoundingBox *below, BoundingBox *above) const
+{
+    box.split(axis, position, below, above);
+}
 bool Aggregate::intersect(Ray &ray, Intersection *inter) {
     std::cerr << "ERROR: Unimplemented intersect() routine of aggregate called.\n";
     exit(EXIT_FAILURE);
@@ -3,6 +3,7 @@
 #include "core.hpp"
 #include "imaging.hpp"
 #include "scene.hpp"
+#include "statistics.hpp"
 
 // The Renderer can act as a coroutine, allowing for example progressive viewing.
 struct RenderingState {
@@ -41,6 +42,10 @@ public:
 
     Renderer(Scene *_scene, Camera *_camera, int horizontal_pixels, int supersample_width = 1) {
         rendering_should_yield = NULL;
+        m_wavefront = false;
+#if RENDER_STATS
+        m_render_stats = RenderStats();
+#endif
         scene = _scene;
         camera = _camera;
         m_supersample_width = supersample_width;
@@ -68,7 +73,20 @@ public:
     RenderingState render(bool use_blocks = false, int exit_subblock = 0) {
         render(RenderingState(), use_blocks, exit_subblock);
     }
+    // Render the whole image in one pass. In wavefront mode, this is done by render_wavefront().
     void render_direct();
+    // Render the whole image a bounce at a time, tracing sorted queues of rays (see renderer/wavefront.cpp).
+    // This gives the same image as render_direct.
+    void render_wavefront();
+    void set_wavefront(bool wavefront) {
+        m_wavefront = wavefront;
+    }
+#if RENDER_STATS
+    // The statistics of the last render_direct() (see statistics.hpp).
+    const RenderStats &last_render_stats() const {
+        return m_render_stats;
+    }
+#endif
 
     FrameBuffer downsampled_framebuffer();
     // Alternatively, downsample to a framebuffer provided by the caller.
@@ -111,6 +129,8 @@ public:
     void print_properties() const;
 
 private:
+    void render_tiles();
+
     // Renderer private data.
     int m_downsampled_horizontal_pixels;
     int m_downsampled_vertical_pixels;
@@ -125,6 +145,10 @@ private:
     int m_active_frame;
     std::vector<FrameBuffer> m_frames;
     bool (*rendering_should_yield)(); //= NULL?
+    bool m_wavefront;
+#if RENDER_STATS
+    RenderStats m_render_stats;
+#endif
 };
 
 
@@ -1,79 +1,77 @@
 #include "renderer.hpp"
 #include "multithreading.hpp"
+#include "renderer/shading.hpp"
+#include "statistics.hpp"
 
 using glm::normalize;
 using glm::cross;
 using glm::dot;
 
-// This does not include the primary camera ray.
-#define MAX_RECURSION 3
+// Trace camera rays in packets (see mathematics/ray_packet.hpp) in render_direct().
+// Secondary rays are always traced one at a time, since they go off in all directions.
+#define PACKET_PRIMARY_RAYS 1
+// With packets of camera rays, also trace the shadow rays from their hits to each light in packets.
+#define PACKET_SHADOW_RAYS 1
+
+static RGB ray_trace(Ray &ray, Scene *scene, Primitive *root_primitive, OcclusionCache *cache, int recursion_level = 0,
+                     RayType type = RAY_PRIMARY);
+
+// Compute the color seen along a ray which hit something (see shading.hpp).
+// If unoccluded_lanes is given, the shadow rays from this hit have already been traced in packets,
+// and bit lane of the entry for each light tells whether that light is visible.
+static RGB shade(Ray &ray, Intersection &inter, Scene *scene, Primitive *root_primitive, OcclusionCache *cache,
+                 int recursion_level, const uint32_t *unoccluded_lanes = NULL, int lane = 0)
+{
+    GeometricPrimitive *hit_primitive = inter.primitive;
+    LocalGeometry &geom = inter.geom;
+
+    Vector &n = geom.n; //--need to normalize? Should just leave it to the primitive.
+    RGB color = ambient_color;
+    // Compute direct lighting.
+    for (int light_index = 0; light_index < scene->lights.size(); light_index++) {
+        Vector light_vector;
+        VisibilityTester visibility_tester;
+        RGB light_radiance = scene->lights[light_index]->radiance(geom.p, &light_vector, &visibility_tester);
+        bool unoccluded = unoccluded_lanes != NULL ? (unoccluded_lanes[light_index] >> lane) & 1
+                                                   : visibility_tester.unoccluded(root_primitive, cache, light_index);
+        if (unoccluded) {
+            color += light_contribution(light_radiance, light_vector, n);
+        }
+    }
+    float r = hit_primitive->reflectiveness;
+    color *= diffuse_color(hit_primitive, geom);
+
+    // Reflection
+    if (recursion_level < MAX_RECURSION && r > 0) {
+        Ray reflected = reflected_ray(ray, geom);
+        color += r * ray_trace(reflected, scene, root_primitive, cache, recursion_level + 1, RAY_REFLECTION);
+    }
+    // Refraction
+    float eta = hit_primitive->refractive_index;
+    if (recursion_level < MAX_RECURSION && eta > 0) {
+        Ray refracted = refracted_ray(ray, geom, eta);
+        Intersection exit_inter;
+        RENDER_STATS_ADD(rays[RAY_REFRACTION], 1);
+        if (hit_primitive->intersect(refracted, &exit_inter)) {
+            RENDER_STATS_ADD(ray_hits[RAY_REFRACTION], 1);
+            Ray exit = exit_ray(refracted, exit_inter.geom, eta);
+            color += ray_trace(exit, scene, root_primitive, cache, recursion_level + 1, RAY_REFRACTION);
+        }
+    }
+    return color;
+}
 
 // Trace a ray through the primitive (probably the scene itself,
 // but since the scene is a primitive, why not allow this to be any primitive).
-static RGB ray_trace(Ray &ray, Scene *scene, Primitive *root_primitive, int recursion_level = 0)
+static RGB ray_trace(Ray &ray, Scene *scene, Primitive *root_primitive, OcclusionCache *cache, int recursion_level,
+                     RayType type)
 {
     Intersection inter;
+    RENDER_STATS_ADD(rays[type], 1);
     if (root_primitive->intersect(ray, &inter)) {
-
-        GeometricPrimitive *hit_primitive = inter.primitive;
-        LocalGeometry &geom = inter.geom;
-
-        Vector &n = geom.n; //--need to normalize? Should just leave it to the primitive.
-        // Initialize the returned color to an ambient (hack) term.
-        RGB ambient(0.1,0.1,0.1);
-        RGB color = ambient;
-        // Compute direct lighting.
-        for (Light *light : scene->lights) {
-            Vector light_vector;
-            VisibilityTester visibility_tester;
-            RGB light_radiance = light->radiance(geom.p, &light_vector, &visibility_tester);
-            if (visibility_tester.unoccluded(root_primitive)) {
-                float cos_theta = glm::dot(light_vector, n);
-                color += light_radiance * (cos_theta < 0 ? 0 : cos_theta);
-            }
-        }
-        float r = hit_primitive->reflectiveness;
-        RGB diffuse_color = (1 - r) * hit_primitive->diffuse_texture->rgb_lookup(geom);
-        color *= diffuse_color;
-
-        // Reflection
-        if (recursion_level < MAX_RECURSION && r > 0) {
-            Vector reflected_dir = ray.d - 2*glm::dot(ray.d, geom.n)*geom.n;
-            const float epsilon = 1e-3;
-            Ray reflected_ray(geom.p+epsilon*reflected_dir, reflected_dir);
-            color += r * ray_trace(reflected_ray, scene, root_primitive, recursion_level + 1);
-        }
-        // Refraction
-        #if 1
-        float eta = hit_primitive->refractive_index;
-        if (recursion_level < MAX_RECURSION && eta > 0) {
-            float inv_eta = 1.0 / eta;
-
-            Vector e = -glm::normalize(glm::cross(glm::cross(geom.n,ray.d), geom.n));
-            float sinthetap = inv_eta * glm::dot(glm::normalize(ray.d), e);
-            float costhetap = sqrt(1 - sinthetap*sinthetap);
-            Vector refracted_direction = sinthetap*e - costhetap*geom.n;
-            const float epsilon = 1e-3;
-            Ray refracted_ray(geom.p+epsilon*refracted_direction, refracted_direction);
-            Intersection exit_inter;
-	    // It is assumed refractive surfaces are closed. Ignore refraction in the case that the ray doesn't exit.
-            if (hit_primitive->intersect(refracted_ray, &exit_inter)) {
-                LocalGeometry &e_geom = exit_inter.geom;
-                e = normalize(cross(e_geom.n, cross(refracted_ray.d, e_geom.n)));
-                sinthetap = eta * dot(normalize(refracted_ray.d), e);
-                costhetap = sqrt(1 - sinthetap*sinthetap);
-
-                Vector exit_direction = sinthetap*e + costhetap*e_geom.n;
-                Ray exit_ray = Ray(e_geom.p+epsilon*exit_direction, exit_direction);
-                color += ray_trace(exit_ray, scene, root_primitive, recursion_level + 1);
-                // Ray exit_ray(exit_inter.geom.p+refracted_ray.d*epsilon, refracted_ray.d);
-                // color += ray_trace(exit_ray, scene, root_primitive, recursion_level + 1);
-            }
-        }
-        #endif
-        return color;
+        RENDER_STATS_ADD(ray_hits[type], 1);
+        return shade(ray, inter, scene, root_primitive, cache, recursion_level);
     } else {
-        const RGB background_color(0.97, 0.7, 0.96);
         return background_color;
     }
 }
@@ -118,6 +116,22 @@ void Renderer::write_to_ppm(std::string const &filename)
 
 // This render function is intended for just rendering an image in one pass.
 void Renderer::render_direct()
+{
+#if RENDER_STATS
+    reset_render_stats();
+#endif
+    if (m_wavefront) {
+        render_wavefront();
+    } else {
+        render_tiles();
+    }
+#if RENDER_STATS
+    m_render_stats = render_stats();
+#endif
+}
+
+// Render the image in tiles, tracing the secondary rays of each camera ray depth-first.
+void Renderer::render_tiles()
 {
     int width = pixels_x();
     int height = pixels_y();
@@ -131,6 +145,8 @@ void Renderer::render_direct()
     Vector camera_down_extent = camera->imaging_plane_height() * camera->camera_to_world(Vector(0,-1,0));
     Point origin = camera->position();
     Vector shifted_camera_top_left = camera->lens_point(0,1) - origin;
+    int num_lights = scene->lights.size();
+    vector<OcclusionCache> occlusion_caches(num_parallel_threads(), OcclusionCache(num_lights));
 
     // Iterate over all i,j pairs, i:[0,tiles_x), j:[0,tiles_y).
     // This is done with parallel_for_2D, so that if multithreading is available,
@@ -147,7 +163,57 @@ void Renderer::render_direct()
        int x1 = min(width, tile_size * (tile_i + 1));
        int y0 = tile_size * tile_j;
        int y1 = min(height, tile_size * (tile_j + 1));
+       OcclusionCache *cache = &occlusion_caches[thread_index];
+
+#if PACKET_PRIMARY_RAYS
+       vector<uint32_t> unoccluded_lanes(num_lights);
+       // Loop over blocks of pixels, tracing a packet of camera rays for each.
+       for (int i = x0; i < x1; i += RAY_PACKET_WIDTH) {
+           for (int j = y0; j < y1; j += RAY_PACKET_HEIGHT) {
+               // Generate the rays. Lanes for pixels past the edge of the tile are left inactive.
+               RayPacket packet = RayPacket();
+               uint32_t active = 0;
+               for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+                   int pi = i + lane % RAY_PACKET_WIDTH;
+                   int pj = j + lane / RAY_PACKET_WIDTH;
+                   if (pi >= x1 || pj >= y1) continue;
+                   float x = pixels_x_inv() * pi;
+                   float y = pixels_y_inv() * pj;
+                   packet.set(lane, Ray(origin, shifted_camera_top_left + x*camera_right_extent + y*camera_down_extent));
+                   active |= 1 << lane;
+               }
+               Intersection inters[RAY_PACKET_SIZE];
+               uint32_t hit = scene->intersect_packet(packet, active, inters);
+               RENDER_STATS_ADD(rays[RAY_PRIMARY], RayPacket::num_rays(active));
+               RENDER_STATS_ADD(ray_hits[RAY_PRIMARY], RayPacket::num_rays(hit));
 
+#if PACKET_SHADOW_RAYS
+               // The shadow rays of neighbouring hits to the same light are also coherent, so they are traced in packets too.
+               for (int light_index = 0; light_index < num_lights; light_index++) {
+                   VisibilityTester visibility_testers[RAY_PACKET_SIZE];
+                   for (uint32_t lanes = hit; lanes != 0; lanes &= lanes - 1) {
+                       int lane = __builtin_ctz(lanes);
+                       Vector light_vector;
+                       scene->lights[light_index]->radiance(inters[lane].geom.p, &light_vector, &visibility_testers[lane]);
+                   }
+                   unoccluded_lanes[light_index] = unoccluded_packet(scene, visibility_testers, hit, cache, light_index);
+               }
+               const uint32_t *shadow_results = unoccluded_lanes.data();
+#else
+               const uint32_t *shadow_results = NULL;
+#endif
+
+               // Shade each ray (secondary rays are traced one at a time), and update the pixel colors.
+               for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+                   if (!(active & (1 << lane))) continue;
+                   Ray ray = packet.ray(lane);
+                   RGB color = (hit & (1 << lane)) ? shade(ray, inters[lane], scene, scene, cache, 0, shadow_results, lane)
+                                                   : background_color;
+                   set_pixel(i + lane % RAY_PACKET_WIDTH, j + lane / RAY_PACKET_WIDTH, color);
+               }
+           }
+       }
+#else
        // Loop over the pixels (this is the single-thread task).
        for (int i = x0; i < x1; i++) {
            for (int j = y0; j < y1; j++) {
@@ -157,12 +223,13 @@ void Renderer::render_direct()
                Ray ray(origin, shifted_camera_top_left + x*camera_right_extent + y*camera_down_extent);
 
                // Ray trace.
-               RGB color = ray_trace(ray, scene, scene);
+               RGB color = ray_trace(ray, scene, scene, cache);
 
                // Update the pixel color.
                set_pixel(i, j, color);
            }
        }
+#endif
     }, tiles_x, tiles_y);
 }
 
@@ -199,6 +266,7 @@ RenderingState Renderer::render(RenderingState state, bool use_blocks, int exit_
     bool i_entered = false;
     bool j_entered = false;
     bool pj_entered = false;
+    OcclusionCache cache(scene->lights.size());
     
     // A lot of complication in the loop is here because it needs to act as a coroutine,
     // and also scatter rendered pixels giving an image of increasing resolution without double-tracing
@@ -219,7 +287,7 @@ RenderingState Renderer::render(RenderingState state, bool use_blocks, int exit_
                     Ray ray(origin, p - origin);
 
                     // Ray trace.
-                    RGB color = ray_trace(ray, scene, scene);
+                    RGB color = ray_trace(ray, scene, scene, &cache);
 
                     // Update the pixel or block of pixels.
                     if (use_blocks) set_pixel_block(i, j, i+sizes[pi]-1, j+sizes[pi]-1, color);
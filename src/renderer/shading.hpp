@@ -0,0 +1,69 @@
+#ifndef RENDERER_SHADING_H
+#define RENDERER_SHADING_H
+#include "renderer.hpp"
+
+/*--------------------------------------------------------------------------------
+    The shading model, shared by the recursive renderer (renderer.cpp) and the
+    wavefront renderer (wavefront.cpp). Both must give the same images, so the
+    arithmetic for the colors and the secondary rays lives here only once.
+
+    The color seen along a ray that hits a surface is
+        (ambient + sum of unoccluded light contributions) * (1 - r) * texture
+            + r * (color seen along the reflected ray)
+            + (color seen along the ray leaving through the far side of a refractive primitive),
+    added up in this order. Rays that hit nothing see the background color.
+--------------------------------------------------------------------------------*/
+// This does not include the primary camera ray.
+#define MAX_RECURSION 3
+
+static const RGB background_color(0.97, 0.7, 0.96);
+// Initialize the color at a hit to an ambient (hack) term.
+static const RGB ambient_color(0.1,0.1,0.1);
+
+// The light reaching a surface point from a light source, if it is not occluded.
+static inline RGB light_contribution(const RGB &light_radiance, const Vector &light_vector, const Vector &n)
+{
+    float cos_theta = glm::dot(light_vector, n);
+    return light_radiance * (cos_theta < 0 ? 0 : cos_theta);
+}
+
+static inline RGB diffuse_color(const GeometricPrimitive *hit_primitive, const LocalGeometry &geom)
+{
+    float r = hit_primitive->reflectiveness;
+    return (1 - r) * hit_primitive->diffuse_texture->rgb_lookup(geom);
+}
+
+static inline Ray reflected_ray(const Ray &ray, const LocalGeometry &geom)
+{
+    Vector reflected_dir = ray.d - 2*glm::dot(ray.d, geom.n)*geom.n;
+    const float epsilon = 1e-3;
+    return Ray(geom.p+epsilon*reflected_dir, reflected_dir);
+}
+
+// The ray going into a refractive primitive. It is assumed refractive surfaces are closed, and this is intersected
+// with the hit primitive alone to find where it leaves (refraction is ignored in the case that the ray doesn't exit).
+static inline Ray refracted_ray(const Ray &ray, const LocalGeometry &geom, float eta)
+{
+    float inv_eta = 1.0 / eta;
+
+    Vector e = -glm::normalize(glm::cross(glm::cross(geom.n,ray.d), geom.n));
+    float sinthetap = inv_eta * glm::dot(glm::normalize(ray.d), e);
+    float costhetap = sqrt(1 - sinthetap*sinthetap);
+    Vector refracted_direction = sinthetap*e - costhetap*geom.n;
+    const float epsilon = 1e-3;
+    return Ray(geom.p+epsilon*refracted_direction, refracted_direction);
+}
+
+// The ray leaving a refractive primitive, given where the refracted ray hit it from the inside.
+static inline Ray exit_ray(const Ray &refracted_ray, const LocalGeometry &e_geom, float eta)
+{
+    Vector e = glm::normalize(glm::cross(e_geom.n, glm::cross(refracted_ray.d, e_geom.n)));
+    float sinthetap = eta * glm::dot(glm::normalize(refracted_ray.d), e);
+    float costhetap = sqrt(1 - sinthetap*sinthetap);
+
+    Vector exit_direction = sinthetap*e + costhetap*e_geom.n;
+    const float epsilon = 1e-3;
+    return Ray(e_geom.p+epsilon*exit_direction, exit_direction);
+}
+
+#endif // RENDERER_SHADING_H
@@ -0,0 +1,425 @@
+#include "renderer.hpp"
+#include "multithreading.hpp"
+#include "renderer/shading.hpp"
+#include "statistics.hpp"
+
+/*--------------------------------------------------------------------------------
+    Wavefront rendering.
+    Instead of following the tree of secondary rays from each camera ray
+    depth-first (as ray_trace does), each bounce is done for the whole image at
+    once, as separate stages over large queues of rays:
+        extension rays:  the camera rays, then the reflected rays and the rays leaving refractive primitives.
+        shadow rays:     one per light for each hit, only tested for occlusion, in packets of rays to the same light.
+        refraction rays: rays going into a refractive primitive, intersected with that primitive alone.
+    Rays traced one after the other should visit the same parts of the scene (which
+    are then in cache), so camera rays are traced in blocks of pixels, and the other
+    queues can be sorted by a Morton code of the ray origins and directions
+    (see WAVEFRONT_SORT_RAYS). Extension rays are traced in packets of neighbours
+    in this order.
+
+    The colors are combined at the end, from the deepest bounce up, with the same
+    arithmetic in the same order as the recursive renderer (see shading.hpp), so
+    the images are the same.
+--------------------------------------------------------------------------------*/
+// Sort the queues of secondary rays before tracing them. Otherwise they are traced in the order they were made in,
+// which follows the image, since every ray comes from a camera ray through specular bounces. On the test scenes
+// this order was as coherent as the sorted order, and the sort cost more than it saved, so this is off by default.
+// (Sorting should pay off with incoherent bounces, such as diffuse ones.)
+#define WAVEFRONT_SORT_RAYS 0
+// Rays are sorted and traced in chunks of this many, so that the work can be shared between threads.
+#define WAVEFRONT_CHUNK_SIZE 4096
+
+// What an extension ray hit. Once resolved, color is the color seen along the ray.
+struct WavefrontRecord {
+    RGB color;
+    RGB diffuse;
+    float reflectiveness;
+    // The shadow rays of the lights at the hit, in the order of the lights.
+    int first_shadow_ray;
+    int num_shadow_rays;
+    // Indices of the child rays in the next bounce's queue, or -1.
+    int reflection;
+    int refraction;
+};
+struct ShadowRay {
+    VisibilityTester visibility_tester;
+    RGB contribution; // Added to the color of the record if the ray is unoccluded.
+    int light; // Index into the scene's lights.
+    int record;
+};
+struct SecondaryRay {
+    Ray ray;
+    int record;
+};
+struct RefractionRay {
+    Ray ray;
+    GeometricPrimitive *primitive;
+    int record;
+};
+// The rays spawned by the hits in one chunk of an extension ray queue.
+struct WavefrontShadingOutput {
+    vector<ShadowRay> shadow_rays;
+    vector<SecondaryRay> reflected_rays;
+    vector<RefractionRay> refraction_rays;
+};
+
+#if WAVEFRONT_SORT_RAYS
+// Spread the low 10 bits of v out to every third bit.
+static inline uint64_t morton_expand_bits(uint32_t v)
+{
+    uint64_t x = v & 0x3FF;
+    x = (x | (x << 16)) & 0x030000FF;
+    x = (x | (x << 8)) & 0x0300F00F;
+    x = (x | (x << 4)) & 0x030C30C3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+}
+static inline uint64_t morton_code(float x, float y, float z)
+{
+    // x, y and z are in [0, 1].
+    uint32_t ix = (uint32_t) min(max(x * 1024.f, 0.f), 1023.f);
+    uint32_t iy = (uint32_t) min(max(y * 1024.f, 0.f), 1023.f);
+    uint32_t iz = (uint32_t) min(max(z * 1024.f, 0.f), 1023.f);
+    return (morton_expand_bits(ix) << 2) | (morton_expand_bits(iy) << 1) | morton_expand_bits(iz);
+}
+
+// The sort key of a ray is a Morton code of its origin (in the scene's box) followed by a Morton code of its direction.
+static inline uint64_t ray_sort_key(const Ray &ray, const Point &box_min, const Vector &inv_extent)
+{
+    Vector o = (ray.o - box_min) * inv_extent;
+    Vector d = 0.5f * glm::normalize(ray.d) + Vector(0.5f);
+    return (morton_code(o.x, o.y, o.z) << 30) | morton_code(d.x, d.y, d.z);
+}
+
+struct RaySortKey {
+    uint64_t key;
+    uint32_t index;
+};
+// Sort the 60-bit keys with a least-significant-digit radix sort, 15 bits at a time.
+static void radix_sort(vector<RaySortKey> &keys)
+{
+    const int digit_bits = 15;
+    const int num_buckets = 1 << digit_bits;
+    if (keys.size() < num_buckets) {
+        std::sort(keys.begin(), keys.end(), [](const RaySortKey &a, const RaySortKey &b) { return a.key < b.key; });
+        return;
+    }
+    vector<RaySortKey> sorted(keys.size());
+    vector<uint32_t> bucket_starts(num_buckets);
+    for (int shift = 0; shift < 60; shift += digit_bits) {
+        std::fill(bucket_starts.begin(), bucket_starts.end(), 0);
+        for (const RaySortKey &key : keys) bucket_starts[(key.key >> shift) & (num_buckets - 1)] ++;
+        uint32_t start = 0;
+        for (int bucket = 0; bucket < num_buckets; bucket++) {
+            uint32_t count = bucket_starts[bucket];
+            bucket_starts[bucket] = start;
+            start += count;
+        }
+        for (const RaySortKey &key : keys) sorted[bucket_starts[(key.key >> shift) & (num_buckets - 1)] ++] = key;
+        keys.swap(sorted);
+    }
+}
+#endif
+
+// Return the order in which to trace rays, given how to get the i'th ray.
+template <typename GET_RAY>
+static vector<uint32_t> sorted_ray_order(int num_rays, const GET_RAY &get_ray, const BoundingBox &box)
+{
+    vector<uint32_t> order(num_rays);
+#if WAVEFRONT_SORT_RAYS
+    Point box_min = box.corners[0];
+    Vector extent = box.corners[1] - box.corners[0];
+    Vector inv_extent;
+    for (int i = 0; i < 3; i++) inv_extent[i] = extent[i] > 0 && extent[i] < INFINITY ? 1.f / extent[i] : 0.f;
+
+    vector<RaySortKey> keys(num_rays);
+    parallel_for([&](int begin, int end, int) {
+        for (int i = begin; i < end; i++) {
+            keys[i].key = ray_sort_key(get_ray(i), box_min, inv_extent);
+            keys[i].index = i;
+        }
+    }, num_rays, WAVEFRONT_CHUNK_SIZE);
+    radix_sort(keys);
+    for (int i = 0; i < num_rays; i++) order[i] = keys[i].index;
+#else
+    for (int i = 0; i < num_rays; i++) order[i] = i;
+#endif
+    return order;
+}
+
+// Camera rays from a pinhole camera are already coherent in the image, so they don't need to be sorted.
+// They are traced in the same order as by render_direct, in packets of blocks of pixels within square tiles.
+static vector<uint32_t> camera_ray_order(int width, int height)
+{
+    const int tile_size = 32;
+    vector<uint32_t> order;
+    order.reserve(width * height);
+    for (int x0 = 0; x0 < width; x0 += tile_size) {
+        for (int y0 = 0; y0 < height; y0 += tile_size) {
+            int x1 = min(width, x0 + tile_size);
+            int y1 = min(height, y0 + tile_size);
+            for (int i = x0; i < x1; i += RAY_PACKET_WIDTH) {
+                for (int j = y0; j < y1; j += RAY_PACKET_HEIGHT) {
+                    for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+                        int pi = i + lane % RAY_PACKET_WIDTH;
+                        int pj = j + lane / RAY_PACKET_WIDTH;
+                        if (pi < x1 && pj < y1) order.push_back(pi * height + pj);
+                    }
+                }
+            }
+        }
+    }
+    return order;
+}
+
+// Find the closest hits of the rays, tracing packets of consecutive rays in the sorted order.
+// After the camera rays, the first num_reflected_rays rays are reflected rays, and the rest leave refractive primitives.
+static void trace_extension_rays(Scene *scene, int recursion_level, int num_reflected_rays, vector<Ray> &rays,
+                                 const vector<uint32_t> &order, vector<Intersection> &inters, vector<uint8_t> &hit)
+{
+    int num_rays = rays.size();
+    int num_packets = (num_rays + RAY_PACKET_SIZE - 1) / RAY_PACKET_SIZE;
+    parallel_for([&](int begin, int end, int) {
+        for (int p = begin; p < end; p++) {
+            RayPacket packet = RayPacket();
+            uint32_t active = 0;
+            for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+                int k = p * RAY_PACKET_SIZE + lane;
+                if (k >= num_rays) break;
+                packet.set(lane, rays[order[k]]);
+                active |= 1 << lane;
+            }
+            Intersection packet_inters[RAY_PACKET_SIZE];
+            uint32_t packet_hit = scene->intersect_packet(packet, active, packet_inters);
+            for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+                if (!(active & (1 << lane))) continue;
+                int index = order[p * RAY_PACKET_SIZE + lane];
+                hit[index] = (packet_hit >> lane) & 1;
+#if RENDER_STATS
+                RayType type = recursion_level == 0 ? RAY_PRIMARY : index < num_reflected_rays ? RAY_REFLECTION : RAY_REFRACTION;
+                RENDER_STATS_ADD(rays[type], 1);
+                RENDER_STATS_ADD(ray_hits[type], hit[index]);
+#endif
+                if (hit[index]) {
+                    inters[index] = packet_inters[lane];
+                    rays[index].max_t = packet.max_t[lane];
+                }
+            }
+        }
+    }, num_packets, WAVEFRONT_CHUNK_SIZE / RAY_PACKET_SIZE);
+}
+
+// Stably reorder the shadow rays so that the rays to each light are together.
+static vector<uint32_t> group_shadow_rays_by_light(const vector<uint32_t> &order, const vector<ShadowRay> &shadow_rays,
+                                                   int num_lights)
+{
+    if (num_lights <= 1) return order;
+    vector<uint32_t> light_starts(num_lights + 1, 0);
+    for (uint32_t index : order) light_starts[shadow_rays[index].light + 1] ++;
+    for (int light_index = 0; light_index < num_lights; light_index++) light_starts[light_index + 1] += light_starts[light_index];
+    vector<uint32_t> grouped(order.size());
+    for (uint32_t index : order) grouped[light_starts[shadow_rays[index].light] ++] = index;
+    return grouped;
+}
+
+// Start the records of the extension rays, and generate the shadow, reflected and refraction rays from the hits.
+static void shade_hits(Scene *scene, int recursion_level, const vector<Ray> &rays,
+                       const vector<Intersection> &inters, const vector<uint8_t> &hit,
+                       vector<WavefrontRecord> &records, vector<WavefrontShadingOutput> &outputs)
+{
+    int num_rays = rays.size();
+    int num_chunks = (num_rays + WAVEFRONT_CHUNK_SIZE - 1) / WAVEFRONT_CHUNK_SIZE;
+    outputs = vector<WavefrontShadingOutput>(num_chunks);
+    parallel_for([&](int first_chunk, int last_chunk, int) {
+        for (int chunk = first_chunk; chunk < last_chunk; chunk++) {
+            WavefrontShadingOutput &output = outputs[chunk];
+            int end = min(num_rays, (chunk + 1) * WAVEFRONT_CHUNK_SIZE);
+            for (int index = chunk * WAVEFRONT_CHUNK_SIZE; index < end; index++) {
+                WavefrontRecord &record = records[index];
+                // The first shadow ray is relative to this chunk's output until the outputs are put together.
+                record.first_shadow_ray = output.shadow_rays.size();
+                record.num_shadow_rays = 0;
+                record.reflection = -1;
+                record.refraction = -1;
+                if (!hit[index]) {
+                    record.color = background_color;
+                    record.reflectiveness = 0;
+                    continue;
+                }
+                GeometricPrimitive *hit_primitive = inters[index].primitive;
+                const LocalGeometry &geom = inters[index].geom;
+                record.color = ambient_color;
+                record.diffuse = diffuse_color(hit_primitive, geom);
+                record.reflectiveness = hit_primitive->reflectiveness;
+                for (int light_index = 0; light_index < scene->lights.size(); light_index++) {
+                    ShadowRay shadow_ray;
+                    Vector light_vector;
+                    RGB light_radiance = scene->lights[light_index]->radiance(geom.p, &light_vector, &shadow_ray.visibility_tester);
+                    shadow_ray.contribution = light_contribution(light_radiance, light_vector, geom.n);
+                    // Adding zero would not change the color, so there is no need to test for occlusion.
+                    const RGB &c = shadow_ray.contribution;
+                    if (c.x == 0 && c.y == 0 && c.z == 0) continue;
+                    shadow_ray.light = light_index;
+                    shadow_ray.record = index;
+                    output.shadow_rays.push_back(shadow_ray);
+                    record.num_shadow_rays ++;
+                }
+                if (recursion_level < MAX_RECURSION && record.reflectiveness > 0) {
+                    SecondaryRay reflected;
+                    reflected.ray = reflected_ray(rays[index], geom);
+                    reflected.record = index;
+                    output.reflected_rays.push_back(reflected);
+                }
+                float eta = hit_primitive->refractive_index;
+                if (recursion_level < MAX_RECURSION && eta > 0) {
+                    RefractionRay refracted;
+                    refracted.ray = refracted_ray(rays[index], geom, eta);
+                    refracted.primitive = hit_primitive;
+                    refracted.record = index;
+                    output.refraction_rays.push_back(refracted);
+                }
+            }
+        }
+    }, num_chunks);
+}
+
+void Renderer::render_wavefront()
+{
+    int width = pixels_x();
+    int height = pixels_y();
+    BoundingBox scene_box = scene->world_bound();
+    int num_lights = scene->lights.size();
+    vector<OcclusionCache> occlusion_caches(num_parallel_threads(), OcclusionCache(num_lights));
+
+    Vector camera_right_extent = camera->imaging_plane_width() * camera->camera_to_world(Vector(1,0,0));
+    Vector camera_down_extent = camera->imaging_plane_height() * camera->camera_to_world(Vector(0,-1,0));
+    Point origin = camera->position();
+    Vector shifted_camera_top_left = camera->lens_point(0,1) - origin;
+
+    // The camera rays are the first extension rays, with the ray for pixel (i, j) at index i*height + j.
+    vector<Ray> rays(width * height);
+    parallel_for([&](int begin, int end, int) {
+        for (int index = begin; index < end; index++) {
+            float x = pixels_x_inv() * (index / height);
+            float y = pixels_y_inv() * (index % height);
+            rays[index] = Ray(origin, shifted_camera_top_left + x*camera_right_extent + y*camera_down_extent);
+        }
+    }, width * height, WAVEFRONT_CHUNK_SIZE);
+
+    // The records of each bounce are kept until the colors are resolved.
+    vector<vector<WavefrontRecord>> bounces;
+    int num_reflected_rays = 0; // How many of the rays after the camera rays are reflected (they come first).
+    for (int recursion_level = 0; !rays.empty(); recursion_level++) {
+        int num_rays = rays.size();
+        bounces.push_back(vector<WavefrontRecord>(num_rays));
+        vector<WavefrontRecord> &records = bounces.back();
+
+        // Trace the extension rays.
+        vector<Intersection> inters(num_rays);
+        vector<uint8_t> hit(num_rays);
+        vector<uint32_t> order = recursion_level == 0 ? camera_ray_order(width, height)
+                                                      : sorted_ray_order(num_rays, [&](int i) -> const Ray & { return rays[i]; }, scene_box);
+        trace_extension_rays(scene, recursion_level, num_reflected_rays, rays, order, inters, hit);
+
+        // Shade the hits, collecting the new rays.
+        vector<WavefrontShadingOutput> outputs;
+        shade_hits(scene, recursion_level, rays, inters, hit, records, outputs);
+        vector<ShadowRay> shadow_rays;
+        vector<RefractionRay> refraction_rays;
+        vector<Ray> next_rays;
+        int num_shadow_rays = 0;
+        int num_refraction_rays = 0;
+        num_reflected_rays = 0;
+        for (const WavefrontShadingOutput &output : outputs) {
+            num_shadow_rays += output.shadow_rays.size();
+            num_refraction_rays += output.refraction_rays.size();
+            num_reflected_rays += output.reflected_rays.size();
+        }
+        shadow_rays.reserve(num_shadow_rays);
+        refraction_rays.reserve(num_refraction_rays);
+        next_rays.reserve(num_reflected_rays + num_refraction_rays);
+        for (int chunk = 0; chunk < outputs.size(); chunk++) {
+            WavefrontShadingOutput &output = outputs[chunk];
+            int end = min(num_rays, (chunk + 1) * WAVEFRONT_CHUNK_SIZE);
+            for (int index = chunk * WAVEFRONT_CHUNK_SIZE; index < end; index++) {
+                records[index].first_shadow_ray += shadow_rays.size();
+            }
+            shadow_rays.insert(shadow_rays.end(), output.shadow_rays.begin(), output.shadow_rays.end());
+            refraction_rays.insert(refraction_rays.end(), output.refraction_rays.begin(), output.refraction_rays.end());
+            for (const SecondaryRay &reflected : output.reflected_rays) {
+                records[reflected.record].reflection = next_rays.size();
+                next_rays.push_back(reflected.ray);
+            }
+        }
+        outputs.clear();
+
+        // Trace the shadow rays, and finish the local color of each hit.
+        // The rays are grouped by light (keeping their order within each group), and runs of rays to the same light
+        // are traced as packets, with a per-thread cache of the last occluder of each light.
+        vector<uint8_t> unoccluded(num_shadow_rays);
+        order = sorted_ray_order(num_shadow_rays, [&](int i) -> const Ray & { return shadow_rays[i].visibility_tester.ray; }, scene_box);
+        order = group_shadow_rays_by_light(order, shadow_rays, num_lights);
+        parallel_for([&](int begin, int end, int thread_index) {
+            OcclusionCache *cache = &occlusion_caches[thread_index];
+            for (int k = begin; k < end; ) {
+                int light_index = shadow_rays[order[k]].light;
+                VisibilityTester visibility_testers[RAY_PACKET_SIZE];
+                uint32_t active = 0;
+                int n = 0;
+                for (; n < RAY_PACKET_SIZE && k + n < end && shadow_rays[order[k+n]].light == light_index; n++) {
+                    visibility_testers[n] = shadow_rays[order[k+n]].visibility_tester;
+                    active |= 1 << n;
+                }
+                uint32_t unoccluded_lanes = unoccluded_packet(scene, visibility_testers, active, cache, light_index);
+                for (int lane = 0; lane < n; lane++) unoccluded[order[k+lane]] = (unoccluded_lanes >> lane) & 1;
+                k += n;
+            }
+        }, num_shadow_rays, WAVEFRONT_CHUNK_SIZE);
+        parallel_for([&](int begin, int end, int) {
+            for (int index = begin; index < end; index++) {
+                WavefrontRecord &record = records[index];
+                if (!hit[index]) continue;
+                for (int s = record.first_shadow_ray; s < record.first_shadow_ray + record.num_shadow_rays; s++) {
+                    if (unoccluded[s]) record.color += shadow_rays[s].contribution;
+                }
+                record.color *= record.diffuse;
+            }
+        }, num_rays, WAVEFRONT_CHUNK_SIZE);
+
+        // Trace the refraction rays through their primitives, giving the rays that leave them.
+        vector<Intersection> exit_inters(num_refraction_rays);
+        vector<uint8_t> exited(num_refraction_rays);
+        order = sorted_ray_order(num_refraction_rays, [&](int i) -> const Ray & { return refraction_rays[i].ray; }, scene_box);
+        parallel_for([&](int begin, int end, int) {
+            for (int k = begin; k < end; k++) {
+                RefractionRay &refracted = refraction_rays[order[k]];
+                exited[order[k]] = refracted.primitive->intersect(refracted.ray, &exit_inters[order[k]]);
+                RENDER_STATS_ADD(rays[RAY_REFRACTION], 1);
+                RENDER_STATS_ADD(ray_hits[RAY_REFRACTION], exited[order[k]]);
+            }
+        }, num_refraction_rays, WAVEFRONT_CHUNK_SIZE);
+        for (int k = 0; k < num_refraction_rays; k++) {
+            if (!exited[k]) continue;
+            const RefractionRay &refracted = refraction_rays[k];
+            records[refracted.record].refraction = next_rays.size();
+            next_rays.push_back(exit_ray(refracted.ray, exit_inters[k].geom, refracted.primitive->refractive_index));
+        }
+        rays.swap(next_rays);
+    }
+
+    // Resolve the colors from the deepest bounce up.
+    for (int level = (int) bounces.size() - 2; level >= 0; level--) {
+        vector<WavefrontRecord> &records = bounces[level];
+        const vector<WavefrontRecord> &next_records = bounces[level + 1];
+        parallel_for([&](int begin, int end, int) {
+            for (int index = begin; index < end; index++) {
+                WavefrontRecord &record = records[index];
+                if (record.reflection >= 0) record.color += record.reflectiveness * next_records[record.reflection].color;
+                if (record.refraction >= 0) record.color += next_records[record.refraction].color;
+            }
+        }, records.size(), WAVEFRONT_CHUNK_SIZE);
+    }
+    for (int i = 0; i < width; i++) {
+        for (int j = 0; j < height; j++) set_pixel(i, j, bounces[0][i*height + j].color);
+    }
+}
@@ -24,6 +24,9 @@ public:
     BoundingBox world_bound() const;
     bool intersect(Ray &ray, Intersection *inter);
     bool does_intersect(Ray &ray) const;
+    uint32_t intersect_packet(RayPacket &packet, uint32_t active, Intersection *inters);
+    const Primitive *occluder(Ray &ray) const;
+    uint32_t occluder_packet(RayPacket &packet, uint32_t active, const Primitive **occluders) const;
 };
 
 
@@ -13,6 +13,18 @@ bool Scene::does_intersect(Ray &ray) const
 {
     return primitives.does_intersect(ray);
 }
+uint32_t Scene::intersect_packet(RayPacket &packet, uint32_t active, Intersection *inters)
+{
+    return primitives.intersect_packet(packet, active, inters);
+}
+const Primitive *Scene::occluder(Ray &ray) const
+{
+    return primitives.occluder(ray);
+}
+uint32_t Scene::occluder_packet(RayPacket &packet, uint32_t active, const Primitive **occluders) const
+{
+    return primitives.occluder_packet(packet, active, occluders);
+}
 
 void Scene::add_primitive(Primitive *prim)
 {
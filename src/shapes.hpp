@@ -13,6 +13,7 @@ public:
     Shape (const Transform &o2w) :
         object_to_world{o2w}, world_to_object{o2w.inverse()}
     {}
+    virtual ~Shape() {} // Virtual, so that deleting any shape (such as a mesh read from a stale cache file) is safe.
     
     // Shape interface
     // Pure virtual functions: Must be implemented by derived classes.
@@ -32,12 +33,26 @@ public:
     virtual bool can_intersect() const { return true; }; // Derived shapes which are self-refining can override this.
     virtual bool intersect(Ray &ray, LocalGeometry *geom) const; // Defaults to error.
     virtual bool does_intersect(Ray &ray) const; // Defaults to calling intersect() and ignoring everything except whether it intersects.
+    // Intersect the active rays of a packet (see mathematics/ray_packet.hpp), returning the mask of the rays which hit.
+    // The hit rays have their max_t shortened and their geometry written to geoms[lane].
+    // Defaults to calling intersect() for each ray in turn.
+    virtual uint32_t intersect_packet(RayPacket &packet, uint32_t active, LocalGeometry *geoms) const;
+    // Test the active rays of a packet for occlusion, returning the mask of the rays which hit the shape.
+    // Defaults to calling does_intersect() for each ray in turn.
+    virtual uint32_t does_intersect_packet(RayPacket &packet, uint32_t active) const;
+    // Bound the parts of the shape, within box (which bounds some part of it), that are below and above the plane at
+    // position along axis. This is for splitting the references to a shape in spatial-split BVH builds.
+    // Defaults to cutting the box in two, which is conservative, but loose for shapes that don't fill their boxes.
+    virtual void split_world_bound(const BoundingBox &box, int axis, float position,
+                                   BoundingBox *below, BoundingBox *above) const;
 
     // Shape refinement is primarily for triangle meshes and things tessellated into triangles.
     // virtual void refine(vector<Reference<Shape> > &refined) const;
 
     // Public methods.
-    void set_transform(const Transform &transform);
+    // Move the shape. Shapes which keep world-space data derived from the transform override this to update it.
+    // (A BVH holding the shape then needs to be refitted or rebuilt, see BVH::refit().)
+    virtual void set_transform(const Transform &transform);
     // Public data
     Transform object_to_world, world_to_object;
 };
@@ -0,0 +1,54 @@
+/*--------------------------------------------------------------------------------
+    Instanced shapes.
+--------------------------------------------------------------------------------*/
+#include "shapes/instance.hpp"
+
+bool Instance::intersect(Ray &in_ray, LocalGeometry *geom) const
+{
+    // The direction is not renormalized, so the ray parameter is the same in both spaces
+    // and the ray segment can be passed straight through.
+    Ray ray = world_to_object(in_ray);
+    if (!shape->intersect(ray, geom)) return false;
+
+    in_ray.max_t = ray.max_t;
+    geom->p = in_ray(ray.max_t);
+    geom->n = glm::normalize(object_to_world.transform_normal(geom->n));
+    // Textures that work in object space will then use this instance's transform.
+    geom->shape = this;
+    return true;
+}
+bool Instance::does_intersect(Ray &in_ray) const
+{
+    Ray ray = world_to_object(in_ray);
+    return shape->does_intersect(ray);
+}
+uint32_t Instance::intersect_packet(RayPacket &in_packet, uint32_t active, LocalGeometry *geoms) const
+{
+    if (RayPacket::num_rays(active) < RAY_PACKET_MIN_RAYS) return Shape::intersect_packet(in_packet, active, geoms);
+    // An affine transform keeps coherent rays coherent, so the packet is transformed and passed on whole.
+    // (Inactive lanes are left uninitialized. They are masked out of everything.)
+    RayPacket packet;
+    transform_ray_packet(world_to_object, in_packet, active, &packet);
+    uint32_t hit = shape->intersect_packet(packet, active, geoms);
+    for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+        if (!(hit & (1 << lane))) continue;
+        in_packet.max_t[lane] = packet.max_t[lane];
+        geoms[lane].p = in_packet.ray(lane)(packet.max_t[lane]);
+        geoms[lane].n = glm::normalize(object_to_world.transform_normal(geoms[lane].n));
+        geoms[lane].shape = this;
+    }
+    return hit;
+}
+uint32_t Instance::does_intersect_packet(RayPacket &in_packet, uint32_t active) const
+{
+    if (RayPacket::num_rays(active) < RAY_PACKET_MIN_RAYS) return Shape::does_intersect_packet(in_packet, active);
+    RayPacket packet;
+    transform_ray_packet(world_to_object, in_packet, active, &packet);
+    return shape->does_intersect_packet(packet, active);
+}
+
+BoundingBox Instance::object_bound() const
+{
+    // The shared shape's world space is this instance's object space.
+    return shape->world_bound();
+}
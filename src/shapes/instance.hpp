@@ -0,0 +1,29 @@
+#ifndef SHAPES_INSTANCE_H
+#define SHAPES_INSTANCE_H
+#include "shapes.hpp"
+
+/*--------------------------------------------------------------------------------
+    An Instance places a shared shape into the scene with its own transform.
+    The shared shape (such as a triangle mesh, built once with the identity transform)
+    is treated as if it were in the instance's object space, and rays are transformed
+    into that space to be intersected with it. This way any number of instances
+    share one copy of the shape's data and acceleration structure.
+--------------------------------------------------------------------------------*/
+class Instance : public Shape {
+public:
+    Instance(const Transform &o2w, Shape *_shape) :
+        Shape(o2w)
+    {
+        shape = _shape;
+    }
+    // Shape implementations.
+    bool intersect(Ray &ray, LocalGeometry *geom) const;
+    bool does_intersect(Ray &ray) const;
+    uint32_t intersect_packet(RayPacket &packet, uint32_t active, LocalGeometry *geoms) const;
+    uint32_t does_intersect_packet(RayPacket &packet, uint32_t active) const;
+    BoundingBox object_bound() const;
+
+    Shape *shape;
+};
+
+#endif // SHAPES_INSTANCE_H
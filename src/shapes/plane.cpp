@@ -20,7 +20,8 @@ Plane::Plane(Point position, Vector x_extent, Vector y_extent, float width, floa
         z_extent.x, z_extent.y, z_extent.z, 0,
         position.x, position.y, position.z, 1
     );
-    set_transform(Transform(matrix));
+    // The basis vectors are already worked out, so just set the transforms.
+    Shape::set_transform(Transform(matrix));
     m_width = width;
     m_height = height;
     m_inv_width = 1.0 / width;
@@ -29,16 +30,18 @@ Plane::Plane(Point position, Vector x_extent, Vector y_extent, float width, floa
 
 bool Plane::intersect(Ray &in_ray, LocalGeometry *geom) const
 {
-    Ray ray = world_to_object(in_ray);
+    // Only the origin and direction are needed in object space, not a whole Ray.
+    Point o = world_to_object(in_ray.o);
+    Vector d = world_to_object(in_ray.d);
     
     const float epsilon = 1e-5;
     // The ray is almost parallel to the plane, so don't intersect it.
-    if (fabs(ray.d.z) < epsilon) return false;
+    if (fabs(d.z) < epsilon) return false;
 
-    float t = -ray.o.z / ray.d.z; //---rearrange to avoid divide, at least for the exit-check?
-    if (t < ray.min_t || t > ray.max_t) return false; // There is a hit, but it is out of range of the ray segment.
-    float x = ray.o.x + ray.d.x * t;
-    float y = ray.o.y + ray.d.y * t;
+    float t = -o.z / d.z; //---rearrange to avoid divide, at least for the exit-check?
+    if (t < in_ray.min_t || t > in_ray.max_t) return false; // There is a hit, but it is out of range of the ray segment.
+    float x = o.x + d.x * t;
+    float y = o.y + d.y * t;
     if (x < -m_width*0.5 || x > m_width*0.5) return false;
     if (y < -m_height*0.5 || y > m_height*0.5) return false;
     
@@ -52,22 +55,33 @@ bool Plane::intersect(Ray &in_ray, LocalGeometry *geom) const
 }
 bool Plane::does_intersect(Ray &in_ray) const
 {
-    Ray ray = world_to_object(in_ray);
+    // Only the origin and direction are needed in object space, not a whole Ray.
+    Point o = world_to_object(in_ray.o);
+    Vector d = world_to_object(in_ray.d);
     
     const float epsilon = 1e-5;
     // The ray is almost parallel to the plane, so don't intersect it.
-    if (fabs(ray.d.z) < epsilon) return false;
+    if (fabs(d.z) < epsilon) return false;
 
-    float t = -ray.o.z / ray.d.z; //---rearrange to avoid divide, at least for the exit-check?
-    if (t < ray.min_t || t > ray.max_t) return false; // There is a hit, but it is out of range of the ray segment.
-    float x = ray.o.x + ray.d.x * t;
-    float y = ray.o.y + ray.d.y * t;
+    float t = -o.z / d.z; //---rearrange to avoid divide, at least for the exit-check?
+    if (t < in_ray.min_t || t > in_ray.max_t) return false; // There is a hit, but it is out of range of the ray segment.
+    float x = o.x + d.x * t;
+    float y = o.y + d.y * t;
     if (x < -m_width*0.5 || x > m_width*0.5) return false;
     if (y < -m_height*0.5 || y > m_height*0.5) return false;
     return true;
 }
 
 
+void Plane::set_transform(const Transform &transform)
+{
+    Shape::set_transform(transform);
+    // The plane is the xy plane in object space.
+    m_x_vector = glm::normalize(transform(Vector(1,0,0)));
+    m_y_vector = glm::normalize(transform(Vector(0,1,0)));
+    m_normal = glm::normalize(glm::cross(m_y_vector, m_x_vector));
+}
+
 BoundingBox Plane::object_bound() const
 {
     Point p = Point(0.5 * m_width, 0.5 * m_height, 0); //--check this.
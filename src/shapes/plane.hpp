@@ -15,6 +15,7 @@ public:
     bool intersect(Ray &ray, LocalGeometry *geom) const;
     bool does_intersect(Ray &in_ray) const;
     BoundingBox object_bound() const;
+    void set_transform(const Transform &transform);
 
 private:
     float m_height;
@@ -24,7 +25,7 @@ private:
     float m_inv_width;
     Point m_position;
 
-    //-----Remember to update these if the transform is changed!
+    // World-space basis, kept up to date by set_transform().
     Vector m_normal;
     Vector m_x_vector;
     Vector m_y_vector;
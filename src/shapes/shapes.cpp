@@ -19,6 +19,35 @@ bool Shape::does_intersect(Ray &ray) const
     LocalGeometry geom;
     return intersect(ray, &geom);
 };
+uint32_t Shape::intersect_packet(RayPacket &packet, uint32_t active, LocalGeometry *geoms) const
+{
+    uint32_t hit = 0;
+    for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+        if (!(active & (1 << lane))) continue;
+        Ray ray = packet.ray(lane);
+        if (intersect(ray, &geoms[lane])) {
+            packet.max_t[lane] = ray.max_t;
+            hit |= 1 << lane;
+        }
+    }
+    return hit;
+}
+uint32_t Shape::does_intersect_packet(RayPacket &packet, uint32_t active) const
+{
+    uint32_t hit = 0;
+    for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+        if (!(active & (1 << lane))) continue;
+        Ray ray = packet.ray(lane);
+        if (does_intersect(ray)) hit |= 1 << lane;
+    }
+    return hit;
+}
+
+void Shape::split_world_bound(const BoundingBox &box, int axis, float position,
+                              BoundingBox *below, BoundingBox *above) const
+{
+    box.split(axis, position, below, above);
+}
 
 void Shape::set_transform(const Transform &transform)
 {
@@ -5,20 +5,22 @@
 
 bool Sphere::intersect(Ray &in_ray, LocalGeometry *geom) const
 {
-    Ray ray = world_to_object(in_ray);
+    // Only the origin and direction are needed in object space, not a whole Ray.
+    Point o = world_to_object(in_ray.o);
+    Vector d = world_to_object(in_ray.d);
 
     float a,b,c;
-    a = ray.d.x*ray.d.x + ray.d.y*ray.d.y + ray.d.z*ray.d.z;
-    b = 2*(ray.o.x*ray.d.x + ray.o.y*ray.d.y + ray.o.z*ray.d.z);
-    c = ray.o.x*ray.o.x + ray.o.y*ray.o.y + ray.o.z*ray.o.z - m_radius*m_radius;
+    a = d.x*d.x + d.y*d.y + d.z*d.z;
+    b = 2*(o.x*d.x + o.y*d.y + o.z*d.z);
+    c = o.x*o.x + o.y*o.y + o.z*o.z - m_radius*m_radius;
     float discriminant = b*b - 4*a*c;
     if (discriminant < 0) return false;
     float sqrt_d = sqrt(discriminant);
     float inv_2a = 1.0 / (2*a);
     float t = (-b - sqrt_d)*inv_2a;
-    if (t < ray.min_t || t > ray.max_t) {
+    if (t < in_ray.min_t || t > in_ray.max_t) {
         t = (-b + sqrt_d)*inv_2a;
-        if (t < ray.min_t || t > ray.max_t) return false;
+        if (t < in_ray.min_t || t > in_ray.max_t) return false;
     }
     geom->shape = this;
     in_ray.max_t = t;
@@ -48,6 +50,12 @@ bool Sphere::does_intersect(Ray &ray) const
 }
 
 
+void Sphere::set_transform(const Transform &transform)
+{
+    Shape::set_transform(transform);
+    m_position = transform(Point(0,0,0));
+}
+
 BoundingBox Sphere::object_bound() const
 {
     Point p = Point(m_radius, m_radius, m_radius);
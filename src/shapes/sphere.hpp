@@ -5,7 +5,7 @@
 class Sphere : public Shape {
 private:
     float m_radius;
-    Point m_position; // remember to change this is the transform is changed!
+    Point m_position; // The world-space centre, kept up to date by set_transform().
 public:
     Sphere(const Transform &o2w, float radius) :
         Shape(o2w)
@@ -17,6 +17,7 @@ public:
     bool intersect(Ray &ray, LocalGeometry *geom) const;
     bool does_intersect(Ray &ray) const;
     BoundingBox object_bound() const;
+    void set_transform(const Transform &transform);
 };
 
 #endif // PRIMITIVES_SPHERE_H
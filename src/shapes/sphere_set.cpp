@@ -0,0 +1,278 @@
+/*--------------------------------------------------------------------------------
+    Sphere sets.
+--------------------------------------------------------------------------------*/
+#include "shapes/sphere_set.hpp"
+
+// A sphere of the set, as a primitive for the BVH builder, which only needs its box.
+class SphereSetMember : public Primitive {
+public:
+    SphereSetMember() {}
+    SphereSetMember(uint32_t _index, const BoundingBox &_box) : index{_index}, box{_box} {}
+    BoundingBox world_bound() const { return box; }
+    bool does_intersect(Ray &ray) const { return false; } // These are not traced.
+
+    uint32_t index;
+    BoundingBox box;
+};
+
+SphereSet::SphereSet(const vector<Point> &centres, const vector<float> &radii)
+{
+    m_num_spheres = centres.size();
+    if (m_num_spheres == 0) return;
+    vector<SphereSetMember> members(m_num_spheres);
+    vector<Primitive *> member_pointers(m_num_spheres);
+    for (int i = 0; i < m_num_spheres; i++) {
+        Vector extent(radii[i], radii[i], radii[i]);
+        members[i] = SphereSetMember(i, BoundingBox(centres[i] - extent, centres[i] + extent));
+        member_pointers[i] = &members[i];
+    }
+    // As for the groups of triangle meshes, leaves are intersected a group at a time, so fill them up.
+    BVHBuildParameters params(BVH_SPLIT_SAH);
+    params.max_leaf_primitives = SPHERE_LEAF_MAX_GROUPS * SPHERE_LEAF_WIDTH;
+    params.sah_primitive_group_size = SPHERE_LEAF_WIDTH;
+    BVH bvh(member_pointers, true, params);
+    m_box = bvh.world_bound();
+    collapse_to_wide_bvh(bvh.uncompacted_root, wide_bvh);
+
+    // Lay out the spheres of each leaf in groups, starting each leaf at a new group.
+    groups.reserve((m_num_spheres + SPHERE_LEAF_WIDTH - 1) / SPHERE_LEAF_WIDTH);
+    uint32_t position = 0;
+    for (WideBVHNode &node : wide_bvh) {
+        for (int i = 0; i < WIDE_BVH_WIDTH; i++) {
+            if (node.num_primitives[i] == 0) continue;
+            uint32_t first = node.child[i];
+            node.child[i] = position;
+            for (int j = 0; j < node.num_primitives[i]; j++, position++) {
+                if (position % SPHERE_LEAF_WIDTH == 0) groups.push_back(SphereGroup());
+                uint32_t index = static_cast<SphereSetMember *>(bvh.primitives[first + j])->index;
+                SphereGroup &group = groups.back();
+                int lane = position % SPHERE_LEAF_WIDTH;
+                group.x[lane] = centres[index].x;
+                group.y[lane] = centres[index].y;
+                group.z[lane] = centres[index].z;
+                group.radius[lane] = radii[index];
+            }
+            for (; position % SPHERE_LEAF_WIDTH != 0; position++) {
+                SphereGroup &group = groups.back();
+                int lane = position % SPHERE_LEAF_WIDTH;
+                group.x[lane] = group.y[lane] = group.z[lane] = group.radius[lane] = NAN;
+            }
+        }
+    }
+    BVH_delete_node(bvh.uncompacted_root);
+    bvh.uncompacted_root = NULL;
+}
+
+BoundingBox SphereSet::object_bound() const
+{
+    return m_box;
+}
+BoundingBox SphereSet::world_bound() const
+{
+    // The spheres are in world space.
+    return m_box;
+}
+
+// With m the ray's origin relative to the centre, the ray hits the sphere where
+//     (d.d)t^2 + 2(m.d)t + m.m - r^2 = 0.
+// The nearer root is taken if it is in the ray's range, otherwise the further. The comparisons are ordered, so that
+// NaNs (from the padding spheres, or a miss, with a negative discriminant) miss.
+static inline bool sphere_intersect(float cx, float cy, float cz, float radius, const Ray &ray, float *t_hit)
+{
+    float mx = ray.o.x - cx;
+    float my = ray.o.y - cy;
+    float mz = ray.o.z - cz;
+    float a = ray.d.x*ray.d.x + ray.d.y*ray.d.y + ray.d.z*ray.d.z;
+    float b = mx*ray.d.x + my*ray.d.y + mz*ray.d.z;
+    float c = mx*mx + my*my + mz*mz - radius*radius;
+    float sqrt_d = sqrtf(b*b - a*c);
+    float inv_a = 1.f / a;
+    float t = (-b - sqrt_d)*inv_a;
+    if (t >= ray.min_t && t <= ray.max_t) {
+        *t_hit = t;
+        return true;
+    }
+    t = (-b + sqrt_d)*inv_a;
+    if (t >= ray.min_t && t <= ray.max_t) {
+        *t_hit = t;
+        return true;
+    }
+    return false;
+}
+
+#if RAY_PACKET_SIMD
+// sphere_intersect for one ray (broadcast to every lane) against four spheres, such as the lanes of a group,
+// returning the mask of the hits.
+static inline __m128 sphere_test4(__m128 cx, __m128 cy, __m128 cz, __m128 radius,
+                                  __m128 ox, __m128 oy, __m128 oz, __m128 dx, __m128 dy, __m128 dz,
+                                  __m128 min_t, __m128 max_t, __m128 *t_out)
+{
+    __m128 mx = _mm_sub_ps(ox, cx);
+    __m128 my = _mm_sub_ps(oy, cy);
+    __m128 mz = _mm_sub_ps(oz, cz);
+    __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+    __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(mx, dx), _mm_mul_ps(my, dy)), _mm_mul_ps(mz, dz));
+    __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(mx, mx), _mm_mul_ps(my, my)), _mm_mul_ps(mz, mz)),
+                          _mm_mul_ps(radius, radius));
+    __m128 sqrt_d = _mm_sqrt_ps(_mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(a, c)));
+    __m128 inv_a = _mm_div_ps(_mm_set1_ps(1.f), a);
+    __m128 minus_b = _mm_xor_ps(b, _mm_set1_ps(-0.f));
+    __m128 t_near = _mm_mul_ps(_mm_sub_ps(minus_b, sqrt_d), inv_a);
+    __m128 t_far = _mm_mul_ps(_mm_add_ps(minus_b, sqrt_d), inv_a);
+    __m128 near_ok = _mm_and_ps(_mm_cmpge_ps(t_near, min_t), _mm_cmple_ps(t_near, max_t));
+    __m128 far_ok = _mm_and_ps(_mm_cmpge_ps(t_far, min_t), _mm_cmple_ps(t_far, max_t));
+    *t_out = _mm_or_ps(_mm_and_ps(near_ok, t_near), _mm_andnot_ps(near_ok, t_far));
+    return _mm_or_ps(near_ok, far_ok);
+}
+static inline __m128 sphere_group_test4(const SphereGroup &group, const Ray &ray, __m128 *t_out)
+{
+    return sphere_test4(_mm_load_ps(group.x), _mm_load_ps(group.y), _mm_load_ps(group.z), _mm_load_ps(group.radius),
+                        _mm_set1_ps(ray.o.x), _mm_set1_ps(ray.o.y), _mm_set1_ps(ray.o.z),
+                        _mm_set1_ps(ray.d.x), _mm_set1_ps(ray.d.y), _mm_set1_ps(ray.d.z),
+                        _mm_set1_ps(ray.min_t), _mm_set1_ps(ray.max_t), t_out);
+}
+#endif
+
+// Test a ray against all of the spheres of a group. Returns the lane of the closest hit within [min_t, max_t]
+// (the last of equally close hits, as when the spheres are tested in order), or -1.
+static inline int sphere_group_intersect(const SphereGroup &group, const Ray &ray, float *t_hit)
+{
+#if RAY_PACKET_SIMD
+    __m128 t;
+    __m128 ok = sphere_group_test4(group, ray, &t);
+    if (_mm_movemask_ps(ok) == 0) return -1;
+    // The horizontal minimum of the hit distances, broadcast to every lane.
+    __m128 t_min = _mm_or_ps(_mm_and_ps(ok, t), _mm_andnot_ps(ok, _mm_set1_ps(INFINITY)));
+    t_min = _mm_min_ps(t_min, _mm_shuffle_ps(t_min, t_min, _MM_SHUFFLE(1,0,3,2)));
+    t_min = _mm_min_ps(t_min, _mm_shuffle_ps(t_min, t_min, _MM_SHUFFLE(2,3,0,1)));
+    int hits = _mm_movemask_ps(_mm_and_ps(ok, _mm_cmpeq_ps(t, t_min)));
+    int lane = 31 - __builtin_clz(hits);
+    *t_hit = _mm_cvtss_f32(t_min);
+    return lane;
+#else
+    Ray shortened = ray;
+    int hit_lane = -1;
+    for (int lane = 0; lane < SPHERE_LEAF_WIDTH; lane++) {
+        if (sphere_intersect(group.x[lane], group.y[lane], group.z[lane], group.radius[lane], shortened, t_hit)) {
+            shortened.max_t = *t_hit;
+            hit_lane = lane;
+        }
+    }
+    return hit_lane;
+#endif
+}
+// Whether a ray hits any of the spheres of a group within [min_t, max_t].
+static inline bool sphere_group_occludes(const SphereGroup &group, const Ray &ray)
+{
+#if RAY_PACKET_SIMD
+    __m128 t;
+    return _mm_movemask_ps(sphere_group_test4(group, ray, &t)) != 0;
+#else
+    for (int lane = 0; lane < SPHERE_LEAF_WIDTH; lane++) {
+        float t;
+        if (sphere_intersect(group.x[lane], group.y[lane], group.z[lane], group.radius[lane], ray, &t)) return true;
+    }
+    return false;
+#endif
+}
+
+// Leaf intersectors for the wide BVH traversal routines. Leaves are whole numbers of groups.
+// The closest hit's sphere position is kept, and the local geometry is worked out from it at the end.
+struct SphereLeafIntersector {
+    const SphereSet *set;
+    uint32_t hit_position;
+    inline bool operator()(uint32_t first, int num_spheres, Ray &ray) {
+        bool any = false;
+        const SphereGroup *groups = &set->groups[first / SPHERE_LEAF_WIDTH];
+        for (int g = 0; g < num_spheres; g += SPHERE_LEAF_WIDTH, groups++) {
+            float t;
+            int lane = sphere_group_intersect(*groups, ray, &t);
+            if (lane >= 0) {
+                ray.max_t = t;
+                hit_position = first + g + lane;
+                any = true;
+            }
+        }
+        return any;
+    }
+};
+struct SphereLeafOccluder {
+    const SphereSet *set;
+    inline bool operator()(uint32_t first, int num_spheres, Ray &ray) {
+        const SphereGroup *groups = &set->groups[first / SPHERE_LEAF_WIDTH];
+        for (int g = 0; g < num_spheres; g += SPHERE_LEAF_WIDTH, groups++) {
+            if (sphere_group_occludes(*groups, ray)) return true;
+        }
+        return false;
+    }
+};
+// The packet leaf intersectors take the packet's active rays one at a time, each against the groups with SIMD, as
+// this is fewer tests than each sphere against the whole packet unless every ray of the packet is active.
+struct SphereLeafPacketIntersector {
+    const SphereSet *set;
+    uint32_t *hit_positions;
+    inline uint32_t operator()(uint32_t first, int num_spheres, RayPacket &packet, uint32_t active) {
+        SphereLeafIntersector leaf_intersector = { set, 0 };
+        uint32_t hit = 0;
+        for (uint32_t lanes = active; lanes != 0; lanes &= lanes - 1) {
+            int lane = __builtin_ctz(lanes);
+            Ray ray = packet.ray(lane);
+            if (!leaf_intersector(first, num_spheres, ray)) continue;
+            packet.max_t[lane] = ray.max_t;
+            hit_positions[lane] = leaf_intersector.hit_position;
+            hit |= 1 << lane;
+        }
+        return hit;
+    }
+};
+struct SphereLeafPacketOccluder {
+    const SphereSet *set;
+    inline uint32_t operator()(uint32_t first, int num_spheres, RayPacket &packet, uint32_t active) {
+        SphereLeafOccluder leaf_occluder = { set };
+        uint32_t occluded = 0;
+        for (uint32_t lanes = active; lanes != 0; lanes &= lanes - 1) {
+            int lane = __builtin_ctz(lanes);
+            Ray ray = packet.ray(lane);
+            if (leaf_occluder(first, num_spheres, ray)) occluded |= 1 << lane;
+        }
+        return occluded;
+    }
+};
+
+bool SphereSet::intersect(Ray &ray, LocalGeometry *geom) const
+{
+    SphereLeafIntersector leaf_intersector = { this, 0 };
+    if (!wide_bvh_intersect(wide_bvh, ray, leaf_intersector)) return false;
+    uint32_t position = leaf_intersector.hit_position;
+    geom->shape = this;
+    geom->p = ray(ray.max_t);
+    geom->n = glm::normalize(geom->p - groups[position / SPHERE_LEAF_WIDTH].centre(position % SPHERE_LEAF_WIDTH));
+    return true;
+}
+bool SphereSet::does_intersect(Ray &ray) const
+{
+    SphereLeafOccluder leaf_occluder = { this };
+    return wide_bvh_does_intersect(wide_bvh, ray, leaf_occluder);
+}
+uint32_t SphereSet::intersect_packet(RayPacket &packet, uint32_t active, LocalGeometry *geoms) const
+{
+    if (RayPacket::num_rays(active) < RAY_PACKET_MIN_RAYS) return Shape::intersect_packet(packet, active, geoms);
+    uint32_t hit_positions[RAY_PACKET_SIZE];
+    SphereLeafPacketIntersector leaf_intersector = { this, hit_positions };
+    uint32_t hit = wide_bvh_intersect_packet(wide_bvh, packet, active, leaf_intersector);
+    for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+        if (!(hit & (1 << lane))) continue;
+        uint32_t position = hit_positions[lane];
+        LocalGeometry &geom = geoms[lane];
+        geom.shape = this;
+        geom.p = packet.ray(lane)(packet.max_t[lane]);
+        geom.n = glm::normalize(geom.p - groups[position / SPHERE_LEAF_WIDTH].centre(position % SPHERE_LEAF_WIDTH));
+    }
+    return hit;
+}
+uint32_t SphereSet::does_intersect_packet(RayPacket &packet, uint32_t active) const
+{
+    if (RayPacket::num_rays(active) < RAY_PACKET_MIN_RAYS) return Shape::does_intersect_packet(packet, active);
+    SphereLeafPacketOccluder leaf_occluder = { this };
+    return wide_bvh_does_intersect_packet(wide_bvh, packet, active, leaf_occluder);
+}
@@ -0,0 +1,61 @@
+#ifndef SHAPES_SPHERE_SET_H
+#define SHAPES_SPHERE_SET_H
+#include "shapes.hpp"
+#include "aggregates/wide_bvh.hpp"
+
+/*--------------------------------------------------------------------------------
+    A SphereSet is many spheres as one shape, for particle-like scenes where
+    individual Sphere primitives would take too much memory (each has its own
+    transforms) and be intersected one virtual call at a time.
+
+    The spheres are given in world space and intersected there directly, as a
+    sphere only needs its centre and radius. They are held in their own wide BVH,
+    whose leaves are groups of SPHERE_LEAF_WIDTH spheres stored as a structure of
+    arrays, so that a ray is tested against a whole group with SIMD instructions,
+    with the spheres as the lanes. Packets of rays go through the BVH together, and
+    each of their rays reaching a leaf is tested against its groups in the same way.
+    The hit geometry's shape is the set, so all of the spheres share the material
+    of the primitive holding it.
+--------------------------------------------------------------------------------*/
+// The number of spheres in a group, the width of an SSE register.
+#define SPHERE_LEAF_WIDTH 4
+// The BVH is built knowing that a group costs about as much to intersect as one sphere, with leaves of up to this
+// many groups.
+#define SPHERE_LEAF_MAX_GROUPS 2
+
+// Each leaf starts a new group, and the last group of a leaf is padded with NaN spheres, which nothing hits.
+struct SphereGroup {
+    alignas(16) float x[SPHERE_LEAF_WIDTH];
+    alignas(16) float y[SPHERE_LEAF_WIDTH];
+    alignas(16) float z[SPHERE_LEAF_WIDTH];
+    alignas(16) float radius[SPHERE_LEAF_WIDTH];
+
+    inline Point centre(int lane) const {
+        return Point(x[lane], y[lane], z[lane]);
+    }
+};
+
+class SphereSet : public Shape {
+public:
+    SphereSet(const vector<Point> &centres, const vector<float> &radii);
+
+    // Shape implementations.
+    bool intersect(Ray &ray, LocalGeometry *geom) const;
+    bool does_intersect(Ray &ray) const;
+    uint32_t intersect_packet(RayPacket &packet, uint32_t active, LocalGeometry *geoms) const;
+    uint32_t does_intersect_packet(RayPacket &packet, uint32_t active) const;
+    BoundingBox object_bound() const;
+    BoundingBox world_bound() const;
+
+    int num_spheres() const { return m_num_spheres; }
+
+    // The leaves of the wide BVH reference ranges of sphere positions, and the sphere at position i is lane
+    // i % SPHERE_LEAF_WIDTH of group i / SPHERE_LEAF_WIDTH.
+    vector<WideBVHNode> wide_bvh;
+    vector<SphereGroup> groups;
+private:
+    BoundingBox m_box;
+    int m_num_spheres;
+};
+
+#endif // SHAPES_SPHERE_SET_H
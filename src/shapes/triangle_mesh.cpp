@@ -1,4 +1,6 @@
 #include "shapes/triangle_mesh.hpp"
+#include "multithreading.hpp"
+#include "statistics.hpp"
 
 Point MeshTriangle::operator[](int index) const
 {
@@ -16,6 +18,7 @@ Point MeshTriangle::c() const {
 
 bool MeshTriangle::intersect(Ray &ray, LocalGeometry *geom) const
 {
+    RENDER_STATS_ADD(triangle_tests, 1);
 /*
     // Following pbrt, page 140.
     // Parameterizing the triangle in barycentric coordinates,
@@ -85,6 +88,7 @@ static inline bool barycentric_triangle_convex(float wa, float wb, float wc)
 }
 bool MeshTriangle::does_intersect(Ray &ray) const
 {
+    RENDER_STATS_ADD(triangle_tests, 1);
     Vector n = glm::cross(c()-a(), b()-a());
     float denom = glm::dot(ray.d, n);
     const float epsilon = 1e-4;
@@ -105,11 +109,36 @@ BoundingBox MeshTriangle::object_bound() const
 {
     return m_box;
 }
+// The vertices of a mesh's triangles are in the space its BVH is built in (see TriangleMesh::build()).
+void MeshTriangle::split_world_bound(const BoundingBox &box, int axis, float position,
+                                     BoundingBox *below, BoundingBox *above) const
+{
+    // Bound the vertices on each side, and the points where the edges cross the plane.
+    Point v[3] = { a(), b(), c() };
+    BoundingBox below_box, above_box;
+    for (int i = 0; i < 3; i++) {
+        const Point &v0 = v[i];
+        const Point &v1 = v[(i + 1) % 3];
+        if (v0[axis] <= position) below_box.enlarge(v0);
+        if (v0[axis] >= position) above_box.enlarge(v0);
+        if ((v0[axis] < position && position < v1[axis]) || (v1[axis] < position && position < v0[axis])) {
+            float t = (position - v0[axis]) / (v1[axis] - v0[axis]);
+            Point crossing = v0 + t * (v1 - v0);
+            crossing[axis] = position;
+            below_box.enlarge(crossing);
+            above_box.enlarge(crossing);
+        }
+    }
+    // The box may already have been clipped by other planes.
+    *below = intersected(below_box, box);
+    *above = intersected(above_box, box);
+}
 
 
-static void flatten_to_triangles_bvh_recur(const BVH &bvh, vector<TriangleNode> &trinodes,
+template <typename NODE>
+static void flatten_to_triangles_bvh_recur(const BVH &bvh, vector<NODE> &trinodes,
 				           Node *node,
-                                           int *trinodes_index)
+                                           int *trinodes_index, int *leaf_index)
 {
     if (node->is_leaf()) {
         for (int i = 0; i < node->num_primitives; i++) {
@@ -121,26 +150,63 @@ static void flatten_to_triangles_bvh_recur(const BVH &bvh, vector<TriangleNode>
             trinodes[*trinodes_index + i].c = mtri->indices[2];
         }
         (*trinodes_index) += node->num_primitives;
+        (*leaf_index) += node->num_primitives;
     } else {
         int this_node_index = *trinodes_index;
         trinodes[this_node_index].box = node->box;
         trinodes[this_node_index].axis = node->axis;
         (*trinodes_index) ++;
-        flatten_to_triangles_bvh_recur(bvh, trinodes, node->children[0], trinodes_index);
+        flatten_to_triangles_bvh_recur(bvh, trinodes, node->children[0], trinodes_index, leaf_index);
         int next_shift = *trinodes_index - this_node_index;
         trinodes[this_node_index].next_shift = next_shift;
-        flatten_to_triangles_bvh_recur(bvh, trinodes, node->children[1], trinodes_index);
+        trinodes[this_node_index].second_leaf = *leaf_index;
+        flatten_to_triangles_bvh_recur(bvh, trinodes, node->children[1], trinodes_index, leaf_index);
     }
 }
 
-static void flatten_to_triangles_bvh(BVH &bvh, vector<TriangleNode> &trinodes)
+template <typename NODE>
+static void flatten_to_triangles_bvh(BVH &bvh, vector<NODE> &trinodes)
 {
     //note: Remember to initialize trinodes to the right size before passing it. No space will be made here.
 
     int trinodes_index = 0;
-    flatten_to_triangles_bvh_recur(bvh, trinodes, bvh.uncompacted_root, &trinodes_index);
+    int leaf_index = 0;
+    flatten_to_triangles_bvh_recur(bvh, trinodes, bvh.uncompacted_root, &trinodes_index, &leaf_index);
+}
+
+template <typename INDEX>
+static void gather_leaf_triangles(const BVH &bvh, vector<INDEX> &triangles)
+{
+    triangles = vector<INDEX>(3 * bvh.primitives.size());
+    for (int i = 0; i < bvh.primitives.size(); i++) {
+        MeshTriangle *mtri = (MeshTriangle *) (((GeometricPrimitive *) bvh.primitives[i])->shape);
+        triangles[3*i] = mtri->indices[0];
+        triangles[3*i+1] = mtri->indices[1];
+        triangles[3*i+2] = mtri->indices[2];
+    }
 }
 
+#if TRIANGLE_GROUPS
+// Move the triangles of each leaf of the wide BVH to start at a multiple of TRIANGLE_LEAF_WIDTH, so that each leaf
+// is a whole number of triangle groups. The gaps are filled with degenerate triangles (of vertex 0), which nothing hits.
+template <typename INDEX>
+static void align_leaf_triangles(vector<WideBVHNode> &nodes, vector<INDEX> &triangles)
+{
+    vector<INDEX> aligned;
+    aligned.reserve(2 * triangles.size());
+    for (WideBVHNode &node : nodes) {
+        for (int i = 0; i < WIDE_BVH_WIDTH; i++) {
+            if (node.num_primitives[i] == 0) continue;
+            uint32_t first = node.child[i];
+            node.child[i] = aligned.size() / 3;
+            aligned.insert(aligned.end(), &triangles[3*first], &triangles[3*(first + node.num_primitives[i])]);
+            while ((aligned.size() / 3) % TRIANGLE_LEAF_WIDTH != 0) aligned.insert(aligned.end(), 3, 0);
+        }
+    }
+    triangles.swap(aligned);
+}
+#endif
+
 static void bvh_unravelled_length_recur(Node *node, int *length)
 {
     if (node->is_leaf()) {
@@ -153,17 +219,21 @@ static void bvh_unravelled_length_recur(Node *node, int *length)
 }
 
 
-static inline bool intersect_box(const TriangleNode &node, const Ray &ray, const Vector &inv_d, const int is_negative[3])
+template <typename NODE>
+static inline bool intersect_box(const NODE &node, const Ray &ray, const Vector &inv_d, const Vector &inv_d_far,
+                                 const int is_negative[3])
 {
     // Optimized function used for box tests in the BVH.
+    RENDER_STATS_ADD(box_tests, 1);
+    // The far planes use inv_d scaled by RAY_BOX_FAR_SCALE.
     // Check box intersection.
     float t0x, t1x, t0y, t1y, t0z, t1z;
     // X
     t0x = (node.box.corners[is_negative[0]].x - ray.o.x) * inv_d.x;
-    t1x = (node.box.corners[1-is_negative[0]].x - ray.o.x) * inv_d.x;
+    t1x = (node.box.corners[1-is_negative[0]].x - ray.o.x) * inv_d_far.x;
     // Y
     t0y = (node.box.corners[is_negative[1]].y - ray.o.y) * inv_d.y;
-    t1y = (node.box.corners[1-is_negative[1]].y - ray.o.y) * inv_d.y;
+    t1y = (node.box.corners[1-is_negative[1]].y - ray.o.y) * inv_d_far.y;
     if (t0x > t1y || t0y > t1x) {
         // No intersection, the X and Y interval intersection is degenerate.
         return false;
@@ -173,7 +243,7 @@ static inline bool intersect_box(const TriangleNode &node, const Ray &ray, const
     if (t1y < t1x) t1x = t1y;
     // Z
     t0z = (node.box.corners[is_negative[2]].z - ray.o.z) * inv_d.z;
-    t1z = (node.box.corners[1-is_negative[2]].z - ray.o.z) * inv_d.z;
+    t1z = (node.box.corners[1-is_negative[2]].z - ray.o.z) * inv_d_far.z;
     if (t0x > t1z || t0z > t1x) {
         // No intersection, the box interval is degenerate.
         return false;
@@ -193,7 +263,7 @@ static inline bool intersect_box(const TriangleNode &node, const Ray &ray, const
 
 static inline bool triangle_intersect(const TriangleMesh *mesh,
                                       const Point &a, const Point &b, const Point &c,
-                                      uint16_t index_a, uint16_t index_b, uint16_t index_c, 
+                                      uint32_t index_a, uint32_t index_b, uint32_t index_c,
                                       Ray &ray, LocalGeometry *geom)
 {
     Vector n = glm::cross(c-a, b-a);
@@ -250,51 +320,461 @@ static inline bool triangle_does_intersect(const TriangleMesh *mesh,
     float wc = glm::dot(ray.d, glm::cross(a-ray.o, b-ray.o));
     return (((wa > 0) == (wb > 0)) && ((wb > 0) == (wc > 0)));
 }
-static inline bool triangles_bvh_intersect(const TriangleMesh *mesh, const vector<TriangleNode> &triangles_bvh, Ray &ray, LocalGeometry *geom)
+
+#if PRECOMPUTED_TRIANGLES
+static PrecomputedTriangle precompute_triangle(const Point &a, const Point &b, const Point &c)
+{
+    // With e1 = b-a, e2 = c-a and n = cross(e1, e2), the triangle is the unit triangle under p -> a + (e1 e2 n)p.
+    // The rows of the inverse of (e1 e2 n) are cross(e2, n), cross(n, e1) and n, divided by dot(n, n).
+    // This is worked out in double precision, since the rows are stored in single precision.
+    auto cross = [](const double u[3], const double v[3], double out[3]) {
+        out[0] = u[1]*v[2] - u[2]*v[1];
+        out[1] = u[2]*v[0] - u[0]*v[2];
+        out[2] = u[0]*v[1] - u[1]*v[0];
+    };
+    double origin[3] = { a.x, a.y, a.z };
+    double e1[3] = { (double) b.x - a.x, (double) b.y - a.y, (double) b.z - a.z };
+    double e2[3] = { (double) c.x - a.x, (double) c.y - a.y, (double) c.z - a.z };
+    double rows[3][3];
+    cross(e1, e2, rows[2]);
+    cross(e2, rows[2], rows[0]);
+    cross(rows[2], e1, rows[1]);
+    double n_squared = rows[2][0]*rows[2][0] + rows[2][1]*rows[2][1] + rows[2][2]*rows[2][2];
+    PrecomputedTriangle tri;
+    memset(&tri, 0, sizeof(PrecomputedTriangle));
+    if (n_squared == 0) return tri;
+    for (int i = 0; i < 3; i++) {
+        double translation = 0;
+        for (int j = 0; j < 3; j++) {
+            tri.m[i][j] = rows[i][j] / n_squared;
+            translation -= rows[i][j] / n_squared * origin[j];
+        }
+        tri.m[i][3] = translation;
+    }
+    return tri;
+}
+
+// If the ray hits the triangle within [min_t, max_t], give the distance and the barycentric coordinates (u, v)
+// of the second and third vertices.
+static inline bool precomputed_triangle_intersect(const PrecomputedTriangle &tri, const Ray &ray,
+                                                  float *t_hit, float *u_hit, float *v_hit)
+{
+    const float *z = tri.m[2];
+    float oz = z[0]*ray.o.x + z[1]*ray.o.y + z[2]*ray.o.z + z[3];
+    float dz = z[0]*ray.d.x + z[1]*ray.d.y + z[2]*ray.d.z;
+    float t = -oz / dz;
+    // The comparisons are negated so that NaN (from a ray in the plane of the triangle, or a degenerate triangle) misses.
+    if (!(t >= ray.min_t && t <= ray.max_t)) return false;
+    float px = ray.o.x + t*ray.d.x;
+    float py = ray.o.y + t*ray.d.y;
+    float pz = ray.o.z + t*ray.d.z;
+    const float *x = tri.m[0];
+    float u = x[0]*px + x[1]*py + x[2]*pz + x[3];
+    if (!(u >= 0)) return false;
+    const float *y = tri.m[1];
+    float v = y[0]*px + y[1]*py + y[2]*pz + y[3];
+    if (!(v >= 0 && u + v <= 1)) return false;
+    *t_hit = t;
+    *u_hit = u;
+    *v_hit = v;
+    return true;
+}
+#endif
+
+// The part of the triangle tests which depends only on the ray, worked out once per ray.
+struct TriangleRaySetup {
+#if WATERTIGHT_TRIANGLES
+    // The axes of the ray space. z is along the largest component of the direction, and x and y are swapped
+    // if that is negative, to keep the winding of the triangles.
+    int kx, ky, kz;
+    // The shear taking the direction to the z axis, and the scale taking it to unit length.
+    float sx, sy, sz;
+#endif
+    TriangleRaySetup(const Ray &ray) {
+    #if WATERTIGHT_TRIANGLES
+        float ax = fabs(ray.d.x), ay = fabs(ray.d.y), az = fabs(ray.d.z);
+        kz = ax > ay ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+        kx = kz == 2 ? 0 : kz + 1;
+        ky = kx == 2 ? 0 : kx + 1;
+        if (ray.d[kz] < 0) std::swap(kx, ky);
+        sz = ray.inv_d[kz];
+        sx = ray.d[kx] * sz;
+        sy = ray.d[ky] * sz;
+    #endif
+    }
+    TriangleRaySetup() {}
+};
+
+#if WATERTIGHT_TRIANGLES
+// If the ray hits the triangle within [min_t, max_t], give the distance and the barycentric coordinates (u, v)
+// of the second and third vertices, as precomputed_triangle_intersect does.
+static inline bool watertight_triangle_intersect(const TriangleRaySetup &setup, const Ray &ray,
+                                                 const Point &a, const Point &b, const Point &c,
+                                                 float *t_hit, float *u_hit, float *v_hit)
+{
+    const int kx = setup.kx, ky = setup.ky, kz = setup.kz;
+    // The vertices relative to the origin, sheared so that the ray is the z axis.
+    float az = a[kz] - ray.o[kz];
+    float ax = (a[kx] - ray.o[kx]) - setup.sx*az;
+    float ay = (a[ky] - ray.o[ky]) - setup.sy*az;
+    float bz = b[kz] - ray.o[kz];
+    float bx = (b[kx] - ray.o[kx]) - setup.sx*bz;
+    float by = (b[ky] - ray.o[ky]) - setup.sy*bz;
+    float cz = c[kz] - ray.o[kz];
+    float cx = (c[kx] - ray.o[kx]) - setup.sx*cz;
+    float cy = (c[ky] - ray.o[ky]) - setup.sy*cz;
+    // The edge functions, twice the signed areas that the ray (now the point (0, 0)) makes with each edge,
+    // which are also the unnormalized barycentric coordinates.
+    float U = cx*by - cy*bx;
+    float V = ax*cy - ay*cx;
+    float W = bx*ay - by*ax;
+    if (U == 0 || V == 0 || W == 0) {
+        // The ray is on an edge, or too close to tell. The products are exact in double precision, so this
+        // gives the same answer for the edge in both of the triangles sharing it.
+        U = (float) ((double) cx*by - (double) cy*bx);
+        V = (float) ((double) ax*cy - (double) ay*cx);
+        W = (float) ((double) bx*ay - (double) by*ax);
+    }
+    if ((U < 0 || V < 0 || W < 0) && (U > 0 || V > 0 || W > 0)) return false;
+    float det = U + V + W;
+    if (det == 0) return false;
+    // The distance scaled by det, tested against the range before dividing.
+    float T = U*(setup.sz*az) + V*(setup.sz*bz) + W*(setup.sz*cz);
+    float abs_det = fabs(det);
+    float abs_T = det < 0 ? -T : T;
+    // The comparisons are negated so that NaN (from the padding triangles of a group) misses.
+    if (!(abs_T >= ray.min_t*abs_det && abs_T <= ray.max_t*abs_det)) return false;
+    float inv_det = 1.f / det;
+    *t_hit = T*inv_det;
+    *u_hit = V*inv_det;
+    *v_hit = W*inv_det;
+    return true;
+}
+#endif
+
+#if PRECOMPUTED_TRIANGLES || WATERTIGHT_TRIANGLES
+// Fill in the local geometry at a hit found by precomputed_triangle_intersect or watertight_triangle_intersect,
+// once ray.max_t is set to it. As in triangle_intersect, the normal is left to be normalized by the caller.
+static inline void triangle_hit_geometry(const TriangleMesh *mesh,
+                                         uint32_t index_a, uint32_t index_b, uint32_t index_c,
+                                         float u, float v, const Ray &ray, LocalGeometry *geom)
+{
+    if (mesh->model->has_normals) {
+        Vector &na = mesh->model->normals[index_a];
+        Vector &nb = mesh->model->normals[index_b];
+        Vector &nc = mesh->model->normals[index_c];
+        geom->n = (1 - u - v)*na + u*nb + v*nc;
+    } else {
+        const Point &a = mesh->model->vertices[index_a];
+        const Point &b = mesh->model->vertices[index_b];
+        const Point &c = mesh->model->vertices[index_c];
+        geom->n = glm::cross(c-a, b-a);
+    }
+    geom->p = ray(ray.max_t);
+}
+#endif
+
+#if TRIANGLE_GROUPS
+// The test of one lane of a group.
+static inline bool triangle_group_lane_intersect(const TriangleGroup &group, int lane, const TriangleRaySetup &setup,
+                                                 const Ray &ray, float *t_hit, float *u_hit, float *v_hit)
+{
+#if WATERTIGHT_TRIANGLES
+    return watertight_triangle_intersect(setup, ray, group.vertex(0, lane), group.vertex(1, lane), group.vertex(2, lane),
+                                         t_hit, u_hit, v_hit);
+#else
+    return precomputed_triangle_intersect(group.triangle(lane), ray, t_hit, u_hit, v_hit);
+#endif
+}
+
+#if RAY_PACKET_SIMD
+#if PRECOMPUTED_TRIANGLES
+// precomputed_triangle_intersect for four lanes of a group, returning the mask of the hits.
+static inline __m128 triangle_group_test4(const PrecomputedTriangleGroup &group, int g, const TriangleRaySetup &, const Ray &ray,
+                                          __m128 *t_out, __m128 *u_out, __m128 *v_out)
+{
+    const __m128 zero = _mm_setzero_ps();
+    __m128 ox = _mm_set1_ps(ray.o.x), oy = _mm_set1_ps(ray.o.y), oz = _mm_set1_ps(ray.o.z);
+    __m128 dx = _mm_set1_ps(ray.d.x), dy = _mm_set1_ps(ray.d.y), dz = _mm_set1_ps(ray.d.z);
+    #define ROW(I,J) _mm_load_ps(&group.m[I][J][g])
+    __m128 o_z = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ROW(2,0), ox), _mm_mul_ps(ROW(2,1), oy)), _mm_mul_ps(ROW(2,2), oz)), ROW(2,3));
+    __m128 d_z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ROW(2,0), dx), _mm_mul_ps(ROW(2,1), dy)), _mm_mul_ps(ROW(2,2), dz));
+    __m128 t = _mm_div_ps(_mm_xor_ps(o_z, _mm_set1_ps(-0.f)), d_z);
+    // Ordered comparisons, so that NaNs (including those of the padding triangles) miss.
+    __m128 ok = _mm_and_ps(_mm_cmpge_ps(t, _mm_set1_ps(ray.min_t)), _mm_cmple_ps(t, _mm_set1_ps(ray.max_t)));
+    if (_mm_movemask_ps(ok) == 0) return ok;
+    __m128 px = _mm_add_ps(ox, _mm_mul_ps(t, dx));
+    __m128 py = _mm_add_ps(oy, _mm_mul_ps(t, dy));
+    __m128 pz = _mm_add_ps(oz, _mm_mul_ps(t, dz));
+    __m128 u = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ROW(0,0), px), _mm_mul_ps(ROW(0,1), py)), _mm_mul_ps(ROW(0,2), pz)), ROW(0,3));
+    __m128 v = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ROW(1,0), px), _mm_mul_ps(ROW(1,1), py)), _mm_mul_ps(ROW(1,2), pz)), ROW(1,3));
+    #undef ROW
+    ok = _mm_and_ps(ok, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmpge_ps(v, zero)));
+    ok = _mm_and_ps(ok, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.f)));
+    *t_out = t;
+    *u_out = u;
+    *v_out = v;
+    return ok;
+}
+#endif
+#if WATERTIGHT_TRIANGLES
+// watertight_triangle_intersect for four lanes of a group, returning the mask of the hits.
+static inline __m128 triangle_group_test4(const TriangleVertexGroup &group, int g, const TriangleRaySetup &setup, const Ray &ray,
+                                          __m128 *t_out, __m128 *u_out, __m128 *v_out)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 sign_bit = _mm_set1_ps(-0.f);
+    __m128 okx = _mm_set1_ps(ray.o[setup.kx]), oky = _mm_set1_ps(ray.o[setup.ky]), okz = _mm_set1_ps(ray.o[setup.kz]);
+    __m128 sx = _mm_set1_ps(setup.sx), sy = _mm_set1_ps(setup.sy), sz = _mm_set1_ps(setup.sz);
+    // The same order of operations as watertight_triangle_intersect.
+    #define SHEAR(I, X, Y, Z) \
+        __m128 Z = _mm_sub_ps(_mm_load_ps(&group.v[I][setup.kz][g]), okz); \
+        __m128 X = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(&group.v[I][setup.kx][g]), okx), _mm_mul_ps(sx, Z)); \
+        __m128 Y = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(&group.v[I][setup.ky][g]), oky), _mm_mul_ps(sy, Z));
+    SHEAR(0, ax, ay, az)
+    SHEAR(1, bx, by, bz)
+    SHEAR(2, cx, cy, cz)
+    #undef SHEAR
+    __m128 U = _mm_sub_ps(_mm_mul_ps(cx, by), _mm_mul_ps(cy, bx));
+    __m128 V = _mm_sub_ps(_mm_mul_ps(ax, cy), _mm_mul_ps(ay, cx));
+    __m128 W = _mm_sub_ps(_mm_mul_ps(bx, ay), _mm_mul_ps(by, ax));
+    // Lanes with a ray on an edge are redone below in double precision.
+    int on_edge = _mm_movemask_ps(_mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(U, zero), _mm_cmpeq_ps(V, zero)), _mm_cmpeq_ps(W, zero)));
+    __m128 negative = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(U, zero), _mm_cmplt_ps(V, zero)), _mm_cmplt_ps(W, zero));
+    __m128 positive = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(U, zero), _mm_cmpgt_ps(V, zero)), _mm_cmpgt_ps(W, zero));
+    __m128 det = _mm_add_ps(_mm_add_ps(U, V), W);
+    __m128 ok = _mm_andnot_ps(_mm_and_ps(negative, positive), _mm_cmpneq_ps(det, zero));
+    __m128 T = _mm_add_ps(_mm_add_ps(_mm_mul_ps(U, _mm_mul_ps(sz, az)), _mm_mul_ps(V, _mm_mul_ps(sz, bz))), _mm_mul_ps(W, _mm_mul_ps(sz, cz)));
+    __m128 det_sign = _mm_and_ps(det, sign_bit);
+    __m128 abs_det = _mm_xor_ps(det, det_sign);
+    __m128 abs_T = _mm_xor_ps(T, det_sign);
+    // Ordered comparisons, so that NaNs (including those of the padding triangles) miss.
+    ok = _mm_and_ps(ok, _mm_and_ps(_mm_cmpge_ps(abs_T, _mm_mul_ps(_mm_set1_ps(ray.min_t), abs_det)),
+                                   _mm_cmple_ps(abs_T, _mm_mul_ps(_mm_set1_ps(ray.max_t), abs_det))));
+    if (_mm_movemask_ps(ok) == 0 && on_edge == 0) return ok;
+    __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.f), det);
+    *t_out = _mm_mul_ps(T, inv_det);
+    *u_out = _mm_mul_ps(V, inv_det);
+    *v_out = _mm_mul_ps(W, inv_det);
+    if (on_edge != 0) {
+        alignas(16) float t[4], u[4], v[4];
+        alignas(16) int32_t hit[4];
+        _mm_store_ps(t, *t_out);
+        _mm_store_ps(u, *u_out);
+        _mm_store_ps(v, *v_out);
+        _mm_store_si128((__m128i *) hit, _mm_castps_si128(ok));
+        for (int l = 0; l < 4; l++) {
+            if (!(on_edge & (1 << l))) continue;
+            hit[l] = triangle_group_lane_intersect(group, g + l, setup, ray, &t[l], &u[l], &v[l]) ? -1 : 0;
+        }
+        *t_out = _mm_load_ps(t);
+        *u_out = _mm_load_ps(u);
+        *v_out = _mm_load_ps(v);
+        ok = _mm_castsi128_ps(_mm_load_si128((const __m128i *) hit));
+    }
+    return ok;
+}
+#endif
+#endif
+#if PRECOMPUTED_TRIANGLES && RAY_PACKET_SIMD && defined(__AVX__) && TRIANGLE_LEAF_WIDTH == 8
+#define TRIANGLE_GROUP_AVX 1
+// The same for all eight lanes at once.
+static inline __m256 triangle_group_test8(const PrecomputedTriangleGroup &group, const Ray &ray,
+                                          __m256 *t_out, __m256 *u_out, __m256 *v_out)
+{
+    const __m256 zero = _mm256_setzero_ps();
+    __m256 ox = _mm256_set1_ps(ray.o.x), oy = _mm256_set1_ps(ray.o.y), oz = _mm256_set1_ps(ray.o.z);
+    __m256 dx = _mm256_set1_ps(ray.d.x), dy = _mm256_set1_ps(ray.d.y), dz = _mm256_set1_ps(ray.d.z);
+    #define ROW(I,J) _mm256_load_ps(group.m[I][J])
+    __m256 o_z = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ROW(2,0), ox), _mm256_mul_ps(ROW(2,1), oy)), _mm256_mul_ps(ROW(2,2), oz)), ROW(2,3));
+    __m256 d_z = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ROW(2,0), dx), _mm256_mul_ps(ROW(2,1), dy)), _mm256_mul_ps(ROW(2,2), dz));
+    __m256 t = _mm256_div_ps(_mm256_xor_ps(o_z, _mm256_set1_ps(-0.f)), d_z);
+    __m256 ok = _mm256_and_ps(_mm256_cmp_ps(t, _mm256_set1_ps(ray.min_t), _CMP_GE_OQ),
+                              _mm256_cmp_ps(t, _mm256_set1_ps(ray.max_t), _CMP_LE_OQ));
+    if (_mm256_movemask_ps(ok) == 0) return ok;
+    __m256 px = _mm256_add_ps(ox, _mm256_mul_ps(t, dx));
+    __m256 py = _mm256_add_ps(oy, _mm256_mul_ps(t, dy));
+    __m256 pz = _mm256_add_ps(oz, _mm256_mul_ps(t, dz));
+    __m256 u = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ROW(0,0), px), _mm256_mul_ps(ROW(0,1), py)), _mm256_mul_ps(ROW(0,2), pz)), ROW(0,3));
+    __m256 v = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ROW(1,0), px), _mm256_mul_ps(ROW(1,1), py)), _mm256_mul_ps(ROW(1,2), pz)), ROW(1,3));
+    #undef ROW
+    ok = _mm256_and_ps(ok, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(v, zero, _CMP_GE_OQ)));
+    ok = _mm256_and_ps(ok, _mm256_cmp_ps(_mm256_add_ps(u, v), _mm256_set1_ps(1.f), _CMP_LE_OQ));
+    *t_out = t;
+    *u_out = u;
+    *v_out = v;
+    return ok;
+}
+#endif
+
+// Test a ray against all of the triangles of a group. Returns the lane of the closest hit within [min_t, max_t]
+// (the last of equally close hits, as when the triangles are tested in order), or -1.
+static inline int triangle_group_intersect(const TriangleGroup &group, const TriangleRaySetup &setup, const Ray &ray,
+                                           float *t_hit, float *u_hit, float *v_hit)
+{
+    alignas(32) float t_lanes[TRIANGLE_LEAF_WIDTH];
+    alignas(32) float u_lanes[TRIANGLE_LEAF_WIDTH];
+    alignas(32) float v_lanes[TRIANGLE_LEAF_WIDTH];
+    int hits = 0;
+#if TRIANGLE_GROUP_AVX
+    __m256 t, u, v;
+    __m256 ok = triangle_group_test8(group, ray, &t, &u, &v);
+    hits = _mm256_movemask_ps(ok);
+    if (hits == 0) return -1;
+    // The horizontal minimum of the hit distances, broadcast to every lane.
+    __m256 t_hits = _mm256_blendv_ps(_mm256_set1_ps(INFINITY), t, ok);
+    __m256 t_min = _mm256_min_ps(t_hits, _mm256_permute2f128_ps(t_hits, t_hits, 1));
+    t_min = _mm256_min_ps(t_min, _mm256_shuffle_ps(t_min, t_min, _MM_SHUFFLE(1,0,3,2)));
+    t_min = _mm256_min_ps(t_min, _mm256_shuffle_ps(t_min, t_min, _MM_SHUFFLE(2,3,0,1)));
+    hits = _mm256_movemask_ps(_mm256_and_ps(ok, _mm256_cmp_ps(t, t_min, _CMP_EQ_OQ)));
+    _mm256_store_ps(t_lanes, t);
+    _mm256_store_ps(u_lanes, u);
+    _mm256_store_ps(v_lanes, v);
+#elif RAY_PACKET_SIMD
+    const int num_blocks = TRIANGLE_LEAF_WIDTH / 4;
+    __m128 t[num_blocks], u[num_blocks], v[num_blocks], ok[num_blocks];
+    __m128 t_min = _mm_set1_ps(INFINITY);
+    for (int b = 0; b < num_blocks; b++) {
+        ok[b] = triangle_group_test4(group, 4*b, setup, ray, &t[b], &u[b], &v[b]);
+        int block_hits = _mm_movemask_ps(ok[b]);
+        if (block_hits == 0) continue;
+        hits |= block_hits << (4*b);
+        t_min = _mm_min_ps(t_min, _mm_or_ps(_mm_and_ps(ok[b], t[b]), _mm_andnot_ps(ok[b], _mm_set1_ps(INFINITY))));
+    }
+    if (hits == 0) return -1;
+    // The horizontal minimum of the hit distances, broadcast to every lane.
+    t_min = _mm_min_ps(t_min, _mm_shuffle_ps(t_min, t_min, _MM_SHUFFLE(1,0,3,2)));
+    t_min = _mm_min_ps(t_min, _mm_shuffle_ps(t_min, t_min, _MM_SHUFFLE(2,3,0,1)));
+    int closest = 0;
+    for (int b = 0; b < num_blocks; b++) {
+        if (((hits >> (4*b)) & 0xF) == 0) continue;
+        closest |= _mm_movemask_ps(_mm_and_ps(ok[b], _mm_cmpeq_ps(t[b], t_min))) << (4*b);
+        _mm_store_ps(&t_lanes[4*b], t[b]);
+        _mm_store_ps(&u_lanes[4*b], u[b]);
+        _mm_store_ps(&v_lanes[4*b], v[b]);
+    }
+    hits = closest;
+#else
+    Ray shortened = ray;
+    for (int lane = 0; lane < TRIANGLE_LEAF_WIDTH; lane++) {
+        if (triangle_group_lane_intersect(group, lane, setup, shortened, &t_lanes[lane], &u_lanes[lane], &v_lanes[lane])) {
+            shortened.max_t = t_lanes[lane];
+            hits = 1 << lane;
+        }
+    }
+    if (hits == 0) return -1;
+#endif
+    int lane = 31 - __builtin_clz(hits);
+    *t_hit = t_lanes[lane];
+    *u_hit = u_lanes[lane];
+    *v_hit = v_lanes[lane];
+    return lane;
+}
+
+// Whether a ray hits any of the triangles of a group within [min_t, max_t].
+static inline bool triangle_group_occludes(const TriangleGroup &group, const TriangleRaySetup &setup, const Ray &ray)
+{
+#if TRIANGLE_GROUP_AVX
+    __m256 t, u, v;
+    return _mm256_movemask_ps(triangle_group_test8(group, ray, &t, &u, &v)) != 0;
+#elif RAY_PACKET_SIMD
+    for (int g = 0; g < TRIANGLE_LEAF_WIDTH; g += 4) {
+        __m128 t, u, v;
+        if (_mm_movemask_ps(triangle_group_test4(group, g, setup, ray, &t, &u, &v)) != 0) return true;
+    }
+    return false;
+#else
+    for (int lane = 0; lane < TRIANGLE_LEAF_WIDTH; lane++) {
+        float t, u, v;
+        if (triangle_group_lane_intersect(group, lane, setup, ray, &t, &u, &v)) return true;
+    }
+    return false;
+#endif
+}
+#endif
+
+template <typename NODE>
+static inline bool triangles_bvh_intersect(const TriangleMesh *mesh, const vector<NODE> &triangles_bvh, Ray &ray, LocalGeometry *geom)
 {
     // Precomputations
-    Vector inv_d(1.f / ray.d.x, 1.f / ray.d.y, 1.f / ray.d.z);
+    Vector inv_d = ray.inv_d;
+    Vector inv_d_far = inv_d * RAY_BOX_FAR_SCALE;
     Point origin = ray(ray.min_t);
-    int is_negative[3] = { ray.d.x < 0, ray.d.y < 0, ray.d.z < 0 };
+    int is_negative[3] = { ray.is_negative[0], ray.is_negative[1], ray.is_negative[2] };
+    TriangleRaySetup setup(ray);
 
     bool any_intersection = false;
     uint32_t todo[128];
+    uint32_t todo_leaf[128];
     int todo_now = 0;
     todo[0] = 0;
+    todo_leaf[0] = 0;
     int index = 0;
+    // The number of the node at index among the leaves (see TriangleNode::second_leaf).
+    uint32_t leaf = 0;
     do {
-        if (intersect_box(triangles_bvh[index], ray, inv_d, is_negative)) {
+        if (intersect_box(triangles_bvh[index], ray, inv_d, inv_d_far, is_negative)) {
+            RENDER_STATS_ADD(nodes_visited, 1);
             if (triangles_bvh[index].next_shift == 0) {
                 // Leaf node.
                 do {
                     // Intersect with the triangles in this leaf.
-                    uint16_t index_a = triangles_bvh[index].a;
-                    uint16_t index_b = triangles_bvh[index].b;
-                    uint16_t index_c = triangles_bvh[index].c;
+                    RENDER_STATS_ADD(primitive_tests, 1);
+                    RENDER_STATS_ADD(triangle_tests, 1);
+                #if PRECOMPUTED_TRIANGLES
+                    float t, u, v;
+                    if (precomputed_triangle_intersect(mesh->precomputed_triangles[leaf], ray, &t, &u, &v)) {
+                        ray.max_t = t;
+                        triangle_hit_geometry(mesh, triangles_bvh[index].a, triangles_bvh[index].b, triangles_bvh[index].c,
+                                              u, v, ray, geom);
+                        any_intersection = true;
+                    }
+                #elif WATERTIGHT_TRIANGLES
+                    const Point &a = mesh->model->vertices[triangles_bvh[index].a];
+                    const Point &b = mesh->model->vertices[triangles_bvh[index].b];
+                    const Point &c = mesh->model->vertices[triangles_bvh[index].c];
+                    float t, u, v;
+                    if (watertight_triangle_intersect(setup, ray, a, b, c, &t, &u, &v)) {
+                        ray.max_t = t;
+                        triangle_hit_geometry(mesh, triangles_bvh[index].a, triangles_bvh[index].b, triangles_bvh[index].c,
+                                              u, v, ray, geom);
+                        any_intersection = true;
+                    }
+                #else
+                    uint32_t index_a = triangles_bvh[index].a;
+                    uint32_t index_b = triangles_bvh[index].b;
+                    uint32_t index_c = triangles_bvh[index].c;
                     Point a,b,c;
                     a = mesh->model->vertices[index_a];
                     b = mesh->model->vertices[index_b];
                     c = mesh->model->vertices[index_c];
                     if (triangle_intersect(mesh, a, b, c, index_a, index_b, index_c, ray, geom)) any_intersection = true;
+                #endif
                     index ++;
+                    leaf ++;
                     // Either the loop terminates at the end of the array or when a branching node is reached.
                 } while (index < mesh->triangles_bvh_length && triangles_bvh[index].next_shift == 0);
                 
-                index = todo[todo_now--];
+                index = todo[todo_now];
+                leaf = todo_leaf[todo_now--];
             } else {
                 if (is_negative[triangles_bvh[index].axis]) {
                     todo_now ++;
                     todo[todo_now] = index + 1;
+                    todo_leaf[todo_now] = leaf;
+                    leaf = triangles_bvh[index].second_leaf;
                     index += triangles_bvh[index].next_shift;
                 } else {
                     todo_now ++;
                     todo[todo_now] = index + triangles_bvh[index].next_shift;
+                    todo_leaf[todo_now] = triangles_bvh[index].second_leaf;
                     // Due to the unravelled order, the next node is the first primitive of the first child.
                     index ++;
                 }
             }
         } else {
-            index = todo[todo_now--];
+            index = todo[todo_now];
+            leaf = todo_leaf[todo_now--];
         }
     } while (todo_now >= 0);
     if (any_intersection) {
@@ -305,76 +785,825 @@ static inline bool triangles_bvh_intersect(const TriangleMesh *mesh, const vecto
     }
     return any_intersection;
 }
-static inline bool triangles_bvh_does_intersect(const TriangleMesh *mesh, const vector<TriangleNode> &triangles_bvh, Ray &ray)
+template <typename NODE>
+static inline bool triangles_bvh_does_intersect(const TriangleMesh *mesh, const vector<NODE> &triangles_bvh, Ray &ray)
 {
     // Precomputations
-    Vector inv_d(1.f / ray.d.x, 1.f / ray.d.y, 1.f / ray.d.z);
+    Vector inv_d = ray.inv_d;
+    Vector inv_d_far = inv_d * RAY_BOX_FAR_SCALE;
     Point origin = ray(ray.min_t);
-    int is_negative[3] = { ray.d.x < 0, ray.d.y < 0, ray.d.z < 0 };
+    int is_negative[3] = { ray.is_negative[0], ray.is_negative[1], ray.is_negative[2] };
+    TriangleRaySetup setup(ray);
 
     uint32_t todo[128];
+    uint32_t todo_leaf[128];
     int todo_now = 0;
     todo[0] = 0;
+    todo_leaf[0] = 0;
     int index = 0;
+    // The number of the node at index among the leaves (see TriangleNode::second_leaf).
+    uint32_t leaf = 0;
     do {
-        if (intersect_box(triangles_bvh[index], ray, inv_d, is_negative)) {
+        if (intersect_box(triangles_bvh[index], ray, inv_d, inv_d_far, is_negative)) {
+            RENDER_STATS_ADD(nodes_visited, 1);
             if (triangles_bvh[index].next_shift == 0) {
                 // Leaf node.
                 do {
                     // Intersect with the triangles in this leaf.
+                    RENDER_STATS_ADD(primitive_tests, 1);
+                    RENDER_STATS_ADD(triangle_tests, 1);
+                #if PRECOMPUTED_TRIANGLES
+                    float t, u, v;
+                    if (precomputed_triangle_intersect(mesh->precomputed_triangles[leaf], ray, &t, &u, &v)) return true;
+                #elif WATERTIGHT_TRIANGLES
+                    const Point &a = mesh->model->vertices[triangles_bvh[index].a];
+                    const Point &b = mesh->model->vertices[triangles_bvh[index].b];
+                    const Point &c = mesh->model->vertices[triangles_bvh[index].c];
+                    float t, u, v;
+                    if (watertight_triangle_intersect(setup, ray, a, b, c, &t, &u, &v)) return true;
+                #else
                     Point &a = mesh->model->vertices[triangles_bvh[index].a];
                     Point &b = mesh->model->vertices[triangles_bvh[index].b];
                     Point &c = mesh->model->vertices[triangles_bvh[index].c];
                     if (triangle_does_intersect(mesh, a, b, c, ray)) return true;
+                #endif
                     index ++;
+                    leaf ++;
                     // Either the loop terminates at the end of the array or when a branching node is reached.
                 } while (index < mesh->triangles_bvh_length && triangles_bvh[index].next_shift == 0);
                 
-                index = todo[todo_now--];
+                index = todo[todo_now];
+                leaf = todo_leaf[todo_now--];
             } else {
                 // Branching node.
                 #if 0
                 todo_now ++;
                 todo[todo_now] = index + triangles_bvh[index].next_shift;
+                todo_leaf[todo_now] = triangles_bvh[index].second_leaf;
                 // Due to the unravelled order, the next node is the first primitive of the first child.
                 index ++;
                 #else
                 if (is_negative[triangles_bvh[index].axis]) {
                     todo_now ++;
                     todo[todo_now] = index + 1;
+                    todo_leaf[todo_now] = leaf;
+                    leaf = triangles_bvh[index].second_leaf;
                     index += triangles_bvh[index].next_shift;
                 } else {
                     todo_now ++;
                     todo[todo_now] = index + triangles_bvh[index].next_shift;
+                    todo_leaf[todo_now] = triangles_bvh[index].second_leaf;
                     // Due to the unravelled order, the next node is the first primitive of the first child.
                     index ++;
                 }
                 #endif
             }
         } else {
-            index = todo[todo_now--];
+            index = todo[todo_now];
+            leaf = todo_leaf[todo_now--];
         }
     } while (todo_now >= 0);
     return false;
 }
 
+// Leaf intersectors for the wide BVH traversal routines.
+template <typename INDEX>
+struct TriangleLeafIntersector {
+    const TriangleMesh *mesh;
+    const vector<INDEX> &triangles;
+    LocalGeometry *geom;
+    TriangleRaySetup setup;
+    inline bool operator()(uint32_t first, int num_triangles, Ray &ray) {
+        RENDER_STATS_ADD(triangle_tests, num_triangles);
+        bool any = false;
+        const INDEX *indices = &triangles[3*first];
+    #if TRIANGLE_GROUPS
+        const TriangleGroup *groups = &mesh->triangle_groups[first / TRIANGLE_LEAF_WIDTH];
+        for (int g = 0; g < num_triangles; g += TRIANGLE_LEAF_WIDTH, groups++) {
+            float t, u, v;
+            int lane = triangle_group_intersect(*groups, setup, ray, &t, &u, &v);
+            if (lane >= 0) {
+                ray.max_t = t;
+                const INDEX *hit_indices = &indices[3*(g + lane)];
+                triangle_hit_geometry(mesh, hit_indices[0], hit_indices[1], hit_indices[2], u, v, ray, geom);
+                any = true;
+            }
+        }
+    #elif PRECOMPUTED_TRIANGLES
+        const PrecomputedTriangle *tris = &mesh->precomputed_triangles[first];
+        for (int i = 0; i < num_triangles; i++, indices += 3) {
+            float t, u, v;
+            if (precomputed_triangle_intersect(tris[i], ray, &t, &u, &v)) {
+                ray.max_t = t;
+                triangle_hit_geometry(mesh, indices[0], indices[1], indices[2], u, v, ray, geom);
+                any = true;
+            }
+        }
+    #elif WATERTIGHT_TRIANGLES
+        for (int i = 0; i < num_triangles; i++, indices += 3) {
+            const Point &a = mesh->model->vertices[indices[0]];
+            const Point &b = mesh->model->vertices[indices[1]];
+            const Point &c = mesh->model->vertices[indices[2]];
+            float t, u, v;
+            if (watertight_triangle_intersect(setup, ray, a, b, c, &t, &u, &v)) {
+                ray.max_t = t;
+                triangle_hit_geometry(mesh, indices[0], indices[1], indices[2], u, v, ray, geom);
+                any = true;
+            }
+        }
+    #else
+        for (int i = 0; i < num_triangles; i++, indices += 3) {
+            const Point &a = mesh->model->vertices[indices[0]];
+            const Point &b = mesh->model->vertices[indices[1]];
+            const Point &c = mesh->model->vertices[indices[2]];
+            if (triangle_intersect(mesh, a, b, c, indices[0], indices[1], indices[2], ray, geom)) any = true;
+        }
+    #endif
+        return any;
+    }
+};
+template <typename INDEX>
+struct TriangleLeafOccluder {
+    const TriangleMesh *mesh;
+    const vector<INDEX> &triangles;
+    TriangleRaySetup setup;
+    inline bool operator()(uint32_t first, int num_triangles, Ray &ray) {
+    #if TRIANGLE_GROUPS
+        const TriangleGroup *groups = &mesh->triangle_groups[first / TRIANGLE_LEAF_WIDTH];
+        for (int g = 0; g < num_triangles; g += TRIANGLE_LEAF_WIDTH, groups++) {
+            RENDER_STATS_ADD(triangle_tests, min(TRIANGLE_LEAF_WIDTH, num_triangles - g));
+            if (triangle_group_occludes(*groups, setup, ray)) return true;
+        }
+    #elif PRECOMPUTED_TRIANGLES
+        const PrecomputedTriangle *tris = &mesh->precomputed_triangles[first];
+        for (int i = 0; i < num_triangles; i++) {
+            RENDER_STATS_ADD(triangle_tests, 1);
+            float t, u, v;
+            if (precomputed_triangle_intersect(tris[i], ray, &t, &u, &v)) return true;
+        }
+    #elif WATERTIGHT_TRIANGLES
+        const INDEX *indices = &triangles[3*first];
+        for (int i = 0; i < num_triangles; i++, indices += 3) {
+            RENDER_STATS_ADD(triangle_tests, 1);
+            const Point &a = mesh->model->vertices[indices[0]];
+            const Point &b = mesh->model->vertices[indices[1]];
+            const Point &c = mesh->model->vertices[indices[2]];
+            float t, u, v;
+            if (watertight_triangle_intersect(setup, ray, a, b, c, &t, &u, &v)) return true;
+        }
+    #else
+        const INDEX *indices = &triangles[3*first];
+        for (int i = 0; i < num_triangles; i++, indices += 3) {
+            RENDER_STATS_ADD(triangle_tests, 1);
+            const Point &a = mesh->model->vertices[indices[0]];
+            const Point &b = mesh->model->vertices[indices[1]];
+            const Point &c = mesh->model->vertices[indices[2]];
+            if (triangle_does_intersect(mesh, a, b, c, ray)) return true;
+        }
+    #endif
+        return false;
+    }
+};
+
+/*--------------------------------------------------------------------------------
+    Packet traversal.
+    While traversing, only the distance, barycentric weights and vertex indices
+    of each ray's closest hit are kept. The rest of the local geometry is worked
+    out at the end for the triangle each ray finally hit.
+--------------------------------------------------------------------------------*/
+struct TrianglePacketHits {
+    uint32_t indices[3][RAY_PACKET_SIZE];
+    float w[3][RAY_PACKET_SIZE]; // Barycentric weights, not yet normalized.
+};
+
+// The part of the triangle tests which depends only on the rays of a packet, worked out once per packet.
+struct TrianglePacketSetup {
+#if WATERTIGHT_TRIANGLES
+    TriangleRaySetup rays[RAY_PACKET_SIZE];
+    // The shears and scales of the rays, as a structure of arrays.
+    alignas(16) float sx[RAY_PACKET_SIZE];
+    alignas(16) float sy[RAY_PACKET_SIZE];
+    alignas(16) float sz[RAY_PACKET_SIZE];
+    // Whether the active rays all have the same axes, as coherent rays mostly do. Otherwise they are tested
+    // one at a time.
+    bool same_axes;
+#endif
+    TrianglePacketSetup(const RayPacket &packet, uint32_t active) {
+    #if WATERTIGHT_TRIANGLES
+        same_axes = true;
+        int first = __builtin_ctz(active);
+        for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+            if (!(active & (1 << lane))) {
+                sx[lane] = sy[lane] = sz[lane] = 0;
+                continue;
+            }
+            rays[lane] = TriangleRaySetup(packet.ray(lane));
+            sx[lane] = rays[lane].sx;
+            sy[lane] = rays[lane].sy;
+            sz[lane] = rays[lane].sz;
+            if (rays[lane].kx != rays[first].kx || rays[lane].ky != rays[first].ky) same_axes = false;
+        }
+    #endif
+    }
+};
+
+#if RAY_PACKET_SIMD
+// dot(d, cross(u, v)), in the same order of operations as glm.
+static inline __m128 triple_product_ps(__m128 dx, __m128 dy, __m128 dz,
+                                       __m128 ux, __m128 uy, __m128 uz,
+                                       __m128 vx, __m128 vy, __m128 vz)
+{
+    __m128 cx = _mm_sub_ps(_mm_mul_ps(uy, vz), _mm_mul_ps(vy, uz));
+    __m128 cy = _mm_sub_ps(_mm_mul_ps(uz, vx), _mm_mul_ps(vz, ux));
+    __m128 cz = _mm_sub_ps(_mm_mul_ps(ux, vy), _mm_mul_ps(vx, uy));
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, cx), _mm_mul_ps(dy, cy)), _mm_mul_ps(dz, cz));
+}
+#endif
+
+// The test of triangle_intersect, for the active rays of a packet. The rays which hit closer than their max_t
+// have it shortened and their barycentric weights written to w, and the mask of these rays is returned.
+static inline uint32_t ray_packet_intersect_triangle(RayPacket &packet, uint32_t active,
+                                                     const Point &a, const Point &b, const Point &c,
+                                                     float w[3][RAY_PACKET_SIZE])
+{
+    Vector n = glm::cross(c-a, b-a);
+    const float epsilon = 1e-4;
+    uint32_t mask = 0;
+#if RAY_PACKET_SIMD
+    const __m128 sign_bit = _mm_set1_ps(-0.f);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 nx = _mm_set1_ps(n.x);
+    const __m128 ny = _mm_set1_ps(n.y);
+    const __m128 nz = _mm_set1_ps(n.z);
+    for (int g = 0; g < RAY_PACKET_SIZE; g += 4) {
+        int lanes = (active >> g) & 0xF;
+        if (lanes == 0) continue;
+        __m128 ox = _mm_load_ps(&packet.o[0][g]);
+        __m128 oy = _mm_load_ps(&packet.o[1][g]);
+        __m128 oz = _mm_load_ps(&packet.o[2][g]);
+        __m128 dx = _mm_load_ps(&packet.d[0][g]);
+        __m128 dy = _mm_load_ps(&packet.d[1][g]);
+        __m128 dz = _mm_load_ps(&packet.d[2][g]);
+
+        __m128 denom = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, nx), _mm_mul_ps(dy, ny)), _mm_mul_ps(dz, nz));
+        // Rays almost parallel to the triangle miss. The comparisons are negated so that NaNs behave as in triangle_intersect.
+        __m128 ok = _mm_cmpnlt_ps(_mm_andnot_ps(sign_bit, denom), _mm_set1_ps(epsilon));
+        __m128 aox = _mm_sub_ps(ox, _mm_set1_ps(a.x));
+        __m128 aoy = _mm_sub_ps(oy, _mm_set1_ps(a.y));
+        __m128 aoz = _mm_sub_ps(oz, _mm_set1_ps(a.z));
+        __m128 t = _mm_div_ps(_mm_xor_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(aox, nx), _mm_mul_ps(aoy, ny)), _mm_mul_ps(aoz, nz)), sign_bit), denom);
+        ok = _mm_and_ps(ok, _mm_cmpnlt_ps(t, _mm_load_ps(&packet.min_t[g])));
+        ok = _mm_and_ps(ok, _mm_cmpngt_ps(t, _mm_load_ps(&packet.max_t[g])));
+
+        __m128 box = _mm_sub_ps(_mm_set1_ps(b.x), ox), boy = _mm_sub_ps(_mm_set1_ps(b.y), oy), boz = _mm_sub_ps(_mm_set1_ps(b.z), oz);
+        __m128 cox = _mm_sub_ps(_mm_set1_ps(c.x), ox), coy = _mm_sub_ps(_mm_set1_ps(c.y), oy), coz = _mm_sub_ps(_mm_set1_ps(c.z), oz);
+        __m128 wa = triple_product_ps(dx, dy, dz, box, boy, boz, cox, coy, coz);
+        __m128 wb = triple_product_ps(dx, dy, dz, cox, coy, coz, _mm_xor_ps(aox, sign_bit), _mm_xor_ps(aoy, sign_bit), _mm_xor_ps(aoz, sign_bit));
+        __m128 wc = triple_product_ps(dx, dy, dz, _mm_xor_ps(aox, sign_bit), _mm_xor_ps(aoy, sign_bit), _mm_xor_ps(aoz, sign_bit), box, boy, boz);
+        // The ray passes inside the triangle if the three signed volumes have the same sign.
+        __m128 pa = _mm_cmpgt_ps(wa, zero);
+        __m128 pb = _mm_cmpgt_ps(wb, zero);
+        __m128 pc = _mm_cmpgt_ps(wc, zero);
+        ok = _mm_andnot_ps(_mm_or_ps(_mm_xor_ps(pa, pb), _mm_xor_ps(pb, pc)), ok);
+
+        int m = _mm_movemask_ps(ok) & lanes;
+        if (m == 0) continue;
+        float t_lanes[4], wa_lanes[4], wb_lanes[4], wc_lanes[4];
+        _mm_storeu_ps(t_lanes, t);
+        _mm_storeu_ps(wa_lanes, wa);
+        _mm_storeu_ps(wb_lanes, wb);
+        _mm_storeu_ps(wc_lanes, wc);
+        for (int l = 0; l < 4; l++) {
+            if (!(m & (1 << l))) continue;
+            packet.max_t[g+l] = t_lanes[l];
+            w[0][g+l] = wa_lanes[l];
+            w[1][g+l] = wb_lanes[l];
+            w[2][g+l] = wc_lanes[l];
+        }
+        mask |= m << g;
+    }
+#else
+    for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+        if (!(active & (1 << lane))) continue;
+        Ray ray = packet.ray(lane);
+        float denom = glm::dot(ray.d, n);
+        if (fabs(denom) < epsilon) continue;
+        float t = -glm::dot(ray.o - a, n)/denom;
+        if (t < ray.min_t || t > ray.max_t) continue;
+        float wa = glm::dot(ray.d, glm::cross(b-ray.o, c-ray.o));
+        float wb = glm::dot(ray.d, glm::cross(c-ray.o, a-ray.o));
+        float wc = glm::dot(ray.d, glm::cross(a-ray.o, b-ray.o));
+        if (((wa > 0) != (wb > 0)) || ((wb > 0) != (wc > 0))) continue;
+        packet.max_t[lane] = t;
+        w[0][lane] = wa;
+        w[1][lane] = wb;
+        w[2][lane] = wc;
+        mask |= 1 << lane;
+    }
+#endif
+    return mask;
+}
+
+#if PRECOMPUTED_TRIANGLES
+// The test of precomputed_triangle_intersect, for the active rays of a packet, writing the barycentric weights
+// of the hits to w as ray_packet_intersect_triangle does.
+static inline uint32_t ray_packet_intersect_precomputed_triangle(RayPacket &packet, uint32_t active,
+                                                                 const PrecomputedTriangle &tri,
+                                                                 float w[3][RAY_PACKET_SIZE])
+{
+    uint32_t mask = 0;
+#if RAY_PACKET_SIMD
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.f);
+    __m128 m[3][4];
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) m[i][j] = _mm_set1_ps(tri.m[i][j]);
+    }
+    for (int g = 0; g < RAY_PACKET_SIZE; g += 4) {
+        int lanes = (active >> g) & 0xF;
+        if (lanes == 0) continue;
+        __m128 ox = _mm_load_ps(&packet.o[0][g]);
+        __m128 oy = _mm_load_ps(&packet.o[1][g]);
+        __m128 oz = _mm_load_ps(&packet.o[2][g]);
+        __m128 dx = _mm_load_ps(&packet.d[0][g]);
+        __m128 dy = _mm_load_ps(&packet.d[1][g]);
+        __m128 dz = _mm_load_ps(&packet.d[2][g]);
+        // The same order of operations as precomputed_triangle_intersect.
+        __m128 o_z = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m[2][0], ox), _mm_mul_ps(m[2][1], oy)), _mm_mul_ps(m[2][2], oz)), m[2][3]);
+        __m128 d_z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[2][0], dx), _mm_mul_ps(m[2][1], dy)), _mm_mul_ps(m[2][2], dz));
+        __m128 t = _mm_div_ps(_mm_xor_ps(o_z, _mm_set1_ps(-0.f)), d_z);
+        // Ordered comparisons, so that NaNs miss.
+        __m128 ok = _mm_and_ps(_mm_cmpge_ps(t, _mm_load_ps(&packet.min_t[g])), _mm_cmple_ps(t, _mm_load_ps(&packet.max_t[g])));
+        if ((_mm_movemask_ps(ok) & lanes) == 0) continue;
+        __m128 px = _mm_add_ps(ox, _mm_mul_ps(t, dx));
+        __m128 py = _mm_add_ps(oy, _mm_mul_ps(t, dy));
+        __m128 pz = _mm_add_ps(oz, _mm_mul_ps(t, dz));
+        __m128 u = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m[0][0], px), _mm_mul_ps(m[0][1], py)), _mm_mul_ps(m[0][2], pz)), m[0][3]);
+        __m128 v = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m[1][0], px), _mm_mul_ps(m[1][1], py)), _mm_mul_ps(m[1][2], pz)), m[1][3]);
+        ok = _mm_and_ps(ok, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmpge_ps(v, zero)));
+        ok = _mm_and_ps(ok, _mm_cmple_ps(_mm_add_ps(u, v), one));
+
+        int hit = _mm_movemask_ps(ok) & lanes;
+        if (hit == 0) continue;
+        float t_lanes[4], u_lanes[4], v_lanes[4];
+        _mm_storeu_ps(t_lanes, t);
+        _mm_storeu_ps(u_lanes, u);
+        _mm_storeu_ps(v_lanes, v);
+        for (int l = 0; l < 4; l++) {
+            if (!(hit & (1 << l))) continue;
+            packet.max_t[g+l] = t_lanes[l];
+            w[0][g+l] = 1 - u_lanes[l] - v_lanes[l];
+            w[1][g+l] = u_lanes[l];
+            w[2][g+l] = v_lanes[l];
+        }
+        mask |= hit << g;
+    }
+#else
+    for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+        if (!(active & (1 << lane))) continue;
+        Ray ray = packet.ray(lane);
+        float t, u, v;
+        if (!precomputed_triangle_intersect(tri, ray, &t, &u, &v)) continue;
+        packet.max_t[lane] = t;
+        w[0][lane] = 1 - u - v;
+        w[1][lane] = u;
+        w[2][lane] = v;
+        mask |= 1 << lane;
+    }
+#endif
+    return mask;
+}
+#endif
+
+#if WATERTIGHT_TRIANGLES
+// The test of watertight_triangle_intersect, for the active rays of a packet, writing the barycentric weights
+// of the hits to w as ray_packet_intersect_triangle does.
+static inline uint32_t ray_packet_intersect_watertight_triangle(RayPacket &packet, uint32_t active,
+                                                                const TrianglePacketSetup &setup,
+                                                                const Point &a, const Point &b, const Point &c,
+                                                                float w[3][RAY_PACKET_SIZE])
+{
+    uint32_t mask = 0;
+#if RAY_PACKET_SIMD
+    if (setup.same_axes) {
+        const TriangleRaySetup &axes = setup.rays[__builtin_ctz(active)];
+        const int kx = axes.kx, ky = axes.ky, kz = axes.kz;
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 sign_bit = _mm_set1_ps(-0.f);
+        for (int g = 0; g < RAY_PACKET_SIZE; g += 4) {
+            int lanes = (active >> g) & 0xF;
+            if (lanes == 0) continue;
+            __m128 okx = _mm_load_ps(&packet.o[kx][g]), oky = _mm_load_ps(&packet.o[ky][g]), okz = _mm_load_ps(&packet.o[kz][g]);
+            __m128 sx = _mm_load_ps(&setup.sx[g]), sy = _mm_load_ps(&setup.sy[g]), sz = _mm_load_ps(&setup.sz[g]);
+            // The same order of operations as watertight_triangle_intersect.
+            #define SHEAR(P, X, Y, Z) \
+                __m128 Z = _mm_sub_ps(_mm_set1_ps(P[kz]), okz); \
+                __m128 X = _mm_sub_ps(_mm_sub_ps(_mm_set1_ps(P[kx]), okx), _mm_mul_ps(sx, Z)); \
+                __m128 Y = _mm_sub_ps(_mm_sub_ps(_mm_set1_ps(P[ky]), oky), _mm_mul_ps(sy, Z));
+            SHEAR(a, ax, ay, az)
+            SHEAR(b, bx, by, bz)
+            SHEAR(c, cx, cy, cz)
+            #undef SHEAR
+            __m128 U = _mm_sub_ps(_mm_mul_ps(cx, by), _mm_mul_ps(cy, bx));
+            __m128 V = _mm_sub_ps(_mm_mul_ps(ax, cy), _mm_mul_ps(ay, cx));
+            __m128 W = _mm_sub_ps(_mm_mul_ps(bx, ay), _mm_mul_ps(by, ax));
+            int on_edge = lanes & _mm_movemask_ps(_mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(U, zero), _mm_cmpeq_ps(V, zero)),
+                                                            _mm_cmpeq_ps(W, zero)));
+            __m128 negative = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(U, zero), _mm_cmplt_ps(V, zero)), _mm_cmplt_ps(W, zero));
+            __m128 positive = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(U, zero), _mm_cmpgt_ps(V, zero)), _mm_cmpgt_ps(W, zero));
+            __m128 det = _mm_add_ps(_mm_add_ps(U, V), W);
+            __m128 ok = _mm_andnot_ps(_mm_and_ps(negative, positive), _mm_cmpneq_ps(det, zero));
+            __m128 T = _mm_add_ps(_mm_add_ps(_mm_mul_ps(U, _mm_mul_ps(sz, az)), _mm_mul_ps(V, _mm_mul_ps(sz, bz))),
+                                  _mm_mul_ps(W, _mm_mul_ps(sz, cz)));
+            __m128 det_sign = _mm_and_ps(det, sign_bit);
+            __m128 abs_det = _mm_xor_ps(det, det_sign);
+            __m128 abs_T = _mm_xor_ps(T, det_sign);
+            ok = _mm_and_ps(ok, _mm_and_ps(_mm_cmpge_ps(abs_T, _mm_mul_ps(_mm_load_ps(&packet.min_t[g]), abs_det)),
+                                           _mm_cmple_ps(abs_T, _mm_mul_ps(_mm_load_ps(&packet.max_t[g]), abs_det))));
+            int hit = _mm_movemask_ps(ok) & lanes & ~on_edge;
+            if (hit == 0 && on_edge == 0) continue;
+            float t_lanes[4], U_lanes[4], V_lanes[4], W_lanes[4];
+            _mm_storeu_ps(t_lanes, _mm_mul_ps(T, _mm_div_ps(_mm_set1_ps(1.f), det)));
+            _mm_storeu_ps(U_lanes, U);
+            _mm_storeu_ps(V_lanes, V);
+            _mm_storeu_ps(W_lanes, W);
+            for (int l = 0; l < 4; l++) {
+                if (on_edge & (1 << l)) {
+                    // Redo the rays on an edge in double precision.
+                    float t, u, v;
+                    if (!watertight_triangle_intersect(setup.rays[g+l], packet.ray(g+l), a, b, c, &t, &u, &v)) continue;
+                    t_lanes[l] = t;
+                    U_lanes[l] = 1 - u - v;
+                    V_lanes[l] = u;
+                    W_lanes[l] = v;
+                    hit |= 1 << l;
+                }
+                if (!(hit & (1 << l))) continue;
+                packet.max_t[g+l] = t_lanes[l];
+                w[0][g+l] = U_lanes[l];
+                w[1][g+l] = V_lanes[l];
+                w[2][g+l] = W_lanes[l];
+            }
+            mask |= hit << g;
+        }
+        return mask;
+    }
+#endif
+    for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+        if (!(active & (1 << lane))) continue;
+        float t, u, v;
+        if (!watertight_triangle_intersect(setup.rays[lane], packet.ray(lane), a, b, c, &t, &u, &v)) continue;
+        packet.max_t[lane] = t;
+        w[0][lane] = 1 - u - v;
+        w[1][lane] = u;
+        w[2][lane] = v;
+        mask |= 1 << lane;
+    }
+    return mask;
+}
+#endif
+
+// The triangle test for packets, through the precomputed triangle at the given position
+// (see TriangleMesh::precomputed_triangles) if there are precomputed triangles, otherwise through the vertices.
+static inline uint32_t ray_packet_intersect_mesh_triangle(const TriangleMesh *mesh, uint32_t position,
+                                                          uint32_t index_a, uint32_t index_b, uint32_t index_c,
+                                                          RayPacket &packet, uint32_t active,
+                                                          const TrianglePacketSetup &setup,
+                                                          float w[3][RAY_PACKET_SIZE])
+{
+    RENDER_STATS_ADD(triangle_tests, RayPacket::num_rays(active));
+#if PRECOMPUTED_TRIANGLES
+#if TRIANGLE_GROUPS
+    if (!mesh->triangle_groups.empty()) {
+        // Packets are tested against the triangles of a group one at a time, since their rays are the SIMD lanes.
+        const PrecomputedTriangleGroup &group = mesh->triangle_groups[position / TRIANGLE_LEAF_WIDTH];
+        return ray_packet_intersect_precomputed_triangle(packet, active, group.triangle(position % TRIANGLE_LEAF_WIDTH), w);
+    }
+#endif
+    return ray_packet_intersect_precomputed_triangle(packet, active, mesh->precomputed_triangles[position], w);
+#else
+    const Point &a = mesh->model->vertices[index_a];
+    const Point &b = mesh->model->vertices[index_b];
+    const Point &c = mesh->model->vertices[index_c];
+#if WATERTIGHT_TRIANGLES
+    return ray_packet_intersect_watertight_triangle(packet, active, setup, a, b, c, w);
+#else
+    return ray_packet_intersect_triangle(packet, active, a, b, c, w);
+#endif
+#endif
+}
+
+static inline uint32_t triangle_intersect_packet(const TriangleMesh *mesh, uint32_t position,
+                                                 uint32_t index_a, uint32_t index_b, uint32_t index_c,
+                                                 RayPacket &packet, uint32_t active, const TrianglePacketSetup &setup,
+                                                 TrianglePacketHits &hits)
+{
+    uint32_t mask = ray_packet_intersect_mesh_triangle(mesh, position, index_a, index_b, index_c, packet, active, setup, hits.w);
+    for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+        if (!(mask & (1 << lane))) continue;
+        hits.indices[0][lane] = index_a;
+        hits.indices[1][lane] = index_b;
+        hits.indices[2][lane] = index_c;
+    }
+    return mask;
+}
+
+template <typename NODE>
+static inline uint32_t triangles_bvh_intersect_packet(const TriangleMesh *mesh, const vector<NODE> &triangles_bvh,
+                                                      RayPacket &packet, uint32_t active, TrianglePacketHits &hits)
+{
+    // The same traversal as triangles_bvh_intersect, where each entry of the stack holds the rays that hit its parent.
+    TrianglePacketSetup setup(packet, active);
+    uint32_t hit = 0;
+    uint32_t todo[128];
+    uint32_t todo_leaf[128];
+    uint32_t todo_active[128];
+    int todo_now = 0;
+    todo[0] = 0;
+    todo_leaf[0] = 0;
+    todo_active[0] = active;
+    while (todo_now >= 0) {
+        int index = todo[todo_now];
+        uint32_t leaf = todo_leaf[todo_now];
+        uint32_t mask = todo_active[todo_now--];
+        RENDER_STATS_ADD(box_tests, RayPacket::num_rays(mask));
+        mask = ray_packet_intersect_box(packet, mask, triangles_bvh[index].box);
+        if (mask == 0) continue;
+        RENDER_STATS_ADD(nodes_visited, RayPacket::num_rays(mask));
+        if (triangles_bvh[index].next_shift == 0) {
+            // Leaf node.
+            do {
+                RENDER_STATS_ADD(primitive_tests, RayPacket::num_rays(mask));
+                hit |= triangle_intersect_packet(mesh, leaf, triangles_bvh[index].a, triangles_bvh[index].b, triangles_bvh[index].c,
+                                                 packet, mask, setup, hits);
+                index ++;
+                leaf ++;
+            } while (index < mesh->triangles_bvh_length && triangles_bvh[index].next_shift == 0);
+        } else {
+            // Visit the near child first, going by the direction of the first of the rays.
+            int lane = __builtin_ctz(mask);
+            todo_now += 2;
+            todo_active[todo_now-1] = todo_active[todo_now] = mask;
+            if (packet.d[triangles_bvh[index].axis][lane] < 0) {
+                todo[todo_now-1] = index + 1;
+                todo_leaf[todo_now-1] = leaf;
+                todo[todo_now] = index + triangles_bvh[index].next_shift;
+                todo_leaf[todo_now] = triangles_bvh[index].second_leaf;
+            } else {
+                todo[todo_now-1] = index + triangles_bvh[index].next_shift;
+                todo_leaf[todo_now-1] = triangles_bvh[index].second_leaf;
+                todo[todo_now] = index + 1;
+                todo_leaf[todo_now] = leaf;
+            }
+        }
+    }
+    return hit;
+}
+
+// Any-hit packet traversal, as in triangles_bvh_does_intersect. Rays drop out once they are blocked.
+// (The blocked rays' max_t are shortened to the hit, which does not matter for occlusion.)
+template <typename NODE>
+static inline uint32_t triangles_bvh_does_intersect_packet(const TriangleMesh *mesh, const vector<NODE> &triangles_bvh,
+                                                           RayPacket &packet, uint32_t active)
+{
+    TrianglePacketSetup setup(packet, active);
+    uint32_t occluded = 0;
+    float w[3][RAY_PACKET_SIZE];
+    uint32_t todo[128];
+    uint32_t todo_leaf[128];
+    uint32_t todo_active[128];
+    int todo_now = 0;
+    todo[0] = 0;
+    todo_leaf[0] = 0;
+    todo_active[0] = active;
+    while (todo_now >= 0) {
+        int index = todo[todo_now];
+        uint32_t leaf = todo_leaf[todo_now];
+        uint32_t mask = todo_active[todo_now--] & ~occluded;
+        RENDER_STATS_ADD(box_tests, RayPacket::num_rays(mask));
+        mask = ray_packet_intersect_box(packet, mask, triangles_bvh[index].box);
+        if (mask == 0) continue;
+        RENDER_STATS_ADD(nodes_visited, RayPacket::num_rays(mask));
+        if (triangles_bvh[index].next_shift == 0) {
+            // Leaf node.
+            do {
+                RENDER_STATS_ADD(primitive_tests, RayPacket::num_rays(mask));
+                uint32_t blocked = ray_packet_intersect_mesh_triangle(mesh, leaf, triangles_bvh[index].a, triangles_bvh[index].b,
+                                                                      triangles_bvh[index].c, packet, mask, setup, w);
+                occluded |= blocked;
+                mask &= ~blocked;
+                index ++;
+                leaf ++;
+            } while (mask != 0 && index < mesh->triangles_bvh_length && triangles_bvh[index].next_shift == 0);
+            if (occluded == active) break;
+        } else {
+            // Any hit will do, so the children are not ordered.
+            todo_now += 2;
+            todo_active[todo_now-1] = todo_active[todo_now] = mask;
+            todo[todo_now-1] = index + triangles_bvh[index].next_shift;
+            todo_leaf[todo_now-1] = triangles_bvh[index].second_leaf;
+            todo[todo_now] = index + 1;
+            todo_leaf[todo_now] = leaf;
+        }
+    }
+    return occluded;
+}
+
+template <typename INDEX>
+struct TriangleLeafPacketIntersector {
+    const TriangleMesh *mesh;
+    const vector<INDEX> &triangles;
+    const TrianglePacketSetup &setup;
+    TrianglePacketHits &hits;
+    inline uint32_t operator()(uint32_t first, int num_triangles, RayPacket &packet, uint32_t active) {
+        uint32_t hit = 0;
+        const INDEX *indices = &triangles[3*first];
+    #if TRIANGLE_GROUPS
+        // Each ray is tested against a whole group at once, as in TriangleLeafIntersector. Taking the triangles one
+        // at a time across the lanes of the packet takes as many tests as there are triangles even when few of the
+        // rays reach the leaf, which is usual below the top of the hierarchy.
+        RENDER_STATS_ADD(triangle_tests, num_triangles * RayPacket::num_rays(active));
+        const TriangleGroup *groups = &mesh->triangle_groups[first / TRIANGLE_LEAF_WIDTH];
+        for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+            if (!(active & (1 << lane))) continue;
+            Ray ray = packet.ray(lane);
+        #if WATERTIGHT_TRIANGLES
+            const TriangleRaySetup &ray_setup = setup.rays[lane];
+        #else
+            TriangleRaySetup ray_setup(ray);
+        #endif
+            for (int g = 0; g < num_triangles; g += TRIANGLE_LEAF_WIDTH) {
+                float t, u, v;
+                int group_lane = triangle_group_intersect(groups[g / TRIANGLE_LEAF_WIDTH], ray_setup, ray, &t, &u, &v);
+                if (group_lane < 0) continue;
+                ray.max_t = packet.max_t[lane] = t;
+                hits.w[0][lane] = 1 - u - v;
+                hits.w[1][lane] = u;
+                hits.w[2][lane] = v;
+                const INDEX *hit_indices = &indices[3*(g + group_lane)];
+                for (int i = 0; i < 3; i++) hits.indices[i][lane] = hit_indices[i];
+                hit |= 1 << lane;
+            }
+        }
+    #else
+        for (int i = 0; i < num_triangles; i++, indices += 3) {
+            hit |= triangle_intersect_packet(mesh, first + i, indices[0], indices[1], indices[2], packet, active, setup, hits);
+        }
+    #endif
+        return hit;
+    }
+};
+template <typename INDEX>
+struct TriangleLeafPacketOccluder {
+    const TriangleMesh *mesh;
+    const vector<INDEX> &triangles;
+    const TrianglePacketSetup &setup;
+    inline uint32_t operator()(uint32_t first, int num_triangles, RayPacket &packet, uint32_t active) {
+        uint32_t occluded = 0;
+    #if TRIANGLE_GROUPS
+        // One ray at a time against whole groups, as in TriangleLeafPacketIntersector.
+        const TriangleGroup *groups = &mesh->triangle_groups[first / TRIANGLE_LEAF_WIDTH];
+        for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+            if (!(active & (1 << lane))) continue;
+            Ray ray = packet.ray(lane);
+        #if WATERTIGHT_TRIANGLES
+            const TriangleRaySetup &ray_setup = setup.rays[lane];
+        #else
+            TriangleRaySetup ray_setup(ray);
+        #endif
+            for (int g = 0; g < num_triangles; g += TRIANGLE_LEAF_WIDTH) {
+                RENDER_STATS_ADD(triangle_tests, min(TRIANGLE_LEAF_WIDTH, num_triangles - g));
+                if (triangle_group_occludes(groups[g / TRIANGLE_LEAF_WIDTH], ray_setup, ray)) {
+                    occluded |= 1 << lane;
+                    break;
+                }
+            }
+        }
+        return occluded;
+    #else
+        float w[3][RAY_PACKET_SIZE];
+        const INDEX *indices = &triangles[3*first];
+        for (int i = 0; i < num_triangles && active != 0; i++, indices += 3) {
+            uint32_t blocked = ray_packet_intersect_mesh_triangle(mesh, first + i, indices[0], indices[1], indices[2],
+                                                                  packet, active, setup, w);
+            occluded |= blocked;
+            active &= ~blocked;
+        }
+        return occluded;
+    #endif
+    }
+};
+
 bool TriangleMesh::intersect(Ray &ray, LocalGeometry *geom) const
 {
-    return triangles_bvh_intersect(this, triangles_bvh, ray, geom);
+    if (m_layout == TRIANGLE_MESH_BINARY) {
+        if (compact_indices) return triangles_bvh_intersect(this, triangles_bvh16, ray, geom);
+        return triangles_bvh_intersect(this, triangles_bvh32, ray, geom);
+    }
+
+    bool hit;
+    if (compact_indices) {
+        TriangleLeafIntersector<uint16_t> leaf_intersector = { this, wide_bvh_triangles16, geom, TriangleRaySetup(ray) };
+        hit = m_layout == TRIANGLE_MESH_QUANTIZED ? wide_bvh_intersect(quantized_wide_bvh, ray, leaf_intersector)
+                                                  : wide_bvh_intersect(wide_bvh, ray, leaf_intersector);
+    } else {
+        TriangleLeafIntersector<uint32_t> leaf_intersector = { this, wide_bvh_triangles32, geom, TriangleRaySetup(ray) };
+        hit = m_layout == TRIANGLE_MESH_QUANTIZED ? wide_bvh_intersect(quantized_wide_bvh, ray, leaf_intersector)
+                                                  : wide_bvh_intersect(wide_bvh, ray, leaf_intersector);
+    }
+    if (!hit) return false;
+    // Finish off the LocalGeometry as in triangles_bvh_intersect.
+    geom->shape = this;
+    if (model->has_normals) geom->n = glm::normalize(geom->n);
+    return true;
 }
 bool TriangleMesh::does_intersect(Ray &ray) const
 {
-    return triangles_bvh_does_intersect(this, triangles_bvh, ray);
+    if (m_layout != TRIANGLE_MESH_BINARY) {
+        if (compact_indices) {
+            TriangleLeafOccluder<uint16_t> leaf_occluder = { this, wide_bvh_triangles16, TriangleRaySetup(ray) };
+            return m_layout == TRIANGLE_MESH_QUANTIZED ? wide_bvh_does_intersect(quantized_wide_bvh, ray, leaf_occluder)
+                                                       : wide_bvh_does_intersect(wide_bvh, ray, leaf_occluder);
+        }
+        TriangleLeafOccluder<uint32_t> leaf_occluder = { this, wide_bvh_triangles32, TriangleRaySetup(ray) };
+        return m_layout == TRIANGLE_MESH_QUANTIZED ? wide_bvh_does_intersect(quantized_wide_bvh, ray, leaf_occluder)
+                                                   : wide_bvh_does_intersect(wide_bvh, ray, leaf_occluder);
+    }
+    if (compact_indices) return triangles_bvh_does_intersect(this, triangles_bvh16, ray);
+    return triangles_bvh_does_intersect(this, triangles_bvh32, ray);
     // //---specialize this.
     // LocalGeometry geom;
     // return intersect(ray, &geom);
 }
+uint32_t TriangleMesh::does_intersect_packet(RayPacket &packet, uint32_t active) const
+{
+    if (RayPacket::num_rays(active) < RAY_PACKET_MIN_RAYS) return Shape::does_intersect_packet(packet, active);
+    if (m_layout == TRIANGLE_MESH_BINARY) {
+        if (compact_indices) return triangles_bvh_does_intersect_packet(this, triangles_bvh16, packet, active);
+        return triangles_bvh_does_intersect_packet(this, triangles_bvh32, packet, active);
+    }
+    TrianglePacketSetup setup(packet, active);
+    if (compact_indices) {
+        TriangleLeafPacketOccluder<uint16_t> leaf_occluder = { this, wide_bvh_triangles16, setup };
+        return m_layout == TRIANGLE_MESH_QUANTIZED ? wide_bvh_does_intersect_packet(quantized_wide_bvh, packet, active, leaf_occluder)
+                                                   : wide_bvh_does_intersect_packet(wide_bvh, packet, active, leaf_occluder);
+    }
+    TriangleLeafPacketOccluder<uint32_t> leaf_occluder = { this, wide_bvh_triangles32, setup };
+    return m_layout == TRIANGLE_MESH_QUANTIZED ? wide_bvh_does_intersect_packet(quantized_wide_bvh, packet, active, leaf_occluder)
+                                               : wide_bvh_does_intersect_packet(wide_bvh, packet, active, leaf_occluder);
+}
+uint32_t TriangleMesh::intersect_packet(RayPacket &packet, uint32_t active, LocalGeometry *geoms) const
+{
+    if (RayPacket::num_rays(active) < RAY_PACKET_MIN_RAYS) return Shape::intersect_packet(packet, active, geoms);
+    TrianglePacketHits hits;
+    uint32_t hit;
+    if (m_layout == TRIANGLE_MESH_BINARY) {
+        if (compact_indices) hit = triangles_bvh_intersect_packet(this, triangles_bvh16, packet, active, hits);
+        else hit = triangles_bvh_intersect_packet(this, triangles_bvh32, packet, active, hits);
+    } else if (compact_indices) {
+        TrianglePacketSetup setup(packet, active);
+        TriangleLeafPacketIntersector<uint16_t> leaf_intersector = { this, wide_bvh_triangles16, setup, hits };
+        hit = m_layout == TRIANGLE_MESH_QUANTIZED ? wide_bvh_intersect_packet(quantized_wide_bvh, packet, active, leaf_intersector)
+                                                  : wide_bvh_intersect_packet(wide_bvh, packet, active, leaf_intersector);
+    } else {
+        TrianglePacketSetup setup(packet, active);
+        TriangleLeafPacketIntersector<uint32_t> leaf_intersector = { this, wide_bvh_triangles32, setup, hits };
+        hit = m_layout == TRIANGLE_MESH_QUANTIZED ? wide_bvh_intersect_packet(quantized_wide_bvh, packet, active, leaf_intersector)
+                                                  : wide_bvh_intersect_packet(wide_bvh, packet, active, leaf_intersector);
+    }
+    // Work out the local geometry at each ray's closest hit, as triangle_intersect and TriangleMesh::intersect do.
+    for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+        if (!(hit & (1 << lane))) continue;
+        LocalGeometry &geom = geoms[lane];
+        geom.p = packet.ray(lane)(packet.max_t[lane]);
+        if (model->has_normals) {
+            float wa = hits.w[0][lane];
+            float wb = hits.w[1][lane];
+            float wc = hits.w[2][lane];
+            float winv = 1.0 / (wa + wb + wc);
+            wa *= winv;
+            wb *= winv;
+            wc *= winv;
+            Vector &na = model->normals[hits.indices[0][lane]];
+            Vector &nb = model->normals[hits.indices[1][lane]];
+            Vector &nc = model->normals[hits.indices[2][lane]];
+            geom.n = glm::normalize(wa*na + wb*nb + wc*nc);
+        } else {
+            const Point &a = model->vertices[hits.indices[0][lane]];
+            const Point &b = model->vertices[hits.indices[1][lane]];
+            const Point &c = model->vertices[hits.indices[2][lane]];
+            geom.n = glm::cross(c-a, b-a);
+        }
+        geom.shape = this;
+    }
+    return hit;
+}
 BoundingBox TriangleMesh::object_bound() const
 {
     return m_world_bound;
 }
 
-TriangleMesh::TriangleMesh(const Transform &o2w, Model *_model)
+TriangleMesh::TriangleMesh(const Transform &o2w, Model *_model, bool build_now, TriangleMeshLayout layout)
 {
     // Even though the triangles are baked into world space, keep the
     // transforms, since they are used elsewhere.
@@ -382,16 +1611,41 @@ TriangleMesh::TriangleMesh(const Transform &o2w, Model *_model)
     //---------...... o2w seems to be used elsewhere and clashes with the triangles being in worldspace.
     //---------w2o is still useful and seems to work.
     world_to_object = o2w.inverse();
+    m_object_to_world = o2w;
+    model = _model;
+    m_layout = layout;
+    m_built = false;
+    m_cache_key = 0;
+    if (build_now) build();
+}
 
+BVHBuildParameters triangle_mesh_bvh_parameters(TriangleMeshLayout layout)
+{
+    BVHBuildParameters params(TRIANGLE_MESH_SPATIAL_SPLITS ? BVH_SPLIT_SBVH : BVH_SPLIT_SAH);
+#if TRIANGLE_GROUPS
+    // Wide leaves are intersected a group at a time, so fill them up.
+    if (layout != TRIANGLE_MESH_BINARY) {
+        params.max_leaf_primitives = TRIANGLE_LEAF_MAX_GROUPS * TRIANGLE_LEAF_WIDTH;
+        params.sah_primitive_group_size = TRIANGLE_LEAF_WIDTH;
+    }
+#endif
+    return params;
+}
+
+void TriangleMesh::build()
+{
+    if (m_built) return;
     // Copy and transform the model into world space.
     // This can save a lot of ray transformations.
     std::cout << "Creating triangle mesh\n";
     
-    // model = _model;
-    model = _model->copy();
-    std::cout << "Copied\n";
-    model->transform_by(o2w);
-    std::cout << "Transformed\n";
+    if (!m_object_to_world.is_identity()) {
+        // Meshes shared between instances are built with the identity transform, and use the model as-is.
+        model = model->copy();
+        std::cout << "Copied\n";
+        model->transform_by(m_object_to_world);
+        std::cout << "Transformed\n";
+    }
 
     // Set up to use the usual code to create a BVH (don't want to duplicate that here).
     vector<MeshTriangle> triangles = vector<MeshTriangle>(model->num_triangles);
@@ -403,18 +1657,117 @@ TriangleMesh::TriangleMesh(const Transform &o2w, Model *_model)
         triangle_pointers[i] = &geometric_triangles[i];
     }
     // Construct a usual bounding volume heirarchy around the mesh triangles.
-    BVH bvh = BVH(triangle_pointers, true);
-    int unravelled_length = 0;
-    bvh_unravelled_length_recur(bvh.uncompacted_root, &unravelled_length);
-    triangles_bvh = vector<TriangleNode>(unravelled_length);
-    printf("flattened: %d\n", bvh.flattened_length());
-    printf("unravelled: %d\n", unravelled_length);
-    triangles_bvh_length = unravelled_length;
-
-    printf("Flattening to triangles ...\n");
-    flatten_to_triangles_bvh(bvh, triangles_bvh);
-    printf("Flattened!\n");
+    BVH bvh = BVH(triangle_pointers, true, triangle_mesh_bvh_parameters(m_layout));
     m_world_bound = bvh.world_bound();
-    
-    //----Destroy the bvh!
+    // 16-bit indices are used if every vertex index fits, and, for the binary layout, the offsets to second children
+    // (which are at most the length of the array) fit in an int16_t.
+    compact_indices = model->num_vertices <= UINT16_MAX + 1;
+    if (m_layout != TRIANGLE_MESH_BINARY) {
+        collapse_to_wide_bvh(bvh.uncompacted_root, wide_bvh);
+        // The leaves reference ranges of the BVH's primitive array, so lay out the triangles in the same order.
+        if (compact_indices) gather_leaf_triangles(bvh, wide_bvh_triangles16);
+        else gather_leaf_triangles(bvh, wide_bvh_triangles32);
+    #if TRIANGLE_GROUPS
+        if (compact_indices) align_leaf_triangles(wide_bvh, wide_bvh_triangles16);
+        else align_leaf_triangles(wide_bvh, wide_bvh_triangles32);
+    #endif
+        if (m_layout == TRIANGLE_MESH_QUANTIZED) {
+            quantize_wide_bvh(wide_bvh, quantized_wide_bvh);
+            vector<WideBVHNode>().swap(wide_bvh);
+        }
+    } else {
+        int unravelled_length = 0;
+        bvh_unravelled_length_recur(bvh.uncompacted_root, &unravelled_length);
+        if (unravelled_length > INT16_MAX) compact_indices = false;
+        printf("flattened: %d\n", bvh.flattened_length());
+        printf("unravelled: %d\n", unravelled_length);
+        triangles_bvh_length = unravelled_length;
+
+        printf("Flattening to triangles ...\n");
+        if (compact_indices) {
+            triangles_bvh16 = vector<TriangleNode16>(unravelled_length);
+            flatten_to_triangles_bvh(bvh, triangles_bvh16);
+        } else {
+            triangles_bvh32 = vector<TriangleNode32>(unravelled_length);
+            flatten_to_triangles_bvh(bvh, triangles_bvh32);
+        }
+        printf("Flattened!\n");
+    }
+    precompute_triangles();
+    BVH_delete_node(bvh.uncompacted_root);
+    bvh.uncompacted_root = NULL;
+    m_built = true;
+    if (!m_cache_filename.empty()) write_cache();
+}
+
+void TriangleMesh::precompute_triangles()
+{
+#if PRECOMPUTED_TRIANGLES
+    auto precompute = [&](uint32_t a, uint32_t b, uint32_t c) {
+        return precompute_triangle(model->vertices[a], model->vertices[b], model->vertices[c]);
+    };
+    if (m_layout != TRIANGLE_MESH_BINARY) {
+        int num_positions = (compact_indices ? wide_bvh_triangles16.size() : wide_bvh_triangles32.size()) / 3;
+        vector<PrecomputedTriangle> triangles(num_positions);
+        for (int i = 0; i < num_positions; i++) {
+            if (compact_indices) {
+                const uint16_t *t = &wide_bvh_triangles16[3*i];
+                triangles[i] = precompute(t[0], t[1], t[2]);
+            } else {
+                const uint32_t *t = &wide_bvh_triangles32[3*i];
+                triangles[i] = precompute(t[0], t[1], t[2]);
+            }
+        }
+    #if TRIANGLE_GROUPS
+        // Transpose into groups. The leaves are aligned to the groups, so there are a whole number of them.
+        triangle_groups = vector<TriangleGroup>(num_positions / TRIANGLE_LEAF_WIDTH);
+        for (int i = 0; i < num_positions; i++) {
+            TriangleGroup &group = triangle_groups[i / TRIANGLE_LEAF_WIDTH];
+            for (int r = 0; r < 3; r++) {
+                for (int c = 0; c < 4; c++) group.m[r][c][i % TRIANGLE_LEAF_WIDTH] = triangles[i].m[r][c];
+            }
+        }
+    #else
+        precomputed_triangles.swap(triangles);
+    #endif
+    } else {
+        // One for each leaf node, in order.
+        precomputed_triangles.clear();
+        precomputed_triangles.reserve(model->num_triangles);
+        for (int i = 0; i < triangles_bvh_length; i++) {
+            if (compact_indices && triangles_bvh16[i].next_shift == 0) {
+                precomputed_triangles.push_back(precompute(triangles_bvh16[i].a, triangles_bvh16[i].b, triangles_bvh16[i].c));
+            } else if (!compact_indices && triangles_bvh32[i].next_shift == 0) {
+                precomputed_triangles.push_back(precompute(triangles_bvh32[i].a, triangles_bvh32[i].b, triangles_bvh32[i].c));
+            }
+        }
+    }
+#elif WATERTIGHT_TRIANGLES && TRIANGLE_GROUPS
+    if (m_layout != TRIANGLE_MESH_BINARY) {
+        int num_positions = (compact_indices ? wide_bvh_triangles16.size() : wide_bvh_triangles32.size()) / 3;
+        triangle_groups = vector<TriangleGroup>(num_positions / TRIANGLE_LEAF_WIDTH);
+        for (int i = 0; i < num_positions; i++) {
+            TriangleGroup &group = triangle_groups[i / TRIANGLE_LEAF_WIDTH];
+            uint32_t indices[3];
+            for (int j = 0; j < 3; j++) indices[j] = compact_indices ? wide_bvh_triangles16[3*i+j] : wide_bvh_triangles32[3*i+j];
+            // The padding triangles (and any others with a single vertex, which can't be hit anyway) are made NaN.
+            bool padding = indices[0] == indices[1] && indices[1] == indices[2];
+            for (int j = 0; j < 3; j++) {
+                const Point &p = model->vertices[indices[j]];
+                for (int axis = 0; axis < 3; axis++) {
+                    group.v[j][axis][i % TRIANGLE_LEAF_WIDTH] = padding ? NAN : p[axis];
+                }
+            }
+        }
+    }
+#endif
+}
+
+void build_triangle_meshes(const vector<TriangleMesh *> &meshes)
+{
+    // Separate meshes are built at the same time. Each mesh's BVH build spawns its own parallel work too,
+    // which is shared out between the same threads (so a lone big mesh still uses all of them).
+    parallel_for_2D([&](int i, int, int) {
+        meshes[i]->build();
+    }, meshes.size(), 1);
 }
@@ -6,25 +6,118 @@
 #include "models.hpp"
 #include "aggregates.hpp"
 
+// The node of the unravelled triangle BVH, parameterized by the vertex index type and the type of the offset
+// to the second child.
+// Meshes use TriangleNode16 (32 bytes) when its indices and offsets fit, to keep more nodes in cache,
+// and TriangleNode32 (40 bytes) otherwise.
+template <typename INDEX, typename SHIFT>
 struct TriangleNode {
     BoundingBox box; // 6 floats, 24 bytes
-    uint16_t a; // leaf
-    uint16_t b; // leaf
+    INDEX a; // leaf
     union {
-        uint16_t c; // leaf
-        uint16_t axis; // branch
+        INDEX b; // leaf
+        // branch: the number, counting leaves only, of the first leaf under the second child. The precomputed
+        // triangles are numbered this way, so traversal keeps count of the leaf number alongside the node index.
+        INDEX second_leaf;
     };
-    int16_t next_shift; // zero signifies a leaf
+    union {
+        INDEX c; // leaf
+        INDEX axis; // branch
+    };
+    SHIFT next_shift; // zero signifies a leaf
     TriangleNode() {}
 };
+typedef TriangleNode<uint16_t, int16_t> TriangleNode16;
+typedef TriangleNode<uint32_t, int32_t> TriangleNode32;
+
+// How the triangles of a mesh are arranged for traversal.
+enum TriangleMeshLayout {
+    // The binary BVH unravelled into an array of TriangleNodes, with a node for each triangle at the leaves.
+    TRIANGLE_MESH_BINARY,
+    // A wide BVH (see aggregates/wide_bvh.hpp), whose leaves are ranges of wide_bvh_triangles16/32.
+    TRIANGLE_MESH_WIDE,
+    // The wide layout with QuantizedWideBVHNodes, whose child boxes take 8 bits per plane instead of 32.
+    TRIANGLE_MESH_QUANTIZED,
+};
+
+// Intersect rays with triangles by the watertight test of Woop, Benthin and Wald ("Watertight Ray/Triangle
+// Intersection", JCGT 2013). The vertices are moved into a space where the ray is the z axis, and the edge tests
+// are worked out there from the vertices alone (in double precision for a ray on an edge), so the two triangles
+// sharing an edge agree on which side of it a ray passes, and no ray slips between them. The other tests work
+// the plane and edges out separately for each triangle, and rounding can leak rays through shared edges.
+#define WATERTIGHT_TRIANGLES 0
+
+// Unless WATERTIGHT_TRIANGLES, intersect rays with triangles through a transform precomputed for each triangle
+// (PrecomputedTriangle), stored in the order the leaves visit them, rather than by gathering the three vertices
+// through the index arrays and working out the plane and edge tests from them. This costs 48 bytes more per triangle.
+#define PRECOMPUTED_TRIANGLES (!WATERTIGHT_TRIANGLES)
+
+// The affine transform taking a triangle to the unit triangle, (0,0,0), (1,0,0), (0,1,0), and its normal to z
+// (following Woop, Benthin and Wald's "unit triangle" test). A ray hits the plane where the transformed z is zero,
+// and the transformed x and y there are the barycentric coordinates of the second and third vertices.
+// Each row holds the linear part then the translation. Degenerate triangles have all zeros, which nothing hits.
+struct PrecomputedTriangle {
+    float m[3][4];
+};
+
+// With PRECOMPUTED_TRIANGLES or WATERTIGHT_TRIANGLES, the triangles of each leaf of the wide layout are packed into
+// groups of this many, stored as a structure of arrays, and a ray is tested against a whole group at once with SIMD
+// instructions (SSE for groups of 4, AVX, if it is enabled, for precomputed groups of 8). 1 tests the triangles
+// one at a time. Each leaf starts a new group, and the last group of a leaf is padded with triangles nothing hits.
+#define TRIANGLE_LEAF_WIDTH 4
+#define TRIANGLE_GROUPS ((PRECOMPUTED_TRIANGLES || WATERTIGHT_TRIANGLES) && TRIANGLE_LEAF_WIDTH > 1)
+#if TRIANGLE_GROUPS && TRIANGLE_LEAF_WIDTH % 4 != 0
+#error "TRIANGLE_LEAF_WIDTH must be 1 or a multiple of 4."
+#endif
+// The BVH of the wide layout is built knowing that a group costs about as much to intersect as one triangle,
+// with leaves of up to this many groups.
+#define TRIANGLE_LEAF_MAX_GROUPS 2
+
+struct PrecomputedTriangleGroup {
+    alignas(32) float m[3][4][TRIANGLE_LEAF_WIDTH];
+
+    inline PrecomputedTriangle triangle(int lane) const {
+        PrecomputedTriangle tri;
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 4; j++) tri.m[i][j] = m[i][j][lane];
+        }
+        return tri;
+    }
+};
+
+// With WATERTIGHT_TRIANGLES, the groups hold the vertices, indexed by vertex, axis and lane.
+// The padding triangles have NaN vertices.
+struct TriangleVertexGroup {
+    alignas(32) float v[3][3][TRIANGLE_LEAF_WIDTH];
+
+    inline Point vertex(int i, int lane) const {
+        return Point(v[i][0][lane], v[i][1][lane], v[i][2][lane]);
+    }
+};
+
+#if WATERTIGHT_TRIANGLES
+typedef TriangleVertexGroup TriangleGroup;
+#else
+typedef PrecomputedTriangleGroup TriangleGroup;
+#endif
+
+// Build the BVHs of meshes with spatial splits (BVH_SPLIT_SBVH), so that long, thin triangles, such as those of
+// large ground planes and architecture, are cut between leaves rather than making leaf boxes overlap. Triangles
+// crossing a split are stored in each leaf they reach, taking more memory.
+#define TRIANGLE_MESH_SPATIAL_SPLITS 0
 
+// Meshes loaded with load_triangle_mesh() are kept, once built, in a cache file in this directory. Later loads
+// of the same model file with the same parameters map the cache file instead of parsing the model and building
+// the BVH (see triangle_mesh_cache.cpp).
+#define MESH_CACHE 1
+#define MESH_CACHE_DIRECTORY "mesh_cache"
 
 class TriangleMesh;
 
 // This class is specifically for a triangle of a mesh.
 class MeshTriangle : public Shape {
 public:
-    uint16_t indices[3];
+    uint32_t indices[3];
     Point operator[](int index) const;
     Point a() const;
     Point b() const;
@@ -32,6 +125,9 @@ public:
     bool intersect(Ray &ray, LocalGeometry *geom) const;
     bool does_intersect(Ray &ray) const;
     BoundingBox object_bound() const;
+    // Clip the triangle's edges by the plane, rather than cutting its box.
+    void split_world_bound(const BoundingBox &box, int axis, float position,
+                           BoundingBox *below, BoundingBox *above) const;
 
     MeshTriangle() {}
     MeshTriangle(TriangleMesh *_mesh, int ta, int tb, int tc)
@@ -42,17 +138,9 @@ public:
         mesh = _mesh;
 
         // Form the bounding box around the three vertices.
-        Vector minp = PointToVector(a());
-        Vector maxp = PointToVector(a());
-        for (int i = 1; i < 3; i++) {
-            Vector b = PointToVector((*this)[i]);
-            for (int j = 0; j < 3; j++) {
-                if (b[j] < minp[j]) minp[j] = b[j];
-                if (b[j] > maxp[j]) maxp[j] = b[j];
-            }
-        }
-        m_box = BoundingBox(Point(minp), Point(maxp));
-        
+        m_box = BoundingBox(a());
+        m_box.enlarge((*this)[1]);
+        m_box.enlarge((*this)[2]);
     }
 private:
     TriangleMesh *mesh;
@@ -63,19 +151,72 @@ class TriangleMesh : public Shape {
 public:
     Model *model;
 
-    TriangleMesh(const Transform &o2w, Model *_model);
+    // If build_now is false, build() must be called before the mesh is used. This is so that
+    // many meshes can be built at once with build_triangle_meshes().
+    TriangleMesh(const Transform &o2w, Model *_model, bool build_now = true,
+                 TriangleMeshLayout layout = TRIANGLE_MESH_WIDE);
+    void build();
 
     bool intersect(Ray &ray, LocalGeometry *geom) const;
     bool does_intersect(Ray &ray) const;
+    uint32_t intersect_packet(RayPacket &packet, uint32_t active, LocalGeometry *geoms) const;
+    uint32_t does_intersect_packet(RayPacket &packet, uint32_t active) const;
     BoundingBox object_bound() const;
 
+    // Whether 16-bit indices are used. Only one of each pair of 16 and 32-bit arrays below is filled.
+    bool compact_indices;
+
     // This is a specialized data structure, processed after using the usual BVH constructor on the mesh.
     // There is then specific BVH traversal code for using this specialized data structure.
     // (hopefully so mesh intersection is faster.)
-    vector<TriangleNode> triangles_bvh;
+    vector<TriangleNode16> triangles_bvh16;
+    vector<TriangleNode32> triangles_bvh32;
     BoundingBox m_world_bound;
     int triangles_bvh_length;
+    // The wide layout. The triangles are stored as three vertex indices each, in the order of the leaves.
+    vector<WideBVHNode> wide_bvh;
+    // The quantized layout keeps its nodes here instead of in wide_bvh, with the same triangle arrays.
+    vector<QuantizedWideBVHNode> quantized_wide_bvh;
+    vector<uint16_t> wide_bvh_triangles16;
+    vector<uint32_t> wide_bvh_triangles32;
+    // With PRECOMPUTED_TRIANGLES. For the wide layout, these are in the order of wide_bvh_triangles (unless
+    // TRIANGLE_GROUPS). For the binary layout, there is one for each leaf node of triangles_bvh, in order
+    // (see TriangleNode::second_leaf).
+    vector<PrecomputedTriangle> precomputed_triangles;
+    // With TRIANGLE_GROUPS, the wide layout's triangles in groups, precomputed or as vertices. The triangle at
+    // position i of wide_bvh_triangles is lane i % TRIANGLE_LEAF_WIDTH of group i / TRIANGLE_LEAF_WIDTH.
+    vector<TriangleGroup> triangle_groups;
 private:
+    TriangleMeshLayout m_layout;
+    Transform m_object_to_world;
+    bool m_built;
+    void precompute_triangles();
+
+    // If not empty, the built mesh is written to this cache file, tagged with the key.
+    std::string m_cache_filename;
+    uint64_t m_cache_key;
+    bool read_cache(std::string const &filename, uint64_t key);
+    void write_cache() const;
+    friend TriangleMesh *load_triangle_mesh(const Transform &, std::string const &, float, Point, bool, bool,
+                                            bool, TriangleMeshLayout);
 };
 
+// Load a model file (.off or .ply, taking the parameters of load_OFF_model) as a triangle mesh.
+// With MESH_CACHE, a cached copy of the built mesh is used if there is one for the same file contents,
+// parameters and transform. Otherwise the model is loaded, and the mesh is written to the cache once it is built.
+// NULL is returned if the model can't be loaded.
+TriangleMesh *load_triangle_mesh(const Transform &o2w, std::string const &filename,
+                                 float scale = 1.f,
+                                 Point center = Point(0,0,0),
+                                 bool invert_winding_order = false,
+                                 bool create_phong_normals = true,
+                                 bool build_now = true,
+                                 TriangleMeshLayout layout = TRIANGLE_MESH_WIDE);
+
+// Build meshes (constructed with build_now = false) in parallel, one per task.
+void build_triangle_meshes(const vector<TriangleMesh *> &meshes);
+
+// The parameters that the BVH of a mesh with this layout is built with.
+BVHBuildParameters triangle_mesh_bvh_parameters(TriangleMeshLayout layout);
+
 #endif // PRIMITIVES_TRIANGLE_MESH_H
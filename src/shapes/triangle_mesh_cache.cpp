@@ -0,0 +1,303 @@
+/*--------------------------------------------------------------------------------
+    The triangle mesh cache.
+    Loading a large model means parsing the model file and then building its
+    BVH, which is slow, and gives the same mesh every time. So a built mesh is
+    written to a cache file, holding the (world space) vertices, normals and
+    triangles and the traversal arrays of its layout, and later loads map the
+    cache file and copy the arrays out.
+
+    A cache file is used only if its key matches. The key is a hash of the model
+    file contents, the loading parameters, the transform, the mesh layout and
+    the BVH build parameters, along with the cache format version and the node
+    sizes, so a changed model, scene or build of the renderer never reads a
+    stale mesh. Each key has its own file, so meshes loaded with different
+    parameters (or transforms) are cached side by side.
+
+    File layout (native byte order):
+        MeshCacheHeader
+        arrays, in the order of the counts in the header, each starting
+        at a multiple of MESH_CACHE_ALIGNMENT.
+--------------------------------------------------------------------------------*/
+#include "shapes/triangle_mesh.hpp"
+#include <sys/stat.h>
+
+// Change this when the file layout, or the way meshes are built, changes.
+#define MESH_CACHE_VERSION 3
+#define MESH_CACHE_ALIGNMENT 64
+
+static const char mesh_cache_magic[8] = { 'M','E','S','H','C','A','C','H' };
+
+struct MeshCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t layout;
+    uint64_t key;
+    int32_t num_vertices;
+    int32_t num_triangles;
+    uint8_t has_normals;
+    uint8_t has_uvs;
+    uint8_t compact_indices;
+    uint8_t padding;
+    int32_t triangles_bvh_length;
+    float world_bound[6];
+    // The number of elements of each array.
+    uint64_t num_vertex_elements;
+    uint64_t num_normal_elements;
+    uint64_t num_uv_elements;
+    uint64_t num_triangle_elements;
+    uint64_t num_triangles_bvh16;
+    uint64_t num_triangles_bvh32;
+    uint64_t num_wide_bvh;
+    uint64_t num_quantized_wide_bvh;
+    uint64_t num_wide_bvh_triangles16;
+    uint64_t num_wide_bvh_triangles32;
+};
+
+// FNV-1a, taking eight bytes at a time (so hashing the model file is not much slower than reading it).
+struct CacheHasher {
+    uint64_t hash;
+    CacheHasher() : hash(14695981039346656037ULL) {}
+    inline void add_word(uint64_t word) {
+        hash ^= word;
+        hash *= 1099511628211ULL;
+    }
+    void add_bytes(const void *data, size_t size) {
+        const char *bytes = (const char *) data;
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8) {
+            uint64_t word;
+            memcpy(&word, bytes + i, 8);
+            add_word(word);
+        }
+        uint64_t last = 0;
+        memcpy(&last, bytes + i, size - i);
+        add_word(last ^ ((uint64_t) size << 56));
+    }
+    template <typename T>
+    void add(const T &value) {
+        add_bytes(&value, sizeof(T));
+    }
+    // FNV-1a mixes the high bits poorly, so finish with the MurmurHash3 finalizer.
+    uint64_t finish() const {
+        uint64_t h = hash;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+};
+
+static uint64_t mesh_cache_key(const MappedFile &model_file, float scale, Point center, bool invert_winding_order,
+                               bool create_phong_normals, const Transform &o2w, TriangleMeshLayout layout)
+{
+    CacheHasher hasher;
+    hasher.add<uint32_t>(MESH_CACHE_VERSION);
+    hasher.add_bytes(model_file.data, model_file.size);
+    hasher.add(scale);
+    for (int i = 0; i < 3; i++) hasher.add(center[i]);
+    hasher.add<uint32_t>(invert_winding_order);
+    hasher.add<uint32_t>(create_phong_normals);
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) hasher.add(o2w.matrix.m[i][j]);
+    }
+    hasher.add<uint32_t>(layout);
+    // Whether the build is parallel doesn't change the tree.
+    BVHBuildParameters params = triangle_mesh_bvh_parameters(layout);
+    hasher.add<uint32_t>(params.split_method);
+    hasher.add(params.max_leaf_primitives);
+    hasher.add(params.sah_num_bins);
+    hasher.add(params.sah_traversal_cost);
+    hasher.add(params.sah_primitive_group_size);
+    hasher.add(params.lbvh_treelet_passes);
+    hasher.add(params.sbvh_max_duplication);
+    hasher.add(params.sbvh_overlap_threshold);
+    hasher.add<uint32_t>(WIDE_BVH_WIDTH);
+    // The wide layout's leaves are aligned to the triangle groups.
+    hasher.add<uint32_t>(TRIANGLE_GROUPS);
+    hasher.add<uint32_t>(TRIANGLE_LEAF_WIDTH);
+    hasher.add<uint32_t>(sizeof(TriangleNode16));
+    hasher.add<uint32_t>(sizeof(TriangleNode32));
+    hasher.add<uint32_t>(sizeof(WideBVHNode));
+    hasher.add<uint32_t>(sizeof(QuantizedWideBVHNode));
+    return hasher.finish();
+}
+
+static inline size_t align_offset(size_t offset)
+{
+    return (offset + MESH_CACHE_ALIGNMENT - 1) & ~(size_t) (MESH_CACHE_ALIGNMENT - 1);
+}
+
+// Copy an array out of the mapped file, advancing the offset. Returns false if the file is too short.
+template <typename T>
+static bool read_cache_array(const MappedFile &file, size_t *offset, uint64_t count, vector<T> &array)
+{
+    *offset = align_offset(*offset);
+    size_t size = count * sizeof(T);
+    if (*offset > file.size || size > file.size - *offset) return false;
+    const T *start = (const T *) (file.data + *offset);
+    array.assign(start, start + count);
+    *offset += size;
+    return true;
+}
+
+template <typename T>
+static void write_cache_array(FILE *file, size_t *offset, const vector<T> &array)
+{
+    static const char zeros[MESH_CACHE_ALIGNMENT] = {0};
+    size_t aligned = align_offset(*offset);
+    fwrite(zeros, 1, aligned - *offset, file);
+    fwrite(array.data(), sizeof(T), array.size(), file);
+    *offset = aligned + array.size() * sizeof(T);
+}
+
+bool TriangleMesh::read_cache(std::string const &filename, uint64_t key)
+{
+    MappedFile file(filename);
+    if (file.data == NULL || file.size < sizeof(MeshCacheHeader)) return false;
+    MeshCacheHeader header;
+    memcpy(&header, file.data, sizeof(MeshCacheHeader));
+    if (memcmp(header.magic, mesh_cache_magic, 8) != 0 || header.version != MESH_CACHE_VERSION
+            || header.key != key || header.layout != (uint32_t) m_layout) {
+        return false;
+    }
+    Model *cached = new Model();
+    cached->num_vertices = header.num_vertices;
+    cached->num_triangles = header.num_triangles;
+    cached->has_normals = header.has_normals;
+    cached->has_uvs = header.has_uvs;
+    size_t offset = sizeof(MeshCacheHeader);
+    bool complete = read_cache_array(file, &offset, header.num_vertex_elements, cached->vertices)
+                 && read_cache_array(file, &offset, header.num_normal_elements, cached->normals)
+                 && read_cache_array(file, &offset, header.num_uv_elements, cached->uvs)
+                 && read_cache_array(file, &offset, header.num_triangle_elements, cached->triangles)
+                 && read_cache_array(file, &offset, header.num_triangles_bvh16, triangles_bvh16)
+                 && read_cache_array(file, &offset, header.num_triangles_bvh32, triangles_bvh32)
+                 && read_cache_array(file, &offset, header.num_wide_bvh, wide_bvh)
+                 && read_cache_array(file, &offset, header.num_quantized_wide_bvh, quantized_wide_bvh)
+                 && read_cache_array(file, &offset, header.num_wide_bvh_triangles16, wide_bvh_triangles16)
+                 && read_cache_array(file, &offset, header.num_wide_bvh_triangles32, wide_bvh_triangles32);
+    if (!complete || cached->vertices.size() != (size_t) cached->num_vertices
+                  || cached->triangles.size() != 3 * (size_t) cached->num_triangles) {
+        delete cached;
+        triangles_bvh16.clear();
+        triangles_bvh32.clear();
+        wide_bvh.clear();
+        quantized_wide_bvh.clear();
+        wide_bvh_triangles16.clear();
+        wide_bvh_triangles32.clear();
+        return false;
+    }
+    model = cached;
+    compact_indices = header.compact_indices;
+    triangles_bvh_length = header.triangles_bvh_length;
+    m_world_bound.corners[0] = Point(header.world_bound[0], header.world_bound[1], header.world_bound[2]);
+    m_world_bound.corners[1] = Point(header.world_bound[3], header.world_bound[4], header.world_bound[5]);
+    // These are quick to work out, so they aren't kept in the cache file.
+    precompute_triangles();
+    m_built = true;
+    return true;
+}
+
+void TriangleMesh::write_cache() const
+{
+    mkdir(MESH_CACHE_DIRECTORY, 0755);
+    // Write to a temporary file and rename it, so that a partly written cache file is never read.
+    std::string temporary_filename = m_cache_filename + ".tmp";
+    FILE *file = fopen(temporary_filename.c_str(), "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Warning: couldn't write mesh cache file \"%s\".\n", m_cache_filename.c_str());
+        return;
+    }
+    MeshCacheHeader header;
+    memset(&header, 0, sizeof(MeshCacheHeader));
+    memcpy(header.magic, mesh_cache_magic, 8);
+    header.version = MESH_CACHE_VERSION;
+    header.layout = m_layout;
+    header.key = m_cache_key;
+    header.num_vertices = model->num_vertices;
+    header.num_triangles = model->num_triangles;
+    header.has_normals = model->has_normals;
+    header.has_uvs = model->has_uvs;
+    header.compact_indices = compact_indices;
+    header.triangles_bvh_length = m_layout == TRIANGLE_MESH_BINARY ? triangles_bvh_length : 0;
+    for (int i = 0; i < 3; i++) {
+        header.world_bound[i] = m_world_bound.corners[0][i];
+        header.world_bound[3 + i] = m_world_bound.corners[1][i];
+    }
+    header.num_vertex_elements = model->vertices.size();
+    header.num_normal_elements = model->normals.size();
+    header.num_uv_elements = model->uvs.size();
+    header.num_triangle_elements = model->triangles.size();
+    header.num_triangles_bvh16 = triangles_bvh16.size();
+    header.num_triangles_bvh32 = triangles_bvh32.size();
+    header.num_wide_bvh = wide_bvh.size();
+    header.num_quantized_wide_bvh = quantized_wide_bvh.size();
+    header.num_wide_bvh_triangles16 = wide_bvh_triangles16.size();
+    header.num_wide_bvh_triangles32 = wide_bvh_triangles32.size();
+    fwrite(&header, sizeof(MeshCacheHeader), 1, file);
+
+    size_t offset = sizeof(MeshCacheHeader);
+    write_cache_array(file, &offset, model->vertices);
+    write_cache_array(file, &offset, model->normals);
+    write_cache_array(file, &offset, model->uvs);
+    write_cache_array(file, &offset, model->triangles);
+    write_cache_array(file, &offset, triangles_bvh16);
+    write_cache_array(file, &offset, triangles_bvh32);
+    write_cache_array(file, &offset, wide_bvh);
+    write_cache_array(file, &offset, quantized_wide_bvh);
+    write_cache_array(file, &offset, wide_bvh_triangles16);
+    write_cache_array(file, &offset, wide_bvh_triangles32);
+    bool failed = ferror(file);
+    if (fclose(file) != 0) failed = true;
+    if (failed || rename(temporary_filename.c_str(), m_cache_filename.c_str()) != 0) {
+        fprintf(stderr, "Warning: couldn't write mesh cache file \"%s\".\n", m_cache_filename.c_str());
+        remove(temporary_filename.c_str());
+    }
+}
+
+static bool is_PLY_filename(std::string const &filename)
+{
+    return filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".ply") == 0;
+}
+
+TriangleMesh *load_triangle_mesh(const Transform &o2w, std::string const &filename,
+                                 float scale, Point center, bool invert_winding_order, bool create_phong_normals,
+                                 bool build_now, TriangleMeshLayout layout)
+{
+#if MESH_CACHE
+    std::string cache_filename;
+    uint64_t key = 0;
+    {
+        MappedFile model_file(filename);
+        if (model_file.data != NULL) {
+            key = mesh_cache_key(model_file, scale, center, invert_winding_order, create_phong_normals, o2w, layout);
+            char key_string[17];
+            snprintf(key_string, sizeof(key_string), "%016llx", (unsigned long long) key);
+            std::string basename = filename.substr(filename.find_last_of('/') + 1);
+            cache_filename = std::string(MESH_CACHE_DIRECTORY) + "/" + basename + "." + key_string + ".mesh";
+        }
+    }
+    if (!cache_filename.empty()) {
+        TriangleMesh *mesh = new TriangleMesh(o2w, NULL, false, layout);
+        if (mesh->read_cache(cache_filename, key)) {
+            printf("Loaded cached mesh \"%s\"\n", cache_filename.c_str());
+            return mesh;
+        }
+        delete mesh;
+    }
+#endif
+    // A model file that can't be loaded is reported by the loader.
+    Model *model = is_PLY_filename(filename)
+                 ? load_PLY_model(filename, scale, center, invert_winding_order, create_phong_normals)
+                 : load_OFF_model(filename, scale, center, invert_winding_order, create_phong_normals);
+    if (model == NULL) return NULL;
+    TriangleMesh *mesh = new TriangleMesh(o2w, model, false, layout);
+#if MESH_CACHE
+    mesh->m_cache_filename = cache_filename;
+    mesh->m_cache_key = key;
+#endif
+    if (build_now) mesh->build();
+    return mesh;
+}
@@ -6,5 +6,7 @@
 #include "shapes/sphere.hpp"
 #include "shapes/plane.hpp"
 #include "shapes/triangle_mesh.hpp"
+#include "shapes/instance.hpp"
+#include "shapes/sphere_set.hpp"
 
 #endif // SHAPE_LIBRARY_H
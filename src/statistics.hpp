@@ -0,0 +1,69 @@
+#ifndef STATISTICS_H
+#define STATISTICS_H
+#include "core.hpp"
+
+/*--------------------------------------------------------------------------------
+    Render statistics
+    -----------------
+    Counts of what the renderer and the traversal kernels do, for comparing
+    acceleration structures, traversal orders and rendering modes (see
+    main_programs/write.cpp and main_programs/benchmark.cpp).
+
+    Each thread adds to its own counters (a thread_local ThreadRenderStats), with
+    plain additions and no sharing, so counting costs little even in the
+    innermost loops. A thread's counters are registered when it first counts,
+    and kept when it exits, so that they are summed when asked for, after the
+    work is done, without the threads having to do anything. Counts are per ray:
+    a packet of k active rays visiting a node counts as k visits.
+
+    Set this flag to count. Otherwise the counting macros expand to nothing.
+--------------------------------------------------------------------------------*/
+#define RENDER_STATS 0
+
+enum RayType {
+    RAY_PRIMARY,    // From the camera.
+    RAY_SHADOW,     // Towards a light, only tested for occlusion.
+    RAY_REFLECTION,
+    RAY_REFRACTION, // Through a refractive primitive, and out of it.
+    NUM_RAY_TYPES
+};
+extern const char *ray_type_names[NUM_RAY_TYPES];
+
+struct RenderStats {
+    uint64_t rays[NUM_RAY_TYPES];
+    // Rays which hit something (for shadow rays, which were occluded).
+    uint64_t ray_hits[NUM_RAY_TYPES];
+    // BVH nodes entered, in every BVH (including those of triangle meshes and sphere sets).
+    uint64_t nodes_visited;
+    // Ray-box tests. A wide BVH node counts the boxes of all of its children.
+    uint64_t box_tests;
+    // Primitives in the BVH leaves that rays reach (including the triangles of meshes and the spheres of sphere sets).
+    // Any-hit traversal counts the whole leaf, though it may stop partway through.
+    uint64_t primitive_tests;
+    // Ray-triangle tests, in meshes or of MeshTriangle primitives.
+    uint64_t triangle_tests;
+
+    void add(const RenderStats &other);
+    void print() const;
+    void write_json(std::ostream &out) const;
+};
+
+// A thread's counters, which register themselves for render_stats() when the thread first uses them, and add
+// themselves to the totals of exited threads when it exits.
+struct ThreadRenderStats : public RenderStats {
+    ThreadRenderStats();
+    ~ThreadRenderStats();
+};
+
+#if RENDER_STATS
+extern thread_local ThreadRenderStats thread_render_stats;
+#define RENDER_STATS_ADD(COUNTER,AMOUNT) (thread_render_stats. COUNTER += ( AMOUNT ))
+#else
+#define RENDER_STATS_ADD(COUNTER,AMOUNT) ((void) 0)
+#endif
+
+// The totals over all threads since the last reset. This should not be called while they are counting.
+RenderStats render_stats();
+void reset_render_stats();
+
+#endif // STATISTICS_H
@@ -0,0 +1,94 @@
+#include "statistics.hpp"
+#include <mutex>
+
+const char *ray_type_names[NUM_RAY_TYPES] = { "primary", "shadow", "reflection", "refraction" };
+
+// Constructed in each thread when it first counts, and destroyed when the thread exits (for the main thread,
+// before the registry below is).
+thread_local ThreadRenderStats thread_render_stats;
+
+static std::mutex registry_mutex;
+static vector<RenderStats *> registered_threads;
+// What exited threads counted.
+static RenderStats retired_stats;
+
+ThreadRenderStats::ThreadRenderStats() : RenderStats()
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    registered_threads.push_back(this);
+}
+ThreadRenderStats::~ThreadRenderStats()
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    retired_stats.add(*this);
+    registered_threads.erase(std::find(registered_threads.begin(), registered_threads.end(), this));
+}
+
+RenderStats render_stats()
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    RenderStats stats = retired_stats;
+    for (const RenderStats *thread_stats : registered_threads) stats.add(*thread_stats);
+    return stats;
+}
+void reset_render_stats()
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    retired_stats = RenderStats();
+    for (RenderStats *thread_stats : registered_threads) *thread_stats = RenderStats();
+}
+
+void RenderStats::add(const RenderStats &other)
+{
+    for (int type = 0; type < NUM_RAY_TYPES; type++) {
+        rays[type] += other.rays[type];
+        ray_hits[type] += other.ray_hits[type];
+    }
+    nodes_visited += other.nodes_visited;
+    box_tests += other.box_tests;
+    primitive_tests += other.primitive_tests;
+    triangle_tests += other.triangle_tests;
+}
+
+void RenderStats::print() const
+{
+    uint64_t total_rays = 0;
+    for (int type = 0; type < NUM_RAY_TYPES; type++) total_rays += rays[type];
+    std::cout << "Render stats:\n";
+    for (int type = 0; type < NUM_RAY_TYPES; type++) {
+        printf("    %-10s rays: %12llu   hits: %12llu", ray_type_names[type],
+               (unsigned long long) rays[type], (unsigned long long) ray_hits[type]);
+        if (rays[type] > 0) printf(" (%.1f%%)", 100.0 * ray_hits[type] / rays[type]);
+        printf("\n");
+    }
+    printf("    total rays: %llu\n", (unsigned long long) total_rays);
+    printf("    nodes visited: %llu\n", (unsigned long long) nodes_visited);
+    printf("    box tests: %llu\n", (unsigned long long) box_tests);
+    printf("    primitive tests: %llu\n", (unsigned long long) primitive_tests);
+    printf("    triangle tests: %llu\n", (unsigned long long) triangle_tests);
+    if (total_rays > 0) {
+        printf("    per ray: %.2f nodes visited, %.2f box tests, %.2f primitive tests, %.2f triangle tests\n",
+               nodes_visited / (double) total_rays, box_tests / (double) total_rays,
+               primitive_tests / (double) total_rays, triangle_tests / (double) total_rays);
+    }
+}
+
+void RenderStats::write_json(std::ostream &out) const
+{
+    out << "{\n";
+    out << "    \"rays\": {";
+    for (int type = 0; type < NUM_RAY_TYPES; type++) {
+        out << (type == 0 ? " " : ", ") << "\"" << ray_type_names[type] << "\": " << rays[type];
+    }
+    out << " },\n";
+    out << "    \"ray_hits\": {";
+    for (int type = 0; type < NUM_RAY_TYPES; type++) {
+        out << (type == 0 ? " " : ", ") << "\"" << ray_type_names[type] << "\": " << ray_hits[type];
+    }
+    out << " },\n";
+    out << "    \"nodes_visited\": " << nodes_visited << ",\n";
+    out << "    \"box_tests\": " << box_tests << ",\n";
+    out << "    \"primitive_tests\": " << primitive_tests << ",\n";
+    out << "    \"triangle_tests\": " << triangle_tests << "\n";
+    out << "}\n";
+}
@@ -0,0 +1,128 @@
+/*
+Benchmark of the BVH build methods.
+    g++ -O2 -std=c++17 -Isrc -Ilibraries tests/bvh_build.cpp src/models/*.cpp src/mathematics/*.cpp \
+        src/multithreading/*.cpp src/statistics/*.cpp src/shapes/[a-z]*.cpp src/aggregates/*.cpp src/primitives/*.cpp src/textures/*.cpp src/ext/*.cpp \
+        -o tests/bvh_build -lpthread
+    tests/bvh_build [-n repetitions] [-r millions of rays] [-t threads] [-p treelet passes] [-d duplication] [model files]
+The triangles of each OFF model are made into a BVH with the midpoint and SAH split methods, as a linear BVH
+with and without treelet restructuring passes (by default 2), and with spatial splits. The best build time of each
+is given, with the SAH cost from the build report, the number of references to triangles in the leaves per triangle,
+and the throughput of random closest-hit rays through the tree, along with the number of hits, which should be the
+same for every method.
+With no files given, this uses models/bunny.off and models/dragon.off.
+    -t:  Build with this many threads (by default, one per core).
+    -d:  The sbvh_max_duplication of the spatial split build.
+*/
+#include "shapes/triangle_mesh.hpp"
+#include "multithreading.hpp"
+#include <chrono>
+#include <random>
+#include <sstream>
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Rays from outside the box to random points in it.
+static vector<Ray> random_rays(const BoundingBox &box, int num_rays)
+{
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> uniform(0, 1);
+    Vector extent = box.corners[1] - box.corners[0];
+    float size = glm::length(extent);
+    vector<Ray> rays;
+    for (int i = 0; i < num_rays; i++) {
+        Point target = box.corners[0] + Vector(uniform(rng)*extent.x, uniform(rng)*extent.y, uniform(rng)*extent.z);
+        Vector direction = glm::normalize(Vector(uniform(rng) - 0.5f, uniform(rng) - 0.5f, uniform(rng) - 0.5f));
+        rays.push_back(Ray(target - 2*size*direction, direction));
+    }
+    return rays;
+}
+
+static void benchmark(const string &filename, int repetitions, int num_rays, int treelet_passes, float duplication)
+{
+    std::stringstream discard;
+    std::streambuf *cout_buffer = std::cout.rdbuf(discard.rdbuf());
+    Model *model = load_OFF_model(filename, 1, Point(0,0,0), false, false);
+    std::cout.rdbuf(cout_buffer);
+    if (model == NULL) exit(EXIT_FAILURE);
+    // The triangles as primitives, as TriangleMesh::build() makes them (the mesh is not built).
+    TriangleMesh mesh(Transform(), model, false);
+    vector<MeshTriangle> triangles(model->num_triangles);
+    vector<GeometricPrimitive> geometric_triangles(model->num_triangles);
+    vector<Primitive *> primitives(model->num_triangles);
+    for (int i = 0; i < model->num_triangles; i++) {
+        triangles[i] = MeshTriangle(&mesh, model->triangles[3*i], model->triangles[3*i+1], model->triangles[3*i+2]);
+        geometric_triangles[i] = GeometricPrimitive(&triangles[i]);
+        primitives[i] = &geometric_triangles[i];
+    }
+
+    const int num_methods = 5;
+    const char *method_names[num_methods] = { "midpoint", "sah", "lbvh", "lbvh+treelets", "sbvh" };
+    BVHBuildParameters method_parameters[num_methods] = {
+        BVHBuildParameters(BVH_SPLIT_MIDPOINT), BVHBuildParameters(BVH_SPLIT_SAH),
+        BVHBuildParameters(BVH_SPLIT_LBVH), BVHBuildParameters(BVH_SPLIT_LBVH), BVHBuildParameters(BVH_SPLIT_SBVH)
+    };
+    method_parameters[3].lbvh_treelet_passes = treelet_passes;
+    if (duplication >= 0) method_parameters[4].sbvh_max_duplication = duplication;
+
+    vector<Ray> rays;
+    printf("%s, %d triangles, %.1f million rays\n", filename.c_str(), model->num_triangles, num_rays * 1e-6);
+    printf("    method           build        SAH cost   leaves  depth  refs   rays\n");
+    for (int method = 0; method < num_methods; method++) {
+        double best_seconds = 0;
+        BVH *bvh = NULL;
+        for (int i = 0; i < repetitions; i++) {
+            delete bvh;
+            auto start = std::chrono::steady_clock::now();
+            bvh = new BVH(primitives, false, method_parameters[method]);
+            double seconds = seconds_since(start);
+            if (i == 0 || seconds < best_seconds) best_seconds = seconds;
+        }
+        if (rays.empty()) rays = random_rays(bvh->world_bound(), num_rays);
+        auto start = std::chrono::steady_clock::now();
+        long hits = 0;
+        for (const Ray &r : rays) {
+            Ray ray = r;
+            Intersection inter;
+            if (bvh->intersect(ray, &inter)) hits++;
+        }
+        double trace_seconds = seconds_since(start);
+        BVHBuildReport report = bvh->build_report();
+        printf("    %-14s %8.2fms  %8.2f  %8d  %5d  %4.2f  %6.2f Mrays/s (%ld hits)\n", method_names[method],
+               best_seconds * 1e3, report.sah_cost, report.num_leaves, report.max_depth,
+               (double) bvh->primitives.size() / model->num_triangles, rays.size() / trace_seconds * 1e-6, hits);
+        delete bvh;
+    }
+    delete model;
+}
+
+int main(int argc, char *argv[])
+{
+    int repetitions = 5;
+    double millions_of_rays = 0.5;
+    int num_threads = 0;
+    int treelet_passes = 2;
+    float duplication = -1;
+    vector<string> filenames;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i+1 < argc) sscanf(argv[++i], "%d", &repetitions);
+        else if (strcmp(argv[i], "-r") == 0 && i+1 < argc) sscanf(argv[++i], "%lf", &millions_of_rays);
+        else if (strcmp(argv[i], "-t") == 0 && i+1 < argc) sscanf(argv[++i], "%d", &num_threads);
+        else if (strcmp(argv[i], "-p") == 0 && i+1 < argc) sscanf(argv[++i], "%d", &treelet_passes);
+        else if (strcmp(argv[i], "-d") == 0 && i+1 < argc) sscanf(argv[++i], "%f", &duplication);
+        else filenames.push_back(argv[i]);
+    }
+    if (repetitions < 1) repetitions = 1;
+    if (filenames.empty()) {
+        filenames.push_back("models/bunny.off");
+        filenames.push_back("models/dragon.off");
+    }
+    if (num_threads > 0) init_multithreading(true, num_threads);
+    else init_multithreading();
+    for (const string &filename : filenames) {
+        benchmark(filename, repetitions, (int) (millions_of_rays * 1e6), treelet_passes, duplication);
+    }
+    close_multithreading();
+}
@@ -0,0 +1,131 @@
+/*
+Benchmark of refitting a BVH of moving primitives, against rebuilding it each frame.
+    g++ -O2 -std=c++17 -Isrc -Ilibraries tests/bvh_refit.cpp src/models/*.cpp src/mathematics/*.cpp \
+        src/multithreading/*.cpp src/statistics/*.cpp src/shapes/[a-z]*.cpp src/aggregates/*.cpp src/primitives/*.cpp src/textures/*.cpp src/ext/*.cpp \
+        -o tests/bvh_refit -lpthread
+    tests/bvh_refit [-s spheres] [-f frames] [-r thousands of rays per frame] [-t rebuild threshold]
+A cloud of spheres is animated, each sphere orbiting its own centre. For each frame, one BVH is refitted and another
+is built from scratch, and the same random rays are traced through both. The refitted BVH is rebuilt once the cost
+ratio given by BVH::refit() passes the threshold (by default never). The times, the cost ratio and the ray throughput
+of each are printed every few frames, and the number of hits, which should be the same for both.
+*/
+#include "shapes/sphere.hpp"
+#include "aggregates/bvh.hpp"
+#include "multithreading.hpp"
+#include <chrono>
+#include <random>
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+struct MovingSphere {
+    Point centre;
+    Vector axis_u, axis_v;
+    float speed;
+    Sphere *sphere;
+    Transform at(float time) const {
+        float angle = speed * time;
+        Vector p = PointToVector(centre) + cos(angle) * axis_u + sin(angle) * axis_v;
+        return Transform::translate(p.x, p.y, p.z);
+    }
+};
+
+static long trace(BVH *bvh, const vector<Ray> &rays)
+{
+    long hits = 0;
+    for (const Ray &r : rays) {
+        Ray ray = r;
+        Intersection inter;
+        if (bvh->intersect(ray, &inter)) hits++;
+    }
+    return hits;
+}
+
+int main(int argc, char *argv[])
+{
+    int num_spheres = 20000;
+    int num_frames = 60;
+    double thousands_of_rays = 100;
+    float rebuild_threshold = INFINITY;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i+1 < argc) sscanf(argv[++i], "%d", &num_spheres);
+        else if (strcmp(argv[i], "-f") == 0 && i+1 < argc) sscanf(argv[++i], "%d", &num_frames);
+        else if (strcmp(argv[i], "-r") == 0 && i+1 < argc) sscanf(argv[++i], "%lf", &thousands_of_rays);
+        else if (strcmp(argv[i], "-t") == 0 && i+1 < argc) sscanf(argv[++i], "%f", &rebuild_threshold);
+    }
+    init_multithreading();
+
+    // Spheres in a unit cube, each moving around a circle of up to a tenth of the cube's width.
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> uniform(0, 1);
+    auto random_vector = [&]() { return Vector(uniform(rng) - 0.5f, uniform(rng) - 0.5f, uniform(rng) - 0.5f); };
+    vector<MovingSphere> spheres(num_spheres);
+    vector<Primitive *> primitives(num_spheres);
+    float radius = 0.5f / cbrt((float) num_spheres);
+    for (int i = 0; i < num_spheres; i++) {
+        MovingSphere &s = spheres[i];
+        s.centre = Point(0,0,0) + random_vector();
+        s.axis_u = 0.1f * random_vector();
+        s.axis_v = 0.1f * random_vector();
+        s.speed = 1 + uniform(rng);
+        s.sphere = new Sphere(s.at(0), radius);
+        primitives[i] = new GeometricPrimitive(s.sphere);
+    }
+    BVH *refitted = new BVH(primitives);
+
+    // Rays from around the cube towards points in it.
+    int num_rays = (int) (thousands_of_rays * 1e3);
+    vector<Ray> rays;
+    for (int i = 0; i < num_rays; i++) {
+        Point target = Point(0,0,0) + random_vector();
+        Vector direction = glm::normalize(random_vector());
+        rays.push_back(Ray(target - 2.f*direction, direction));
+    }
+
+    printf("%d spheres, %d frames, %d rays per frame\n", num_spheres, num_frames, num_rays);
+    printf("frame    refit  (cost ratio)    rebuild     refitted rays    rebuilt rays\n");
+    double total_refit = 0, total_rebuild = 0, total_refitted_trace = 0, total_rebuilt_trace = 0;
+    int num_rebuilds = 0;
+    for (int frame = 1; frame <= num_frames; frame++) {
+        float time = frame / 24.f;
+        for (MovingSphere &s : spheres) s.sphere->set_transform(s.at(time));
+
+        auto start = std::chrono::steady_clock::now();
+        float cost_ratio = refitted->refit();
+        if (cost_ratio > rebuild_threshold) {
+            delete refitted;
+            refitted = new BVH(primitives);
+            num_rebuilds++;
+        }
+        double refit_seconds = seconds_since(start);
+
+        start = std::chrono::steady_clock::now();
+        BVH *rebuilt = new BVH(primitives);
+        double rebuild_seconds = seconds_since(start);
+
+        start = std::chrono::steady_clock::now();
+        long refitted_hits = trace(refitted, rays);
+        double refitted_trace = seconds_since(start);
+        start = std::chrono::steady_clock::now();
+        long rebuilt_hits = trace(rebuilt, rays);
+        double rebuilt_trace = seconds_since(start);
+        delete rebuilt;
+
+        total_refit += refit_seconds;
+        total_rebuild += rebuild_seconds;
+        total_refitted_trace += refitted_trace;
+        total_rebuilt_trace += rebuilt_trace;
+        if (frame % 10 == 0 || frame == num_frames) {
+            printf("%5d %7.2fms  (%.3f)  %9.2fms  %7.2f Mrays/s  %7.2f Mrays/s%s\n", frame,
+                   refit_seconds * 1e3, cost_ratio, rebuild_seconds * 1e3,
+                   num_rays / refitted_trace * 1e-6, num_rays / rebuilt_trace * 1e-6,
+                   refitted_hits == rebuilt_hits ? "" : "  (DIFFERENT HITS)");
+        }
+    }
+    printf("per frame: refit %.2fms + trace %.2fms (%d rebuilds), rebuild %.2fms + trace %.2fms\n",
+           total_refit / num_frames * 1e3, total_refitted_trace / num_frames * 1e3, num_rebuilds,
+           total_rebuild / num_frames * 1e3, total_rebuilt_trace / num_frames * 1e3);
+    close_multithreading();
+}
@@ -0,0 +1,143 @@
+/*
+Benchmark of ray-mesh intersection.
+    g++ -O2 -std=c++17 -Isrc -Ilibraries tests/mesh_intersection.cpp src/models/*.cpp src/mathematics/*.cpp \
+        src/multithreading/*.cpp src/statistics/*.cpp src/shapes/[a-z]*.cpp src/aggregates/*.cpp src/primitives/*.cpp src/textures/*.cpp src/ext/*.cpp \
+        -o tests/mesh_intersection -lpthread
+    tests/mesh_intersection [-n repetitions] [-r millions of rays] [model files]
+Each OFF model is built as a triangle mesh in each layout, and random rays through its bounding box are
+traced with intersect(), does_intersect() and in packets of coherent rays with intersect_packet(). The best time of
+each is given, along with the number of hits, which should be about the same for every kernel, and the bytes per
+triangle taken by the nodes and by the triangle arrays (not counting the model's vertices).
+With no files given, this uses models/bunny.off and models/dragon.off.
+To compare triangle group widths, set TRIANGLE_LEAF_WIDTH in src/shapes/triangle_mesh.hpp (and compile with -mavx
+for groups of 8). To compare the watertight triangle test, set WATERTIGHT_TRIANGLES there.
+*/
+#include "shapes/triangle_mesh.hpp"
+#include "mathematics/ray_packet.hpp"
+#include <chrono>
+#include <random>
+#include <sstream>
+
+struct Timing {
+    double seconds;
+    long hits;
+};
+
+template <typename F>
+static Timing best_time(int repetitions, F f)
+{
+    Timing best = { 0, 0 };
+    for (int i = 0; i < repetitions; i++) {
+        auto start = std::chrono::steady_clock::now();
+        long hits = f();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (i == 0 || seconds < best.seconds) best.seconds = seconds;
+        best.hits = hits;
+    }
+    return best;
+}
+
+// Rays from outside the box to random points in it. Every RAY_PACKET_SIZE rays go to nearby points from one origin,
+// so that they can be traced as a packet.
+static vector<Ray> random_rays(const BoundingBox &box, int num_rays)
+{
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> uniform(0, 1);
+    Vector extent = box.corners[1] - box.corners[0];
+    float size = glm::length(extent);
+    vector<Ray> rays;
+    while ((int) rays.size() < num_rays) {
+        Point target = box.corners[0] + Vector(uniform(rng)*extent.x, uniform(rng)*extent.y, uniform(rng)*extent.z);
+        Vector direction = glm::normalize(Vector(uniform(rng) - 0.5f, uniform(rng) - 0.5f, uniform(rng) - 0.5f));
+        Point origin = target - 2*size*direction;
+        for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+            Vector jitter = 0.01f * size * Vector(uniform(rng) - 0.5f, uniform(rng) - 0.5f, uniform(rng) - 0.5f);
+            rays.push_back(Ray(origin, target + jitter - origin));
+        }
+    }
+    return rays;
+}
+
+template <typename T>
+static double array_bytes(const vector<T> &array)
+{
+    return (double) array.size() * sizeof(T);
+}
+
+static void benchmark(const string &filename, int repetitions, int num_rays)
+{
+    std::stringstream discard;
+    std::streambuf *cout_buffer = std::cout.rdbuf(discard.rdbuf());
+    Model *model = load_OFF_model(filename, 1, Point(0,0,0), false, true);
+    if (model == NULL) exit(EXIT_FAILURE);
+    const int num_layouts = 3;
+    TriangleMesh *meshes[num_layouts] = { new TriangleMesh(Transform(), model, true, TRIANGLE_MESH_BINARY),
+                                          new TriangleMesh(Transform(), model, true, TRIANGLE_MESH_WIDE),
+                                          new TriangleMesh(Transform(), model, true, TRIANGLE_MESH_QUANTIZED) };
+    std::cout.rdbuf(cout_buffer);
+    const char *layout_names[num_layouts] = { "binary", "wide", "quant" };
+    vector<Ray> rays = random_rays(meshes[0]->object_bound(), num_rays);
+
+    printf("%s, %d triangles, %.1f million rays\n", filename.c_str(), model->num_triangles, rays.size() * 1e-6);
+    for (int layout = 0; layout < num_layouts; layout++) {
+        const TriangleMesh *mesh = meshes[layout];
+        double node_bytes = array_bytes(mesh->triangles_bvh16) + array_bytes(mesh->triangles_bvh32)
+                          + array_bytes(mesh->wide_bvh) + array_bytes(mesh->quantized_wide_bvh);
+        double triangle_bytes = array_bytes(mesh->wide_bvh_triangles16) + array_bytes(mesh->wide_bvh_triangles32)
+                              + array_bytes(mesh->precomputed_triangles) + array_bytes(mesh->triangle_groups);
+        Timing closest = best_time(repetitions, [&]() {
+            long hits = 0;
+            for (const Ray &r : rays) {
+                Ray ray = r;
+                LocalGeometry geom;
+                if (mesh->intersect(ray, &geom)) hits++;
+            }
+            return hits;
+        });
+        Timing any = best_time(repetitions, [&]() {
+            long hits = 0;
+            for (const Ray &r : rays) {
+                Ray ray = r;
+                if (mesh->does_intersect(ray)) hits++;
+            }
+            return hits;
+        });
+        Timing packets = best_time(repetitions, [&]() {
+            long hits = 0;
+            RayPacket packet;
+            LocalGeometry geoms[RAY_PACKET_SIZE];
+            for (size_t i = 0; i + RAY_PACKET_SIZE <= rays.size(); i += RAY_PACKET_SIZE) {
+                for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) packet.set(lane, rays[i + lane]);
+                uint32_t all = (1u << RAY_PACKET_SIZE) - 1;
+                hits += RayPacket::num_rays(mesh->intersect_packet(packet, all, geoms));
+            }
+            return hits;
+        });
+        printf("    %-7s nodes %5.1f + triangles %5.1f B/tri   intersect %7.2f Mrays/s (%ld hits)   does_intersect %7.2f Mrays/s (%ld hits)   packets %7.2f Mrays/s (%ld hits)\n",
+               layout_names[layout],
+               node_bytes / model->num_triangles, triangle_bytes / model->num_triangles,
+               rays.size() / closest.seconds * 1e-6, closest.hits,
+               rays.size() / any.seconds * 1e-6, any.hits,
+               rays.size() / packets.seconds * 1e-6, packets.hits);
+    }
+    for (int layout = 0; layout < num_layouts; layout++) delete meshes[layout];
+    delete model;
+}
+
+int main(int argc, char *argv[])
+{
+    int repetitions = 5;
+    double millions_of_rays = 1;
+    vector<string> filenames;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i+1 < argc) sscanf(argv[++i], "%d", &repetitions);
+        else if (strcmp(argv[i], "-r") == 0 && i+1 < argc) sscanf(argv[++i], "%lf", &millions_of_rays);
+        else filenames.push_back(argv[i]);
+    }
+    if (repetitions < 1) repetitions = 1;
+    if (filenames.empty()) {
+        filenames.push_back("models/bunny.off");
+        filenames.push_back("models/dragon.off");
+    }
+    for (const string &filename : filenames) benchmark(filename, repetitions, (int) (millions_of_rays * 1e6));
+}
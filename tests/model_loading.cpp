@@ -0,0 +1,166 @@
+/*
+Benchmark of model loading times.
+    g++ -O2 -std=c++17 -Isrc -Ilibraries tests/model_loading.cpp src/models/*.cpp src/mathematics/*.cpp src/multithreading/*.cpp src/statistics/*.cpp \
+        -o tests/model_loading -lpthread
+    tests/model_loading [-n repetitions] [-t threads] [-g millions of triangles] [model files]
+Each model (.off or .ply) is loaded a number of times, and the best time is given. A binary little-endian PLY copy of
+each model is also written to /tmp and loaded, and checked to give the same model.
+With no files given, this loads models/dragon.off and models/dragon.ply.
+    -t:  Load with this many threads (by default, one per core).
+    -g:  Also generate a grid mesh of about this many million triangles, written as OFF, ASCII PLY and binary PLY.
+*/
+#include "models.hpp"
+#include "multithreading.hpp"
+#include <chrono>
+#include <sstream>
+
+static bool ends_with(const string &s, const string &suffix)
+{
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+static Model *load_model(const string &filename)
+{
+    // The loaders print the model properties. Keep that out of the timings.
+    std::stringstream discard;
+    std::streambuf *cout_buffer = std::cout.rdbuf(discard.rdbuf());
+    Model *model = ends_with(filename, ".ply") ? load_PLY_model(filename, 1, Point(0,0,0), false, false)
+                                               : load_OFF_model(filename, 1, Point(0,0,0), false, false);
+    std::cout.rdbuf(cout_buffer);
+    if (model == NULL) exit(EXIT_FAILURE);
+    return model;
+}
+
+static double time_loading(const string &filename, int repetitions, Model **model)
+{
+    double best_seconds = 0;
+    for (int i = 0; i < repetitions; i++) {
+        auto start = std::chrono::steady_clock::now();
+        Model *loaded = load_model(filename);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (i == 0 || seconds < best_seconds) best_seconds = seconds;
+        if (i == repetitions - 1) *model = loaded;
+        else delete loaded;
+    }
+    return best_seconds;
+}
+
+static void write_OFF(const Model &model, const string &filename)
+{
+    FILE *file = fopen(filename.c_str(), "w");
+    fprintf(file, "OFF\n%d %d 0\n", model.num_vertices, model.num_triangles);
+    for (const Point &p : model.vertices) fprintf(file, "%.9g %.9g %.9g\n", p.x, p.y, p.z);
+    for (int i = 0; i < model.num_triangles; i++) {
+        fprintf(file, "3 %u %u %u\n", model.triangles[3*i], model.triangles[3*i+1], model.triangles[3*i+2]);
+    }
+    fclose(file);
+}
+static void write_PLY(const Model &model, const string &filename, bool binary)
+{
+    FILE *file = fopen(filename.c_str(), "wb");
+    fprintf(file, "ply\nformat %s 1.0\n", binary ? "binary_little_endian" : "ascii");
+    fprintf(file, "element vertex %d\nproperty float x\nproperty float y\nproperty float z\n", model.num_vertices);
+    fprintf(file, "element face %d\nproperty list uchar int vertex_indices\nend_header\n", model.num_triangles);
+    for (const Point &p : model.vertices) {
+        if (binary) {
+            float xyz[3] = { p.x, p.y, p.z };
+            fwrite(xyz, sizeof(float), 3, file);
+        } else fprintf(file, "%.9g %.9g %.9g\n", p.x, p.y, p.z);
+    }
+    for (int i = 0; i < model.num_triangles; i++) {
+        const uint32_t *t = &model.triangles[3*i];
+        if (binary) {
+            uint8_t n = 3;
+            fwrite(&n, 1, 1, file);
+            fwrite(t, sizeof(uint32_t), 3, file);
+        } else fprintf(file, "3 %u %u %u\n", t[0], t[1], t[2]);
+    }
+    fclose(file);
+}
+
+static bool same_model(const Model &a, const Model &b)
+{
+    if (a.num_vertices != b.num_vertices || a.num_triangles != b.num_triangles) return false;
+    for (int i = 0; i < a.num_vertices; i++) {
+        if (a.vertices[i].x != b.vertices[i].x || a.vertices[i].y != b.vertices[i].y || a.vertices[i].z != b.vertices[i].z) return false;
+    }
+    return a.triangles == b.triangles;
+}
+
+// A wavy grid of about the given number of triangles.
+static Model *grid_model(double millions_of_triangles)
+{
+    int n = (int) sqrt(millions_of_triangles * 1e6 / 2);
+    Model *model = new Model();
+    model->num_vertices = (n + 1) * (n + 1);
+    model->num_triangles = 2 * n * n;
+    for (int i = 0; i <= n; i++) {
+        for (int j = 0; j <= n; j++) {
+            float x = i / (float) n;
+            float z = j / (float) n;
+            model->vertices.push_back(Point(x, 0.05f * sin(20 * x) * cos(20 * z), z));
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            uint32_t a = i * (n + 1) + j;
+            uint32_t b = a + 1;
+            uint32_t c = a + n + 1;
+            uint32_t d = c + 1;
+            uint32_t quad[6] = { a, b, d, a, d, c };
+            model->triangles.insert(model->triangles.end(), quad, quad + 6);
+        }
+    }
+    return model;
+}
+
+static void benchmark(const string &filename, int repetitions)
+{
+    Model *model;
+    double seconds = time_loading(filename, repetitions, &model);
+    printf("%-40s %9d triangles  %8.4fs\n", filename.c_str(), model->num_triangles, seconds);
+    if (ends_with(filename, ".binary.ply")) {
+        delete model;
+        return;
+    }
+    // Compare with a binary PLY copy.
+    string copy = "/tmp/" + filename.substr(filename.find_last_of('/') + 1) + ".binary.ply";
+    write_PLY(*model, copy, true);
+    Model *copied;
+    seconds = time_loading(copy, repetitions, &copied);
+    printf("%-40s %9d triangles  %8.4fs%s\n", copy.c_str(), copied->num_triangles, seconds,
+           same_model(*model, *copied) ? "" : "  (DIFFERENT MODEL)");
+    delete model;
+    delete copied;
+}
+
+int main(int argc, char *argv[])
+{
+    int repetitions = 5;
+    int num_threads = 0;
+    double grid_millions = 0;
+    vector<string> filenames;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i+1 < argc) sscanf(argv[++i], "%d", &repetitions);
+        else if (strcmp(argv[i], "-t") == 0 && i+1 < argc) sscanf(argv[++i], "%d", &num_threads);
+        else if (strcmp(argv[i], "-g") == 0 && i+1 < argc) sscanf(argv[++i], "%lf", &grid_millions);
+        else filenames.push_back(argv[i]);
+    }
+    if (repetitions < 1) repetitions = 1;
+    if (num_threads > 0) init_multithreading(true, num_threads);
+    else init_multithreading();
+    if (filenames.empty() && grid_millions <= 0) {
+        filenames.push_back("models/dragon.off");
+        filenames.push_back("models/dragon.ply");
+    }
+    if (grid_millions > 0) {
+        Model *grid = grid_model(grid_millions);
+        write_OFF(*grid, "/tmp/grid.off");
+        write_PLY(*grid, "/tmp/grid.ply", false);
+        delete grid;
+        filenames.push_back("/tmp/grid.off");
+        filenames.push_back("/tmp/grid.ply");
+    }
+    for (const string &filename : filenames) benchmark(filename, repetitions);
+    close_multithreading();
+}
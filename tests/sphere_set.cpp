@@ -0,0 +1,135 @@
+/*
+Benchmark of sphere sets, against a BVH of Sphere primitives.
+    g++ -O2 -std=c++17 -Isrc -Ilibraries tests/sphere_set.cpp src/models/*.cpp src/mathematics/*.cpp \
+        src/multithreading/*.cpp src/statistics/*.cpp src/shapes/[a-z]*.cpp src/aggregates/*.cpp src/primitives/*.cpp src/textures/*.cpp src/ext/*.cpp \
+        -o tests/sphere_set -lpthread
+    tests/sphere_set [-s thousands of spheres] [-r millions of rays] [-n repetitions]
+A cloud of random spheres in a unit cube is made into a SphereSet and into a BVH of GeometricPrimitives of Spheres.
+Random rays are traced through both with intersect(), does_intersect() and in packets of coherent rays. The build
+time and best time of each is given, along with the number of hits, which should be about the same for both.
+*/
+#include "shapes/sphere.hpp"
+#include "shapes/sphere_set.hpp"
+#include "multithreading.hpp"
+#include <chrono>
+#include <random>
+
+struct Timing {
+    double seconds;
+    long hits;
+};
+
+template <typename F>
+static Timing best_time(int repetitions, F f)
+{
+    Timing best = { 0, 0 };
+    for (int i = 0; i < repetitions; i++) {
+        auto start = std::chrono::steady_clock::now();
+        long hits = f();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (i == 0 || seconds < best.seconds) best.seconds = seconds;
+        best.hits = hits;
+    }
+    return best;
+}
+
+// Rays from around the cube towards points in it. Every RAY_PACKET_SIZE rays go to nearby points from one origin,
+// so that they can be traced as a packet.
+static vector<Ray> random_rays(int num_rays, std::mt19937 &rng)
+{
+    std::uniform_real_distribution<float> uniform(0, 1);
+    auto random_vector = [&]() { return Vector(uniform(rng) - 0.5f, uniform(rng) - 0.5f, uniform(rng) - 0.5f); };
+    vector<Ray> rays;
+    while ((int) rays.size() < num_rays) {
+        Point target = Point(0,0,0) + random_vector();
+        Point origin = target - 2.f*glm::normalize(random_vector());
+        for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+            rays.push_back(Ray(origin, target + 0.01f*random_vector() - origin));
+        }
+    }
+    return rays;
+}
+
+template <typename INTERSECT, typename DOES_INTERSECT, typename INTERSECT_PACKET>
+static void benchmark(const char *name, double build_seconds, const vector<Ray> &rays, int repetitions,
+                      INTERSECT intersect, DOES_INTERSECT does_intersect, INTERSECT_PACKET intersect_packet)
+{
+    Timing closest = best_time(repetitions, [&]() {
+        long hits = 0;
+        for (const Ray &r : rays) {
+            Ray ray = r;
+            if (intersect(ray)) hits++;
+        }
+        return hits;
+    });
+    Timing any = best_time(repetitions, [&]() {
+        long hits = 0;
+        for (const Ray &r : rays) {
+            Ray ray = r;
+            if (does_intersect(ray)) hits++;
+        }
+        return hits;
+    });
+    Timing packets = best_time(repetitions, [&]() {
+        long hits = 0;
+        RayPacket packet;
+        for (size_t i = 0; i + RAY_PACKET_SIZE <= rays.size(); i += RAY_PACKET_SIZE) {
+            for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) packet.set(lane, rays[i + lane]);
+            hits += RayPacket::num_rays(intersect_packet(packet, (1u << RAY_PACKET_SIZE) - 1));
+        }
+        return hits;
+    });
+    printf("    %-10s build %8.2fms   intersect %7.2f Mrays/s (%ld hits)   does_intersect %7.2f Mrays/s (%ld hits)   packets %7.2f Mrays/s (%ld hits)\n",
+           name, build_seconds * 1e3,
+           rays.size() / closest.seconds * 1e-6, closest.hits,
+           rays.size() / any.seconds * 1e-6, any.hits,
+           rays.size() / packets.seconds * 1e-6, packets.hits);
+}
+
+int main(int argc, char *argv[])
+{
+    double thousands_of_spheres = 200;
+    double millions_of_rays = 1;
+    int repetitions = 3;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i+1 < argc) sscanf(argv[++i], "%lf", &thousands_of_spheres);
+        else if (strcmp(argv[i], "-r") == 0 && i+1 < argc) sscanf(argv[++i], "%lf", &millions_of_rays);
+        else if (strcmp(argv[i], "-n") == 0 && i+1 < argc) sscanf(argv[++i], "%d", &repetitions);
+    }
+    if (repetitions < 1) repetitions = 1;
+    init_multithreading();
+
+    int num_spheres = (int) (thousands_of_spheres * 1e3);
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> uniform(0, 1);
+    vector<Point> centres(num_spheres);
+    vector<float> radii(num_spheres);
+    float radius = 0.5f / cbrt((float) num_spheres);
+    for (int i = 0; i < num_spheres; i++) {
+        centres[i] = Point(uniform(rng) - 0.5f, uniform(rng) - 0.5f, uniform(rng) - 0.5f);
+        radii[i] = radius * (0.5f + uniform(rng));
+    }
+    vector<Ray> rays = random_rays((int) (millions_of_rays * 1e6), rng);
+    printf("%d spheres, %.1f million rays\n", num_spheres, rays.size() * 1e-6);
+
+    auto start = std::chrono::steady_clock::now();
+    SphereSet set(centres, radii);
+    double set_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    benchmark("sphere set", set_seconds, rays, repetitions,
+        [&](Ray &ray) { LocalGeometry geom; return set.intersect(ray, &geom); },
+        [&](Ray &ray) { return set.does_intersect(ray); },
+        [&](RayPacket &packet, uint32_t active) { LocalGeometry geoms[RAY_PACKET_SIZE]; return set.intersect_packet(packet, active, geoms); });
+
+    vector<Primitive *> primitives(num_spheres);
+    for (int i = 0; i < num_spheres; i++) {
+        primitives[i] = new GeometricPrimitive(new Sphere(Transform::translate(centres[i].x, centres[i].y, centres[i].z), radii[i]));
+    }
+    start = std::chrono::steady_clock::now();
+    BVH bvh(primitives);
+    double bvh_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    benchmark("bvh", bvh_seconds, rays, repetitions,
+        [&](Ray &ray) { Intersection inter; return bvh.intersect(ray, &inter); },
+        [&](Ray &ray) { return bvh.does_intersect(ray); },
+        [&](RayPacket &packet, uint32_t active) { Intersection inters[RAY_PACKET_SIZE]; return bvh.intersect_packet(packet, active, inters); });
+    close_multithreading();
+}
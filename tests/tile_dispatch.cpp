@@ -0,0 +1,108 @@
+/*
+Microbenchmark of the per-tile cost of handing out work to threads.
+    g++ -O2 -std=c++17 -Isrc -Ilibraries tests/tile_dispatch.cpp src/multithreading/multithreading.cpp -o tests/tile_dispatch -lpthread
+    tests/tile_dispatch [number of threads]
+Each tile does a small fixed amount of work, so that the difference between the methods is the dispatch overhead.
+    mutex:          Every tile is taken by locking a mutex and stepping a shared grid position (as the old global Work slot did).
+    task per tile:  parallel_for with a grain size of 1, which spawns a task for every tile.
+    atomic:         parallel_for_2D, which takes tiles from an atomic counter.
+*/
+#include "multithreading.hpp"
+#include <chrono>
+
+static const int tiles_x = 60;
+static const int tiles_y = 34; // A 1920x1080 image in 32x32 tiles.
+static const int repetitions = 2000;
+
+static std::atomic<long> sink(0);
+static volatile uint64_t seed = 1;
+static inline void tile_work(int i, int j)
+{
+    uint64_t x = seed + i * 31 + j;
+    for (int k = 0; k < 64; k++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+    }
+    if (x == 0) sink.fetch_add(1, std::memory_order_relaxed); // Keep the work from being optimized out, without sharing a cache line.
+}
+
+struct MutexGrid {
+    std::mutex mutex;
+    int next_i;
+    int next_j;
+    bool next(int *i, int *j) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (next_i >= tiles_x) return false;
+        *i = next_i;
+        *j = next_j;
+        if (++next_j == tiles_y) {
+            next_j = 0;
+            next_i ++;
+        }
+        return true;
+    }
+};
+
+static void mutex_dispatch()
+{
+    MutexGrid grid;
+    grid.next_i = 0;
+    grid.next_j = 0;
+    TaskGroup group;
+    auto work = [&](int) {
+        int i, j;
+        while (grid.next(&i, &j)) tile_work(i, j);
+    };
+    for (int t = 0; t < num_parallel_threads() - 1; t++) group.spawn(work);
+    work(0);
+    group.wait();
+}
+
+static void task_per_tile_dispatch()
+{
+    parallel_for([](int begin, int end, int) {
+        for (int index = begin; index < end; index++) tile_work(index / tiles_y, index % tiles_y);
+    }, tiles_x * tiles_y, 1);
+}
+
+static void atomic_dispatch()
+{
+    parallel_for_2D([](int i, int j, int) {
+        tile_work(i, j);
+    }, tiles_x, tiles_y);
+}
+
+static void serial()
+{
+    for (int i = 0; i < tiles_x; i++) {
+        for (int j = 0; j < tiles_y; j++) tile_work(i, j);
+    }
+}
+
+static double time_per_tile(const char *name, void (*dispatch)(), double baseline)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < repetitions; r++) dispatch();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double ns = seconds * 1e9 / (repetitions * (double) tiles_x * tiles_y);
+    if (baseline > 0) printf("%-16s %8.1f ns per tile (%.1f ns over serial work / threads)\n", name, ns, ns - baseline);
+    else printf("%-16s %8.1f ns per tile\n", name, ns);
+    return ns;
+}
+
+int main(int argc, char *argv[])
+{
+    int num_threads = 0;
+    if (argc > 1) sscanf(argv[1], "%d", &num_threads);
+    init_multithreading(num_threads > 0, num_threads);
+    printf("%d threads, %dx%d tiles, %d repetitions\n", num_parallel_threads(), tiles_x, tiles_y, repetitions);
+
+    double serial_ns = time_per_tile("serial", serial, 0);
+    double ideal_ns = serial_ns / num_parallel_threads();
+    time_per_tile("mutex", mutex_dispatch, ideal_ns);
+    time_per_tile("task per tile", task_per_tile_dispatch, ideal_ns);
+    time_per_tile("atomic", atomic_dispatch, ideal_ns);
+
+    close_multithreading();
+}
@@ -0,0 +1,110 @@
+/*
+Benchmark of the batch transforms.
+    g++ -O2 -std=c++17 -Isrc -Ilibraries tests/transforms.cpp src/models/*.cpp src/mathematics/*.cpp \
+        src/multithreading/*.cpp src/statistics/*.cpp src/shapes/[a-z]*.cpp src/aggregates/*.cpp src/primitives/*.cpp src/textures/*.cpp src/ext/*.cpp \
+        -o tests/transforms -lpthread
+    tests/transforms [-m millions of points] [-n repetitions]
+Random points, vectors, normals and packets of rays are transformed by a rotation, scale and translation, one at a
+time through Transform and with the batch functions. The best time of each is given, along with the number of
+results which differ between the two, which should be zero.
+*/
+#include "mathematics.hpp"
+#include <chrono>
+#include <random>
+
+template <typename F>
+static double best_seconds(int repetitions, F f)
+{
+    double best = 0;
+    for (int i = 0; i < repetitions; i++) {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (i == 0 || seconds < best) best = seconds;
+    }
+    return best;
+}
+
+template <typename T>
+static int count_differences(const vector<T> &a, const vector<T> &b)
+{
+    int differences = 0;
+    for (size_t i = 0; i < a.size(); i++) {
+        if (a[i].x != b[i].x || a[i].y != b[i].y || a[i].z != b[i].z) differences++;
+    }
+    return differences;
+}
+
+static void print_result(const char *name, int num, double single_seconds, double batch_seconds, int differences)
+{
+    printf("    %-8s one at a time %8.2f M/s   batch %8.2f M/s   (%d differ)\n", name,
+           num / single_seconds * 1e-6, num / batch_seconds * 1e-6, differences);
+}
+
+int main(int argc, char *argv[])
+{
+    double millions = 1;
+    int repetitions = 5;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-m") == 0 && i+1 < argc) sscanf(argv[++i], "%lf", &millions);
+        else if (strcmp(argv[i], "-n") == 0 && i+1 < argc) sscanf(argv[++i], "%d", &repetitions);
+    }
+    if (repetitions < 1) repetitions = 1;
+    int num = (int) (millions * 1e6);
+
+    Transform transform = Transform::translate(1.5, -2, 7) * Transform::extrinsic_euler_angles_XYZ(0.3, 1.1, -0.7)
+                        * Transform::scale(2.5);
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> uniform(-10, 10);
+    vector<Point> points(num);
+    vector<Vector> vectors(num);
+    for (int i = 0; i < num; i++) {
+        points[i] = Point(uniform(rng), uniform(rng), uniform(rng));
+        vectors[i] = Vector(uniform(rng), uniform(rng), uniform(rng));
+    }
+    printf("%d of each\n", num);
+
+    vector<Point> single_points(num), batch_points(num);
+    double single = best_seconds(repetitions, [&]() {
+        for (int i = 0; i < num; i++) single_points[i] = transform(points[i]);
+    });
+    double batch = best_seconds(repetitions, [&]() { transform_points(transform, points.data(), batch_points.data(), num); });
+    print_result("points", num, single, batch, count_differences(single_points, batch_points));
+
+    vector<Vector> single_vectors(num), batch_vectors(num);
+    single = best_seconds(repetitions, [&]() {
+        for (int i = 0; i < num; i++) single_vectors[i] = transform(vectors[i]);
+    });
+    batch = best_seconds(repetitions, [&]() { transform_vectors(transform, vectors.data(), batch_vectors.data(), num); });
+    print_result("vectors", num, single, batch, count_differences(single_vectors, batch_vectors));
+
+    single = best_seconds(repetitions, [&]() {
+        for (int i = 0; i < num; i++) single_vectors[i] = transform.transform_normal(vectors[i]);
+    });
+    batch = best_seconds(repetitions, [&]() { transform_normals(transform, vectors.data(), batch_vectors.data(), num); });
+    print_result("normals", num, single, batch, count_differences(single_vectors, batch_vectors));
+
+    // Packets of rays from the points in the directions of the vectors.
+    int num_packets = num / RAY_PACKET_SIZE;
+    vector<RayPacket> packets(num_packets);
+    for (int i = 0; i < num_packets; i++) {
+        for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+            packets[i].set(lane, Ray(points[i*RAY_PACKET_SIZE + lane], vectors[i*RAY_PACKET_SIZE + lane]));
+        }
+    }
+    const uint32_t active = (1u << RAY_PACKET_SIZE) - 1;
+    vector<RayPacket> single_packets(num_packets), batch_packets(num_packets);
+    single = best_seconds(repetitions, [&]() {
+        for (int i = 0; i < num_packets; i++) {
+            for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) single_packets[i].set(lane, transform(packets[i].ray(lane)));
+        }
+    });
+    batch = best_seconds(repetitions, [&]() {
+        for (int i = 0; i < num_packets; i++) transform_ray_packet(transform, packets[i], active, &batch_packets[i]);
+    });
+    int differences = 0;
+    for (int i = 0; i < num_packets; i++) {
+        if (memcmp(&single_packets[i], &batch_packets[i], sizeof(RayPacket)) != 0) differences++;
+    }
+    print_result("packets", num_packets, single, batch, differences);
+}